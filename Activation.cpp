@@ -1,20 +1,219 @@
 #include "Activation.h"
+#include "Simd.h"
 #include <algorithm>
-#include <cmath>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define EXP_MODE_ENV "MLP_EXP"
+#define FAST_EXP_NAME "fast"
+
+namespace {
+
+void identity_in_place(Matrix &) {}
+
+activation::exp_mode initial_exp_mode() {
+  const char *name = std::getenv(EXP_MODE_ENV);
+  return name != nullptr && std::strcmp(name, FAST_EXP_NAME) == 0 ? activation::FAST_EXP
+                                                                   : activation::PRECISE_EXP;
+}
+
+std::atomic<int> current_exp_mode(initial_exp_mode());
+
+typedef float (*exp_sum_func)(const float *x, float shift, float *out, int n);
+
+exp_sum_func exp_sum_for(const simd::kernel_table &kernels) {
+  return activation::get_exp_mode() == activation::FAST_EXP ? kernels.fast_exp_sum : kernels.exp_sum;
+}
+
+/**
+ * Softmax over n contiguous values, in place.
+ */
+void softmax_contiguous(const simd::kernel_table &kernels, float *values, int n) {
+  const float sum = exp_sum_for(kernels)(values, kernels.max(values, n), values, n);
+  kernels.scale(values, 1.0f / sum, values, n);
+}
+
+/**
+ * Writes the maximum of each column of the rows X cols matrix at values
+ * to maxes. Rows are contiguous, so the maxima build up one row at a time.
+ */
+void column_maxes(const simd::kernel_table &kernels, const float *values, int rows, int cols, float *maxes) {
+  std::copy(values, values + cols, maxes);
+  for (int i = 1; i < rows; ++i) {
+    kernels.maximum(maxes, values + i * cols, maxes, cols);
+  }
+}
+
+/**
+ * @return Room for count floats, reused by later calls on the same thread.
+ */
+float *scratch(size_t count) {
+  thread_local std::vector<float> buffer;
+  buffer.resize(std::max(buffer.size(), count));
+  return buffer.data();
+}
+
+typedef struct named_activation
+{
+    const char *name;
+    activation::activation_func func;
+} named_activation;
+
+const named_activation named_activations[] = {{"relu", activation::relu},
+                                              {"softmax", activation::softmax},
+                                              {"identity", activation::identity}};
+
+}
 
 Matrix activation::relu(const Matrix &input) {
   Matrix output(input.get_rows(), input.get_cols());
-  std::transform(input.begin(), input.end(), output.begin(), [](float val) { return std::max(0.0f, val); });
+  simd::kernels().relu(input.begin(), output.begin(), input.get_rows() * input.get_cols());
   return output;
 }
 
+void activation::set_exp_mode(exp_mode mode) {
+  current_exp_mode.store(mode, std::memory_order_relaxed);
+}
+
+activation::exp_mode activation::get_exp_mode() {
+  return static_cast<exp_mode>(current_exp_mode.load(std::memory_order_relaxed));
+}
+
 Matrix activation::softmax(const Matrix &input) {
-  Matrix output(input.get_rows(), input.get_cols());
-  float sum = 0.0f;
-  std::transform(input.begin(), input.end(), output.begin(), [&sum](float val) {
-      float expVal = std::exp(val);
-      sum += expVal;
-      return expVal;
-  });
-  return output * (1.0f / sum);
+  Matrix output = input;
+  softmax_contiguous(simd::kernels(), output.begin(), output.get_rows() * output.get_cols());
+  return output;
+}
+
+Matrix activation::identity(const Matrix &input) {
+  return input;
+}
+
+Matrix activation::softmax_columns(const Matrix &input) {
+  Matrix output = input;
+  softmax_columns_in_place(output);
+  return output;
+}
+
+Matrix activation::softmax_rows(const Matrix &input) {
+  Matrix output = input;
+  softmax_rows_in_place(output);
+  return output;
+}
+
+activation::activation_func activation::batch_form(activation_func func) {
+  return func == softmax ? softmax_columns : func;
+}
+
+void activation::relu_in_place(Matrix &input) {
+  simd::kernels().relu(input.begin(), input.begin(), input.get_rows() * input.get_cols());
+}
+
+void activation::softmax_columns_in_place(Matrix &input) {
+  const simd::kernel_table &kernels = simd::kernels();
+  const int rows = input.get_rows();
+  const int cols = input.get_cols();
+  if (cols == 1) {
+    softmax_contiguous(kernels, input.begin(), rows);
+    return;
+  }
+  // Rows are contiguous, so the column maxima and sums build up one row
+  // at a time.
+  float *maxes = scratch(2 * static_cast<size_t>(cols));
+  float *sums = maxes + cols;
+  column_maxes(kernels, input.begin(), rows, cols, maxes);
+  std::fill(sums, sums + cols, 0.0f);
+  const exp_sum_func exp_sum = exp_sum_for(kernels);
+  for (int i = 0; i < rows; ++i) {
+    float *row = input.begin() + i * cols;
+    kernels.sub(row, maxes, row, cols);
+    exp_sum(row, 0.0f, row, cols);
+    kernels.add(sums, row, sums, cols);
+  }
+  for (int j = 0; j < cols; ++j) {
+    sums[j] = 1.0f / sums[j];
+  }
+  for (int i = 0; i < rows; ++i) {
+    float *row = input.begin() + i * cols;
+    kernels.mul(row, sums, row, cols);
+  }
+}
+
+void activation::softmax_rows_in_place(Matrix &input) {
+  const simd::kernel_table &kernels = simd::kernels();
+  const int cols = input.get_cols();
+  for (int i = 0; i < input.get_rows(); ++i) {
+    softmax_contiguous(kernels, input.begin() + i * cols, cols);
+  }
+}
+
+void activation::softmax_columns_argmax(const Matrix &logits, unsigned int *labels, float *probabilities) {
+  const simd::kernel_table &kernels = simd::kernels();
+  const int rows = logits.get_rows();
+  const int cols = logits.get_cols();
+  const exp_sum_func exp_sum = exp_sum_for(kernels);
+  if (cols == 1) {
+    const float max = kernels.max(logits.begin(), rows);
+    const int label = static_cast<int>(std::find(logits.begin(), logits.end(), max) - logits.begin());
+    float *terms = scratch(rows);
+    const float sum = exp_sum(logits.begin(), max, terms, rows);
+    labels[0] = static_cast<unsigned int>(label);
+    probabilities[0] = terms[label] / sum;
+    return;
+  }
+  float *maxes = scratch(4 * static_cast<size_t>(cols));
+  float *sums = maxes + cols;
+  float *terms = sums + cols;
+  float *best = terms + cols;
+  column_maxes(kernels, logits.begin(), rows, cols, maxes);
+  std::fill(sums, sums + cols, 0.0f);
+  // Backwards, so that the first of equal maxima wins.
+  for (int i = rows - 1; i >= 0; --i) {
+    const float *row = logits.begin() + i * cols;
+    kernels.set_where_equal(row, maxes, static_cast<float>(i), best, cols);
+    kernels.sub(row, maxes, terms, cols);
+    exp_sum(terms, 0.0f, terms, cols);
+    kernels.add(sums, terms, sums, cols);
+  }
+  // Every winner's term is exp(0), as the active exp_mode computes it.
+  const float zero = 0.0f;
+  float winner;
+  exp_sum(&zero, 0.0f, &winner, 1);
+  for (int j = 0; j < cols; ++j) {
+    labels[j] = static_cast<unsigned int>(best[j]);
+    probabilities[j] = winner / sums[j];
+  }
+}
+
+activation::in_place_activation_func activation::in_place_form(activation_func func) {
+  if (func == relu) {
+    return relu_in_place;
+  }
+  if (func == softmax || func == softmax_columns) {
+    return softmax_columns_in_place;
+  }
+  if (func == identity) {
+    return identity_in_place;
+  }
+  return nullptr;
+}
+
+activation::activation_func activation::from_name(const std::string &name) {
+  for (const named_activation &entry : named_activations) {
+    if (name == entry.name) {
+      return entry.func;
+    }
+  }
+  return nullptr;
+}
+
+const char *activation::name_of(activation_func func) {
+  for (const named_activation &entry : named_activations) {
+    if (func == entry.func) {
+      return entry.name;
+    }
+  }
+  return nullptr;
 }
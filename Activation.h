@@ -1,12 +1,36 @@
 #include "Matrix.h"
 #include <cmath>
+#include <string>
 #ifndef ACTIVATION_H
 #define ACTIVATION_H
 using std::exp;
 
 namespace activation
 {
-    typedef Matrix (*activation_func) (Matrix &);
+    typedef Matrix (*activation_func) (const Matrix &);
+    typedef void (*in_place_activation_func) (Matrix &);
+
+    /**
+     * @enum exp_mode
+     * @brief How the softmax functions evaluate exp. PRECISE_EXP is exact
+     *        up to float rounding. FAST_EXP uses a cheaper polynomial whose
+     *        terms, and so the probabilities, are within a relative 1e-4
+     *        of the precise ones; it suits serving rather than training.
+     */
+    enum exp_mode
+    {
+        PRECISE_EXP, FAST_EXP
+    };
+
+    /**
+     * Selects the exp_mode of later softmax calls, on every thread.
+     * PRECISE_EXP is the default, unless the MLP_EXP environment variable
+     * is set to fast.
+     */
+    void set_exp_mode (exp_mode mode);
+
+    exp_mode get_exp_mode ();
+
     /**
      * The relu turns the input values of the matrix to max {0,value}.
      * @return A matrix that is the function relu on the input matrix.
@@ -15,11 +39,80 @@ namespace activation
     /**
      * The softmax turns the input into a small probability, and if an input
      * is large, then it turns it into a large probability, but it will
-     * always remain between 0 and 1.
+     * always remain between 0 and 1. The largest input is subtracted
+     * before exp, so any finite input gives finite probabilities.
      * @return A matrix that is the function softmax on the input matrix.
      */
     Matrix softmax (const Matrix &input);
 
+    /**
+     * @return A copy of the input, for layers with no activation.
+     */
+    Matrix identity (const Matrix &input);
+
+    /**
+     * Softmax over each column on its own, for a batch whose columns are
+     * separate samples. Equals softmax for a single column.
+     * @return A matrix whose every column sums to 1.
+     */
+    Matrix softmax_columns (const Matrix &input);
+
+    /**
+     * @return The function that applies func to a batch matrix of column
+     * samples: softmax_columns for softmax, func itself for the elementwise
+     * activations.
+     */
+    activation_func batch_form (activation_func func);
+
+    /**
+     * Softmax over each row on its own, for a batch whose rows are
+     * separate samples.
+     * @return A matrix whose every row sums to 1.
+     */
+    Matrix softmax_rows (const Matrix &input);
+
+    /**
+     * relu, overwriting its input instead of allocating an output.
+     */
+    void relu_in_place (Matrix &input);
+
+    /**
+     * softmax_columns, overwriting its input instead of allocating an
+     * output.
+     */
+    void softmax_columns_in_place (Matrix &input);
+
+    /**
+     * softmax_rows, overwriting its input instead of allocating an output.
+     */
+    void softmax_rows_in_place (Matrix &input);
+
+    /**
+     * The argmax of softmax_columns without normalizing: for each column
+     * of logits, writes the row of its largest value (the first, on a
+     * tie) to labels and that row's softmax probability to probabilities.
+     * @param labels, probabilities - Room for get_cols () values each.
+     */
+    void softmax_columns_argmax (const Matrix &logits, unsigned int *labels,
+                                 float *probabilities);
+
+    /**
+     * @return The in place function that applies the batch form of func,
+     * or nullptr if func has none.
+     */
+    in_place_activation_func in_place_form (activation_func func);
+
+    /**
+     * @return The activation called name ("relu", "softmax" or
+     * "identity"), or nullptr if there is none.
+     */
+    activation_func from_name (const std::string &name);
+
+    /**
+     * @return The name of func, see from_name, or nullptr if it has none.
+     */
+    const char *name_of (activation_func func);
+
 
 }
 #endif //ACTIVATION_H
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "Dataset.h"
+#include "Simd.h"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IDX_IMAGES_MAGIC 0x00000803u
+#define IDX_LABELS_MAGIC 0x00000801u
+#define IDX_IMAGES_HEADER 16
+#define IDX_LABELS_HEADER 8
+#define PIXEL_SCALE (1.0f / 255.0f)
+// Images are converted and transposed this many at a time, and pixels in
+// tiles of this many, so the staged floats stay in cache.
+#define DATASET_CHUNK 32
+#define DATASET_TILE 32
+#define OPEN_ERROR_MSG "Error: Cannot open dataset: "
+#define INVALID_DATASET_MSG "Error: Invalid dataset: "
+#define INVALID_LABELS_MSG "Error: Invalid IDX labels file: "
+#define OUT_OF_RANGE_MSG "Error: Index out of range."
+
+namespace {
+
+uint32_t read_big_endian(const unsigned char *bytes) {
+  return static_cast<uint32_t>(bytes[0]) << 24 | static_cast<uint32_t>(bytes[1]) << 16
+         | static_cast<uint32_t>(bytes[2]) << 8 | static_cast<uint32_t>(bytes[3]);
+}
+
+/**
+ * Writes count images of image_size floats, back to back at in, as the
+ * columns of out, whose rows are ld_out floats apart.
+ */
+void images_to_columns(const simd::kernel_table &kernels, const float *in, int count, int image_size,
+                       float *out, int ld_out) {
+  for (int p = 0; p < image_size; p += DATASET_TILE) {
+    kernels.transpose(in + p, image_size, out + static_cast<size_t>(p) * ld_out, ld_out, count,
+                      std::min(DATASET_TILE, image_size - p));
+  }
+}
+
+}
+
+Dataset::Dataset(const std::string &path, int image_size)
+    : _mapping(MAP_FAILED), _size(0), _images(nullptr), _format(FLAT), _count(0), _image_size(image_size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error(OPEN_ERROR_MSG + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0 || image_size <= 0) {
+    close(fd);
+    throw std::runtime_error(INVALID_DATASET_MSG + path);
+  }
+  _size = static_cast<size_t>(st.st_size);
+  _mapping = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (_mapping == MAP_FAILED) {
+    throw std::runtime_error(OPEN_ERROR_MSG + path);
+  }
+  madvise(_mapping, _size, MADV_SEQUENTIAL);
+
+  const unsigned char *header = static_cast<const unsigned char *>(_mapping);
+  uint64_t count = 0;
+  if (_size >= IDX_IMAGES_HEADER && read_big_endian(header) == IDX_IMAGES_MAGIC) {
+    count = read_big_endian(header + 4);
+    const uint64_t pixels = static_cast<uint64_t>(read_big_endian(header + 8)) * read_big_endian(header + 12);
+    if (pixels == static_cast<uint64_t>(image_size) && IDX_IMAGES_HEADER + count * pixels == _size) {
+      _format = IDX;
+      _images = static_cast<const char *>(_mapping) + IDX_IMAGES_HEADER;
+    }
+  }
+  if (_format == FLAT) {
+    const size_t record = static_cast<size_t>(image_size) * sizeof(float);
+    count = _size % record == 0 ? _size / record : 0;
+    _images = static_cast<const char *>(_mapping);
+  }
+  if (count == 0 || count > INT32_MAX) {
+    munmap(_mapping, _size);
+    throw std::runtime_error(INVALID_DATASET_MSG + path);
+  }
+  _count = static_cast<int>(count);
+}
+
+Dataset::~Dataset() {
+  munmap(_mapping, _size);
+}
+
+void Dataset::read_batch(int begin, int count, Matrix &batch) const {
+  if (begin < 0 || count <= 0 || begin > _count - count) {
+    throw std::out_of_range(OUT_OF_RANGE_MSG);
+  }
+  const simd::kernel_table &kernels = simd::kernels();
+  const size_t first = static_cast<size_t>(begin) * _image_size;
+  batch.resize(_image_size, count);
+  if (_format == FLAT) {
+    const float *images = reinterpret_cast<const float *>(_images) + first;
+    for (int j = 0; j < count; j += DATASET_CHUNK) {
+      images_to_columns(kernels, images + static_cast<size_t>(j) * _image_size,
+                        std::min(DATASET_CHUNK, count - j), _image_size, batch.begin() + j, count);
+    }
+    return;
+  }
+  const unsigned char *pixels = reinterpret_cast<const unsigned char *>(_images) + first;
+  if (count == 1) {
+    kernels.u8_to_float(pixels, PIXEL_SCALE, batch.begin(), _image_size);
+    return;
+  }
+  // A chunk of images converted to floats row by row, before it is transposed
+  // into columns of the batch.
+  thread_local std::vector<float> staged;
+  staged.resize(std::max(staged.size(), static_cast<size_t>(DATASET_CHUNK) * _image_size));
+  for (int j = 0; j < count; j += DATASET_CHUNK) {
+    const int chunk = std::min(DATASET_CHUNK, count - j);
+    kernels.u8_to_float(pixels + static_cast<size_t>(j) * _image_size, PIXEL_SCALE, staged.data(),
+                        chunk * _image_size);
+    images_to_columns(kernels, staged.data(), chunk, _image_size, batch.begin() + j, count);
+  }
+}
+
+std::vector<unsigned int> Dataset::read_idx_labels(const std::string &path) {
+  std::ifstream is(path, std::ios::in | std::ios::binary);
+  if (!is.is_open()) {
+    throw std::runtime_error(OPEN_ERROR_MSG + path);
+  }
+  is.seekg(0, std::ios::end);
+  const std::streamoff size = is.tellg();
+  is.seekg(0, std::ios::beg);
+  unsigned char header[IDX_LABELS_HEADER];
+  is.read(reinterpret_cast<char *>(header), IDX_LABELS_HEADER);
+  if (!is.good() || read_big_endian(header) != IDX_LABELS_MAGIC
+      || size != IDX_LABELS_HEADER + static_cast<std::streamoff>(read_big_endian(header + 4))) {
+    throw std::runtime_error(INVALID_LABELS_MSG + path);
+  }
+  std::vector<unsigned char> bytes(static_cast<size_t>(size - IDX_LABELS_HEADER));
+  is.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+  if (!is.good()) {
+    throw std::runtime_error(INVALID_LABELS_MSG + path);
+  }
+  return std::vector<unsigned int>(bytes.begin(), bytes.end());
+}
@@ -0,0 +1,80 @@
+// Dataset.h
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "Matrix.h"
+#include <string>
+#include <vector>
+
+/**
+ * Many images in one file, read through a read-only mapping instead of
+ * one file per image. Two formats are recognized:
+ * IDX, the MNIST ubyte format: a big-endian header (magic 0x00000803, then
+ * the image count, rows and cols) followed by one byte per pixel. Pixels
+ * become floats in [0, 1] as they are read.
+ * Flat: images of image_size native floats back to back with no header,
+ * like the input of the stream mode.
+ * Batches are converted from the mapping straight into matrix columns and
+ * the kernel reads ahead of them, so a dataset of any size streams through
+ * the page cache. Threads may read batches from one dataset concurrently.
+ */
+class Dataset
+{
+ public:
+  /**
+   * @enum format
+   * @brief How the images are stored.
+   */
+  enum format
+  {
+      IDX, FLAT
+  };
+
+  /**
+   * Maps the dataset at path. An IDX file is recognized by its header and
+   * size; any other file is read as flat floats.
+   * @param image_size - The floats per image; an IDX file's rows * cols
+   * must match it.
+   * @throw std::runtime_error if the file cannot be mapped or does not hold
+   * a whole, non-zero amount of images of image_size.
+   */
+  Dataset (const std::string &path, int image_size);
+  Dataset (const Dataset &) = delete;
+  Dataset &operator= (const Dataset &) = delete;
+  ~Dataset ();
+
+  format get_format () const
+  { return _format; }
+
+  int get_count () const
+  { return _count; }
+
+  int get_image_size () const
+  { return _image_size; }
+
+  /**
+   * Writes images begin to begin + count - 1 as the columns of batch,
+   * resized (see Matrix::resize) to get_image_size () X count.
+   * @throw std::out_of_range unless 0 <= begin, 0 < count and
+   * begin + count <= get_count ().
+   */
+  void read_batch (int begin, int count, Matrix &batch) const;
+
+  /**
+   * Reads an IDX label file: a big-endian header (magic 0x00000801, then
+   * the label count) followed by one byte per label.
+   * @throw std::runtime_error if the file cannot be read or is not an IDX
+   * label file.
+   */
+  static std::vector<unsigned int> read_idx_labels (const std::string &path);
+
+ private:
+  void *_mapping;
+  size_t _size;
+  const char *_images;
+  format _format;
+  int _count;
+  int _image_size;
+};
+
+#endif //DATASET_H
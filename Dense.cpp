@@ -1,26 +1,220 @@
-#include "MlpNetwork.h"
+#include "Dense.h"
+#include "Gemm.h"
+#include "Simd.h"
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
-MlpNetwork::MlpNetwork(Matrix weights[], Matrix biases[]) {
-  for (int i = 0; i < MLP_SIZE; ++i) {
-    _layers[i] = Dense(weights[i], biases[i], (i == MLP_SIZE - 1) ? activation::softmax : activation::relu);
+#define LENGTH_ERROR_MSG "Error: Invalid matrix size."
+
+namespace {
+
+/**
+ * @return Another view of m's elements when m is a view, e.g. weights
+ * mapped from a packed model, and a copy of them otherwise.
+ */
+Matrix share(const Matrix &m) {
+  if (m.is_view()) {
+    return Matrix::view(const_cast<float *>(m.begin()), m.get_rows(), m.get_cols());
   }
+  return m;
+}
+
 }
 
-digit MlpNetwork::operator()(const Matrix &input) const {
-  Matrix result = input;
-  for (const auto &layer : _layers) {
-    result = layer(result);
+Dense::Dense() : _activation(activation::relu), _format(FP32), _input_params(dynamic_quant_params) {}
+
+Dense::Dense(const Matrix &weight, const Matrix &bias, activation_func activation)
+    : _weight(share(weight)), _bias(share(bias)), _activation(activation), _format(FP32),
+      _input_params(dynamic_quant_params) {}
+
+Dense::Dense(const QuantizedMatrix &weight, const Matrix &bias, activation_func activation,
+             const quant_params &input_params)
+    : _bias(share(bias)), _activation(activation), _format(INT8), _quantized_weight(weight),
+      _input_params(input_params) {}
+
+Dense::Dense(const SparseMatrix &weight, const Matrix &bias, activation_func activation)
+    : _bias(share(bias)), _activation(activation), _format(SPARSE), _input_params(dynamic_quant_params),
+      _sparse_weight(weight) {}
+
+Dense::Dense(const HalfMatrix &weight, const Matrix &bias, activation_func activation)
+    : _bias(share(bias)), _activation(activation), _format(weight.get_format() == half::FP16 ? FP16 : BF16),
+      _input_params(dynamic_quant_params), _half_weight(weight) {}
+
+Dense::Dense(const Dense &other)
+    : _weight(share(other._weight)), _bias(share(other._bias)), _activation(other._activation),
+      _format(other._format), _quantized_weight(other._quantized_weight), _input_params(other._input_params),
+      _sparse_weight(other._sparse_weight), _half_weight(other._half_weight) {}
+
+Dense &Dense::operator=(const Dense &other) {
+  if (this != &other) {
+    Dense copy(other);
+    *this = std::move(copy);
   }
-  return getHighestProbabilityDigit(result);
+  return *this;
 }
 
-digit MlpNetwork::getHighestProbabilityDigit(const Matrix &output) const {
-  digit maxDigit = {0, output[0]};
-  for (int i = 1; i < OUTPUT_VECTOR_SIZE; ++i) {
-    if (output[i] > maxDigit.probability) {
-      maxDigit.value = i;
-      maxDigit.probability = output[i];
+int Dense::get_input_size() const {
+  switch (_format) {
+    case INT8:
+      return _quantized_weight.get_cols();
+    case SPARSE:
+      return _sparse_weight.get_cols();
+    case FP16:
+    case BF16:
+      return _half_weight.get_cols();
+    default:
+      return _weight.get_cols();
+  }
+}
+
+int Dense::get_weight_rows() const {
+  switch (_format) {
+    case INT8:
+      return _quantized_weight.get_rows();
+    case SPARSE:
+      return _sparse_weight.get_rows();
+    case FP16:
+    case BF16:
+      return _half_weight.get_rows();
+    default:
+      return _weight.get_rows();
+  }
+}
+
+Matrix Dense::operator()(const Matrix &input) const {
+  Matrix output;
+  forward(input, output);
+  return output;
+}
+
+void Dense::forward(const Matrix &input, Matrix &output) const {
+  // relu is fused into the product; every other activation gets the
+  // biased product (the logits, for softmax) and runs afterwards.
+  const bool fused_relu = _activation == activation::relu;
+  forward_product(input, fused_relu, output);
+  if (fused_relu) {
+    return;
+  }
+  activation::in_place_activation_func in_place = activation::in_place_form(_activation);
+  if (in_place != nullptr) {
+    in_place(output);
+  } else if (input.get_cols() == 1) {
+    output = _activation(output);
+  } else {
+    output = activation::batch_form(_activation)(output);
+  }
+}
+
+void Dense::forward_logits(const Matrix &input, Matrix &output) const {
+  forward_product(input, false, output);
+}
+
+void Dense::forward_product(const Matrix &input, bool fused_relu, Matrix &output) const {
+  const int rows = get_output_size();
+  const int cols = get_input_size();
+  if (input.get_rows() != cols || get_weight_rows() != rows) {
+    throw std::length_error(LENGTH_ERROR_MSG);
+  }
+  output.resize(rows, input.get_cols());
+  if (_format == INT8) {
+    forward_int8(input, fused_relu, output);
+  } else if (_format == SPARSE) {
+    _sparse_weight.multiply(input, _bias.begin(), fused_relu, output);
+  } else if (_format == FP16 || _format == BF16) {
+    gemm::hgemm_bias(rows, input.get_cols(), cols, _half_weight.row(0), cols, _half_weight.get_format(),
+                     input.begin(), input.get_cols(), _bias.begin(), fused_relu, output.begin(),
+                     output.get_cols());
+  } else {
+    gemm::sgemm_bias(rows, input.get_cols(), cols, _weight.begin(), cols, input.begin(), input.get_cols(),
+                     _bias.begin(), fused_relu, output.begin(), output.get_cols());
+  }
+}
+
+void Dense::forward_int8(const Matrix &input, bool fused_relu, Matrix &output) const {
+  const int rows = get_output_size();
+  const int cols = get_input_size();
+  const int batch = input.get_cols();
+  // Grown on first use and reused by every later call on the same thread.
+  thread_local std::vector<unsigned char> quantized;
+  thread_local std::vector<quant_params> params;
+  quantized.resize(std::max<size_t>(quantized.size(), static_cast<size_t>(cols) * batch));
+  params.resize(std::max<size_t>(params.size(), batch));
+
+  for (int j = 0; j < batch; ++j) {
+    const float *column = input.begin() + j;
+    if (_input_params.scale > 0.0f) {
+      params[j] = _input_params;
+    } else {
+      float min = column[0];
+      float max = column[0];
+      for (int k = 1; k < cols; ++k) {
+        min = std::min(min, column[k * batch]);
+        max = std::max(max, column[k * batch]);
+      }
+      params[j] = quantization::params_for_range(min, max);
+    }
+    quantization::quantize_activations(column, cols, batch, params[j], quantized.data() + j * cols);
+  }
+
+  const simd::kernel_table &kernels = simd::kernels();
+  for (int i = 0; i < rows; ++i) {
+    const signed char *weights = _quantized_weight.row(i);
+    const int rowSum = _quantized_weight.row_sum(i);
+    const float weightScale = _quantized_weight.scale(i);
+    const float bias = _bias[i];
+    float *out = output.begin() + i * batch;
+    for (int j = 0; j < batch; ++j) {
+      const int acc =
+          kernels.dot_u8s8(quantized.data() + j * cols, weights, cols) - params[j].zero_point * rowSum;
+      const float value = static_cast<float>(acc) * weightScale * params[j].scale + bias;
+      out[j] = fused_relu && value < 0.0f ? 0.0f : value;
+    }
+  }
+}
+
+void Dense::to_fp32() {
+  if (_format == SPARSE) {
+    _weight = _sparse_weight.to_dense();
+    _sparse_weight = SparseMatrix();
+    _format = FP32;
+  } else if (_format == FP16 || _format == BF16) {
+    _weight = _half_weight.to_float();
+    _half_weight = HalfMatrix();
+    _format = FP32;
+  }
+}
+
+void Dense::quantize(const quant_params &input_params) {
+  to_fp32();
+  if (_format == FP32) {
+    _quantized_weight = QuantizedMatrix::quantize(_weight);
+    _weight = Matrix();
+    _format = INT8;
+  }
+  _input_params = input_params;
+}
+
+bool Dense::sparsify() {
+  if (_format == FP32) {
+    bool sparse;
+    const SparseMatrix::layout chosen = SparseMatrix::choose_layout(_weight, sparse);
+    if (sparse) {
+      _sparse_weight = SparseMatrix::from_dense(_weight, chosen);
+      _weight = Matrix();
+      _format = SPARSE;
     }
   }
-  return maxDigit;
+  return _format == SPARSE;
+}
+
+void Dense::to_half(half::format format) {
+  if (_format == INT8) {
+    return;
+  }
+  to_fp32();
+  _half_weight = HalfMatrix::convert(_weight, format);
+  _weight = Matrix();
+  _format = format == half::FP16 ? FP16 : BF16;
 }
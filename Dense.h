@@ -2,35 +2,174 @@
 #define DENSE_H
 
 #include "Activation.h"
+#include "HalfPrecision.h"
+#include "Quantization.h"
+#include "Sparse.h"
 using activation::activation_func;
 
 class Dense
 {
+ public:
+  /**
+   * @enum weight_format
+   * @brief How the layer stores its weights. SPARSE keeps only the
+   *        non-zero FP32 weights of a pruned layer, see SparseMatrix;
+   *        FP16 and BF16 keep 16-bit floats, see HalfMatrix.
+   */
+  enum weight_format
+  {
+      FP32, INT8, SPARSE, FP16, BF16
+  };
 
  private:
   Matrix _weight;
   Matrix _bias;
   activation_func _activation;
+  weight_format _format;
+  QuantizedMatrix _quantized_weight;
+  quant_params _input_params;
+  SparseMatrix _sparse_weight;
+  HalfMatrix _half_weight;
+
+  /**
+   * @return The rows of the weights in the layer's format.
+   */
+  int get_weight_rows () const;
+
+  /**
+   * Converts SPARSE, FP16 and BF16 weights back to FP32 ones.
+   */
+  void to_fp32 ();
+
+  /**
+   * output = _quantized_weight * input + bias, with relu when fused_relu
+   * is set: the input columns are quantized to 7 bits and the dot
+   * products accumulate in 32-bit integers.
+   */
+  void forward_int8 (const Matrix &input_matrix, bool fused_relu,
+                     Matrix &output) const;
+
+  /**
+   * output = weight * input + bias, with relu when fused_relu is set.
+   */
+  void forward_product (const Matrix &input_matrix, bool fused_relu,
+                        Matrix &output) const;
 
  public:
   //Constructor
-  Dense (Matrix &weight, Matrix &bias, activation_func activation);
+  Dense ();
+  Dense (const Matrix &weight, const Matrix &bias, activation_func activation);
+  /**
+   * Constructs an INT8 layer.
+   * @param input_params - Calibrated input quantization, or
+   * dynamic_quant_params to derive it from each input column.
+   */
+  Dense (const QuantizedMatrix &weight, const Matrix &bias,
+         activation_func activation, const quant_params &input_params);
+  /**
+   * Constructs a SPARSE layer.
+   */
+  Dense (const SparseMatrix &weight, const Matrix &bias,
+         activation_func activation);
+  /**
+   * Constructs an FP16 or BF16 layer, after the format of weight.
+   */
+  Dense (const HalfMatrix &weight, const Matrix &bias,
+         activation_func activation);
+  /**
+   * Copies share weights and biases that are views, e.g. the layers of a
+   * mapped packed model, and duplicate owned ones. The constructors above
+   * keep the same sharing for their arguments.
+   */
+  Dense (const Dense &other);
+  Dense &operator= (const Dense &other);
+  Dense (Dense &&other) = default;
+  Dense &operator= (Dense &&other) = default;
   //Destructor
-  Matrix get_weights () const
+  /**
+   * @return The FP32 weights. Layers of other formats have none and
+   * return a 1 X 1 matrix; see get_quantized_weights, get_sparse_weights
+   * and get_half_weights.
+   */
+  const Matrix &get_weights () const
   { return this->_weight; }
 
-  Matrix get_bias () const
+  const QuantizedMatrix &get_quantized_weights () const
+  { return this->_quantized_weight; }
+
+  const SparseMatrix &get_sparse_weights () const
+  { return this->_sparse_weight; }
+
+  const HalfMatrix &get_half_weights () const
+  { return this->_half_weight; }
+
+  weight_format get_format () const
+  { return this->_format; }
+
+  const quant_params &get_input_params () const
+  { return this->_input_params; }
+
+  int get_input_size () const;
+
+  int get_output_size () const
+  { return this->_bias.get_rows (); }
+
+  const Matrix &get_bias () const
   { return this->_bias; }
 
   activation_func get_activation () const
   { return this->_activation; }
   /**
-   * Applies the layer on input matrix.
+   * Applies the layer on input matrix. An input with several columns is a
+   * batch of samples: it goes through a single GEMM, the bias is added to
+   * every column and the activation is applied to each column.
    * @param input_matrix - The matrix that was created in the previous layer.
    * @return A new matrix that was created from the current layer of the
    * Mlp network.
    */
-  Matrix operator() (Matrix &input_matrix) const;
+  Matrix operator() (const Matrix &input_matrix) const;
+
+  /**
+   * Applies the layer on input matrix like operator(), writing into output
+   * instead of returning a new matrix. output is resized to fit (see
+   * Matrix::resize), so reusing it for same-sized inputs never allocates
+   * for the relu and softmax activations. The bias, and relu when it is
+   * the activation, are applied inside the product kernel.
+   * @param input_matrix - The matrix that was created in the previous layer.
+   * @param output - Receives the layer's output, must not be input_matrix.
+   */
+  void forward (const Matrix &input_matrix, Matrix &output) const;
+
+  /**
+   * Like forward, but writes the biased product without applying the
+   * activation: the logits, for softmax.
+   */
+  void forward_logits (const Matrix &input_matrix, Matrix &output) const;
+
+  /**
+   * Converts the weights to INT8 with one symmetric scale per output row
+   * and releases the FP32 weights.
+   * @param input_params - Calibrated input quantization, or
+   * dynamic_quant_params to derive it from each input column.
+   */
+  void quantize (const quant_params &input_params = dynamic_quant_params);
+
+  /**
+   * Measures the density of the FP32 weights and, when they are sparse
+   * enough to run faster as a SparseMatrix (see
+   * SparseMatrix::choose_layout), converts them to one in the layout that
+   * suits them and releases the FP32 weights. Other layers are unchanged.
+   * @return Whether the layer is SPARSE.
+   */
+  bool sparsify ();
+
+  /**
+   * Rounds the weights to 16-bit floats in the given format (see
+   * HalfMatrix) and releases the others; products then convert them back
+   * as they load them and accumulate in float. SPARSE weights are
+   * densified first. INT8 layers are unchanged.
+   */
+  void to_half (half::format format);
 
 };
 
@@ -0,0 +1,142 @@
+#include "Evaluation.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <stdexcept>
+
+#define EVALUATION_BATCH 256
+#define INVALID_CLASSES_MSG "Error: Invalid amount of classes."
+#define INVALID_LABEL_MSG "Error: Label or prediction out of range."
+#define LABELS_MISMATCH_MSG "Error: Labels do not match the images."
+#define REPORT_PRECISION 4
+#define COUNT_WIDTH 7
+
+Evaluation::Evaluation(int classes)
+    : _classes(classes), _count(0), _correct(0), _probability_sum(0.0), _bins() {
+  if (classes <= 0) {
+    throw std::invalid_argument(INVALID_CLASSES_MSG);
+  }
+  _confusion.assign(static_cast<size_t>(classes) * classes, 0);
+}
+
+void Evaluation::add(const digit *predictions, const unsigned int *labels, int count) {
+  const unsigned int classes = static_cast<unsigned int>(_classes);
+  for (int i = 0; i < count; ++i) {
+    const unsigned int predicted = predictions[i].value;
+    if (labels[i] >= classes || predicted >= classes) {
+      throw std::invalid_argument(INVALID_LABEL_MSG);
+    }
+    const bool correct = predicted == labels[i];
+    const float probability = predictions[i].probability;
+    ++_confusion[labels[i] * classes + predicted];
+    _correct += correct;
+    _probability_sum += probability;
+    calibration_bin &bin = _bins[std::min(std::max(static_cast<int>(probability * CALIBRATION_BINS), 0),
+                                          CALIBRATION_BINS - 1)];
+    ++bin.count;
+    bin.correct += correct;
+    bin.probability_sum += probability;
+  }
+  _count += count;
+}
+
+void Evaluation::merge(const Evaluation &other) {
+  if (other._classes != _classes) {
+    throw std::invalid_argument(INVALID_CLASSES_MSG);
+  }
+  _count += other._count;
+  _correct += other._correct;
+  _probability_sum += other._probability_sum;
+  for (size_t i = 0; i < _confusion.size(); ++i) {
+    _confusion[i] += other._confusion[i];
+  }
+  for (int b = 0; b < CALIBRATION_BINS; ++b) {
+    _bins[b].count += other._bins[b].count;
+    _bins[b].correct += other._bins[b].correct;
+    _bins[b].probability_sum += other._bins[b].probability_sum;
+  }
+}
+
+Evaluation Evaluation::run(const MlpNetwork &mlp, const Dataset &images,
+                           const std::vector<unsigned int> &labels, ThreadPool &pool) {
+  const int count = images.get_count();
+  if (static_cast<int>(labels.size()) != count) {
+    throw std::invalid_argument(LABELS_MISMATCH_MSG);
+  }
+  // Each worker counts its own batches; the counts are merged at the end.
+  std::vector<Evaluation> partial(pool.size(), Evaluation(mlp.get_output_size()));
+  std::vector<Matrix> batches(pool.size());
+  std::vector<mlp_workspace> workspaces(pool.size());
+  pool.parallel_for(count, EVALUATION_BATCH, [&](int worker, int begin, int end) {
+    images.read_batch(begin, end - begin, batches[worker]);
+    const std::vector<digit> digits = mlp.predict_batch(batches[worker], workspaces[worker]);
+    partial[worker].add(digits.data(), labels.data() + begin, end - begin);
+  });
+  for (size_t w = 1; w < partial.size(); ++w) {
+    partial[0].merge(partial[w]);
+  }
+  return partial[0];
+}
+
+float Evaluation::accuracy() const {
+  return _count == 0 ? 0.0f : static_cast<float>(static_cast<double>(_correct) / _count);
+}
+
+float Evaluation::mean_probability() const {
+  return _count == 0 ? 0.0f : static_cast<float>(_probability_sum / _count);
+}
+
+float Evaluation::calibration_error() const {
+  if (_count == 0) {
+    return 0.0f;
+  }
+  double error = 0.0;
+  for (const calibration_bin &bin : _bins) {
+    error += std::fabs(static_cast<double>(bin.correct) - bin.probability_sum);
+  }
+  return static_cast<float>(error / _count);
+}
+
+std::ostream &operator<<(std::ostream &os, const Evaluation &evaluation) {
+  const int classes = evaluation.get_classes();
+  const std::ios::fmtflags flags = os.flags();
+  const std::streamsize precision = os.precision();
+  os << std::fixed << std::setprecision(REPORT_PRECISION);
+  os << "images: " << evaluation.get_count() << "\n";
+  os << "accuracy: " << evaluation.accuracy() << "\n";
+  os << "mean probability: " << evaluation.mean_probability() << "\n";
+  os << "calibration error: " << evaluation.calibration_error() << "\n";
+
+  os << "calibration (probability range, images, mean probability, accuracy):\n";
+  for (int b = 0; b < CALIBRATION_BINS; ++b) {
+    const calibration_bin &bin = evaluation.get_bin(b);
+    if (bin.count == 0) {
+      continue;
+    }
+    os << "  " << static_cast<float>(b) / CALIBRATION_BINS << "-"
+       << static_cast<float>(b + 1) / CALIBRATION_BINS << " " << std::setw(COUNT_WIDTH) << bin.count << " "
+       << bin.probability_sum / bin.count << " " << static_cast<double>(bin.correct) / bin.count << "\n";
+  }
+
+  os << "recall per label:\n";
+  for (int actual = 0; actual < classes; ++actual) {
+    long total = 0;
+    for (int predicted = 0; predicted < classes; ++predicted) {
+      total += evaluation.confusion(actual, predicted);
+    }
+    os << "  " << actual << " " << std::setw(COUNT_WIDTH) << total << " "
+       << (total == 0 ? 0.0 : static_cast<double>(evaluation.confusion(actual, actual)) / total) << "\n";
+  }
+
+  os << "confusion (row: label, column: prediction):\n";
+  for (int actual = 0; actual < classes; ++actual) {
+    os << "  " << actual;
+    for (int predicted = 0; predicted < classes; ++predicted) {
+      os << " " << std::setw(COUNT_WIDTH) << evaluation.confusion(actual, predicted);
+    }
+    os << "\n";
+  }
+  os.flags(flags);
+  os.precision(precision);
+  return os;
+}
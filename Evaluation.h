@@ -0,0 +1,122 @@
+// Evaluation.h
+#ifndef EVALUATION_H
+#define EVALUATION_H
+
+#include "Dataset.h"
+#include "MlpNetwork.h"
+#include "ThreadPool.h"
+#include <ostream>
+#include <vector>
+
+// Predictions are grouped into this many equal ranges of probability to
+// compare the probability a network reports with its actual accuracy.
+#define CALIBRATION_BINS 10
+
+/**
+ * @struct calibration_bin
+ * @brief The predictions whose probability fell in one calibration range:
+ *        how many there were, how many were right and the sum of their
+ *        probabilities.
+ */
+typedef struct calibration_bin
+{
+    long count;
+    long correct;
+    double probability_sum;
+} calibration_bin;
+
+/**
+ * How well a network's predictions match their labels: accuracy, the
+ * confusion matrix and calibration. Results are added a batch at a time,
+ * and evaluations of parts of a set may be merged, so a set can be
+ * evaluated on many threads (see run).
+ */
+class Evaluation
+{
+ public:
+  /**
+   * @param classes - The amount of distinct labels, the network's output
+   * size.
+   */
+  explicit Evaluation (int classes);
+
+  /**
+   * Counts count predictions against their labels.
+   * @throw std::invalid_argument if a label or prediction is not below
+   * the amount of classes.
+   */
+  void add (const digit *predictions, const unsigned int *labels, int count);
+
+  /**
+   * Adds the counts of other, which must have as many classes.
+   */
+  void merge (const Evaluation &other);
+
+  /**
+   * Runs mlp over every image of images in batches on the workers of pool
+   * and evaluates the predictions against labels, one per image.
+   * @throw std::invalid_argument unless there is one label per image and
+   * every label is below mlp's output size.
+   */
+  static Evaluation run (const MlpNetwork &mlp, const Dataset &images,
+                         const std::vector<unsigned int> &labels,
+                         ThreadPool &pool);
+
+  int get_classes () const
+  { return _classes; }
+
+  long get_count () const
+  { return _count; }
+
+  long get_correct () const
+  { return _correct; }
+
+  /**
+   * @return The fraction of correct predictions, 0 before any.
+   */
+  float accuracy () const;
+
+  /**
+   * @return The mean probability of the predictions, which a calibrated
+   * network keeps close to its accuracy.
+   */
+  float mean_probability () const;
+
+  /**
+   * @return How many images labeled actual were predicted as predicted.
+   */
+  long confusion (unsigned int actual, unsigned int predicted) const
+  { return _confusion[actual * _classes + predicted]; }
+
+  /**
+   * @param bin - 0 to CALIBRATION_BINS - 1; bin i holds the predictions
+   * whose probability is in [i, i + 1) / CALIBRATION_BINS, bin
+   * CALIBRATION_BINS - 1 also those of probability 1.
+   */
+  const calibration_bin &get_bin (int bin) const
+  { return _bins[bin]; }
+
+  /**
+   * @return The expected calibration error: the mean, weighted by the
+   * predictions in each bin, of the gap between the bin's accuracy and its
+   * mean probability.
+   */
+  float calibration_error () const;
+
+ private:
+  int _classes;
+  long _count;
+  long _correct;
+  double _probability_sum;
+  std::vector<long> _confusion;
+  calibration_bin _bins[CALIBRATION_BINS];
+};
+
+/**
+ * Prints the accuracy, mean probability and calibration error, the
+ * calibration bins, per-class recall and the confusion matrix, one row
+ * per label, as text.
+ */
+std::ostream &operator<< (std::ostream &stream, const Evaluation &evaluation);
+
+#endif //EVALUATION_H
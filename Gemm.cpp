@@ -0,0 +1,243 @@
+#include "Gemm.h"
+#include "Simd.h"
+#include <algorithm>
+#include <vector>
+
+// Cache blocks: an MC X KC panel of a stays in L2, a KC X NR sliver of b
+// in L1, and a KC X NC panel of b in L3. The register tile (MR X NR) comes
+// from the micro-kernel of the selected instruction set.
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 2048
+#define GEMM_MAX_TILE 256
+
+namespace {
+
+/**
+ * Packs the mc X kc block of a starting at a into row panels of height
+ * mr, each stored column by column. Rows past mc are zero padded.
+ */
+void pack_a(int mc, int kc, const float *a, int lda, int mr, float *packed) {
+  for (int ir = 0; ir < mc; ir += mr) {
+    const int rows = std::min(mr, mc - ir);
+    for (int p = 0; p < kc; ++p) {
+      for (int i = 0; i < mr; ++i) {
+        *packed++ = i < rows ? a[(ir + i) * lda + p] : 0.0f;
+      }
+    }
+  }
+}
+
+/**
+ * Packs the kc X nc block of b starting at b into column panels of width
+ * nr, each stored row by row. Columns past nc are zero padded.
+ */
+void pack_b(int kc, int nc, const float *b, int ldb, int nr, float *packed) {
+  for (int jr = 0; jr < nc; jr += nr) {
+    const int cols = std::min(nr, nc - jr);
+    for (int p = 0; p < kc; ++p) {
+      const float *bp = b + p * ldb + jr;
+      for (int j = 0; j < nr; ++j) {
+        *packed++ = j < cols ? bp[j] : 0.0f;
+      }
+    }
+  }
+}
+
+/**
+ * @struct float_rows
+ * @brief The a operand of sgemm_bias: float rows lda floats apart.
+ */
+typedef struct float_rows
+{
+    const float *a;
+    int lda;
+
+    float dot(const simd::kernel_table &k, int i, const float *x, int n) const {
+      return k.dot(a + i * lda, x, n);
+    }
+
+    /** Packs the mc X kc block at row ic, column pc, see pack_a. */
+    void pack(const simd::kernel_table &, int ic, int pc, int mc, int kc, int mr, float *packed) const {
+      pack_a(mc, kc, a + ic * lda + pc, lda, mr, packed);
+    }
+} float_rows;
+
+/**
+ * @struct half_rows
+ * @brief The a operand of hgemm_bias: 16-bit float rows lda values apart.
+ */
+typedef struct half_rows
+{
+    const uint16_t *a;
+    int lda;
+    half::format format;
+
+    float dot(const simd::kernel_table &k, int i, const float *x, int n) const {
+      return (format == half::FP16 ? k.dot_f16 : k.dot_bf16)(a + i * lda, x, n);
+    }
+
+    /**
+     * Converts the mc X kc block at row ic, column pc to floats, which stay
+     * in cache for pack_a right after.
+     */
+    void pack(const simd::kernel_table &k, int ic, int pc, int mc, int kc, int mr, float *packed) const {
+      thread_local std::vector<float> block;
+      block.resize(std::max<size_t>(block.size(), static_cast<size_t>(mc) * kc));
+      void (*convert)(const uint16_t *, float *, int) =
+          format == half::FP16 ? k.f16_to_float : k.bf16_to_float;
+      for (int i = 0; i < mc; ++i) {
+        convert(a + (ic + i) * lda + pc, block.data() + i * kc, kc);
+      }
+      pack_a(mc, kc, block.data(), kc, mr, packed);
+    }
+} half_rows;
+
+/**
+ * @struct epilogue
+ * @brief What to apply to a finished tile of c: bias[i] is added to row i
+ *        (bias points at the block's first row), then relu if requested.
+ */
+typedef struct epilogue
+{
+    const float *bias;
+    bool relu;
+} epilogue;
+
+void apply_epilogue(const epilogue &ep, int rows, int cols, float *c, int ldc) {
+  for (int i = 0; i < rows; ++i) {
+    float *ci = c + i * ldc;
+    const float bias = ep.bias != nullptr ? ep.bias[i] : 0.0f;
+    for (int j = 0; j < cols; ++j) {
+      const float value = ci[j] + bias;
+      ci[j] = ep.relu && value < 0.0f ? 0.0f : value;
+    }
+  }
+}
+
+/**
+ * Runs the micro-kernel over every register tile of a packed mc X nc
+ * block of c, going through a scratch tile on the ragged edges. ep is
+ * applied to each tile when given, i.e. on the last kc block.
+ */
+void macro_kernel(const simd::kernel_table &k, int mc, int nc, int kc, const float *packed_a,
+                  const float *packed_b, float *c, int ldc, bool accumulate, const epilogue *ep) {
+  const int mr = k.gemm_mr;
+  const int nr = k.gemm_nr;
+  float edge[GEMM_MAX_TILE];
+  for (int jr = 0; jr < nc; jr += nr) {
+    const int cols = std::min(nr, nc - jr);
+    const float *b_panel = packed_b + jr * kc;
+    for (int ir = 0; ir < mc; ir += mr) {
+      const int rows = std::min(mr, mc - ir);
+      const float *a_panel = packed_a + ir * kc;
+      float *c_tile = c + ir * ldc + jr;
+      if (rows == mr && cols == nr) {
+        k.gemm_kernel(kc, a_panel, b_panel, c_tile, ldc, accumulate);
+      } else {
+        k.gemm_kernel(kc, a_panel, b_panel, edge, nr, false);
+        for (int i = 0; i < rows; ++i) {
+          for (int j = 0; j < cols; ++j) {
+            float &dst = c_tile[i * ldc + j];
+            dst = accumulate ? dst + edge[i * nr + j] : edge[i * nr + j];
+          }
+        }
+      }
+      if (ep != nullptr) {
+        const epilogue tile_ep = {ep->bias != nullptr ? ep->bias + ir : nullptr, ep->relu};
+        apply_epilogue(tile_ep, rows, cols, c_tile, ldc);
+      }
+    }
+  }
+}
+
+/**
+ * c = a * b with b stored column by column (column j at b + j * k),
+ * plus bias and relu, as dot products of a's rows and b's columns.
+ */
+template <typename Rows>
+void dot_columns(const simd::kernel_table &k, int m, int n, int depth, const Rows &a, const float *b,
+                 const float *bias, bool relu, float *c, int ldc) {
+  for (int i = 0; i < m; ++i) {
+    const float row_bias = bias != nullptr ? bias[i] : 0.0f;
+    for (int j = 0; j < n; ++j) {
+      const float value = a.dot(k, i, b + j * depth, depth) + row_bias;
+      c[i * ldc + j] = relu && value < 0.0f ? 0.0f : value;
+    }
+  }
+}
+
+/**
+ * sgemm_bias over any a operand (float_rows or half_rows), which provides
+ * the dot products of its rows and the packing of its blocks.
+ */
+template <typename Rows>
+void gemm_bias(int m, int n, int k, const Rows &a, const float *b, int ldb, const float *bias, bool relu,
+               float *c, int ldc) {
+  const simd::kernel_table &kernels = simd::kernels();
+  if (n == 1 && ldb == 1) {
+    dot_columns(kernels, m, 1, k, a, b, bias, relu, c, ldc);
+    return;
+  }
+  if (n < kernels.gemm_nr) {
+    // Too few columns to fill a register tile: packing a would cost more
+    // than the product, so each column is gathered and dotted with a.
+    thread_local std::vector<float> columns;
+    columns.resize(std::max<size_t>(columns.size(), static_cast<size_t>(n) * k));
+    for (int p = 0; p < k; ++p) {
+      for (int j = 0; j < n; ++j) {
+        columns[j * k + p] = b[p * ldb + j];
+      }
+    }
+    dot_columns(kernels, m, n, k, a, columns.data(), bias, relu, c, ldc);
+    return;
+  }
+  const bool has_epilogue = bias != nullptr || relu;
+
+  const int mr = kernels.gemm_mr;
+  const int nr = kernels.gemm_nr;
+  const int mc_block = GEMM_MC / mr * mr;
+  const int nc_block = GEMM_NC / nr * nr;
+  // Grown on first use and reused by every later call on the same thread.
+  thread_local std::vector<float> packed_a;
+  thread_local std::vector<float> packed_b;
+  const int mc_max = std::min(mc_block, (m + mr - 1) / mr * mr);
+  const int nc_max = std::min(nc_block, (n + nr - 1) / nr * nr);
+  const int kc_max = std::min(GEMM_KC, k);
+  packed_a.resize(std::max<size_t>(packed_a.size(), static_cast<size_t>(mc_max) * kc_max));
+  packed_b.resize(std::max<size_t>(packed_b.size(), static_cast<size_t>(nc_max) * kc_max));
+
+  for (int jc = 0; jc < n; jc += nc_block) {
+    const int nc = std::min(nc_block, n - jc);
+    for (int pc = 0; pc < k; pc += GEMM_KC) {
+      const int kc = std::min(GEMM_KC, k - pc);
+      pack_b(kc, nc, b + pc * ldb + jc, ldb, nr, packed_b.data());
+      for (int ic = 0; ic < m; ic += mc_block) {
+        const int mc = std::min(mc_block, m - ic);
+        a.pack(kernels, ic, pc, mc, kc, mr, packed_a.data());
+        const epilogue ep = {bias != nullptr ? bias + ic : nullptr, relu};
+        const bool last_block = pc + kc == k;
+        macro_kernel(kernels, mc, nc, kc, packed_a.data(), packed_b.data(), c + ic * ldc + jc, ldc, pc > 0,
+                     has_epilogue && last_block ? &ep : nullptr);
+      }
+    }
+  }
+}
+
+}
+
+void gemm::sgemm(int m, int n, int k, const float *a, int lda, const float *b, int ldb, float *c, int ldc) {
+  sgemm_bias(m, n, k, a, lda, b, ldb, nullptr, false, c, ldc);
+}
+
+void gemm::sgemm_bias(int m, int n, int k, const float *a, int lda, const float *b, int ldb,
+                      const float *bias, bool relu, float *c, int ldc) {
+  const float_rows rows = {a, lda};
+  gemm_bias(m, n, k, rows, b, ldb, bias, relu, c, ldc);
+}
+
+void gemm::hgemm_bias(int m, int n, int k, const uint16_t *a, int lda, half::format format, const float *b,
+                      int ldb, const float *bias, bool relu, float *c, int ldc) {
+  const half_rows rows = {a, lda, format};
+  gemm_bias(m, n, k, rows, b, ldb, bias, relu, c, ldc);
+}
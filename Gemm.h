@@ -0,0 +1,49 @@
+// Gemm.h
+#ifndef GEMM_H
+#define GEMM_H
+
+#include "HalfPrecision.h"
+#include <cstdint>
+
+namespace gemm
+{
+    /**
+     * Computes c = a * b for row-major single precision matrices.
+     * a is m X k, b is k X n and c is m X n. The ld* arguments are the
+     * distances (in floats) between consecutive rows of each matrix.
+     * Large products are split into cache-sized blocks whose panels are
+     * packed into contiguous buffers and multiplied by a register-tiled
+     * micro-kernel. A single column b (n == 1) takes a dot-product path.
+     */
+    void sgemm (int m, int n, int k,
+                const float *a, int lda,
+                const float *b, int ldb,
+                float *c, int ldc);
+
+    /**
+     * Computes c = a * b like sgemm, then adds bias[i] to row i of c and,
+     * if relu is set, replaces negative results with 0. Both steps run on
+     * each output while it is still in registers (n == 1) or on each tile
+     * of c right after the micro-kernel writes it, so c is written once.
+     * @param bias - m floats, or nullptr for no bias.
+     */
+    void sgemm_bias (int m, int n, int k,
+                     const float *a, int lda,
+                     const float *b, int ldb,
+                     const float *bias, bool relu,
+                     float *c, int ldc);
+
+    /**
+     * sgemm_bias with a stored as 16-bit floats in the given format. Each
+     * block of a is converted to float as it is packed, and a single
+     * column is dotted with a's rows converted as they are loaded (see
+     * simd::kernel_table::dot_f16), so products and sums stay in float.
+     */
+    void hgemm_bias (int m, int n, int k,
+                     const uint16_t *a, int lda, half::format format,
+                     const float *b, int ldb,
+                     const float *bias, bool relu,
+                     float *c, int ldc);
+}
+
+#endif //GEMM_H
@@ -0,0 +1,140 @@
+#include "HalfPrecision.h"
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+#define FLOAT_SIGN 0x80000000u
+#define FLOAT_INFINITY 0x7f800000u
+#define FP16_SIGN 0x8000u
+#define FP16_INFINITY 0x7c00u
+#define FP16_QUIET_NAN 0x7e00u
+#define BF16_QUIET_BIT 0x0040u
+// Floats from 65520, halfway between the largest FP16 value (65504) and
+// 2^16, round to infinity; floats below 2^-14 become FP16 subnormals.
+#define FP16_OVERFLOW 0x477ff000u
+#define FP16_MIN_NORMAL 0x38800000u
+// Moves a float exponent to an FP16 one: 127 - 15 in the exponent field.
+#define FP16_EXPONENT_REBIAS (112u << 23)
+#define FP16_MANTISSA_SHIFT 13
+#define FP16_SUBNORMAL_SCALE 16777216.0f
+
+namespace {
+
+uint32_t float_bits(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+float bits_float(uint32_t bits) {
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+uint16_t float_to_fp16(float value) {
+  const uint32_t bits = float_bits(value);
+  const uint16_t sign = static_cast<uint16_t>((bits & FLOAT_SIGN) >> 16);
+  const uint32_t magnitude = bits & ~FLOAT_SIGN;
+  if (magnitude > FLOAT_INFINITY) {
+    return sign | FP16_QUIET_NAN;
+  }
+  if (magnitude >= FP16_OVERFLOW) {
+    return sign | FP16_INFINITY;
+  }
+  if (magnitude < FP16_MIN_NORMAL) {
+    // Subnormals count steps of 2^-24; scaling by 2^24 is exact and the
+    // default rounding mode rounds ties to even. 1024 steps encode 2^-14.
+    return sign | static_cast<uint16_t>(std::nearbyint(bits_float(magnitude) * FP16_SUBNORMAL_SCALE));
+  }
+  // Adding just under half a step, plus the last kept bit, rounds ties to
+  // even; a carry out of the mantissa correctly bumps the exponent.
+  const uint32_t odd = (magnitude >> FP16_MANTISSA_SHIFT) & 1u;
+  const uint32_t rounded = magnitude - FP16_EXPONENT_REBIAS + (1u << (FP16_MANTISSA_SHIFT - 1)) - 1u + odd;
+  return sign | static_cast<uint16_t>(rounded >> FP16_MANTISSA_SHIFT);
+}
+
+float fp16_to_float(uint16_t value) {
+  const uint32_t sign = static_cast<uint32_t>(value & FP16_SIGN) << 16;
+  const uint32_t exponent = value & FP16_INFINITY;
+  const uint32_t mantissa = value & ~(FP16_SIGN | FP16_INFINITY);
+  if (exponent == 0) {
+    const float magnitude = static_cast<float>(mantissa) / FP16_SUBNORMAL_SCALE;
+    return sign != 0 ? -magnitude : magnitude;
+  }
+  if (exponent == FP16_INFINITY) {
+    return bits_float(sign | FLOAT_INFINITY | (mantissa << FP16_MANTISSA_SHIFT));
+  }
+  return bits_float(sign | ((static_cast<uint32_t>(value & ~FP16_SIGN) << FP16_MANTISSA_SHIFT)
+                            + FP16_EXPONENT_REBIAS));
+}
+
+uint16_t float_to_bf16(float value) {
+  const uint32_t bits = float_bits(value);
+  if ((bits & ~FLOAT_SIGN) > FLOAT_INFINITY) {
+    return static_cast<uint16_t>(bits >> 16) | BF16_QUIET_BIT;
+  }
+  const uint32_t odd = (bits >> 16) & 1u;
+  return static_cast<uint16_t>((bits + 0x7fffu + odd) >> 16);
+}
+
+}
+
+uint16_t half::from_float(float value, format f) {
+  return f == FP16 ? float_to_fp16(value) : float_to_bf16(value);
+}
+
+float half::to_float(uint16_t value, format f) {
+  return f == FP16 ? fp16_to_float(value) : bits_float(static_cast<uint32_t>(value) << 16);
+}
+
+HalfMatrix::HalfMatrix() : _rows(0), _cols(0), _format(half::FP16), _values(nullptr) {}
+
+HalfMatrix::HalfMatrix(const HalfMatrix &other)
+    : _rows(other._rows), _cols(other._cols), _format(other._format), _values(other._values),
+      _owned_values(other._owned_values) {
+  if (!_owned_values.empty()) {
+    _values = _owned_values.data();
+  }
+}
+
+HalfMatrix &HalfMatrix::operator=(const HalfMatrix &other) {
+  if (this != &other) {
+    HalfMatrix copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+HalfMatrix HalfMatrix::convert(const Matrix &m, half::format f) {
+  HalfMatrix h;
+  h._rows = m.get_rows();
+  h._cols = m.get_cols();
+  h._format = f;
+  h._owned_values.resize(static_cast<size_t>(h._rows) * h._cols);
+  for (size_t i = 0; i < h._owned_values.size(); ++i) {
+    h._owned_values[i] = half::from_float(m.begin()[i], f);
+  }
+  h._values = h._owned_values.data();
+  return h;
+}
+
+HalfMatrix HalfMatrix::view(const uint16_t *values, int rows, int cols, half::format f) {
+  HalfMatrix h;
+  h._rows = rows;
+  h._cols = cols;
+  h._format = f;
+  h._values = values;
+  return h;
+}
+
+Matrix HalfMatrix::to_float() const {
+  Matrix m(_rows, _cols);
+  for (int i = 0; i < _rows; ++i) {
+    float *out = m.row(i);
+    for (int j = 0; j < _cols; ++j) {
+      out[j] = half::to_float(row(i)[j], _format);
+    }
+  }
+  return m;
+}
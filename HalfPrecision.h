@@ -0,0 +1,92 @@
+// HalfPrecision.h
+#ifndef HALFPRECISION_H
+#define HALFPRECISION_H
+
+#include "Matrix.h"
+#include <cstdint>
+#include <vector>
+
+namespace half
+{
+    /**
+     * @enum format
+     * @brief 16-bit float formats. FP16 (IEEE binary16) keeps 10 mantissa
+     *        bits but only reaches 65504 and loses precision below 2^-14;
+     *        BF16 is the top half of a float: its whole range with 7
+     *        mantissa bits.
+     */
+    enum format
+    {
+        FP16, BF16
+    };
+
+    /**
+     * @return value rounded to the nearest value of the format, ties to
+     * even. Values beyond the format's range become infinities, NaN stays
+     * NaN.
+     */
+    uint16_t from_float (float value, format f);
+
+    /**
+     * @return The float equal to value, which every format value has.
+     */
+    float to_float (uint16_t value, format f);
+}
+
+/**
+ * A matrix of weights stored as 16-bit floats, half the bytes of a Matrix.
+ * Products convert the values back to float as they load them and
+ * accumulate in float (see gemm::hgemm_bias), so only the rounding of the
+ * weights themselves is lost. Like Matrix, it either owns its storage or
+ * views external memory such as a mapped packed model.
+ */
+class HalfMatrix
+{
+ public:
+  HalfMatrix ();
+  /**
+   * Copies share a view's memory and duplicate owned storage.
+   */
+  HalfMatrix (const HalfMatrix &other);
+  HalfMatrix &operator= (const HalfMatrix &other);
+  HalfMatrix (HalfMatrix &&other) = default;
+  HalfMatrix &operator= (HalfMatrix &&other) = default;
+
+  /**
+   * Rounds every element of m to the given format.
+   */
+  static HalfMatrix convert (const Matrix &m, half::format f);
+
+  /**
+   * A matrix over existing values, which must outlive it.
+   * @param values - rows * cols values in row-major order.
+   */
+  static HalfMatrix view (const uint16_t *values, int rows, int cols,
+                          half::format f);
+
+  int get_rows () const
+  { return _rows; }
+
+  int get_cols () const
+  { return _cols; }
+
+  half::format get_format () const
+  { return _format; }
+
+  const uint16_t *row (int i) const
+  { return _values + static_cast<size_t>(i) * _cols; }
+
+  /**
+   * @return The float matrix these values were rounded from, as rounded.
+   */
+  Matrix to_float () const;
+
+ private:
+  int _rows;
+  int _cols;
+  half::format _format;
+  const uint16_t *_values;
+  std::vector<uint16_t> _owned_values;
+};
+
+#endif //HALFPRECISION_H
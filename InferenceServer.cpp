@@ -0,0 +1,442 @@
+#include "InferenceServer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define INVALID_OPTIONS_MSG "Error: Batches need a positive max batch and max wait."
+#define PATH_TOO_LONG_MSG "Error: Socket path is too long: "
+#define SOCKET_ERROR_MSG "Error: Cannot listen on socket: "
+#define SOCKET_IN_USE_MSG "Error: Another server is listening on socket: "
+#define CONNECT_ERROR_MSG "Error: Cannot connect to server: "
+#define SEND_ERROR_MSG "Error: Failed to send request."
+#define RECEIVE_ERROR_MSG "Error: Server closed the connection."
+// Pause before accepting again when out of descriptors or memory.
+#define ACCEPT_RETRY_MS 10
+// Sends to a client time out this often, so that a writer blocked by a
+// client that does not read notices the server stopping.
+#define SEND_SLICE_MS 100
+// How long a stopping server keeps trying to send a client its replies.
+#define STOP_GRACE_MS 1000
+
+/**
+ * A client's socket and the replies of its requests that are ready but
+ * wait for earlier ones. received is only written by the client's reader
+ * thread and sent by its writer thread; the reader closes fd once the
+ * writer has sent every reply.
+ */
+struct InferenceServer::connection
+{
+    int fd;
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint64_t received;
+    uint64_t sent;
+    std::map<uint64_t, inference_result> ready;
+    bool reading;
+    bool stopping;
+    server_clock::time_point stopped;
+};
+
+namespace {
+
+sockaddr_un unix_address(const std::string &path) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    throw std::invalid_argument(PATH_TOO_LONG_MSG + path);
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size());
+  return address;
+}
+
+int connect_unix(const sockaddr_un &address) {
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0 && connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @return false if the stream ended or failed before size bytes.
+ */
+bool read_fully(int fd, void *data, size_t size) {
+  char *bytes = static_cast<char *>(data);
+  while (size > 0) {
+    const ssize_t count = read(fd, bytes, size);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    bytes += count;
+    size -= static_cast<size_t>(count);
+  }
+  return true;
+}
+
+/**
+ * @return false if the peer is gone. Never raises SIGPIPE.
+ */
+bool write_fully(int fd, const void *data, size_t size) {
+  const char *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    const ssize_t count = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    bytes += count;
+    size -= static_cast<size_t>(count);
+  }
+  return true;
+}
+
+}
+
+InferenceServer::InferenceServer(const MlpNetwork &mlp, const std::string &path,
+                                 const server_options &options)
+    : _mlp(mlp), _path(path), _options(options), _listen_fd(-1), _pool(options.threads),
+      _buffers(_pool.size()), _running_batches(0), _stopping(false), _stopped(false), _accepting(true),
+      _stats_start(server_clock::now()), _requests(0), _batches(0) {
+  if (options.max_batch <= 0 || options.max_wait_us <= 0) {
+    throw std::invalid_argument(INVALID_OPTIONS_MSG);
+  }
+  const sockaddr_un address = unix_address(path);
+  // A socket left behind by a server that exited is replaced, one that
+  // still accepts connections is not.
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+    const int fd = connect_unix(address);
+    if (fd >= 0) {
+      close(fd);
+      throw std::runtime_error(SOCKET_IN_USE_MSG + path);
+    }
+    unlink(path.c_str());
+  }
+  _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (_listen_fd < 0 || bind(_listen_fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0
+      || listen(_listen_fd, SOMAXCONN) != 0) {
+    if (_listen_fd >= 0) {
+      close(_listen_fd);
+    }
+    throw std::runtime_error(SOCKET_ERROR_MSG + path);
+  }
+  _acceptor = std::thread(&InferenceServer::accept_connections, this);
+  _batcher = std::thread(&InferenceServer::form_batches, this);
+}
+
+InferenceServer::~InferenceServer() {
+  stop();
+  unlink(_path.c_str());
+}
+
+void InferenceServer::stop() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_stopped) {
+      return;
+    }
+    _stopped = true;
+  }
+  // Shutting the sockets down wakes the acceptor and ends every client's
+  // stream of requests; the readers then wait for their replies, which
+  // clients that do not read them get STOP_GRACE_MS to take.
+  std::vector<std::thread> readers;
+  {
+    std::lock_guard<std::mutex> lock(_connections_mutex);
+    _accepting = false;
+    shutdown(_listen_fd, SHUT_RDWR);
+    for (const std::shared_ptr<connection> &client : _connections) {
+      if (client->fd >= 0) {
+        shutdown(client->fd, SHUT_RD);
+      }
+      {
+        std::lock_guard<std::mutex> client_lock(client->mutex);
+        client->stopping = true;
+        client->stopped = server_clock::now();
+      }
+      client->changed.notify_all();
+    }
+  }
+  _acceptor.join();
+  {
+    std::lock_guard<std::mutex> lock(_connections_mutex);
+    readers.swap(_readers);
+  }
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _changed.notify_all();
+  _batcher.join();
+  _pool.wait();
+  close(_listen_fd);
+}
+
+server_stats InferenceServer::take_stats() {
+  std::lock_guard<std::mutex> lock(_stats_mutex);
+  const server_clock::time_point now = server_clock::now();
+  server_stats stats = {};
+  stats.requests = _requests;
+  stats.batches = _batches;
+  stats.seconds = std::chrono::duration<double>(now - _stats_start).count();
+  stats.qps = stats.seconds > 0.0 ? _requests / stats.seconds : 0.0;
+  stats.mean_batch = _batches > 0 ? static_cast<double>(_requests) / _batches : 0.0;
+  if (!_latencies_us.empty()) {
+    std::sort(_latencies_us.begin(), _latencies_us.end());
+    stats.p50_us = _latencies_us[_latencies_us.size() / 2];
+    stats.p99_us =
+        _latencies_us[std::min(_latencies_us.size() - 1, _latencies_us.size() * 99 / 100)];
+  }
+  _stats_start = now;
+  _requests = 0;
+  _batches = 0;
+  _latencies_us.clear();
+  return stats;
+}
+
+void InferenceServer::accept_connections() {
+  for (;;) {
+    const int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0 && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_RETRY_MS));
+    }
+    std::lock_guard<std::mutex> lock(_connections_mutex);
+    if (!_accepting) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      return;
+    }
+    if (fd < 0) {
+      continue;
+    }
+    // Joins the readers of closed connections so that a long-running
+    // server does not collect them.
+    for (size_t i = 0; i < _connections.size();) {
+      if (_connections[i]->fd < 0) {
+        _readers[i].join();
+        _readers.erase(_readers.begin() + i);
+        _connections.erase(_connections.begin() + i);
+      } else {
+        ++i;
+      }
+    }
+    const timeval slice = {0, SEND_SLICE_MS * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &slice, sizeof(slice));
+    std::shared_ptr<connection> client = std::make_shared<connection>();
+    client->fd = fd;
+    client->received = 0;
+    client->sent = 0;
+    client->reading = true;
+    client->stopping = false;
+    _connections.push_back(client);
+    _readers.emplace_back(&InferenceServer::read_requests, this, client);
+  }
+}
+
+void InferenceServer::read_requests(std::shared_ptr<connection> client) {
+  std::thread writer(&InferenceServer::write_replies, this, client);
+  const int input_size = _mlp.get_input_size();
+  for (;;) {
+    // Reads no further ahead of the replies than SERVER_MAX_IN_FLIGHT, so
+    // a client that sends faster than it reads is held back by its socket.
+    {
+      std::unique_lock<std::mutex> lock(client->mutex);
+      client->changed.wait(lock, [&client] {
+        return client->stopping || client->received - client->sent < SERVER_MAX_IN_FLIGHT;
+      });
+      if (client->stopping) {
+        break;
+      }
+    }
+    pending_request request;
+    request.image.resize(input_size);
+    // A request cut short by the end of the stream is dropped.
+    if (!read_fully(client->fd, request.image.data(), input_size * sizeof(float))) {
+      break;
+    }
+    request.received = server_clock::now();
+    request.source = client;
+    {
+      std::lock_guard<std::mutex> lock(client->mutex);
+      request.sequence = client->received++;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queue.push_back(std::move(request));
+    }
+    _changed.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock(client->mutex);
+    client->reading = false;
+  }
+  client->changed.notify_all();
+  writer.join();
+  std::lock_guard<std::mutex> lock(_connections_mutex);
+  close(client->fd);
+  client->fd = -1;
+}
+
+void InferenceServer::write_replies(std::shared_ptr<connection> client) {
+  bool broken = false;
+  std::unique_lock<std::mutex> lock(client->mutex);
+  for (;;) {
+    client->changed.wait(lock, [&client] {
+      return (!client->ready.empty() && client->ready.begin()->first == client->sent)
+             || (!client->reading && client->sent == client->received);
+    });
+    if (client->ready.empty() || client->ready.begin()->first != client->sent) {
+      return;
+    }
+    // Batches on other workers may finish first; replies still go out in
+    // request order.
+    std::vector<inference_result> in_order;
+    while (!client->ready.empty() && client->ready.begin()->first == client->sent + in_order.size()) {
+      in_order.push_back(client->ready.begin()->second);
+      client->ready.erase(client->ready.begin());
+    }
+    lock.unlock();
+    // The replies of a client that is gone, or that stopped reading while
+    // the server stops, are dropped; shutting its socket down ends its
+    // requests too.
+    const char *bytes = reinterpret_cast<const char *>(in_order.data());
+    size_t size = in_order.size() * sizeof(inference_result);
+    while (!broken && size > 0) {
+      const ssize_t count = send(client->fd, bytes, size, MSG_NOSIGNAL);
+      if (count > 0) {
+        bytes += count;
+        size -= static_cast<size_t>(count);
+      } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        std::lock_guard<std::mutex> guard(client->mutex);
+        broken = client->stopping
+                 && server_clock::now() - client->stopped >= std::chrono::milliseconds(STOP_GRACE_MS);
+      } else if (count == 0 || errno != EINTR) {
+        broken = true;
+      }
+      if (broken) {
+        shutdown(client->fd, SHUT_RDWR);
+      }
+    }
+    lock.lock();
+    client->sent += in_order.size();
+    client->changed.notify_all();
+  }
+}
+
+void InferenceServer::form_batches() {
+  const size_t max_batch = static_cast<size_t>(_options.max_batch);
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (;;) {
+    _changed.wait(lock, [this] {
+      return _stopping || (!_queue.empty() && _running_batches < _pool.size());
+    });
+    if (_queue.empty()) {
+      return;
+    }
+    // Waits for a full batch until the oldest request is due. Stopping
+    // runs what is left right away.
+    const server_clock::time_point due =
+        _queue.front().received + std::chrono::microseconds(_options.max_wait_us);
+    _changed.wait_until(lock, due, [this, max_batch] {
+      return _stopping || _queue.size() >= max_batch;
+    });
+    const size_t count = std::min(_queue.size(), max_batch);
+    std::shared_ptr<std::vector<pending_request>> requests = std::make_shared<std::vector<pending_request>>(
+        std::make_move_iterator(_queue.begin()), std::make_move_iterator(_queue.begin() + count));
+    _queue.erase(_queue.begin(), _queue.begin() + count);
+    ++_running_batches;
+    lock.unlock();
+    _pool.submit([this, requests](int worker) { run_batch(worker, *requests); });
+    lock.lock();
+  }
+}
+
+void InferenceServer::run_batch(int worker, std::vector<pending_request> &requests) {
+  const int count = static_cast<int>(requests.size());
+  const int input_size = _mlp.get_input_size();
+  Matrix &batch = _buffers[worker].batch;
+  batch.resize(input_size, count);
+  for (int r = 0; r < input_size; ++r) {
+    for (int j = 0; j < count; ++j) {
+      batch[r * count + j] = requests[j].image[r];
+    }
+  }
+  const std::vector<digit> digits = _mlp.predict_batch(batch, _buffers[worker].workspace);
+
+  // Counted before replying, so a client that has its reply finds it in
+  // the stats.
+  const server_clock::time_point now = server_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(_stats_mutex);
+    _requests += count;
+    ++_batches;
+    for (int j = 0; j < count && _latencies_us.size() < SERVER_MAX_LATENCIES; ++j) {
+      _latencies_us.push_back(
+          std::chrono::duration<float, std::micro>(now - requests[j].received).count());
+    }
+  }
+
+  // The connections' writers send the replies, so a client that does not
+  // read them never holds up a worker.
+  for (int j = 0; j < count; ++j) {
+    connection &client = *requests[j].source;
+    {
+      std::lock_guard<std::mutex> lock(client.mutex);
+      client.ready[requests[j].sequence] = {digits[j].value, digits[j].probability};
+    }
+    client.changed.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    --_running_batches;
+  }
+  _changed.notify_all();
+}
+
+InferenceClient::InferenceClient(const std::string &path) : _fd(connect_unix(unix_address(path))) {
+  if (_fd < 0) {
+    throw std::runtime_error(CONNECT_ERROR_MSG + path);
+  }
+}
+
+InferenceClient::~InferenceClient() {
+  close(_fd);
+}
+
+void InferenceClient::send(const float *image, int floats) {
+  if (!write_fully(_fd, image, floats * sizeof(float))) {
+    throw std::runtime_error(SEND_ERROR_MSG);
+  }
+}
+
+inference_result InferenceClient::receive() {
+  inference_result result;
+  if (!read_fully(_fd, &result, sizeof(result))) {
+    throw std::runtime_error(RECEIVE_ERROR_MSG);
+  }
+  return result;
+}
+
+inference_result InferenceClient::classify(const float *image, int floats) {
+  send(image, floats);
+  return receive();
+}
@@ -0,0 +1,202 @@
+// InferenceServer.h
+#ifndef INFERENCESERVER_H
+#define INFERENCESERVER_H
+
+#include "MlpNetwork.h"
+#include "ThreadPool.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Latencies kept between two reports (see InferenceServer::take_stats);
+// requests beyond them still count towards the throughput.
+#define SERVER_MAX_LATENCIES 1000000
+// Requests of one connection read and not yet answered; the server reads
+// no more of its requests until replies are sent.
+#define SERVER_MAX_IN_FLIGHT 256
+
+/**
+ * @struct inference_result
+ * @brief The reply to one request: the predicted digit and its
+ *        probability, in native byte order.
+ */
+typedef struct inference_result
+{
+    uint32_t value;
+    float probability;
+} inference_result;
+
+/**
+ * @struct server_options
+ * @brief How requests are grouped into batches. A batch runs once it holds
+ *        max_batch requests or its oldest request has waited max_wait_us
+ *        microseconds, whichever comes first, and only while a worker is
+ *        free, so a busy server forms larger batches.
+ */
+typedef struct server_options
+{
+    int max_batch;
+    long max_wait_us;
+    int threads;
+} server_options;
+
+const server_options default_server_options = {64, 500, 0};
+
+/**
+ * @struct server_stats
+ * @brief The requests answered over a period: how many, in how many
+ *        batches, the requests per second, and the median and 99th
+ *        percentile of the time from receiving a request to having its
+ *        reply.
+ */
+typedef struct server_stats
+{
+    long requests;
+    long batches;
+    double seconds;
+    double qps;
+    double mean_batch;
+    double p50_us;
+    double p99_us;
+} server_stats;
+
+/**
+ * Serves a network over a Unix domain stream socket. A request is one
+ * vectorized image, get_input_size () native floats with no framing, and
+ * is answered by an inference_result. Clients may send many requests
+ * without waiting; each connection's replies come in request order.
+ * A thread per connection reads requests into a shared queue, from which
+ * a batcher thread forms batches (see server_options) and runs them with
+ * MlpNetwork::predict_batch on a ThreadPool, each worker with its own
+ * buffers. Another thread per connection sends its replies, so a client
+ * that stops reading them only holds up its own requests.
+ */
+class InferenceServer
+{
+ public:
+  /**
+   * Listens on path and starts serving. A socket left at path by an
+   * earlier server is replaced; any other file is an error.
+   * @param mlp - The network, which must outlive the server.
+   * @throw std::invalid_argument if the path is too long for a socket or
+   * options.max_batch or options.max_wait_us is not positive.
+   * @throw std::runtime_error if the socket cannot be created.
+   */
+  InferenceServer (const MlpNetwork &mlp, const std::string &path,
+                   const server_options &options = default_server_options);
+  InferenceServer (const InferenceServer &) = delete;
+  InferenceServer &operator= (const InferenceServer &) = delete;
+  /**
+   * Stops serving (see stop) and removes the socket.
+   */
+  ~InferenceServer ();
+
+  /**
+   * Stops accepting connections and requests, answers those already
+   * received and waits for every thread. A client that does not read its
+   * replies is dropped a second after the call. Later calls do nothing.
+   */
+  void stop ();
+
+  /**
+   * @return The requests answered since the last call, or since the
+   * server started.
+   */
+  server_stats take_stats ();
+
+ private:
+  typedef std::chrono::steady_clock server_clock;
+  struct connection;
+
+  typedef struct pending_request
+  {
+      std::shared_ptr<connection> source;
+      uint64_t sequence;
+      std::vector<float> image;
+      server_clock::time_point received;
+  } pending_request;
+
+  typedef struct worker_buffers
+  {
+      Matrix batch;
+      mlp_workspace workspace;
+  } worker_buffers;
+
+  void accept_connections ();
+  void read_requests (std::shared_ptr<connection> client);
+  void write_replies (std::shared_ptr<connection> client);
+  void form_batches ();
+  void run_batch (int worker, std::vector<pending_request> &requests);
+
+  const MlpNetwork &_mlp;
+  std::string _path;
+  server_options _options;
+  int _listen_fd;
+  ThreadPool _pool;
+  std::vector<worker_buffers> _buffers;
+
+  std::mutex _mutex;
+  std::condition_variable _changed;
+  std::deque<pending_request> _queue;
+  int _running_batches;
+  bool _stopping;
+  bool _stopped;
+
+  std::mutex _connections_mutex;
+  bool _accepting;
+  std::vector<std::shared_ptr<connection>> _connections;
+  std::vector<std::thread> _readers;
+  std::thread _acceptor;
+  std::thread _batcher;
+
+  std::mutex _stats_mutex;
+  server_clock::time_point _stats_start;
+  long _requests;
+  long _batches;
+  std::vector<float> _latencies_us;
+};
+
+/**
+ * A connection to an InferenceServer. Requests may be sent ahead of
+ * receiving their replies, which arrive in order.
+ */
+class InferenceClient
+{
+ public:
+  /**
+   * @throw std::invalid_argument if the path is too long for a socket.
+   * @throw std::runtime_error if the server at path cannot be reached.
+   */
+  explicit InferenceClient (const std::string &path);
+  InferenceClient (const InferenceClient &) = delete;
+  InferenceClient &operator= (const InferenceClient &) = delete;
+  ~InferenceClient ();
+
+  /**
+   * Sends one request of floats image values.
+   * @throw std::runtime_error if the connection fails.
+   */
+  void send (const float *image, int floats);
+
+  /**
+   * @return The reply to the oldest request not yet received.
+   * @throw std::runtime_error if the connection fails or closes first.
+   */
+  inference_result receive ();
+
+  /**
+   * Sends a request and waits for its reply.
+   */
+  inference_result classify (const float *image, int floats);
+
+ private:
+  int _fd;
+};
+
+#endif //INFERENCESERVER_H
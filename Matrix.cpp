@@ -1,170 +1,356 @@
 #include "Matrix.h"
+#include "Gemm.h"
+#include "Simd.h"
 #include <iostream>
 #include <cmath>
 #include <stdexcept>
 #include <cstring>
+#include <utility>
+#include <vector>
+#include <algorithm>
 
 #define INVALID_INDEX -1
 #define DEFAULT_SIZE 1
+// Square tiles of this side, in and out, fit the L1 cache together.
+#define TRANSPOSE_TILE 32
 #define LENGTH_ERROR_MSG "Error: Invalid matrix size."
 #define OUT_OF_RANGE_MSG "Error: Index out of range."
 #define INVALID_PATH_MSG "Error: Invalid file path."
 #define INVALID_FILE_SIZE_MSG "Error: Invalid file size."
 
-Matrix::Matrix() : m_nRows(1), m_nCols(1), m_Data(new float[1]{0.0}) {}
+Matrix::Matrix() : m_nRows(1), m_nCols(1), m_nCapacity(1), m_bView(false), m_Data(nullptr), m_Allocator(&MatrixAllocator::current()) {
+  m_Data = m_Allocator->allocate(1);
+  m_Data[0] = 0.0f;
+}
 
-Matrix::Matrix(int rows, int cols) : m_nRows(rows), m_nCols(cols) {
+Matrix::Matrix(int rows, int cols)
+    : m_nRows(rows), m_nCols(cols), m_nCapacity(rows * cols), m_bView(false), m_Data(nullptr), m_Allocator(nullptr) {
   if (rows <= 0 || cols <= 0) {
     throw std::length_error(LENGTH_ERROR_MSG);
   }
-  m_Data = new float[rows * cols]();
+  m_Allocator = &MatrixAllocator::current();
+  m_Data = m_Allocator->allocate(m_nCapacity);
+  std::memset(m_Data, 0, m_nCapacity * sizeof(float));
 }
 
-Matrix::Matrix(const Matrix &other) : m_nRows(other.m_nRows), m_nCols(other.m_nCols), m_Data(new float[other.m_nRows * other.m_nCols]) {
+Matrix::Matrix(float *data, int rows, int cols)
+    : m_nRows(rows), m_nCols(cols), m_nCapacity(0), m_bView(true), m_Data(data), m_Allocator(nullptr) {
+  if (rows <= 0 || cols <= 0 || data == nullptr) {
+    throw std::length_error(LENGTH_ERROR_MSG);
+  }
+}
+
+Matrix::Matrix(const Matrix &other)
+    : m_nRows(other.m_nRows), m_nCols(other.m_nCols), m_nCapacity(other.m_nRows * other.m_nCols), m_bView(false),
+      m_Data(nullptr), m_Allocator(&MatrixAllocator::current()) {
+  m_Data = m_Allocator->allocate(m_nCapacity);
   std::memcpy(m_Data, other.m_Data, m_nRows * m_nCols * sizeof(float));
 }
 
+Matrix::Matrix(Matrix &&other) noexcept
+    : m_nRows(other.m_nRows), m_nCols(other.m_nCols), m_nCapacity(other.m_nCapacity), m_bView(other.m_bView), m_Data(other.m_Data),
+      m_Allocator(other.m_Allocator) {
+  other.m_nRows = 0;
+  other.m_nCols = 0;
+  other.m_nCapacity = 0;
+  other.m_bView = false;
+  other.m_Data = nullptr;
+  other.m_Allocator = nullptr;
+}
+
 Matrix::~Matrix() {
-  delete[] m_Data;
+  free_storage();
+}
+
+void Matrix::free_storage() {
+  if (m_Allocator != nullptr) {
+    m_Allocator->deallocate(m_Data, m_nCapacity);
+  }
+}
+
+Matrix Matrix::view(float *data, int rows, int cols) {
+  return Matrix(data, rows, cols);
 }
 
 Matrix &Matrix::operator=(const Matrix &other) {
   if (this == &other) {
     return *this;
   }
-  delete[] m_Data;
-  m_nRows = other.m_nRows;
-  m_nCols = other.m_nCols;
-  m_Data = new float[m_nRows * m_nCols];
+  // A view has no capacity, so resize gives it storage of its own first.
+  resize(other.m_nRows, other.m_nCols);
   std::memcpy(m_Data, other.m_Data, m_nRows * m_nCols * sizeof(float));
   return *this;
 }
 
-Matrix &Matrix::transpose() {
-  Matrix transposed(m_nCols, m_nRows);
-  for (int i = 0; i < m_nRows; ++i) {
-    for (int j = 0; j < m_nCols; ++j) {
-      transposed(j, i) = (*this)(i, j);
-    }
+Matrix &Matrix::operator=(Matrix &&other) noexcept {
+  if (this == &other) {
+    return *this;
   }
-  *this = transposed;
+  free_storage();
+  m_nRows = other.m_nRows;
+  m_nCols = other.m_nCols;
+  m_nCapacity = other.m_nCapacity;
+  m_bView = other.m_bView;
+  m_Data = other.m_Data;
+  m_Allocator = other.m_Allocator;
+  other.m_nRows = 0;
+  other.m_nCols = 0;
+  other.m_nCapacity = 0;
+  other.m_bView = false;
+  other.m_Data = nullptr;
+  other.m_Allocator = nullptr;
   return *this;
 }
 
-Matrix &Matrix::vectorize() {
-  m_nRows *= m_nCols;
-  m_nCols = DEFAULT_SIZE;
+Matrix &Matrix::resize(int rows, int cols) {
+  if (rows <= 0 || cols <= 0) {
+    throw std::length_error(LENGTH_ERROR_MSG);
+  }
+  if (rows * cols > m_nCapacity) {
+    MatrixAllocator &allocator = MatrixAllocator::current();
+    float *data = allocator.allocate(rows * cols);
+    free_storage();
+    m_Data = data;
+    m_nCapacity = rows * cols;
+    m_bView = false;
+    m_Allocator = &allocator;
+  }
+  m_nRows = rows;
+  m_nCols = cols;
   return *this;
 }
 
-void Matrix::plain_print() const {
-  for (int i = 0; i < m_nRows; ++i) {
-    for (int j = 0; j < m_nCols; ++j) {
-      std::cout << (*this)(i, j) << " ";
+namespace {
+
+/**
+ * Transposes a square size X size matrix in place, a pair of tiles at a
+ * time: each tile is transposed into a buffer, its mirror tile transposed
+ * into its place, and the buffer copied into the mirror's.
+ */
+void transpose_square(float *data, int size) {
+  alignas(MATRIX_ALIGNMENT) float tile[TRANSPOSE_TILE * TRANSPOSE_TILE];
+  const simd::kernel_table &kernels = simd::kernels();
+  for (int i = 0; i < size; i += TRANSPOSE_TILE) {
+    const int rows = std::min(TRANSPOSE_TILE, size - i);
+    for (int j = i; j < size; j += TRANSPOSE_TILE) {
+      const int cols = std::min(TRANSPOSE_TILE, size - j);
+      float *upper = data + i * size + j;
+      float *lower = data + j * size + i;
+      kernels.transpose(upper, size, tile, rows, rows, cols);
+      if (i != j) {
+        kernels.transpose(lower, size, upper, size, cols, rows);
+      }
+      for (int c = 0; c < cols; ++c) {
+        std::memcpy(lower + c * size, tile + c * rows, rows * sizeof(float));
+      }
     }
-    std::cout << std::endl;
   }
 }
 
-Matrix Matrix::dot(const Matrix &other) const {
-  if (m_nRows != other.m_nRows || m_nCols != other.m_nCols) {
-    throw std::length_error(LENGTH_ERROR_MSG);
+}
+
+Matrix &Matrix::transpose() {
+  if (m_nRows == DEFAULT_SIZE || m_nCols == DEFAULT_SIZE) {
+    // A vector's elements keep their order.
+    std::swap(m_nRows, m_nCols);
+    return *this;
   }
-  Matrix result(m_nRows, m_nCols);
-  for (int i = 0; i < m_nRows * m_nCols; ++i) {
-    result.m_Data[i] = m_Data[i] * other.m_Data[i];
+  if (m_nRows == m_nCols && !m_bView) {
+    transpose_square(m_Data, m_nRows);
+    return *this;
   }
-  return result;
+  Matrix transposed(m_nCols, m_nRows);
+  transpose_into(transposed);
+  *this = std::move(transposed);
+  return *this;
 }
 
-float Matrix::norm() const {
-  float sum = 0.0;
-  for (int i = 0; i < m_nRows * m_nCols; ++i) {
-    sum += m_Data[i] * m_Data[i];
+void Matrix::transpose_into(Matrix &result) const {
+  result.resize(m_nCols, m_nRows);
+  const simd::kernel_table &kernels = simd::kernels();
+  for (int i = 0; i < m_nRows; i += TRANSPOSE_TILE) {
+    const int rows = std::min(TRANSPOSE_TILE, m_nRows - i);
+    for (int j = 0; j < m_nCols; j += TRANSPOSE_TILE) {
+      kernels.transpose(m_Data + i * m_nCols + j, m_nCols, result.m_Data + j * m_nRows + i, m_nRows, rows,
+                        std::min(TRANSPOSE_TILE, m_nCols - j));
+    }
   }
-  return std::sqrt(sum);
 }
 
-Matrix Matrix::operator+(const Matrix &other) const {
-  if (m_nRows != other.m_nRows || m_nCols != other.m_nCols) {
-    throw std::length_error(LENGTH_ERROR_MSG);
+Matrix &Matrix::transpose_in_place() {
+  if (m_nRows == DEFAULT_SIZE || m_nCols == DEFAULT_SIZE) {
+    std::swap(m_nRows, m_nCols);
+    return *this;
   }
-  Matrix result(m_nRows, m_nCols);
-  for (int i = 0; i < m_nRows * m_nCols; ++i) {
-    result.m_Data[i] = m_Data[i] + other.m_Data[i];
+  if (m_nRows == m_nCols) {
+    transpose_square(m_Data, m_nRows);
+    return *this;
   }
-  return result;
+  // The element at index p of the rows X cols layout belongs at index
+  // p * rows mod (size - 1) of the cols X rows one; the first and last
+  // elements stay.
+  const long last = static_cast<long>(m_nRows) * m_nCols - 1;
+  std::vector<bool> moved(last, false);
+  for (long start = 1; start < last; ++start) {
+    if (moved[start]) {
+      continue;
+    }
+    float value = m_Data[start];
+    long p = start;
+    do {
+      p = p * m_nRows % last;
+      std::swap(value, m_Data[p]);
+      moved[p] = true;
+    } while (p != start);
+  }
+  std::swap(m_nRows, m_nCols);
+  return *this;
 }
 
-Matrix Matrix::operator*(const Matrix &other) const {
-  if (m_nCols != other.m_nRows) {
+Matrix &Matrix::vectorize() {
+  m_nRows *= m_nCols;
+  m_nCols = DEFAULT_SIZE;
+  return *this;
+}
+
+Matrix &Matrix::broadcast_add(const Matrix &column) {
+  if (column.m_nRows != m_nRows || column.m_nCols != DEFAULT_SIZE) {
     throw std::length_error(LENGTH_ERROR_MSG);
   }
-  Matrix result(m_nRows, other.m_nCols);
   for (int i = 0; i < m_nRows; ++i) {
-    for (int j = 0; j < other.m_nCols; ++j) {
-      result(i, j) = 0;
-      for (int k = 0; k < m_nCols; ++k) {
-        result(i, j) += (*this)(i, k) * other(k, j);
-      }
+    const float value = column.m_Data[i];
+    float *row = m_Data + i * m_nCols;
+    for (int j = 0; j < m_nCols; ++j) {
+      row[j] += value;
     }
   }
-  return result;
+  return *this;
 }
 
-Matrix Matrix::operator*(float scalar) const {
-  Matrix result(m_nRows, m_nCols);
-  for (int i = 0; i < m_nRows * m_nCols; ++i) {
-    result.m_Data[i] = m_Data[i] * scalar;
+void Matrix::plain_print() const {
+  for (int i = 0; i < m_nRows; ++i) {
+    const float *row = m_Data + i * m_nCols;
+    for (int j = 0; j < m_nCols; ++j) {
+      std::cout << row[j] << " ";
+    }
+    std::cout << std::endl;
   }
-  return result;
 }
 
-Matrix operator*(float scalar, const Matrix &mat) {
-  return mat * scalar;
+float Matrix::norm() const {
+  return std::sqrt(simd::kernels().sum_squares(m_Data, m_nRows * m_nCols));
+}
+
+void Matrix::multiply_into(const Matrix &other, Matrix &result) const {
+  if (m_nCols != other.m_nRows) {
+    throw std::length_error(LENGTH_ERROR_MSG);
+  }
+  result.resize(m_nRows, other.m_nCols);
+  gemm::sgemm(m_nRows, other.m_nCols, m_nCols, m_Data, m_nCols, other.m_Data, other.m_nCols,
+              result.m_Data, result.m_nCols);
 }
 
 void Matrix::operator+=(const Matrix &other) {
   if (m_nRows != other.m_nRows || m_nCols != other.m_nCols) {
     throw std::length_error(LENGTH_ERROR_MSG);
   }
-  for (int i = 0; i < m_nRows * m_nCols; ++i) {
-    m_Data[i] += other.m_Data[i];
+  simd::kernels().add(m_Data, other.m_Data, m_Data, m_nRows * m_nCols);
+}
+
+void expr::check_same_size(int rows, int cols, int other_rows, int other_cols) {
+  if (rows != other_rows || cols != other_cols) {
+    throw std::length_error(LENGTH_ERROR_MSG);
   }
 }
 
-float &Matrix::operator()(int row, int col) {
-  if (row < 0 || col < 0 || row >= m_nRows || col >= m_nCols) {
+void expr::check_index(int index, int size) {
+  if (index < 0 || index >= size) {
     throw std::out_of_range(OUT_OF_RANGE_MSG);
   }
-  return m_Data[row * m_nCols + col];
 }
 
-float Matrix::operator()(int row, int col) const {
-  if (row < 0 || col < 0 || row >= m_nRows || col >= m_nCols) {
-    throw std::out_of_range(OUT_OF_RANGE_MSG);
+expr::product::product(const Matrix &left, const Matrix &right)
+    : base<product>(left.get_rows(), right.get_cols()), _left(&left), _right(&right) {
+  if (left.get_cols() != right.get_rows()) {
+    throw std::length_error(LENGTH_ERROR_MSG);
   }
-  return m_Data[row * m_nCols + col];
 }
 
-float &Matrix::operator[](int idx) {
-  if (idx < 0 || idx >= m_nRows * m_nCols) {
-    throw std::out_of_range(OUT_OF_RANGE_MSG);
+float expr::product::operator()(int row, int col) const {
+  MATRIX_CHECK_INDEX(row, _rows);
+  MATRIX_CHECK_INDEX(col, _cols);
+  const int depth = _left->get_cols();
+  const float *a = _left->begin() + row * depth;
+  const float *b = _right->begin() + col;
+  float sum = 0.0f;
+  for (int k = 0; k < depth; ++k) {
+    sum += a[k] * b[k * _cols];
   }
-  return m_Data[idx];
+  return sum;
 }
 
-float Matrix::operator[](int idx) const {
-  if (idx < 0 || idx >= m_nRows * m_nCols) {
-    throw std::out_of_range(OUT_OF_RANGE_MSG);
+float expr::product::operator[](int index) const {
+  MATRIX_CHECK_INDEX(index, _rows * _cols);
+  return (*this)(index / _cols, index % _cols);
+}
+
+float expr::product::at(int row, int col) const {
+  check_index(row, _rows);
+  check_index(col, _cols);
+  return (*this)(row, col);
+}
+
+float expr::product::at(int index) const {
+  check_index(index, _rows * _cols);
+  return (*this)[index];
+}
+
+bool expr::product::aliases(const float *data) const {
+  return data == _left->begin() || data == _right->begin();
+}
+
+void expr::product::assign_to(Matrix &dest, const float *bias) const {
+  if (aliases(dest.begin()) || (bias != nullptr && bias == dest.begin())) {
+    Matrix result;
+    assign_to(result, bias);
+    dest = std::move(result);
+    return;
   }
-  return m_Data[idx];
+  dest.resize(_rows, _cols);
+  const int depth = _left->get_cols();
+  gemm::sgemm_bias(_rows, _cols, depth, _left->begin(), depth, _right->begin(), _cols, bias, false, dest.begin(),
+                   _cols);
+}
+
+expr::sum<expr::leaf, expr::leaf> operator+(const Matrix &lhs, const Matrix &rhs) {
+  return expr::sum<expr::leaf, expr::leaf>(expr::leaf(lhs), expr::leaf(rhs));
+}
+
+expr::scaled<expr::leaf> operator*(const Matrix &lhs, float scalar) {
+  return expr::scaled<expr::leaf>(expr::leaf(lhs), scalar);
+}
+
+expr::scaled<expr::leaf> operator*(float scalar, const Matrix &rhs) {
+  return expr::scaled<expr::leaf>(expr::leaf(rhs), scalar);
+}
+
+expr::product operator*(const Matrix &lhs, const Matrix &rhs) {
+  return expr::product(lhs, rhs);
+}
+
+expr::product_sum<expr::leaf> operator+(const expr::product &lhs, const Matrix &rhs) {
+  return expr::product_sum<expr::leaf>(lhs, expr::leaf(rhs));
+}
+
+expr::product_sum<expr::leaf> operator+(const Matrix &lhs, const expr::product &rhs) {
+  return expr::product_sum<expr::leaf>(rhs, expr::leaf(lhs));
 }
 
 std::ostream &operator<<(std::ostream &os, const Matrix &mat) {
   for (int i = 0; i < mat.m_nRows; ++i) {
+    const float *row = mat.row(i);
     for (int j = 0; j < mat.m_nCols; ++j) {
-      os << (mat(i, j) > 0.1 ? "**" : "  ");
+      os << (row[j] > 0.1 ? "**" : "  ");
     }
     os << std::endl;
   }
@@ -1,7 +1,10 @@
 // Matrix.h
 #ifndef MATRIX_H
 #define MATRIX_H
+#include "MatrixAllocator.h"
+#include "MatrixExpr.h"
 #include <iostream>
+#include <utility>
 using std::ostream;
 using std::istream;
 /**
@@ -13,6 +16,11 @@ typedef struct matrix_dims
     int rows, cols;
 } matrix_dims;
 
+/**
+ * A rows X cols float matrix in row-major order. Its storage comes from
+ * the MatrixAllocator current when it was allocated (see AllocatorScope),
+ * the heap by default, and is MATRIX_ALIGNMENT aligned.
+ */
 class Matrix
 {
 
@@ -26,13 +34,40 @@ class Matrix
   Matrix (int rows, int cols);
 
   /**
-   * Copy constructor, constructs a matrix from another Matrix.
+   * Copy constructor, constructs a matrix from another Matrix. The copy
+   * owns its elements, also when copying a view (see view).
    * @param m - The matrix the method copies.
    */
   Matrix (Matrix const &input_matrix);
 
+  /**
+   * Move constructor, takes over the storage of another Matrix, which is
+   * left empty (0 X 0) and may only be assigned to or destroyed.
+   * @param input_matrix - The matrix the method moves from.
+   */
+  Matrix (Matrix &&input_matrix) noexcept;
+
+  /**
+   * Evaluates an expression (see MatrixExpr.h) into a new matrix.
+   */
+  template <typename E>
+  Matrix (const expr::base<E> &expression);
+
   ~Matrix ();
 
+  /**
+   * Constructs a matrix over existing data without copying or owning it,
+   * e.g. weights mapped from a packed model file. data must outlive the
+   * view, and must not be written through it if it is read-only. Copies
+   * of a view own copies of the data; assigning to a view or resizing it
+   * detaches it into a matrix with its own storage.
+   * @param data - rows * cols floats in row-major order.
+   */
+  static Matrix view (float *data, int rows, int cols);
+
+  bool is_view () const
+  { return m_bView; }
+
   int get_rows () const
   { return m_nRows; }
 
@@ -40,15 +75,49 @@ class Matrix
   { return m_nCols; }
 
   /**
-   * Transforms a matrix into its transpose matrix.
+   * Changes the shape to rows X cols, reusing the current storage when it
+   * is large enough, so a buffer resized to sizes it already held never
+   * allocates again. The element values are unspecified afterwards.
+   * @param rows - Amount of rows of the Matrix
+   * @param cols - Amount of cols of the Matrix.
+   */
+  Matrix &resize (int rows, int cols);
+
+  /**
+   * Transforms a matrix into its transpose matrix. Square matrices are
+   * transposed in place, tile by tile; others are written tile by tile to
+   * new storage from the current allocator, which then replaces the old
+   * one. A view is never written: it becomes a matrix with its own storage.
    */
   Matrix &transpose ();
 
+  /**
+   * Writes the transpose of this matrix to result, resized (see resize) to
+   * fit, in cache-sized tiles transposed by the SIMD kernels. result must
+   * not be this matrix.
+   */
+  void transpose_into (Matrix &result) const;
+
+  /**
+   * Transforms a matrix into its transpose without a second buffer for the
+   * elements: a non-square matrix moves each element along its permutation
+   * cycle, with one bit of bookkeeping per element. It is slower than
+   * transpose, whose buffer it saves. A view's data is transposed in place.
+   */
+  Matrix &transpose_in_place ();
+
   /**
    * Transforms a matrix into a column vector.
    */
   Matrix &vectorize ();
 
+  /**
+   * Adds a column vector to every column of this matrix, e.g. a layer bias
+   * to a batch of layer outputs.
+   * @param column - A matrix of size rows X 1.
+   */
+  Matrix &broadcast_add (const Matrix &column);
+
   /**
    * Prints matrix elements, no return value.
    */
@@ -58,37 +127,211 @@ class Matrix
    *
    * @param m - the other Matrix.
    * @return: s a matrix which is the elementwise multiplication(Hadamard
-   * product) of this matrix and another matrix m.
+   * product) of this matrix and another matrix m, as a lazy expression (see
+   * MatrixExpr.h).
    */
-  Matrix dot (Matrix const &m) const;
+  template <typename R>
+  expr::hadamard<expr::leaf, expr::node_t<R>> dot (R const &m) const;
 
   /**
    *
    * @return: The Frobenius norm of the given matrix.
    */
-  float norm ();
+  float norm () const;
+
+  /**
+   * Iterators over the matrix elements in row-major order.
+   */
+  float *begin ()
+  { return m_Data; }
+
+  float *end ()
+  { return m_Data + m_nRows * m_nCols; }
+
+  const float *begin () const
+  { return m_Data; }
+
+  const float *end () const
+  { return m_Data + m_nRows * m_nCols; }
+
+  /**
+   * Unchecked access to the elements in row-major order, and to the
+   * get_cols () elements of row row_num.
+   */
+  float *data ()
+  { return m_Data; }
+
+  const float *data () const
+  { return m_Data; }
+
+  float *row (int row_num)
+  { return m_Data + row_num * m_nCols; }
+
+  const float *row (int row_num) const
+  { return m_Data + row_num * m_nCols; }
 
   /******************* Operators *******************/
 
-  Matrix operator+ (const Matrix &input_matrix) const;
+  // +, * and dot build lazy expressions, see MatrixExpr.h and the
+  // operators after this class.
   Matrix &operator= (const Matrix &input_matrix);
-  Matrix operator* (const Matrix &input_matrix) const;
-  Matrix operator* (float &scalar) const;
-  friend Matrix operator* (const float &scalar, const Matrix &input_matrix);
+  Matrix &operator= (Matrix &&input_matrix) noexcept;
+  /**
+   * Evaluates an expression into this matrix, reusing its storage when it
+   * is large enough. The expression may read this matrix.
+   */
+  template <typename E>
+  Matrix &operator= (const expr::base<E> &expression);
+  /**
+   * Computes this * input_matrix into result, resized (see resize) to fit.
+   * result must not be this matrix or input_matrix.
+   */
+  void multiply_into (const Matrix &input_matrix, Matrix &result) const;
   void operator+= (const Matrix &input_matrix);
-  float operator() (int row_num, int col_num) const;
-  float &operator() (int row_num, int col_num);
-  float operator[] (int value_coordination) const;
-  float &operator[] (int value_coordination);
+  /**
+   * Element access, unchecked unless MLP_CHECKED_ACCESS is defined (see
+   * MatrixExpr.h), so that element loops vectorize; see at for checked
+   * access.
+   */
+  float operator() (int row_num, int col_num) const {
+    MATRIX_CHECK_INDEX (row_num, m_nRows);
+    MATRIX_CHECK_INDEX (col_num, m_nCols);
+    return m_Data[row_num * m_nCols + col_num];
+  }
+
+  float &operator() (int row_num, int col_num) {
+    MATRIX_CHECK_INDEX (row_num, m_nRows);
+    MATRIX_CHECK_INDEX (col_num, m_nCols);
+    return m_Data[row_num * m_nCols + col_num];
+  }
+
+  float operator[] (int value_coordination) const {
+    MATRIX_CHECK_INDEX (value_coordination, m_nRows * m_nCols);
+    return m_Data[value_coordination];
+  }
+
+  float &operator[] (int value_coordination) {
+    MATRIX_CHECK_INDEX (value_coordination, m_nRows * m_nCols);
+    return m_Data[value_coordination];
+  }
+
+  /**
+   * Checked element access.
+   * @throw std::out_of_range unless the element is within the matrix.
+   */
+  float at (int row_num, int col_num) const {
+    expr::check_index (row_num, m_nRows);
+    expr::check_index (col_num, m_nCols);
+    return m_Data[row_num * m_nCols + col_num];
+  }
+
+  float &at (int row_num, int col_num) {
+    expr::check_index (row_num, m_nRows);
+    expr::check_index (col_num, m_nCols);
+    return m_Data[row_num * m_nCols + col_num];
+  }
+
+  float at (int value_coordination) const {
+    expr::check_index (value_coordination, m_nRows * m_nCols);
+    return m_Data[value_coordination];
+  }
+
+  float &at (int value_coordination) {
+    expr::check_index (value_coordination, m_nRows * m_nCols);
+    return m_Data[value_coordination];
+  }
   friend ostream &operator<< (ostream &stream, const Matrix &input_matrix);
   friend istream &operator>> (istream &stream, Matrix &input_matrix);
 
  private:
+  Matrix (float *data, int rows, int cols);
+  void free_storage ();
+
   int m_nRows;
   int m_nCols;
+  // Owned floats available to resize; 0 for views, which own nothing.
+  int m_nCapacity;
+  bool m_bView;
   float *m_Data;
-
-  float norm () const;
+  // Where m_Data goes back to; nullptr when nothing is owned.
+  MatrixAllocator *m_Allocator;
 };
 
+ostream &operator<< (ostream &stream, const Matrix &input_matrix);
+
+/******************* Lazy operators, see MatrixExpr.h *******************/
+
+expr::sum<expr::leaf, expr::leaf> operator+ (const Matrix &lhs,
+                                             const Matrix &rhs);
+expr::scaled<expr::leaf> operator* (const Matrix &lhs, float scalar);
+expr::scaled<expr::leaf> operator* (float scalar, const Matrix &rhs);
+/**
+ * Matrix product, computed by the blocked GEMM kernel in Gemm.h when the
+ * expression is evaluated.
+ */
+expr::product operator* (const Matrix &lhs, const Matrix &rhs);
+/**
+ * Matrix product plus a matrix of its size. A column bias (a single column
+ * product, e.g. W * x + b) is added by the fused GEMM kernel.
+ */
+expr::product_sum<expr::leaf> operator+ (const expr::product &lhs,
+                                         const Matrix &rhs);
+expr::product_sum<expr::leaf> operator+ (const Matrix &lhs,
+                                         const expr::product &rhs);
+
+inline expr::leaf::leaf (const Matrix &m)
+    : elementwise<leaf> (m.get_rows (), m.get_cols ()), _data (m.begin ())
+{}
+
+template <typename E>
+Matrix::Matrix (const expr::base<E> &expression)
+    : m_nRows (0), m_nCols (0), m_nCapacity (0), m_bView (false),
+      m_Data (nullptr), m_Allocator (nullptr)
+{ expression.derived ().assign_to (*this); }
+
+template <typename E>
+Matrix &Matrix::operator= (const expr::base<E> &expression) {
+  expression.derived ().assign_to (*this);
+  return *this;
+}
+
+template <typename R>
+expr::hadamard<expr::leaf, expr::node_t<R>> Matrix::dot (R const &m) const
+{ return expr::leaf (*this).dot (m); }
+
+template <typename E>
+void expr::elementwise<E>::assign_to (Matrix &dest) const {
+  // Every operand has the size of dest, so one that shares its storage
+  // keeps it through resize and is read at each index before the write.
+  dest.resize (this->_rows, this->_cols);
+  evaluate (this->derived (), dest.begin (), this->_rows * this->_cols);
+}
+
+namespace expr
+{
+    /** A leaf addend of a product may serve as the fused kernel's bias. */
+    inline const float *bias_data (const leaf &addend)
+    { return addend.data (); }
+
+    template <typename E>
+    const float *bias_data (const E &)
+    { return nullptr; }
+}
+
+template <typename E>
+void expr::product_sum<E>::assign_to (Matrix &dest) const {
+  const float *bias = this->_cols == 1 ? bias_data (_right) : nullptr;
+  if (bias != nullptr) {
+    _left.assign_to (dest, bias);
+    return;
+  }
+  if (_right.aliases (dest.begin ())) {
+    Matrix result (*this);
+    dest = std::move (result);
+    return;
+  }
+  _left.assign_to (dest);
+  evaluate (_right, dest.begin (), this->_rows * this->_cols, true);
+}
+
 #endif //MATRIX_H
\ No newline at end of file
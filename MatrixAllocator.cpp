@@ -0,0 +1,189 @@
+#include "MatrixAllocator.h"
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+// Pool classes hold MATRIX_ALIGNMENT << k bytes, up to 32MB.
+#define POOL_CLASSES 20
+
+namespace {
+
+size_t align_up(size_t bytes) {
+  return (bytes + MATRIX_ALIGNMENT - 1) & ~static_cast<size_t>(MATRIX_ALIGNMENT - 1);
+}
+
+/**
+ * Allocates MATRIX_ALIGNMENT aligned memory through operator new, keeping
+ * the address it returned just before the aligned one.
+ */
+void *aligned_new(size_t bytes) {
+  char *raw = static_cast<char *>(::operator new(bytes + MATRIX_ALIGNMENT));
+  const uintptr_t address = reinterpret_cast<uintptr_t>(raw);
+  char *data = raw + align_up(address + sizeof(void *)) - address;
+  reinterpret_cast<void **>(data)[-1] = raw;
+  return data;
+}
+
+void aligned_delete(void *data) {
+  ::operator delete(reinterpret_cast<void **>(data)[-1]);
+}
+
+class HeapAllocator : public MatrixAllocator
+{
+ protected:
+  void *acquire(size_t bytes) override {
+    return aligned_new(bytes);
+  }
+
+  void release(void *data, size_t) override {
+    aligned_delete(data);
+  }
+};
+
+thread_local MatrixAllocator *current_allocator = nullptr;
+
+/**
+ * @return The pool class serving bytes, or POOL_CLASSES if it is too large.
+ */
+int pool_class(size_t bytes) {
+  int k = 0;
+  while (k < POOL_CLASSES && (static_cast<size_t>(MATRIX_ALIGNMENT) << k) < bytes) {
+    ++k;
+  }
+  return k;
+}
+
+}
+
+float *MatrixAllocator::allocate(size_t count) {
+  const size_t bytes = count * sizeof(float);
+  void *data = acquire(bytes);
+  _allocations.fetch_add(1, std::memory_order_relaxed);
+  _bytes.fetch_add(static_cast<long>(bytes), std::memory_order_relaxed);
+  return static_cast<float *>(data);
+}
+
+void MatrixAllocator::clear_stats() {
+  _allocations = 0;
+  _bytes = 0;
+}
+
+MatrixAllocator &MatrixAllocator::heap() {
+  // Never destroyed, so matrices with static storage can still free into it.
+  static HeapAllocator *allocator = new HeapAllocator();
+  return *allocator;
+}
+
+MatrixAllocator &MatrixAllocator::current() {
+  return current_allocator == nullptr ? heap() : *current_allocator;
+}
+
+AllocatorScope::AllocatorScope(MatrixAllocator &allocator) : _previous(current_allocator) {
+  current_allocator = &allocator;
+}
+
+AllocatorScope::~AllocatorScope() {
+  current_allocator = _previous;
+}
+
+ArenaAllocator::ArenaAllocator(size_t block_bytes) {
+  add_block(align_up(std::max(block_bytes, static_cast<size_t>(MATRIX_ALIGNMENT))));
+}
+
+ArenaAllocator::~ArenaAllocator() {
+  for (const block &b : _blocks) {
+    aligned_delete(b.data);
+  }
+}
+
+void ArenaAllocator::add_block(size_t bytes) {
+  _blocks.push_back({static_cast<char *>(aligned_new(bytes)), bytes, 0});
+}
+
+void *ArenaAllocator::acquire(size_t bytes) {
+  bytes = align_up(bytes);
+  if (_blocks.back().size - _blocks.back().used < bytes) {
+    add_block(std::max(bytes, _blocks.back().size * 2));
+  }
+  block &b = _blocks.back();
+  void *data = b.data + b.used;
+  b.used += bytes;
+  return data;
+}
+
+void ArenaAllocator::release(void *data, size_t bytes) {
+  block &b = _blocks.back();
+  if (static_cast<char *>(data) + align_up(bytes) == b.data + b.used) {
+    b.used -= align_up(bytes);
+  }
+}
+
+void ArenaAllocator::reset() {
+  if (_blocks.size() > 1) {
+    // Merge the blocks, so the next round fits in one.
+    const size_t total = reserved();
+    for (const block &b : _blocks) {
+      aligned_delete(b.data);
+    }
+    _blocks.clear();
+    add_block(total);
+  }
+  _blocks.back().used = 0;
+}
+
+size_t ArenaAllocator::reserved() const {
+  size_t total = 0;
+  for (const block &b : _blocks) {
+    total += b.size;
+  }
+  return total;
+}
+
+PoolAllocator::PoolAllocator() : _free(POOL_CLASSES, nullptr) {}
+
+PoolAllocator::~PoolAllocator() {
+  trim();
+}
+
+void *PoolAllocator::acquire(size_t bytes) {
+  const int k = pool_class(bytes);
+  if (k == POOL_CLASSES) {
+    return aligned_new(bytes);
+  }
+  void *data = _free[k];
+  if (data == nullptr) {
+    return aligned_new(static_cast<size_t>(MATRIX_ALIGNMENT) << k);
+  }
+  _free[k] = *static_cast<void **>(data);
+  return data;
+}
+
+void PoolAllocator::release(void *data, size_t bytes) {
+  const int k = pool_class(bytes);
+  if (k == POOL_CLASSES) {
+    aligned_delete(data);
+    return;
+  }
+  *static_cast<void **>(data) = _free[k];
+  _free[k] = data;
+}
+
+void PoolAllocator::trim() {
+  for (void *&head : _free) {
+    while (head != nullptr) {
+      void *next = *static_cast<void **>(head);
+      aligned_delete(head);
+      head = next;
+    }
+  }
+}
+
+size_t PoolAllocator::cached() const {
+  size_t total = 0;
+  for (int k = 0; k < POOL_CLASSES; ++k) {
+    for (void *data = _free[k]; data != nullptr; data = *static_cast<void **>(data)) {
+      total += static_cast<size_t>(MATRIX_ALIGNMENT) << k;
+    }
+  }
+  return total;
+}
@@ -0,0 +1,178 @@
+// MatrixAllocator.h
+#ifndef MATRIXALLOCATOR_H
+#define MATRIXALLOCATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Every buffer served for Matrix storage starts on a cache line, which is
+// also the widest SIMD load.
+#define MATRIX_ALIGNMENT 64
+
+/**
+ * @struct allocator_stats
+ * @brief What an allocator served since it was created or its counters
+ *        were cleared: the amount of buffers and their requested bytes.
+ */
+typedef struct allocator_stats
+{
+    long allocations;
+    long bytes;
+} allocator_stats;
+
+/**
+ * Where Matrix gets its storage. A matrix takes its buffer from the
+ * calling thread's current allocator (see AllocatorScope) and returns it
+ * to the same allocator, which must therefore outlive it. Buffers are
+ * MATRIX_ALIGNMENT aligned.
+ */
+class MatrixAllocator
+{
+ public:
+  MatrixAllocator () : _allocations (0), _bytes (0)
+  {}
+  MatrixAllocator (const MatrixAllocator &) = delete;
+  MatrixAllocator &operator= (const MatrixAllocator &) = delete;
+  virtual ~MatrixAllocator () = default;
+
+  /**
+   * @return count uninitialized floats.
+   * @throw std::bad_alloc if the memory cannot be obtained.
+   */
+  float *allocate (size_t count);
+
+  /**
+   * Returns a buffer of count floats obtained from allocate.
+   */
+  void deallocate (float *data, size_t count)
+  { release (data, count * sizeof (float)); }
+
+  allocator_stats stats () const
+  { return {_allocations.load (), _bytes.load ()}; }
+
+  void clear_stats ();
+
+  /**
+   * @return The process-wide allocator, which takes every buffer from the
+   * heap and may be used from any thread. It is the default.
+   */
+  static MatrixAllocator &heap ();
+
+  /**
+   * @return The calling thread's current allocator.
+   */
+  static MatrixAllocator &current ();
+
+ protected:
+  virtual void *acquire (size_t bytes) = 0;
+  virtual void release (void *data, size_t bytes) = 0;
+
+ private:
+  // Counted atomically: the heap allocator is shared by every thread.
+  std::atomic<long> _allocations;
+  std::atomic<long> _bytes;
+};
+
+/**
+ * Makes an allocator the calling thread's current one until the scope
+ * ends, when the previous one is restored. Scopes nest.
+ */
+class AllocatorScope
+{
+ public:
+  explicit AllocatorScope (MatrixAllocator &allocator);
+  AllocatorScope (const AllocatorScope &) = delete;
+  AllocatorScope &operator= (const AllocatorScope &) = delete;
+  ~AllocatorScope ();
+
+ private:
+  MatrixAllocator *_previous;
+};
+
+/**
+ * A bump allocator for the temporaries of one inference or batch: it
+ * hands out consecutive slices of a large block and frees nothing until
+ * reset, except that releasing the latest slice takes it back, so
+ * short-lived temporaries are recycled in stack order. After reset the
+ * block is as large as the busiest round so far needed, so steady-state
+ * rounds make no heap allocation. Not thread-safe: use one per thread.
+ */
+class ArenaAllocator : public MatrixAllocator
+{
+ public:
+  /**
+   * @param block_bytes - The initial block size; the arena grows past it
+   * by adding blocks.
+   */
+  explicit ArenaAllocator (size_t block_bytes = 1 << 20);
+  ~ArenaAllocator () override;
+
+  /**
+   * Makes all of the arena free again. Every matrix using it must have
+   * been destroyed.
+   */
+  void reset ();
+
+  /**
+   * @return The bytes held in blocks, used or not.
+   */
+  size_t reserved () const;
+
+ protected:
+  void *acquire (size_t bytes) override;
+  void release (void *data, size_t bytes) override;
+
+ private:
+  /**
+   * @struct block
+   * @brief A heap block and the offset of its first free byte.
+   */
+  typedef struct block
+  {
+      char *data;
+      size_t size;
+      size_t used;
+  } block;
+
+  void add_block (size_t bytes);
+
+  std::vector<block> _blocks;
+};
+
+/**
+ * Recycles buffers in power-of-two size classes: a released buffer is kept
+ * on its class's free list and served again to the next request of that
+ * class, so buffers that are repeatedly created and destroyed stop
+ * reaching the heap. Requests past the largest class go to the heap
+ * directly. Cached buffers are freed by trim and when the pool is
+ * destroyed, after every matrix using it. Not thread-safe: use one per
+ * thread.
+ */
+class PoolAllocator : public MatrixAllocator
+{
+ public:
+  PoolAllocator ();
+  ~PoolAllocator () override;
+
+  /**
+   * Frees the cached buffers.
+   */
+  void trim ();
+
+  /**
+   * @return The bytes of the cached buffers.
+   */
+  size_t cached () const;
+
+ protected:
+  void *acquire (size_t bytes) override;
+  void release (void *data, size_t bytes) override;
+
+ private:
+  // The head of each class's free list; a free buffer starts with the
+  // address of the next one.
+  std::vector<void *> _free;
+};
+
+#endif //MATRIXALLOCATOR_H
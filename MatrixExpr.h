@@ -0,0 +1,447 @@
+// MatrixExpr.h
+#ifndef MATRIXEXPR_H
+#define MATRIXEXPR_H
+
+#include "Simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+
+// Expressions are evaluated in blocks of this many elements, small enough
+// for every intermediate block to stay in the L1 cache.
+#define EXPR_BLOCK 256
+
+// operator () and [] of Matrix and of expressions check their indices only
+// when MLP_CHECKED_ACCESS is defined, as it is in Debug builds, so element
+// loops compile to plain loads and stores; at () always checks.
+#ifdef MLP_CHECKED_ACCESS
+#define MATRIX_CHECK_INDEX(index, size) expr::check_index (index, size)
+#else
+#define MATRIX_CHECK_INDEX(index, size) static_cast<void> (0)
+#endif
+
+class Matrix;
+
+/**
+ * Lazy Matrix arithmetic. The elementwise operators (+, scaling by a float
+ * and Matrix::dot) return small expression nodes instead of matrices, and
+ * the whole expression runs in one pass, with no temporary matrices, when
+ * it is assigned to or converted into a Matrix: block by block, each node
+ * runs its SIMD kernel on its operands' blocks, which stay in cache. A
+ * matrix product is deferred the same way, so that adding a bias to it
+ * runs the fused GEMM kernel (see gemm::sgemm_bias). Sizes are still
+ * checked as each operator is applied.
+ *
+ * Nodes refer to their operands, so an expression must be evaluated in the
+ * statement that builds it: do not keep one in an auto variable.
+ */
+namespace expr
+{
+    /** @throw std::length_error unless both sizes are equal. */
+    void check_same_size (int rows, int cols, int other_rows,
+                          int other_cols);
+
+    /** @throw std::out_of_range unless 0 <= index < size. */
+    void check_index (int index, int size);
+
+    /**
+     * The shape shared by every node; E is the node's own type.
+     */
+    template <typename E>
+    class base
+    {
+     public:
+      int get_rows () const
+      { return _rows; }
+
+      int get_cols () const
+      { return _cols; }
+
+      const E &derived () const
+      { return static_cast<const E &> (*this); }
+
+     protected:
+      base (int rows, int cols) : _rows (rows), _cols (cols)
+      {}
+
+      int _rows;
+      int _cols;
+    };
+
+    template <typename L, typename R>
+    class hadamard;
+
+    class leaf;
+
+    template <typename T>
+    struct node
+    {
+        typedef T type;
+    };
+
+    /** A Matrix enters an expression as a leaf. */
+    template <>
+    struct node<Matrix>
+    {
+        typedef leaf type;
+    };
+
+    template <typename T>
+    using node_t = typename node<T>::type;
+
+    /**
+     * A node whose elements can be computed in row-major order, one at a
+     * time by element (index), or a block of n from index begin at a time
+     * by block_into, which writes them to out, or block, which returns
+     * where they are. A node needs temps blocks of scratch space for itself
+     * and its operands. Element access is checked like Matrix's.
+     */
+    template <typename E>
+    class elementwise : public base<E>
+    {
+     public:
+      float operator[] (int index) const {
+        MATRIX_CHECK_INDEX (index, this->_rows * this->_cols);
+        return this->derived ().element (index);
+      }
+
+      float operator() (int row, int col) const {
+        MATRIX_CHECK_INDEX (row, this->_rows);
+        MATRIX_CHECK_INDEX (col, this->_cols);
+        return this->derived ().element (row * this->_cols + col);
+      }
+
+      /** @throw std::out_of_range unless index is within the expression. */
+      float at (int index) const {
+        check_index (index, this->_rows * this->_cols);
+        return this->derived ().element (index);
+      }
+
+      /** @throw std::out_of_range unless row and col are within it. */
+      float at (int row, int col) const {
+        check_index (row, this->_rows);
+        check_index (col, this->_cols);
+        return this->derived ().element (row * this->_cols + col);
+      }
+
+      /**
+       * @return The Frobenius norm, without storing the elements.
+       */
+      float norm () const {
+        float sum = 0.0f;
+        for (int i = 0; i < this->_rows * this->_cols; ++i) {
+          const float value = this->derived ().element (i);
+          sum += value * value;
+        }
+        return std::sqrt (sum);
+      }
+
+      template <typename R>
+      hadamard<E, node_t<R>> dot (const R &other) const;
+
+      /**
+       * Resizes dest to fit and writes the elements to it. dest may be one
+       * of the operands.
+       */
+      void assign_to (Matrix &dest) const;
+
+     protected:
+      elementwise (int rows, int cols) : base<E> (rows, cols)
+      {}
+    };
+
+    /**
+     * A Matrix operand, read in place.
+     */
+    class leaf : public elementwise<leaf>
+    {
+     public:
+      explicit leaf (const Matrix &m);
+
+      static constexpr int temps = 0;
+
+      float element (int index) const
+      { return _data[index]; }
+
+      const float *block (const simd::kernel_table &, int begin, int,
+                          float *) const
+      { return _data + begin; }
+
+      void block_into (const simd::kernel_table &, int begin, int n,
+                       float *out, float *) const
+      { std::memcpy (out, _data + begin, n * sizeof (float)); }
+
+      const float *data () const
+      { return _data; }
+
+      bool aliases (const float *data) const
+      { return data == _data; }
+
+     private:
+      const float *_data;
+    };
+
+    /** left + right */
+    template <typename L, typename R>
+    class sum : public elementwise<sum<L, R>>
+    {
+     public:
+      sum (const L &left, const R &right)
+          : elementwise<sum<L, R>> (left.get_rows (), left.get_cols ()),
+            _left (left), _right (right) {
+        check_same_size (left.get_rows (), left.get_cols (),
+                         right.get_rows (), right.get_cols ());
+      }
+
+      static constexpr int temps = 1 + L::temps + R::temps;
+
+      float element (int index) const
+      { return _left.element (index) + _right.element (index); }
+
+      void block_into (const simd::kernel_table &k, int begin, int n,
+                       float *out, float *scratch) const {
+        const float *left = _left.block (k, begin, n, scratch);
+        const float *right = _right.block (k, begin, n,
+                                           scratch + L::temps * EXPR_BLOCK);
+        k.add (left, right, out, n);
+      }
+
+      const float *block (const simd::kernel_table &k, int begin, int n,
+                          float *scratch) const {
+        block_into (k, begin, n, scratch, scratch + EXPR_BLOCK);
+        return scratch;
+      }
+
+      bool aliases (const float *data) const
+      { return _left.aliases (data) || _right.aliases (data); }
+
+      const L &left () const
+      { return _left; }
+
+      const R &right () const
+      { return _right; }
+
+     private:
+      L _left;
+      R _right;
+    };
+
+    /** left * right, elementwise (see Matrix::dot) */
+    template <typename L, typename R>
+    class hadamard : public elementwise<hadamard<L, R>>
+    {
+     public:
+      hadamard (const L &left, const R &right)
+          : elementwise<hadamard<L, R>> (left.get_rows (), left.get_cols ()),
+            _left (left), _right (right) {
+        check_same_size (left.get_rows (), left.get_cols (),
+                         right.get_rows (), right.get_cols ());
+      }
+
+      static constexpr int temps = 1 + L::temps + R::temps;
+
+      float element (int index) const
+      { return _left.element (index) * _right.element (index); }
+
+      void block_into (const simd::kernel_table &k, int begin, int n,
+                       float *out, float *scratch) const {
+        const float *left = _left.block (k, begin, n, scratch);
+        const float *right = _right.block (k, begin, n,
+                                           scratch + L::temps * EXPR_BLOCK);
+        k.mul (left, right, out, n);
+      }
+
+      const float *block (const simd::kernel_table &k, int begin, int n,
+                          float *scratch) const {
+        block_into (k, begin, n, scratch, scratch + EXPR_BLOCK);
+        return scratch;
+      }
+
+      bool aliases (const float *data) const
+      { return _left.aliases (data) || _right.aliases (data); }
+
+      const L &left () const
+      { return _left; }
+
+      const R &right () const
+      { return _right; }
+
+     private:
+      L _left;
+      R _right;
+    };
+
+    /** operand * scalar */
+    template <typename E>
+    class scaled : public elementwise<scaled<E>>
+    {
+     public:
+      scaled (const E &operand, float scalar)
+          : elementwise<scaled<E>> (operand.get_rows (), operand.get_cols ()),
+            _operand (operand), _scalar (scalar)
+      {}
+
+      static constexpr int temps = 1 + E::temps;
+
+      float element (int index) const
+      { return _operand.element (index) * _scalar; }
+
+      void block_into (const simd::kernel_table &k, int begin, int n,
+                       float *out, float *scratch) const
+      { k.scale (_operand.block (k, begin, n, scratch), _scalar, out, n); }
+
+      const float *block (const simd::kernel_table &k, int begin, int n,
+                          float *scratch) const {
+        block_into (k, begin, n, scratch, scratch + EXPR_BLOCK);
+        return scratch;
+      }
+
+      bool aliases (const float *data) const
+      { return _operand.aliases (data); }
+
+      const E &operand () const
+      { return _operand; }
+
+      float scalar () const
+      { return _scalar; }
+
+     private:
+      E _operand;
+      float _scalar;
+    };
+
+    /**
+     * A deferred matrix product, computed by the GEMM kernel when it is
+     * assigned. Reading a single element computes only that element.
+     */
+    class product : public base<product>
+    {
+     public:
+      /**
+       * @throw std::length_error if left's cols differ from right's rows.
+       */
+      product (const Matrix &left, const Matrix &right);
+
+      float operator[] (int index) const;
+      float operator() (int row, int col) const;
+      /** @throw std::out_of_range unless the index is within the product. */
+      float at (int index) const;
+      float at (int row, int col) const;
+
+      /**
+       * Resizes dest to fit and writes the product to it, adding bias to
+       * every column as the fused kernel writes it when bias is given.
+       * dest may be one of the operands.
+       * @param bias - get_rows () floats, or nullptr.
+       */
+      void assign_to (Matrix &dest, const float *bias = nullptr) const;
+
+      bool aliases (const float *data) const;
+
+     private:
+      const Matrix *_left;
+      const Matrix *_right;
+    };
+
+    /**
+     * product + addend. A column addend is a bias, added by the fused GEMM
+     * kernel; any other addend is added in one pass after the product.
+     */
+    template <typename E>
+    class product_sum : public base<product_sum<E>>
+    {
+     public:
+      product_sum (const product &left, const E &right)
+          : base<product_sum<E>> (left.get_rows (), left.get_cols ()),
+            _left (left), _right (right) {
+        check_same_size (left.get_rows (), left.get_cols (),
+                         right.get_rows (), right.get_cols ());
+      }
+
+      void assign_to (Matrix &dest) const;
+
+     private:
+      product _left;
+      E _right;
+    };
+
+    template <typename T>
+    struct is_elementwise : std::is_base_of<elementwise<T>, T>
+    {
+    };
+
+    template <typename T>
+    struct is_operand
+        : std::integral_constant<bool, is_elementwise<T>::value
+                                       || std::is_same<T, Matrix>::value>
+    {
+    };
+
+    inline leaf as_node (const Matrix &m)
+    { return leaf (m); }
+
+    template <typename E>
+    const E &as_node (const elementwise<E> &e)
+    { return e.derived (); }
+
+    /**
+     * Enabled for elementwise operands of which at least one is an
+     * expression; Matrix op Matrix has plain overloads (see Matrix.h).
+     */
+    template <typename L, typename R>
+    using enable_if_expression = typename std::enable_if<
+        is_operand<L>::value && is_operand<R>::value
+        && (is_elementwise<L>::value || is_elementwise<R>::value),
+        int>::type;
+
+    template <typename L, typename R, enable_if_expression<L, R> = 0>
+    sum<node_t<L>, node_t<R>> operator+ (const L &left, const R &right)
+    { return sum<node_t<L>, node_t<R>> (as_node (left), as_node (right)); }
+
+    template <typename E>
+    scaled<E> operator* (const elementwise<E> &operand, float scalar)
+    { return scaled<E> (operand.derived (), scalar); }
+
+    template <typename E>
+    scaled<E> operator* (float scalar, const elementwise<E> &operand)
+    { return scaled<E> (operand.derived (), scalar); }
+
+    template <typename E>
+    product_sum<E> operator+ (const product &left,
+                              const elementwise<E> &right)
+    { return product_sum<E> (left, right.derived ()); }
+
+    template <typename E>
+    product_sum<E> operator+ (const elementwise<E> &left,
+                              const product &right)
+    { return product_sum<E> (right, left.derived ()); }
+
+    template <typename E>
+    template <typename R>
+    hadamard<E, node_t<R>> elementwise<E>::dot (const R &other) const {
+      static_assert (is_operand<R>::value, "dot takes a Matrix or an "
+                                           "elementwise expression");
+      return hadamard<E, node_t<R>> (this->derived (), as_node (other));
+    }
+
+    /**
+     * Writes the size elements of e to out or, when accumulate is set,
+     * adds them to it. out may be one of e's operands.
+     */
+    template <typename E>
+    void evaluate (const E &e, float *out, int size, bool accumulate = false) {
+      const simd::kernel_table &k = simd::kernels ();
+      alignas(64) float scratch[(E::temps + 1) * EXPR_BLOCK];
+      for (int begin = 0; begin < size; begin += EXPR_BLOCK) {
+        const int n = std::min (EXPR_BLOCK, size - begin);
+        if (accumulate) {
+          k.add (out + begin, e.block (k, begin, n, scratch), out + begin, n);
+        } else {
+          e.block_into (k, begin, n, out + begin, scratch);
+        }
+      }
+    }
+}
+
+#endif //MATRIXEXPR_H
@@ -1,26 +1,287 @@
 #include "MlpNetwork.h"
+#include "Profiler.h"
+#include "Simd.h"
+#include <algorithm>
+#include <stdexcept>
+
+#define INVALID_LAYERS_MSG "Error: Layers do not match the network layout."
+#define INVALID_TOP_K_MSG "Error: Invalid amount of top predictions."
+#define INVALID_ENGINE_MSG "Error: The static engine needs the default topology with FP32 or sparse weights."
+#define LENGTH_ERROR_MSG "Error: Invalid matrix size."
+
+namespace {
+
+typedef void (*static_forward_func)(const static_mlp &network, const float *input, float *output);
+
+// static_mlp's loops are vectorized for whatever instruction set its caller
+// is compiled for. flatten inlines the whole pass into these entry points,
+// so each compiles it for its own set and none leaks into the others.
+__attribute__((flatten)) void static_forward(const static_mlp &network, const float *input, float *output) {
+  network.forward(input, output);
+}
+
+#ifdef MLP_X86_SIMD
+__attribute__((flatten, target("avx2,fma")))
+void static_forward_avx2(const static_mlp &network, const float *input, float *output) {
+  network.forward(input, output);
+}
+
+__attribute__((flatten, target("avx512f,avx512bw")))
+void static_forward_avx512(const static_mlp &network, const float *input, float *output) {
+  network.forward(input, output);
+}
+#endif
+
+/**
+ * @return The workspace of the overloads that take none. Each thread has
+ * its own, so they may run concurrently on a shared network and still do
+ * not allocate once warmed up.
+ */
+mlp_workspace &thread_workspace() {
+  thread_local mlp_workspace workspace;
+  return workspace;
+}
+
+/**
+ * @return The static_mlp pass for the instruction set of simd::kernels().
+ */
+static_forward_func select_static_forward() {
+#ifdef MLP_X86_SIMD
+  const simd::isa set = simd::kernels().set;
+  if (set >= simd::AVX512) {
+    return static_forward_avx512;
+  }
+  if (set == simd::AVX2) {
+    return static_forward_avx2;
+  }
+#endif
+  return static_forward;
+}
+
+}
 
 MlpNetwork::MlpNetwork(Matrix weights[], Matrix biases[]) {
   for (int i = 0; i < MLP_SIZE; ++i) {
-    _layers[i] = Dense(weights[i], biases[i], (i == MLP_SIZE - 1) ? activation::softmax : activation::relu);
+    _layers.emplace_back(weights[i], biases[i], (i == MLP_SIZE - 1) ? activation::softmax : activation::relu);
+  }
+}
+
+MlpNetwork::MlpNetwork(const std::vector<Dense> &layers) : _layers(layers) {
+  if (_layers.empty()) {
+    throw std::invalid_argument(INVALID_LAYERS_MSG);
+  }
+  for (size_t i = 1; i < _layers.size(); ++i) {
+    if (_layers[i].get_input_size() != _layers[i - 1].get_output_size()) {
+      throw std::invalid_argument(INVALID_LAYERS_MSG);
+    }
+  }
+}
+
+void MlpNetwork::set_engine(engine selected) {
+  if (selected == DYNAMIC) {
+    _static.reset();
+    return;
+  }
+  if (_layers.size() != MLP_SIZE) {
+    throw std::invalid_argument(INVALID_ENGINE_MSG);
+  }
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    const activation_func expected = i == MLP_SIZE - 1 ? activation::softmax : activation::relu;
+    const Dense::weight_format format = _layers[i].get_format();
+    if ((format != Dense::FP32 && format != Dense::SPARSE) || _layers[i].get_activation() != expected
+        || _layers[i].get_output_size() != weights_dims[i].rows
+        || _layers[i].get_input_size() != weights_dims[i].cols) {
+      throw std::invalid_argument(INVALID_ENGINE_MSG);
+    }
+    // Pruned layers run dense on this engine, like the ones sparsify kept.
+    weights[i] = format == Dense::SPARSE ? _layers[i].get_sparse_weights().to_dense()
+                                         : _layers[i].get_weights();
+    biases[i] = _layers[i].get_bias();
   }
+  std::shared_ptr<static_mlp> network(new static_mlp);
+  network->load(weights, biases);
+  _static = network;
+}
+
+void MlpNetwork::quantize(const Matrix *calibration) {
+  _static.reset();
+  const Matrix *input = calibration;
+  std::vector<Matrix> outputs(_layers.size());
+  for (size_t i = 0; i < _layers.size(); ++i) {
+    if (input == nullptr) {
+      _layers[i].quantize();
+      continue;
+    }
+    const float min = *std::min_element(input->begin(), input->end());
+    const float max = *std::max_element(input->begin(), input->end());
+    _layers[i].quantize(quantization::params_for_range(min, max));
+    _layers[i].forward(*input, outputs[i]);
+    input = &outputs[i];
+  }
+}
+
+int MlpNetwork::sparsify() {
+  int sparse = 0;
+  for (Dense &layer : _layers) {
+    sparse += layer.sparsify();
+  }
+  if (sparse > 0) {
+    _static.reset();
+  }
+  return sparse;
+}
+
+void MlpNetwork::to_half(half::format format) {
+  _static.reset();
+  for (Dense &layer : _layers) {
+    layer.to_half(format);
+  }
+}
+
+const Matrix &MlpNetwork::forward(const Matrix &input, mlp_workspace &workspace) const {
+  // Grows only for a deeper network than the workspace served before.
+  if (workspace.layer_outputs.size() < _layers.size()) {
+    workspace.layer_outputs.resize(_layers.size());
+  }
+  if (_static) {
+    if (input.get_rows() != static_mlp::input_size) {
+      throw std::length_error(LENGTH_ERROR_MSG);
+    }
+    const int batch = input.get_cols();
+    Matrix &output = workspace.layer_outputs[FINAL_LAYER_INDEX];
+    output.resize(static_mlp::output_size, batch);
+    static const static_forward_func run = select_static_forward();
+    alignas(STATIC_ALIGNMENT) float image[static_mlp::input_size];
+    alignas(STATIC_ALIGNMENT) float result[static_mlp::output_size];
+    for (int j = 0; j < batch; ++j) {
+      // A single column is already contiguous; batch columns are gathered.
+      const float *column = input.begin() + j;
+      if (batch > 1) {
+        for (int r = 0; r < static_mlp::input_size; ++r) {
+          image[r] = column[r * batch];
+        }
+        column = image;
+      }
+      run(*_static, column, result);
+      for (int r = 0; r < static_mlp::output_size; ++r) {
+        output[r * batch + j] = result[r];
+      }
+    }
+    return output;
+  }
+  return run_layers(input, workspace, true);
+}
+
+const Matrix &MlpNetwork::run_layers(const Matrix &input, mlp_workspace &workspace,
+                                     bool final_activation) const {
+  if (workspace.layer_outputs.size() < _layers.size()) {
+    workspace.layer_outputs.resize(_layers.size());
+  }
+  const Matrix *result = &input;
+  for (size_t i = 0; i < _layers.size(); ++i) {
+    Matrix &output = workspace.layer_outputs[i];
+    PROFILE_LAYER(static_cast<int>(i), _layers[i], *result, output);
+    if (i + 1 == _layers.size() && !final_activation) {
+      _layers[i].forward_logits(*result, output);
+    } else {
+      _layers[i].forward(*result, output);
+    }
+    result = &output;
+  }
+  return *result;
 }
 
 digit MlpNetwork::operator()(const Matrix &input) const {
-  Matrix result = input;
-  for (const auto &layer : _layers) {
-    result = layer(result);
+  return (*this)(input, thread_workspace());
+}
+
+digit MlpNetwork::operator()(const Matrix &input, mlp_workspace &workspace) const {
+  if (input.get_cols() != 1) {
+    throw std::length_error(LENGTH_ERROR_MSG);
   }
-  return getHighestProbabilityDigit(result);
+  digit result;
+  predict_into(input, workspace, &result);
+  return result;
 }
 
-digit MlpNetwork::getHighestProbabilityDigit(const Matrix &output) const {
-  digit maxDigit = {0, output[0]};
-  for (int i = 1; i < OUTPUT_VECTOR_SIZE; ++i) {
-    if (output[i] > maxDigit.probability) {
-      maxDigit.value = i;
-      maxDigit.probability = output[i];
+std::vector<digit> MlpNetwork::predict_batch(const Matrix &images) const {
+  return predict_batch(images, thread_workspace());
+}
+
+std::vector<digit> MlpNetwork::predict_batch(const Matrix &images, mlp_workspace &workspace) const {
+  std::vector<digit> digits(images.get_cols());
+  predict_into(images, workspace, digits.data());
+  return digits;
+}
+
+void MlpNetwork::predict_top_k(const Matrix &images, int k, digit *top) const {
+  predict_top_k(images, k, top, thread_workspace());
+}
+
+void MlpNetwork::predict_top_k(const Matrix &images, int k, digit *top, mlp_workspace &workspace) const {
+  if (k <= 0 || k > get_output_size()) {
+    throw std::invalid_argument(INVALID_TOP_K_MSG);
+  }
+  const Matrix &result = forward(images, workspace);
+  const int rows = result.get_rows();
+  const int batch = result.get_cols();
+  workspace.labels.resize(std::max(workspace.labels.size(), static_cast<size_t>(rows)));
+  unsigned int *order = workspace.labels.data();
+  for (int j = 0; j < batch; ++j) {
+    const float *column = result.begin() + j;
+    for (int i = 0; i < rows; ++i) {
+      order[i] = static_cast<unsigned int>(i);
+    }
+    std::partial_sort(order, order + k, order + rows, [column, batch](unsigned int a, unsigned int b) {
+      return column[a * batch] > column[b * batch] || (column[a * batch] == column[b * batch] && a < b);
+    });
+    for (int i = 0; i < k; ++i) {
+      top[j * k + i] = {order[i], column[order[i] * batch]};
     }
   }
-  return maxDigit;
+}
+
+void MlpNetwork::predict_probabilities(const Matrix &images, float *probabilities) const {
+  predict_probabilities(images, probabilities, thread_workspace());
+}
+
+void MlpNetwork::predict_probabilities(const Matrix &images, float *probabilities,
+                                       mlp_workspace &workspace) const {
+  const Matrix &result = forward(images, workspace);
+  const int rows = result.get_rows();
+  const int batch = result.get_cols();
+  if (batch == 1) {
+    std::copy(result.begin(), result.begin() + rows, probabilities);
+    return;
+  }
+  // Each image's probabilities are a column of result.
+  simd::kernels().transpose(result.begin(), batch, probabilities, rows, rows, batch);
+}
+
+void MlpNetwork::predict_into(const Matrix &input, mlp_workspace &workspace, digit *digits) const {
+  if (_static || _layers.back().get_activation() != activation::softmax) {
+    const Matrix &result = forward(input, workspace);
+    const int batch = result.get_cols();
+    for (int j = 0; j < batch; ++j) {
+      digit maxDigit = {0, result(0, j)};
+      for (int i = 1; i < result.get_rows(); ++i) {
+        if (result(i, j) > maxDigit.probability) {
+          maxDigit.value = i;
+          maxDigit.probability = result(i, j);
+        }
+      }
+      digits[j] = maxDigit;
+    }
+    return;
+  }
+  const Matrix &logits = run_layers(input, workspace, false);
+  const size_t batch = static_cast<size_t>(logits.get_cols());
+  workspace.labels.resize(std::max(workspace.labels.size(), batch));
+  workspace.probabilities.resize(std::max(workspace.probabilities.size(), batch));
+  activation::softmax_columns_argmax(logits, workspace.labels.data(), workspace.probabilities.data());
+  for (size_t j = 0; j < batch; ++j) {
+    digits[j] = {workspace.labels[j], workspace.probabilities[j]};
+  }
 }
@@ -4,6 +4,12 @@
 #define MLPNETWORK_H
 
 #include "Dense.h"
+#include "StaticMlp.h"
+#include <memory>
+#include <vector>
+// The default topology, used by the raw parameter files and static_mlp.
+// Networks built from layers (see PackedModel, ModelDescriptor) may have
+// any depth and sizes.
 #define FINAL_LAYER_INDEX MLP_SIZE - 1
 #define MLP_SIZE 4
 #define OUTPUT_VECTOR_SIZE 10
@@ -21,38 +27,197 @@ typedef struct digit
     float probability;
 } digit;
 
-const matrix_dims img_dims = {28, 28};
-const matrix_dims weights_dims[] = {{128, 784},
+constexpr matrix_dims img_dims = {28, 28};
+constexpr matrix_dims weights_dims[] = {{128, 784},
                                     {64,  128},
                                     {20,  64},
                                     {10,  20}};
-const matrix_dims bias_dims[] = {{128, 1},
+constexpr matrix_dims bias_dims[] = {{128, 1},
                                  {64,  1},
                                  {20,  1},
                                  {10,  1}};
 
+/**
+ * The network with its layer shapes fixed at compile time, see
+ * MlpNetwork::STATIC.
+ */
+typedef StaticMlp<
+    StaticDense<weights_dims[0].cols, weights_dims[0].rows, static_activation::relu>,
+    StaticDense<weights_dims[1].cols, weights_dims[1].rows, static_activation::relu>,
+    StaticDense<weights_dims[2].cols, weights_dims[2].rows, static_activation::relu>,
+    StaticDense<weights_dims[3].cols, weights_dims[3].rows, static_activation::softmax>>
+    static_mlp;
+static_assert (MLP_SIZE == 4, "static_mlp must list every layer");
+
+/**
+ * @struct mlp_workspace
+ * @brief The per-layer output buffers of a forward pass. They are sized by
+ *        the first pass and reused by later ones, so passes after that
+ *        warm-up do not allocate. A workspace serves one pass at a time.
+ */
+typedef struct mlp_workspace
+{
+    std::vector<Matrix> layer_outputs;
+    // The winners found by the argmax fast path, see predict_batch.
+    std::vector<unsigned int> labels;
+    std::vector<float> probabilities;
+} mlp_workspace;
+
 class MlpNetwork
 {
+ public:
+  /**
+   * @enum engine
+   * @brief How the network runs. DYNAMIC runs the Dense layers, batches
+   *        through the blocked GEMM. STATIC runs static_mlp, whose layer
+   *        shapes are template parameters, one image at a time; it suits
+   *        single-image latency.
+   */
+  enum engine
+  {
+      DYNAMIC, STATIC
+  };
+
  private:
-  Matrix *_weights;
-  Matrix *_biases;
+  std::vector<Dense> _layers;
+  // Shared by copies of the network; it is read-only once built.
+  std::shared_ptr<const static_mlp> _static;
+
   /**
-   *
-   * @param input_vector - The vector that was created from the last layer
-   * of the network.
-   * @return The digit with the highest probability in the input_vector.
+   * Runs every layer like forward, leaving out the final activation
+   * unless final_activation is set. Needs the DYNAMIC engine.
    */
-  digit get_highest_probability_digit (Matrix &input_vector) const;
+  const Matrix &run_layers (const Matrix &input_matrix,
+                            mlp_workspace &workspace,
+                            bool final_activation) const;
+
+  /**
+   * Writes the digit with the highest probability for each column of
+   * input_matrix to digits. When the last layer is softmax, the winner
+   * and its probability come from the logits (see
+   * activation::softmax_columns_argmax) and the other probabilities are
+   * never normalized.
+   */
+  void predict_into (const Matrix &input_matrix, mlp_workspace &workspace,
+                     digit *digits) const;
 
  public:
   //Constructor
+  /**
+   * Builds the default topology: MLP_SIZE layers of the shapes in
+   * weights_dims, relu except for a final softmax.
+   */
   MlpNetwork (Matrix *weights, Matrix *biases);
   /**
-   * Applies the entire network on the input_matrix.
+   * Builds a network of any depth from existing layers, such as those of a
+   * PackedModel or a ModelDescriptor.
+   * @throw std::invalid_argument if there are no layers or a layer's input
+   * size differs from the previous layer's output size.
+   */
+  explicit MlpNetwork (const std::vector<Dense> &layers);
+
+  /**
+   * @return The layers, in order (see PackedModel::write).
+   */
+  const std::vector<Dense> &get_layers () const
+  { return _layers; }
+
+  int layer_count () const
+  { return static_cast<int>(_layers.size ()); }
+
+  int get_input_size () const
+  { return _layers.front ().get_input_size (); }
+
+  int get_output_size () const
+  { return _layers.back ().get_output_size (); }
+
+  /**
+   * Selects the engine for later passes. The results of both agree up to
+   * float rounding.
+   * STATIC runs SPARSE layers on their densified weights.
+   * @throw std::invalid_argument when selecting STATIC for a network that
+   * is not the default topology with FP32 or SPARSE weights.
+   */
+  void set_engine (engine selected);
+
+  engine get_engine () const
+  { return _static ? STATIC : DYNAMIC; }
+
+  /**
+   * Converts every layer to INT8 weights (see Dense::quantize).
+   * @param calibration_images - Optional batch of images as columns. When
+   * given, each layer's input range is measured on it, after the previous
+   * layers were quantized, and fixed; otherwise inputs are quantized with
+   * parameters computed per sample. Selects the DYNAMIC engine.
+   */
+  void quantize (const Matrix *calibration_images = nullptr);
+
+  /**
+   * Stores the weights of each FP32 layer that is sparse enough as a
+   * SparseMatrix, leaving denser layers on the GEMM (see Dense::sparsify).
+   * Selects the DYNAMIC engine when a layer became sparse.
+   * @return The amount of SPARSE layers.
+   */
+  int sparsify ();
+
+  /**
+   * Stores every layer's weights as 16-bit floats in the given format
+   * (see Dense::to_half), halving the bytes each product reads. Selects
+   * the DYNAMIC engine.
+   */
+  void to_half (half::format format);
+  /**
+   * Applies the entire network on the input_matrix. The overloads without
+   * a workspace use one of the calling thread's, so any of them may run
+   * concurrently on one network.
    * @param input_matrix - The matrix that represents the input image.
    * @return The digit with the highest probability.
+   * @throw std::length_error unless input_matrix is a single vectorized image;
+   * see predict_batch for several.
+   */
+  digit operator() (const Matrix &input_matrix) const;
+  digit operator() (const Matrix &input_matrix, mlp_workspace &workspace) const;
+  /**
+   * Runs every layer on input_matrix using the buffers of workspace.
+   * @param input_matrix - A vectorized image, or a batch of them as columns.
+   * @return The output of the last layer, a reference into workspace that
+   * stays valid until its next use.
+   */
+  const Matrix &forward (const Matrix &input_matrix, mlp_workspace &workspace) const;
+  /**
+   * Applies the entire network on a batch of images at once, so each layer
+   * runs one matrix-matrix product for the whole batch.
+   * @param images - A matrix of size get_input_size() X N, whose i-th
+   * column is the i-th vectorized image.
+   * @return The digit with the highest probability for each image, in
+   * column order.
+   */
+  std::vector<digit> predict_batch (const Matrix &images) const;
+  std::vector<digit> predict_batch (const Matrix &images, mlp_workspace &workspace) const;
+  /**
+   * Runs the network once and writes the k most probable digits of each
+   * image to top, most probable first (the lower digit first on a tie).
+   * They are selected among the output rows in place, so nothing is
+   * allocated once the workspace has served a batch as large.
+   * @param images - A vectorized image, or a batch of them as columns.
+   * @param top - Room for k digits per image; image j's start at
+   * top + j * k.
+   * @throw std::invalid_argument unless 0 < k <= get_output_size ().
+   */
+  void predict_top_k (const Matrix &images, int k, digit *top) const;
+  void predict_top_k (const Matrix &images, int k, digit *top,
+                      mlp_workspace &workspace) const;
+  /**
+   * Runs the network once and writes the whole output of each image, its
+   * probability for every digit, to probabilities. Nothing is allocated
+   * once the workspace has served a batch as large.
+   * @param images - A vectorized image, or a batch of them as columns.
+   * @param probabilities - Room for get_output_size () floats per image;
+   * image j's start at probabilities + j * get_output_size ().
    */
-  digit operator() (Matrix &input_matrix) const;
-  digit getHighestProbabilityDigit (const Matrix &output) const;
+  void predict_probabilities (const Matrix &images,
+                              float *probabilities) const;
+  void predict_probabilities (const Matrix &images, float *probabilities,
+                              mlp_workspace &workspace) const;
 };
 #endif // MLPNETWORK_H
\ No newline at end of file
@@ -0,0 +1,93 @@
+#include "ModelDescriptor.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#define COMMENT_CHAR '#'
+#define INVALID_DESCRIPTOR_MSG "Error: Invalid model descriptor: "
+#define INVALID_PARAMETER_MSG "Error: Invalid parameters file: "
+
+namespace {
+
+std::string directory_of(const std::string &path) {
+  const size_t slash = path.rfind('/');
+  return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+}
+
+std::string resolve(const std::string &directory, const std::string &path) {
+  return path.empty() || path[0] == '/' ? path : directory + path;
+}
+
+/**
+ * Reads a raw file of rows X cols floats.
+ * @throw std::invalid_argument if the file is missing or has the wrong size
+ */
+Matrix read_parameters(const std::string &path, int rows, int cols) {
+  Matrix m(rows, cols);
+  std::ifstream is(path, std::ios::in | std::ios::binary);
+  if (!is.is_open()) {
+    throw std::invalid_argument(INVALID_PARAMETER_MSG + path);
+  }
+  is.seekg(0, std::ios::end);
+  if (is.tellg() != static_cast<std::streamoff>(static_cast<size_t>(rows) * cols * sizeof(float))) {
+    throw std::invalid_argument(INVALID_PARAMETER_MSG + path);
+  }
+  is.seekg(0, std::ios::beg);
+  is.read(reinterpret_cast<char *>(m.begin()), static_cast<std::streamsize>(static_cast<size_t>(rows) * cols
+                                                                            * sizeof(float)));
+  if (!is.good()) {
+    throw std::invalid_argument(INVALID_PARAMETER_MSG + path);
+  }
+  return m;
+}
+
+}
+
+ModelDescriptor ModelDescriptor::read(const std::string &path) {
+  std::ifstream is(path);
+  if (!is.is_open()) {
+    throw std::invalid_argument(INVALID_DESCRIPTOR_MSG + path);
+  }
+  const std::string directory = directory_of(path);
+  ModelDescriptor descriptor;
+  std::string line;
+  while (std::getline(is, line)) {
+    std::istringstream fields(line);
+    std::string first;
+    if (!(fields >> first) || first[0] == COMMENT_CHAR) {
+      continue;
+    }
+    layer_descriptor layer;
+    std::string activationName;
+    std::istringstream dims(first);
+    if (!(dims >> layer.rows)
+        || !(fields >> layer.cols >> activationName >> layer.weights_path >> layer.bias_path)
+        || layer.rows <= 0 || layer.cols <= 0) {
+      throw std::invalid_argument(INVALID_DESCRIPTOR_MSG + path);
+    }
+    std::string extra;
+    layer.activation = activation::from_name(activationName);
+    if (layer.activation == nullptr || fields >> extra) {
+      throw std::invalid_argument(INVALID_DESCRIPTOR_MSG + path);
+    }
+    if (!descriptor._layers.empty() && descriptor._layers.back().rows != layer.cols) {
+      throw std::invalid_argument(INVALID_DESCRIPTOR_MSG + path);
+    }
+    layer.weights_path = resolve(directory, layer.weights_path);
+    layer.bias_path = resolve(directory, layer.bias_path);
+    descriptor._layers.push_back(layer);
+  }
+  if (descriptor._layers.empty()) {
+    throw std::invalid_argument(INVALID_DESCRIPTOR_MSG + path);
+  }
+  return descriptor;
+}
+
+std::vector<Dense> ModelDescriptor::load() const {
+  std::vector<Dense> layers;
+  for (const layer_descriptor &layer : _layers) {
+    layers.emplace_back(read_parameters(layer.weights_path, layer.rows, layer.cols),
+                        read_parameters(layer.bias_path, layer.rows, 1), layer.activation);
+  }
+  return layers;
+}
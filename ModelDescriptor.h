@@ -0,0 +1,58 @@
+// ModelDescriptor.h
+#ifndef MODELDESCRIPTOR_H
+#define MODELDESCRIPTOR_H
+
+#include "Dense.h"
+#include <string>
+#include <vector>
+
+/**
+ * @struct layer_descriptor
+ * @brief One layer of a ModelDescriptor: its dims, activation and raw
+ *        parameter files (rows X cols weights, rows X 1 bias).
+ */
+typedef struct layer_descriptor
+{
+    int rows;
+    int cols;
+    activation_func activation;
+    std::string weights_path;
+    std::string bias_path;
+} layer_descriptor;
+
+/**
+ * A network topology kept in a text file next to its raw parameter files,
+ * so models of any depth and width load without rebuilding. Each line
+ * describes one layer, from input to output:
+ *
+ *     <rows> <cols> <activation> <weights file> <bias file>
+ *
+ * where activation is a name known to activation::from_name and relative
+ * file paths start from the descriptor's directory. Blank lines and lines
+ * starting with '#' are ignored.
+ */
+class ModelDescriptor
+{
+ public:
+  /**
+   * Parses the descriptor at path.
+   * @throw std::invalid_argument if it cannot be read, a line is malformed
+   * or consecutive layers do not fit together.
+   */
+  static ModelDescriptor read (const std::string &path);
+
+  const std::vector<layer_descriptor> &layers () const
+  { return _layers; }
+
+  /**
+   * Reads every layer's parameter files.
+   * @return The layers, ready for MlpNetwork.
+   * @throw std::invalid_argument if a file is missing or has the wrong size.
+   */
+  std::vector<Dense> load () const;
+
+ private:
+  std::vector<layer_descriptor> _layers;
+};
+
+#endif //MODELDESCRIPTOR_H
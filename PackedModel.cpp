@@ -0,0 +1,264 @@
+#include "PackedModel.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PACK_MAGIC "MLPPACK"
+#define PACK_MAGIC_SIZE 8
+#define PACK_VERSION 1
+#define PACK_ALIGNMENT 64
+#define OPEN_ERROR_MSG "Error: Cannot open packed model: "
+#define INVALID_MODEL_MSG "Error: Invalid packed model: "
+#define WRITE_ERROR_MSG "Error: Cannot write packed model: "
+
+namespace {
+
+/**
+ * @struct pack_header
+ * @brief The start of a packed model file, followed by layer_count
+ *        pack_layer entries.
+ */
+typedef struct pack_header
+{
+    char magic[PACK_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t layer_count;
+    uint64_t file_size;
+} pack_header;
+
+/**
+ * @struct pack_layer
+ * @brief One layer's dims, activation, weight format (a
+ *        Dense::weight_format) and blob offsets (from the start of the
+ *        file, PACK_ALIGNMENT aligned). The bias blob holds rows floats.
+ */
+typedef struct pack_layer
+{
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t activation;
+    uint32_t format;
+    uint64_t weights_offset;
+    uint64_t bias_offset;
+} pack_layer;
+
+/**
+ * @struct int8_blob_header
+ * @brief Start of an INT8 weights blob, followed by rows float scales. The
+ *        int8 values start at the next PACK_ALIGNMENT boundary.
+ */
+typedef struct int8_blob_header
+{
+    float input_scale;
+    int32_t input_zero_point;
+} int8_blob_header;
+
+uint64_t align_up(uint64_t offset) {
+  return (offset + PACK_ALIGNMENT - 1) / PACK_ALIGNMENT * PACK_ALIGNMENT;
+}
+
+uint64_t int8_values_offset(uint64_t weights_offset, uint64_t rows) {
+  return align_up(weights_offset + sizeof(int8_blob_header) + rows * sizeof(float));
+}
+
+/**
+ * @return The size of a layer's weights blob, up to the end of its values.
+ */
+uint64_t weights_blob_size(const pack_layer &layer) {
+  const uint64_t count = static_cast<uint64_t>(layer.rows) * layer.cols;
+  if (layer.format == Dense::INT8) {
+    return int8_values_offset(0, layer.rows) + count;
+  }
+  if (layer.format == Dense::FP16 || layer.format == Dense::BF16) {
+    return count * sizeof(uint16_t);
+  }
+  return count * sizeof(float);
+}
+
+bool blob_fits(uint64_t offset, uint64_t bytes, uint64_t file_size) {
+  return offset % PACK_ALIGNMENT == 0 && offset <= file_size && bytes <= file_size - offset;
+}
+
+// Indexed by PackedModel::layer_activation.
+const activation_func activation_codes[] = {activation::relu, activation::softmax, activation::identity};
+
+/**
+ * @return The code of func, or -1 if it has none.
+ */
+int code_of(activation_func func) {
+  for (int code = PackedModel::RELU; code <= PackedModel::IDENTITY; ++code) {
+    if (activation_codes[code] == func) {
+      return code;
+    }
+  }
+  return -1;
+}
+
+}
+
+PackedModel::PackedModel(const std::string &path) : _mapping(MAP_FAILED), _size(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error(OPEN_ERROR_MSG + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(pack_header))) {
+    close(fd);
+    throw std::runtime_error(INVALID_MODEL_MSG + path);
+  }
+  _size = static_cast<size_t>(st.st_size);
+  _mapping = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (_mapping == MAP_FAILED) {
+    throw std::runtime_error(OPEN_ERROR_MSG + path);
+  }
+  madvise(_mapping, _size, MADV_WILLNEED);
+
+  char *base = static_cast<char *>(_mapping);
+  pack_header header;
+  std::memcpy(&header, base, sizeof(header));
+  const uint64_t table_end =
+      sizeof(pack_header) + static_cast<uint64_t>(header.layer_count) * sizeof(pack_layer);
+  if (std::memcmp(header.magic, PACK_MAGIC, PACK_MAGIC_SIZE) != 0 || header.version != PACK_VERSION
+      || header.file_size != _size || header.layer_count == 0 || table_end > _size) {
+    munmap(_mapping, _size);
+    throw std::runtime_error(INVALID_MODEL_MSG + path);
+  }
+
+  for (uint32_t i = 0; i < header.layer_count; ++i) {
+    pack_layer layer;
+    std::memcpy(&layer, base + sizeof(pack_header) + i * sizeof(pack_layer), sizeof(layer));
+    const uint64_t weight_count = static_cast<uint64_t>(layer.rows) * layer.cols;
+    if (layer.rows == 0 || layer.cols == 0 || weight_count > INT32_MAX || layer.activation > IDENTITY
+        || layer.format == Dense::SPARSE || layer.format > Dense::BF16
+        || !blob_fits(layer.weights_offset, weights_blob_size(layer), _size)
+        || !blob_fits(layer.bias_offset, layer.rows * sizeof(float), _size)) {
+      munmap(_mapping, _size);
+      throw std::runtime_error(INVALID_MODEL_MSG + path);
+    }
+    const int rows = static_cast<int>(layer.rows);
+    const int cols = static_cast<int>(layer.cols);
+    Matrix bias = Matrix::view(reinterpret_cast<float *>(base + layer.bias_offset), rows, 1);
+    if (layer.format == Dense::INT8) {
+      int8_blob_header blob;
+      std::memcpy(&blob, base + layer.weights_offset, sizeof(blob));
+      const float *scales = reinterpret_cast<const float *>(base + layer.weights_offset + sizeof(blob));
+      const signed char *values = reinterpret_cast<const signed char *>(
+          base + int8_values_offset(layer.weights_offset, layer.rows));
+      const quant_params input = {blob.input_scale, blob.input_zero_point};
+      _layers.emplace_back(QuantizedMatrix::view(values, scales, rows, cols), bias,
+                           activation_codes[layer.activation], input);
+    } else if (layer.format == Dense::FP16 || layer.format == Dense::BF16) {
+      const uint16_t *values = reinterpret_cast<const uint16_t *>(base + layer.weights_offset);
+      const half::format format = layer.format == Dense::FP16 ? half::FP16 : half::BF16;
+      _layers.emplace_back(HalfMatrix::view(values, rows, cols, format), bias,
+                           activation_codes[layer.activation]);
+    } else {
+      Matrix weights = Matrix::view(reinterpret_cast<float *>(base + layer.weights_offset), rows, cols);
+      _layers.emplace_back(weights, bias, activation_codes[layer.activation]);
+    }
+  }
+}
+
+bool PackedModel::is_packed_model(const std::string &path) {
+  std::ifstream is(path, std::ios::in | std::ios::binary);
+  char magic[PACK_MAGIC_SIZE] = {};
+  is.read(magic, PACK_MAGIC_SIZE);
+  return is.good() && std::memcmp(magic, PACK_MAGIC, PACK_MAGIC_SIZE) == 0;
+}
+
+PackedModel::~PackedModel() {
+  _layers.clear();
+  munmap(_mapping, _size);
+}
+
+void PackedModel::write(const std::string &path, const std::vector<Dense> &layers) {
+  const uint32_t count = static_cast<uint32_t>(layers.size());
+  pack_header header = {};
+  std::memcpy(header.magic, PACK_MAGIC, PACK_MAGIC_SIZE);
+  header.version = PACK_VERSION;
+  header.layer_count = count;
+
+  std::vector<pack_layer> table(count);
+  uint64_t offset = align_up(sizeof(pack_header) + count * sizeof(pack_layer));
+  for (uint32_t i = 0; i < count; ++i) {
+    const Dense &layer = layers[i];
+    const int code = code_of(layer.get_activation());
+    if (code < 0) {
+      throw std::runtime_error(WRITE_ERROR_MSG + path);
+    }
+    table[i] = {};
+    table[i].rows = static_cast<uint32_t>(layer.get_output_size());
+    table[i].cols = static_cast<uint32_t>(layer.get_input_size());
+    table[i].activation = static_cast<uint32_t>(code);
+    // Sparse layers are written as their FP32 weights; see Dense::sparsify.
+    table[i].format = layer.get_format() == Dense::SPARSE ? Dense::FP32 : layer.get_format();
+    table[i].weights_offset = offset;
+    offset = align_up(offset + weights_blob_size(table[i]));
+    table[i].bias_offset = offset;
+    offset = align_up(offset + table[i].rows * sizeof(float));
+  }
+  header.file_size = offset;
+
+  std::ofstream os(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!os.is_open()) {
+    throw std::runtime_error(WRITE_ERROR_MSG + path);
+  }
+  const char padding[PACK_ALIGNMENT] = {};
+  uint64_t written = 0;
+  auto emit = [&os, &written, &padding](const void *data, uint64_t bytes) {
+    os.write(static_cast<const char *>(data), static_cast<std::streamsize>(bytes));
+    written += bytes;
+  };
+  auto pad = [&os, &written, &padding]() {
+    const uint64_t bytes = align_up(written) - written;
+    os.write(padding, static_cast<std::streamsize>(bytes));
+    written += bytes;
+  };
+  emit(&header, sizeof(header));
+  emit(table.data(), table.size() * sizeof(pack_layer));
+  pad();
+  for (uint32_t i = 0; i < count; ++i) {
+    const Dense &layer = layers[i];
+    const uint64_t weight_count = static_cast<uint64_t>(table[i].rows) * table[i].cols;
+    if (layer.get_format() == Dense::INT8) {
+      const QuantizedMatrix &weights = layer.get_quantized_weights();
+      const int8_blob_header blob = {layer.get_input_params().scale, layer.get_input_params().zero_point};
+      emit(&blob, sizeof(blob));
+      for (uint32_t r = 0; r < table[i].rows; ++r) {
+        const float scale = weights.scale(static_cast<int>(r));
+        emit(&scale, sizeof(scale));
+      }
+      pad();
+      emit(weights.row(0), weight_count);
+    } else if (layer.get_format() == Dense::FP16 || layer.get_format() == Dense::BF16) {
+      emit(layer.get_half_weights().row(0), weight_count * sizeof(uint16_t));
+    } else if (layer.get_format() == Dense::SPARSE) {
+      emit(layer.get_sparse_weights().to_dense().begin(), weight_count * sizeof(float));
+    } else {
+      emit(layer.get_weights().begin(), weight_count * sizeof(float));
+    }
+    pad();
+    emit(layer.get_bias().begin(), table[i].rows * sizeof(float));
+    pad();
+  }
+  if (!os.good()) {
+    throw std::runtime_error(WRITE_ERROR_MSG + path);
+  }
+}
+
+void PackedModel::write(const std::string &path, const Matrix weights[], const Matrix biases[], int layers) {
+  std::vector<Dense> dense;
+  for (int i = 0; i < layers; ++i) {
+    if (biases[i].get_rows() != weights[i].get_rows() || biases[i].get_cols() != 1) {
+      throw std::runtime_error(WRITE_ERROR_MSG + path);
+    }
+    dense.emplace_back(weights[i], biases[i], i == layers - 1 ? activation::softmax : activation::relu);
+  }
+  write(path, dense);
+}
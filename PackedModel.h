@@ -0,0 +1,83 @@
+// PackedModel.h
+#ifndef PACKEDMODEL_H
+#define PACKEDMODEL_H
+
+#include "Dense.h"
+#include <string>
+#include <vector>
+
+/**
+ * A model stored as a single packed file: a header, a table with each
+ * layer's dims, activation, weight format and blob offsets, then one
+ * 64-byte aligned blob per weights or bias matrix. FP32 weights are raw
+ * floats; INT8 weights are the input quantization, the row scales and the
+ * row-major values (see QuantizedMatrix); FP16 and BF16 weights are raw
+ * 16-bit floats (see HalfMatrix).
+ * Loading maps the file read-only and builds every layer over views of the
+ * blobs (see Matrix::view), so no weights are copied and processes loading
+ * the same file share one physical copy through the page cache.
+ */
+class PackedModel
+{
+ public:
+  /**
+   * @enum layer_activation
+   * @brief Activation codes stored in the layer table.
+   */
+  enum layer_activation
+  {
+      RELU = 0, SOFTMAX = 1, IDENTITY = 2
+  };
+
+  /**
+   * @return Whether the file at path starts like a packed model. It may
+   * still fail to load if it is corrupt.
+   */
+  static bool is_packed_model (const std::string &path);
+
+  /**
+   * Maps and validates the packed model at path.
+   * @throw std::runtime_error if the file cannot be mapped or is not a
+   * valid packed model.
+   */
+  explicit PackedModel (const std::string &path);
+  PackedModel (const PackedModel &) = delete;
+  PackedModel &operator= (const PackedModel &) = delete;
+  /**
+   * Unmaps the file. The layers, and any network built from them, must not
+   * be used afterwards.
+   */
+  ~PackedModel ();
+
+  int layer_count () const
+  { return static_cast<int>(_layers.size ()); }
+
+  /**
+   * @return The layers, in order, each viewing its mapped parameters.
+   */
+  const std::vector<Dense> &layers () const
+  { return _layers; }
+
+  /**
+   * Writes layers as a packed model, keeping each layer's weight format,
+   * except that SPARSE layers are stored as FP32 weights with their zeros.
+   * @throw std::runtime_error if the file cannot be written or a layer has
+   * an activation other than relu, softmax and identity.
+   */
+  static void write (const std::string &path, const std::vector<Dense> &layers);
+
+  /**
+   * Writes layers pairs of FP32 weights and biases as a packed model. Every
+   * layer but the last is marked relu, the last softmax.
+   * @throw std::runtime_error if the file cannot be written.
+   */
+  static void write (const std::string &path, const Matrix weights[],
+                     const Matrix biases[], int layers);
+
+ private:
+  void *_mapping;
+  size_t _size;
+  std::vector<Dense> _layers;
+};
+
+#endif //PACKEDMODEL_H
@@ -0,0 +1,365 @@
+#include "Profiler.h"
+#include "MatrixAllocator.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <stdexcept>
+
+#define JSON_ENV "MLP_PROFILE_JSON"
+#define TRACE_ENV "MLP_PROFILE_TRACE"
+#define WRITE_ERROR_MSG "Error: Cannot write profile: "
+#define DISABLED_MSG "Error: Profiling needs a build with MLP_PROFILE for: "
+#define NS_PER_SECOND 1e9
+#define NS_PER_US 1e3
+#define P50 0.5
+#define P99 0.99
+
+using profiling::layer_event;
+using profiling::layer_profile;
+
+namespace {
+
+typedef std::chrono::steady_clock profile_clock;
+
+long to_ns(profile_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+long now_ns() {
+  return to_ns(profile_clock::now());
+}
+
+/**
+ * @return The histogram bucket of a run of ns nanoseconds, see
+ * PROFILE_BUCKETS.
+ */
+int bucket_of(long ns) {
+  int bucket = 0;
+  while (bucket + 1 < PROFILE_BUCKETS && (ns >> (bucket + 1)) > 0) {
+    ++bucket;
+  }
+  return bucket;
+}
+
+void merge(layer_profile &into, const layer_profile &from) {
+  if (from.runs == 0) {
+    return;
+  }
+  into.min_seconds = into.runs == 0 ? from.min_seconds : std::min(into.min_seconds, from.min_seconds);
+  into.max_seconds = std::max(into.max_seconds, from.max_seconds);
+  into.format = from.format;
+  into.runs += from.runs;
+  into.samples += from.samples;
+  into.seconds += from.seconds;
+  into.flops += from.flops;
+  into.bytes += from.bytes;
+  into.allocations += from.allocations;
+  into.relu_outputs += from.relu_outputs;
+  into.relu_zeros += from.relu_zeros;
+  for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+    into.histogram[b] += from.histogram[b];
+  }
+}
+
+void merge(std::vector<layer_profile> &into, const std::vector<layer_profile> &from) {
+  if (into.size() < from.size()) {
+    into.resize(from.size(), layer_profile());
+  }
+  for (size_t i = 0; i < from.size(); ++i) {
+    merge(into[i], from[i]);
+  }
+}
+
+class thread_profile;
+
+/**
+ * @struct profile_registry
+ * @brief The profiles of the live threads, what exited threads left and
+ *        the start of the trace clock. Collecting locks the registry, then
+ *        each thread's profile; recording only locks the thread's own.
+ */
+typedef struct profile_registry
+{
+    std::mutex mutex;
+    std::vector<thread_profile *> threads;
+    std::vector<layer_profile> retired_layers;
+    std::vector<layer_event> retired_events;
+    std::atomic<long> epoch_ns;
+    int next_thread;
+} profile_registry;
+
+profile_registry &registry() {
+  static profile_registry instance = {{}, {}, {}, {}, {now_ns()}, 0};
+  return instance;
+}
+
+/**
+ * One thread's profiles and events. Its mutex is only contended while
+ * another thread collects or resets them.
+ */
+class thread_profile
+{
+ public:
+  thread_profile() {
+    profile_registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    id = r.next_thread++;
+    r.threads.push_back(this);
+  }
+
+  ~thread_profile() {
+    profile_registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::lock_guard<std::mutex> own(mutex);
+    merge(r.retired_layers, layers);
+    r.retired_events.insert(r.retired_events.end(), events.begin(), events.end());
+    r.threads.erase(std::find(r.threads.begin(), r.threads.end(), this));
+  }
+
+  void record(int index, const layer_profile &run, const layer_event &event) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (static_cast<int>(layers.size()) <= index) {
+      layers.resize(index + 1, layer_profile());
+    }
+    merge(layers[index], run);
+    if (events.size() < PROFILE_MAX_EVENTS) {
+      events.push_back(event);
+    }
+  }
+
+  std::mutex mutex;
+  int id;
+  std::vector<layer_profile> layers;
+  std::vector<layer_event> events;
+};
+
+thread_profile &this_thread() {
+  thread_local thread_profile profile;
+  return profile;
+}
+
+/**
+ * Merges the profiles and events of every thread into those given, in
+ * one pass under the registry's lock, so every event's layer has a
+ * profile in the same snapshot. Events are sorted by start.
+ */
+void collect(std::vector<layer_profile> *layers, std::vector<layer_event> *events) {
+  profile_registry &r = registry();
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (layers != nullptr) {
+      *layers = r.retired_layers;
+    }
+    if (events != nullptr) {
+      *events = r.retired_events;
+    }
+    for (thread_profile *thread : r.threads) {
+      std::lock_guard<std::mutex> own(thread->mutex);
+      if (layers != nullptr) {
+        merge(*layers, thread->layers);
+      }
+      if (events != nullptr) {
+        events->insert(events->end(), thread->events.begin(), thread->events.end());
+      }
+    }
+  }
+  if (events != nullptr) {
+    std::sort(events->begin(), events->end(),
+              [](const layer_event &a, const layer_event &b) { return a.start_ns < b.start_ns; });
+  }
+}
+
+/**
+ * @return How many weights a run of layer multiplies per sample, and, in
+ * bytes, how many it reads.
+ */
+long weight_count(const Dense &layer, double &bytes) {
+  const long dense = static_cast<long>(layer.get_output_size()) * layer.get_input_size();
+  switch (layer.get_format()) {
+    case Dense::INT8:
+      bytes = static_cast<double>(dense) + layer.get_output_size() * sizeof(float);
+      return dense;
+    case Dense::SPARSE: {
+      const SparseMatrix &sparse = layer.get_sparse_weights();
+      const long entries =
+          sparse.get_layout() == SparseMatrix::CSR ? sparse.stored() : sparse.stored() / SPARSE_BLOCK;
+      bytes = static_cast<double>(sparse.stored()) * sizeof(float)
+              + (entries + sparse.get_rows() + 1) * sizeof(int);
+      return sparse.stored();
+    }
+    case Dense::FP16:
+    case Dense::BF16:
+      bytes = static_cast<double>(dense) * sizeof(uint16_t);
+      return dense;
+    default:
+      bytes = static_cast<double>(dense) * sizeof(float);
+      return dense;
+  }
+}
+
+const char *format_name(Dense::weight_format format) {
+  switch (format) {
+    case Dense::INT8:
+      return "int8";
+    case Dense::SPARSE:
+      return "sparse";
+    case Dense::FP16:
+      return "fp16";
+    case Dense::BF16:
+      return "bf16";
+    default:
+      return "fp32";
+  }
+}
+
+/**
+ * @return The upper bound, in microseconds, of the histogram bucket that
+ * holds the fraction q of p's runs, capped by the slowest run.
+ */
+double percentile_us(const layer_profile &p, double q) {
+  long seen = 0;
+  for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+    seen += p.histogram[b];
+    if (seen >= q * p.runs) {
+      return std::min(static_cast<double>(2L << b) / NS_PER_US, p.max_seconds * NS_PER_SECOND / NS_PER_US);
+    }
+  }
+  return p.max_seconds * NS_PER_SECOND / NS_PER_US;
+}
+
+void write_file(const char *path, void (*write)(std::ostream &)) {
+  std::ofstream os(path);
+  write(os);
+  if (!os.good()) {
+    throw std::runtime_error(WRITE_ERROR_MSG + std::string(path));
+  }
+}
+
+}
+
+profiling::layer_scope::layer_scope(int index, const Dense &layer, const Matrix &input, const Matrix &output)
+    : _index(index), _layer(layer), _input(input), _output(output),
+      _allocations(MatrixAllocator::current().stats().allocations) {
+  // Registers the thread, which also starts the trace clock on first use,
+  // before the run starts rather than inside it.
+  this_thread();
+  _start = profile_clock::now();
+}
+
+profiling::layer_scope::~layer_scope() {
+  const profile_clock::time_point end = profile_clock::now();
+  const long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - _start).count();
+  const int batch = _input.get_cols();
+  const long outputs = static_cast<long>(_output.get_rows()) * _output.get_cols();
+  double weight_bytes;
+  const long weights = weight_count(_layer, weight_bytes);
+
+  layer_profile run = layer_profile();
+  run.format = _layer.get_format();
+  run.runs = 1;
+  run.samples = batch;
+  run.seconds = ns / NS_PER_SECOND;
+  run.min_seconds = run.seconds;
+  run.max_seconds = run.seconds;
+  run.flops = 2.0 * weights * batch;
+  run.bytes = weight_bytes + (static_cast<double>(_input.get_rows()) * batch + outputs) * sizeof(float);
+  run.allocations = MatrixAllocator::current().stats().allocations - _allocations;
+  if (_layer.get_activation() == activation::relu) {
+    run.relu_outputs = outputs;
+    run.relu_zeros = std::count(_output.begin(), _output.end(), 0.0f);
+  }
+  run.histogram[bucket_of(ns)] = 1;
+
+  thread_profile &profile = this_thread();
+  const layer_event event = {_index, profile.id, batch, to_ns(_start) - registry().epoch_ns.load(), ns};
+  profile.record(_index, run, event);
+}
+
+std::vector<layer_profile> profiling::layers() {
+  std::vector<layer_profile> merged;
+  collect(&merged, nullptr);
+  return merged;
+}
+
+std::vector<layer_event> profiling::events() {
+  std::vector<layer_event> merged;
+  collect(nullptr, &merged);
+  return merged;
+}
+
+void profiling::reset() {
+  profile_registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.retired_layers.clear();
+  r.retired_events.clear();
+  for (thread_profile *thread : r.threads) {
+    std::lock_guard<std::mutex> own(thread->mutex);
+    thread->layers.clear();
+    thread->events.clear();
+  }
+  r.epoch_ns = now_ns();
+}
+
+void profiling::write_json(std::ostream &os) {
+  const std::vector<layer_profile> profiles = layers();
+  os << std::fixed << std::setprecision(3) << "{\n  \"enabled\": " << (PROFILE_ENABLED ? "true" : "false")
+     << ",\n  \"layers\": [";
+  for (size_t i = 0; i < profiles.size(); ++i) {
+    const layer_profile &p = profiles[i];
+    const double runs = std::max<long>(p.runs, 1);
+    const double seconds = p.seconds > 0.0 ? p.seconds : 1.0;
+    os << (i == 0 ? "\n" : ",\n") << "    {\"layer\": " << i + 1 << ", \"format\": \""
+       << format_name(p.format) << "\", \"runs\": " << p.runs << ", \"samples\": " << p.samples
+       << ", \"total_us\": " << p.seconds * NS_PER_SECOND / NS_PER_US
+       << ", \"mean_us\": " << p.seconds * NS_PER_SECOND / NS_PER_US / runs
+       << ", \"min_us\": " << p.min_seconds * NS_PER_SECOND / NS_PER_US
+       << ", \"max_us\": " << p.max_seconds * NS_PER_SECOND / NS_PER_US
+       << ", \"p50_us\": " << percentile_us(p, P50) << ", \"p99_us\": " << percentile_us(p, P99)
+       << ", \"flops\": " << p.flops << ", \"gflops\": " << p.flops / seconds / NS_PER_SECOND
+       << ", \"bytes\": " << p.bytes << ", \"gbytes_per_s\": " << p.bytes / seconds / NS_PER_SECOND
+       << ", \"allocations\": " << p.allocations << ", \"relu_zero_fraction\": "
+       << (p.relu_outputs > 0 ? static_cast<double>(p.relu_zeros) / p.relu_outputs : 0.0)
+       << ", \"histogram_ns\": {";
+    bool first = true;
+    for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+      if (p.histogram[b] > 0) {
+        os << (first ? "" : ", ") << "\"" << (1L << b) << "\": " << p.histogram[b];
+        first = false;
+      }
+    }
+    os << "}}";
+  }
+  os << "\n  ]\n}" << std::endl;
+}
+
+void profiling::write_chrome_trace(std::ostream &os) {
+  std::vector<layer_profile> profiles;
+  std::vector<layer_event> recorded;
+  collect(&profiles, &recorded);
+  os << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+  for (size_t i = 0; i < recorded.size(); ++i) {
+    const layer_event &e = recorded[i];
+    os << (i == 0 ? "\n" : ",\n") << "  {\"name\": \"layer " << e.layer + 1 << "\", \"cat\": \""
+       << format_name(profiles[e.layer].format) << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread
+       << ", \"ts\": " << e.start_ns / NS_PER_US << ", \"dur\": " << e.duration_ns / NS_PER_US
+       << ", \"args\": {\"batch\": " << e.batch << "}}";
+  }
+  os << "\n]}" << std::endl;
+}
+
+void profiling::write_requested() {
+  const char *paths[] = {std::getenv(JSON_ENV), std::getenv(TRACE_ENV)};
+  void (*writers[])(std::ostream &) = {write_json, write_chrome_trace};
+  for (int i = 0; i < 2; ++i) {
+    if (paths[i] == nullptr || *paths[i] == '\0') {
+      continue;
+    }
+    if (!PROFILE_ENABLED) {
+      throw std::runtime_error(DISABLED_MSG + std::string(paths[i]));
+    }
+    write_file(paths[i], writers[i]);
+  }
+}
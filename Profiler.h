@@ -0,0 +1,138 @@
+// Profiler.h
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "Dense.h"
+#include <chrono>
+#include <ostream>
+#include <vector>
+
+// Layer run times are counted in power-of-two buckets: bucket b holds the
+// runs that took [2^b, 2^(b + 1)) nanoseconds.
+#define PROFILE_BUCKETS 40
+// Each thread keeps the first this many layer runs for a Chrome trace;
+// later runs still count in the profiles.
+#define PROFILE_MAX_EVENTS 100000
+
+// MlpNetwork's layer loop records every layer run when MLP_PROFILE is
+// defined (cmake -DMLP_PROFILE=ON). Otherwise PROFILE_LAYER compiles to
+// nothing and inference is untouched. The STATIC engine runs no Dense
+// layers and records nothing.
+#ifdef MLP_PROFILE
+#define PROFILE_ENABLED true
+#define PROFILE_LAYER(index, layer, input, output) \
+  const profiling::layer_scope profile_layer_scope (index, layer, input, output)
+#else
+#define PROFILE_ENABLED false
+#define PROFILE_LAYER(index, layer, input, output) static_cast<void> (0)
+#endif
+
+namespace profiling
+{
+    /**
+     * @struct layer_profile
+     * @brief Every recorded run of one layer index: how many runs and
+     *        samples (input columns), their time and its histogram (see
+     *        PROFILE_BUCKETS), the floating point (or INT8) operations,
+     *        the bytes of weights, inputs and outputs touched, the Matrix
+     *        buffers allocated, and, for relu layers, how many outputs
+     *        were zero.
+     */
+    typedef struct layer_profile
+    {
+        Dense::weight_format format;
+        long runs;
+        long samples;
+        double seconds;
+        double min_seconds;
+        double max_seconds;
+        double flops;
+        double bytes;
+        long allocations;
+        long relu_outputs;
+        long relu_zeros;
+        long histogram[PROFILE_BUCKETS];
+    } layer_profile;
+
+    /**
+     * @struct layer_event
+     * @brief One layer run for a Chrome trace, in nanoseconds since the
+     *        profiles were last reset.
+     */
+    typedef struct layer_event
+    {
+        int layer;
+        int thread;
+        int batch;
+        long start_ns;
+        long duration_ns;
+    } layer_event;
+
+    /**
+     * Times a layer run from its construction to its destruction, see
+     * PROFILE_LAYER, and records it for the calling thread. The
+     * allocations are those of the thread's current MatrixAllocator (see
+     * MatrixAllocator::current), which other threads may share.
+     */
+    class layer_scope
+    {
+     public:
+      /**
+       * @param output - The matrix the layer writes, read once it is done.
+       */
+      layer_scope (int index, const Dense &layer, const Matrix &input,
+                   const Matrix &output);
+      layer_scope (const layer_scope &) = delete;
+      layer_scope &operator= (const layer_scope &) = delete;
+      ~layer_scope ();
+
+     private:
+      int _index;
+      const Dense &_layer;
+      const Matrix &_input;
+      const Matrix &_output;
+      long _allocations;
+      std::chrono::steady_clock::time_point _start;
+    };
+
+    /**
+     * @return The profiles of every layer index, summed over all threads,
+     * those that exited included.
+     */
+    std::vector<layer_profile> layers ();
+
+    /**
+     * @return The recorded layer runs of every thread, by start time.
+     */
+    std::vector<layer_event> events ();
+
+    /**
+     * Clears every profile and event and restarts the trace clock.
+     */
+    void reset ();
+
+    /**
+     * Writes layers () as JSON: each layer's counts, total, mean, minimum,
+     * maximum, p50 and p99 times (the latter two as histogram bucket
+     * bounds), throughput, relu zero fraction and non-empty histogram
+     * buckets.
+     */
+    void write_json (std::ostream &os);
+
+    /**
+     * Writes events () in the Chrome trace event format, which
+     * chrome://tracing and Perfetto open.
+     */
+    void write_chrome_trace (std::ostream &os);
+
+    /**
+     * Writes write_json to the file named by the MLP_PROFILE_JSON
+     * environment variable and write_chrome_trace to the one named by
+     * MLP_PROFILE_TRACE, for those that are set.
+     * @throw std::runtime_error if a file cannot be written, or a file is
+     * requested from a build without MLP_PROFILE.
+     */
+    void write_requested ();
+}
+
+#endif //PROFILER_H
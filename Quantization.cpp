@@ -0,0 +1,96 @@
+#include "Quantization.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+quant_params quantization::params_for_range(float min, float max) {
+  if (min >= 0.0f) {
+    return {max > 0.0f ? max / QUANT_ACTIVATION_MAX : 1.0f, 0};
+  }
+  const float magnitude = std::max(-min, max);
+  const int steps = QUANT_ACTIVATION_MAX - QUANT_ACTIVATION_ZERO_SIGNED;
+  return {magnitude > 0.0f ? magnitude / steps : 1.0f, QUANT_ACTIVATION_ZERO_SIGNED};
+}
+
+void quantization::quantize_activations(const float *x, int n, int stride, const quant_params &params,
+                                        unsigned char *out) {
+  const float inverse = 1.0f / params.scale;
+  for (int i = 0; i < n; ++i) {
+    const long q = std::lrintf(x[i * stride] * inverse) + params.zero_point;
+    out[i] = static_cast<unsigned char>(std::min<long>(QUANT_ACTIVATION_MAX, std::max<long>(0, q)));
+  }
+}
+
+QuantizedMatrix::QuantizedMatrix() : _rows(0), _cols(0), _values(nullptr), _scales(nullptr) {}
+
+QuantizedMatrix::QuantizedMatrix(const QuantizedMatrix &other)
+    : _rows(other._rows), _cols(other._cols), _values(other._values), _scales(other._scales),
+      _owned_values(other._owned_values), _owned_scales(other._owned_scales), _row_sums(other._row_sums) {
+  if (!_owned_values.empty()) {
+    _values = _owned_values.data();
+    _scales = _owned_scales.data();
+  }
+}
+
+QuantizedMatrix &QuantizedMatrix::operator=(const QuantizedMatrix &other) {
+  if (this != &other) {
+    QuantizedMatrix copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+QuantizedMatrix QuantizedMatrix::quantize(const Matrix &m) {
+  QuantizedMatrix q;
+  q._rows = m.get_rows();
+  q._cols = m.get_cols();
+  q._owned_values.resize(static_cast<size_t>(q._rows) * q._cols);
+  q._owned_scales.resize(q._rows);
+  for (int i = 0; i < q._rows; ++i) {
+    const float *row = m.begin() + i * q._cols;
+    float magnitude = 0.0f;
+    for (int j = 0; j < q._cols; ++j) {
+      magnitude = std::max(magnitude, std::fabs(row[j]));
+    }
+    const float scale = magnitude > 0.0f ? magnitude / QUANT_WEIGHT_MAX : 1.0f;
+    q._owned_scales[i] = scale;
+    for (int j = 0; j < q._cols; ++j) {
+      const long value = std::lrintf(row[j] / scale);
+      const long clamped = std::min<long>(QUANT_WEIGHT_MAX, std::max<long>(-QUANT_WEIGHT_MAX, value));
+      q._owned_values[i * q._cols + j] = static_cast<signed char>(clamped);
+    }
+  }
+  q._values = q._owned_values.data();
+  q._scales = q._owned_scales.data();
+  q.compute_row_sums();
+  return q;
+}
+
+QuantizedMatrix QuantizedMatrix::view(const signed char *values, const float *scales, int rows, int cols) {
+  QuantizedMatrix q;
+  q._rows = rows;
+  q._cols = cols;
+  q._values = values;
+  q._scales = scales;
+  q.compute_row_sums();
+  return q;
+}
+
+Matrix QuantizedMatrix::dequantize() const {
+  Matrix m(_rows, _cols);
+  for (int i = 0; i < _rows; ++i) {
+    for (int j = 0; j < _cols; ++j) {
+      m[i * _cols + j] = _scales[i] * row(i)[j];
+    }
+  }
+  return m;
+}
+
+void QuantizedMatrix::compute_row_sums() {
+  _row_sums.assign(_rows, 0);
+  for (int i = 0; i < _rows; ++i) {
+    for (int j = 0; j < _cols; ++j) {
+      _row_sums[i] += row(i)[j];
+    }
+  }
+}
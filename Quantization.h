@@ -0,0 +1,111 @@
+// Quantization.h
+#ifndef QUANTIZATION_H
+#define QUANTIZATION_H
+
+#include "Matrix.h"
+#include <vector>
+
+// Activations are quantized to 7 bits so that the pairwise sums of
+// pmaddubsw (u8 * s8 + u8 * s8) can never saturate.
+#define QUANT_ACTIVATION_MAX 127
+#define QUANT_ACTIVATION_ZERO_SIGNED 64
+#define QUANT_WEIGHT_MAX 127
+
+/**
+ * @struct quant_params
+ * @brief How a float vector maps to unsigned 7-bit values:
+ *        x ~ scale * (q - zero_point). A scale of 0 means the parameters
+ *        are computed for each input vector on the fly (dynamic).
+ */
+typedef struct quant_params
+{
+    float scale;
+    int zero_point;
+} quant_params;
+
+const quant_params dynamic_quant_params = {0.0f, 0};
+
+namespace quantization
+{
+    /**
+     * @return Parameters that cover values in [min, max]: zero_point 0 and
+     * the full 7-bit range when min >= 0 (relu outputs, pixels), or a zero
+     * point of QUANT_ACTIVATION_ZERO_SIGNED otherwise.
+     */
+    quant_params params_for_range (float min, float max);
+
+    /**
+     * Quantizes n floats, read with the given stride, into out.
+     */
+    void quantize_activations (const float *x, int n, int stride,
+                               const quant_params &params,
+                               unsigned char *out);
+}
+
+/**
+ * A matrix of signed 8-bit weights with one symmetric scale per row:
+ * w(i, j) ~ scale(i) * value(i, j). Like Matrix, it either owns its
+ * storage or views external memory such as a mapped packed model.
+ */
+class QuantizedMatrix
+{
+ public:
+  QuantizedMatrix ();
+  /**
+   * Copies share a view's memory and duplicate owned storage.
+   */
+  QuantizedMatrix (const QuantizedMatrix &other);
+  QuantizedMatrix &operator= (const QuantizedMatrix &other);
+  QuantizedMatrix (QuantizedMatrix &&other) = default;
+  QuantizedMatrix &operator= (QuantizedMatrix &&other) = default;
+
+  /**
+   * Quantizes every row of m with scale max|row| / QUANT_WEIGHT_MAX.
+   */
+  static QuantizedMatrix quantize (const Matrix &m);
+
+  /**
+   * A matrix over existing values and scales, which must outlive it.
+   * @param values - rows * cols values in row-major order.
+   * @param scales - rows scales.
+   */
+  static QuantizedMatrix view (const signed char *values,
+                               const float *scales, int rows, int cols);
+
+  int get_rows () const
+  { return _rows; }
+
+  int get_cols () const
+  { return _cols; }
+
+  const signed char *row (int i) const
+  { return _values + i * _cols; }
+
+  float scale (int i) const
+  { return _scales[i]; }
+
+  /**
+   * @return The sum of row i's values, used to remove an activation zero
+   * point from a dot product.
+   */
+  int row_sum (int i) const
+  { return _row_sums[i]; }
+
+  /**
+   * @return The float matrix these weights approximate.
+   */
+  Matrix dequantize () const;
+
+ private:
+  void compute_row_sums ();
+
+  int _rows;
+  int _cols;
+  const signed char *_values;
+  const float *_scales;
+  std::vector<signed char> _owned_values;
+  std::vector<float> _owned_scales;
+  std::vector<int> _row_sums;
+};
+
+#endif //QUANTIZATION_H
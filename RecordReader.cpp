@@ -0,0 +1,94 @@
+#include "RecordReader.h"
+#include <cerrno>
+#include <stdexcept>
+#include <unistd.h>
+
+#define READ_ERROR_MSG "Error: Failed to read input."
+#define PARTIAL_RECORD_MSG "Error: Input ended inside a record."
+
+RecordReader::RecordReader(int fd, size_t record_size, int max_records)
+    : _fd(fd), _record_size(record_size), _current(-1), _end(false), _stop(false) {
+  for (record_buffer &buffer : _buffers) {
+    buffer.bytes.resize(record_size * max_records);
+    buffer.count = 0;
+    buffer.full = false;
+  }
+  _thread = std::thread(&RecordReader::run, this);
+}
+
+RecordReader::~RecordReader() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _changed.notify_all();
+  _thread.join();
+}
+
+const char *RecordReader::next(int &count) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (_current >= 0) {
+    _buffers[_current].full = false;
+    _changed.notify_all();
+  }
+  _current = (_current + 1) % 2;
+  record_buffer &buffer = _buffers[_current];
+  _changed.wait(lock, [this, &buffer] { return buffer.full || _end; });
+  if (buffer.full) {
+    count = buffer.count;
+    return buffer.bytes.data();
+  }
+  count = 0;
+  if (_error) {
+    std::rethrow_exception(_error);
+  }
+  return nullptr;
+}
+
+void RecordReader::run() {
+  for (int index = 0;; index = (index + 1) % 2) {
+    record_buffer &buffer = _buffers[index];
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _changed.wait(lock, [this, &buffer] { return !buffer.full || _stop; });
+      if (_stop) {
+        return;
+      }
+    }
+    // Reads until it holds whole records, so a batch is whatever the
+    // producer has written so far.
+    size_t filled = 0;
+    bool end = false;
+    std::exception_ptr error;
+    while (filled < buffer.bytes.size()) {
+      const ssize_t bytes = read(_fd, buffer.bytes.data() + filled, buffer.bytes.size() - filled);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes <= 0) {
+        end = true;
+        if (bytes < 0) {
+          error = std::make_exception_ptr(std::runtime_error(READ_ERROR_MSG));
+        } else if (filled % _record_size != 0) {
+          error = std::make_exception_ptr(std::runtime_error(PARTIAL_RECORD_MSG));
+        }
+        break;
+      }
+      filled += static_cast<size_t>(bytes);
+      if (filled % _record_size == 0) {
+        break;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      buffer.count = static_cast<int>(filled / _record_size);
+      buffer.full = buffer.count > 0;
+      _end = end;
+      _error = error;
+    }
+    _changed.notify_all();
+    if (end) {
+      return;
+    }
+  }
+}
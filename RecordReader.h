@@ -0,0 +1,69 @@
+// RecordReader.h
+#ifndef RECORDREADER_H
+#define RECORDREADER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Reads fixed-size records from a file descriptor, such as a pipe on
+ * stdin, on a background thread. It fills two buffers in turn, so the next
+ * batch is read while the caller processes the current one.
+ * A batch holds the records that were available, at least one and at most
+ * max_records, so a slow producer gets small batches without waiting for a
+ * full one.
+ */
+class RecordReader
+{
+ public:
+  /**
+   * Starts reading.
+   * @param fd - The descriptor to read, which the reader does not close.
+   * @param record_size - Bytes per record.
+   * @param max_records - The most records in a batch.
+   */
+  RecordReader (int fd, size_t record_size, int max_records);
+  RecordReader (const RecordReader &) = delete;
+  RecordReader &operator= (const RecordReader &) = delete;
+  /**
+   * Stops reading, which may wait for a pending read to return.
+   */
+  ~RecordReader ();
+
+  /**
+   * Waits for the next batch, handing the previous one back to the reader.
+   * @param count - Receives the amount of records in the batch, 0 at the
+   * end of the input.
+   * @return The records, back to back, valid until the next call.
+   * @throw std::runtime_error if reading failed or the input ended inside
+   * a record, once the whole records before that were returned.
+   */
+  const char *next (int &count);
+
+ private:
+  typedef struct record_buffer
+  {
+      std::vector<char> bytes;
+      int count;
+      bool full;
+  } record_buffer;
+
+  void run ();
+
+  const int _fd;
+  const size_t _record_size;
+  record_buffer _buffers[2];
+  int _current;
+  std::mutex _mutex;
+  std::condition_variable _changed;
+  bool _end;
+  bool _stop;
+  std::exception_ptr _error;
+  std::thread _thread;
+};
+
+#endif //RECORDREADER_H
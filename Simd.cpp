@@ -0,0 +1,86 @@
+#include "Simd.h"
+#include <cstdlib>
+#include <cstring>
+
+#define SIMD_ENV_VAR "MLP_SIMD"
+
+namespace {
+
+bool host_supports(simd::isa set) {
+#ifdef MLP_X86_SIMD
+  switch (set) {
+    case simd::SCALAR:
+      return true;
+    case simd::SSE:
+      return __builtin_cpu_supports("sse4.1");
+    case simd::AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+             && __builtin_cpu_supports("f16c");
+    case simd::AVX512:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    case simd::AVX512_VNNI:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+             && __builtin_cpu_supports("avx512vnni");
+  }
+  return false;
+#else
+  return set == simd::SCALAR;
+#endif
+}
+
+/**
+ * @return The strongest instruction set allowed by MLP_SIMD, AVX512_VNNI
+ * when it is unset or unknown.
+ */
+simd::isa requested_isa() {
+  const char *name = std::getenv(SIMD_ENV_VAR);
+  if (name == nullptr) {
+    return simd::AVX512_VNNI;
+  }
+  const char *names[] = {"scalar", "sse", "avx2", "avx512", "avx512vnni"};
+  for (int set = simd::SCALAR; set <= simd::AVX512_VNNI; ++set) {
+    if (std::strcmp(name, names[set]) == 0) {
+      return static_cast<simd::isa>(set);
+    }
+  }
+  return simd::AVX512_VNNI;
+}
+
+const simd::kernel_table &select_kernels() {
+  for (int set = requested_isa(); set > simd::SCALAR; --set) {
+    const simd::kernel_table *table = simd::kernels_for(static_cast<simd::isa>(set));
+    if (table != nullptr) {
+      return *table;
+    }
+  }
+  return simd::scalar_kernels();
+}
+
+}
+
+const simd::kernel_table *simd::kernels_for(isa set) {
+  if (!host_supports(set)) {
+    return nullptr;
+  }
+  switch (set) {
+    case SCALAR:
+      return &scalar_kernels();
+#ifdef MLP_X86_SIMD
+    case SSE:
+      return &sse_kernels();
+    case AVX2:
+      return &avx2_kernels();
+    case AVX512:
+      return &avx512_kernels();
+    case AVX512_VNNI:
+      return &avx512_vnni_kernels();
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+const simd::kernel_table &simd::kernels() {
+  static const kernel_table &selected = select_kernels();
+  return selected;
+}
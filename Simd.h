@@ -0,0 +1,134 @@
+// Simd.h
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+
+// The width of the blocks of a blocked sparse matrix, see block_dot and
+// Sparse.h.
+#define SPARSE_BLOCK 8
+
+namespace simd
+{
+    /**
+     * @enum isa
+     * @brief Instruction sets with their own kernel table, weakest first.
+     */
+    enum isa
+    {
+        SCALAR, SSE, AVX2, AVX512, AVX512_VNNI
+    };
+
+    /**
+     * @struct kernel_table
+     * @brief The float kernels used by Matrix, the activations and the GEMM
+     *        engine, all compiled for one instruction set.
+     * Unless noted otherwise, array arguments hold n contiguous floats, and
+     * out may alias an input.
+     */
+    typedef struct kernel_table
+    {
+        isa set;
+        const char *name;
+        /** out = x + y */
+        void (*add) (const float *x, const float *y, float *out, int n);
+        /** out = x - y */
+        void (*sub) (const float *x, const float *y, float *out, int n);
+        /** out = x * y (elementwise) */
+        void (*mul) (const float *x, const float *y, float *out, int n);
+        /** out = x * scalar */
+        void (*scale) (const float *x, float scalar, float *out, int n);
+        /** out += a * x */
+        void (*axpy) (float a, const float *x, float *out, int n);
+        /** @return The sum of x[i] * y[i]. */
+        float (*dot) (const float *x, const float *y, int n);
+        /**
+         * @return The sum of the dot products of blocks of SPARSE_BLOCK
+         * floats: block b's values, at values + b * SPARSE_BLOCK, with the
+         * SPARSE_BLOCK floats at x + columns[b].
+         */
+        float (*block_dot) (const float *values, const int *columns,
+                            int blocks, const float *x);
+        /** @return The sum of x[i] * x[i]. */
+        float (*sum_squares) (const float *x, int n);
+        /** out = max(0, x) */
+        void (*relu) (const float *x, float *out, int n);
+        /** out = max(x, y) (elementwise) */
+        void (*maximum) (const float *x, const float *y, float *out, int n);
+        /** @return The largest of x, n > 0. */
+        float (*max) (const float *x, int n);
+        /** out = value where x == y, unchanged elsewhere */
+        void (*set_where_equal) (const float *x, const float *y, float value,
+                                 float *out, int n);
+        /**
+         * out = exp(x - shift); @return The sum of out. Subtracting the
+         * maximum of x as shift keeps every term and the sum finite.
+         */
+        float (*exp_sum) (const float *x, float shift, float *out, int n);
+        /**
+         * exp_sum through a cheaper polynomial, whose terms are within a
+         * relative 1e-4 of exp's.
+         */
+        float (*fast_exp_sum) (const float *x, float shift, float *out,
+                               int n);
+        /** out = x * scale, converting bytes to floats */
+        void (*u8_to_float) (const unsigned char *x, float scale, float *out,
+                             int n);
+        /**
+         * @return The sum of x[i] * w[i] in 32-bit integers. x must be
+         * below 128 (see Quantization.h) so no pairwise sum saturates.
+         */
+        int (*dot_u8s8) (const unsigned char *x, const signed char *w, int n);
+        /** out = x converted from FP16 (see HalfPrecision.h) to floats */
+        void (*f16_to_float) (const uint16_t *x, float *out, int n);
+        /** out = x converted from BF16 to floats */
+        void (*bf16_to_float) (const uint16_t *x, float *out, int n);
+        /**
+         * @return The sum of w[i] * x[i], each FP16 w[i] converted to float
+         * as it is loaded; products and sums are in float.
+         */
+        float (*dot_f16) (const uint16_t *w, const float *x, int n);
+        /** dot_f16 for BF16 weights. */
+        float (*dot_bf16) (const uint16_t *w, const float *x, int n);
+        /** Register tile of gemm_kernel, see Gemm.cpp. */
+        int gemm_mr, gemm_nr;
+        /**
+         * Multiplies a packed gemm_mr X kc panel by a packed kc X gemm_nr
+         * panel and stores (or adds, when accumulate is set) the tile in c.
+         */
+        void (*gemm_kernel) (int kc, const float *a, const float *b,
+                             float *c, int ldc, bool accumulate);
+        /**
+         * Writes the transpose of the rows X cols block at in, whose rows
+         * are ld_in floats apart, to out, whose rows are ld_out floats
+         * apart. out must not overlap in. Meant for cache-sized tiles, see
+         * Matrix::transpose_into.
+         */
+        void (*transpose) (const float *in, int ld_in, float *out,
+                           int ld_out, int rows, int cols);
+    } kernel_table;
+
+    /**
+     * The kernel table for the best instruction set this host supports.
+     * The CPU is probed once, on the first call. Setting the MLP_SIMD
+     * environment variable to scalar, sse, avx2, avx512 or avx512vnni caps
+     * the choice.
+     */
+    const kernel_table &kernels ();
+
+    /**
+     * @return The kernel table of the given instruction set, or nullptr if
+     * it was not compiled in or the host cannot run it.
+     */
+    const kernel_table *kernels_for (isa set);
+
+    /* Per instruction set tables, each defined in its own Simd*.cpp. */
+    const kernel_table &scalar_kernels ();
+    const kernel_table &sse_kernels ();
+    const kernel_table &avx2_kernels ();
+    const kernel_table &avx512_kernels ();
+    /** The AVX-512 table with the VNNI dot_u8s8. */
+    const kernel_table &avx512_vnni_kernels ();
+}
+
+#endif //SIMD_H
@@ -0,0 +1,401 @@
+#include "Simd.h"
+#include <immintrin.h>
+
+// Built with -mavx2 -mfma -mf16c and only reached after simd::kernels() has
+// seen all three on the host. Keep library templates out of this file: an inline
+// instantiation emitted here could be picked by the linker for callers on
+// hosts without AVX2.
+#define AVX2_WIDTH 8
+#define AVX2_GEMM_MR 6
+#define AVX2_GEMM_NR 16
+#define EXP_HI 88.3762626647949f
+#define EXP_LO -88.3762626647949f
+#define LOG2E 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+
+namespace {
+
+inline float horizontal_sum(__m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+/**
+ * Cephes style exp: splits x into n * ln2 + r and evaluates a degree 5
+ * polynomial for exp(r), then scales by 2^n through the exponent bits.
+ */
+inline __m256 exp_ps(__m256 x) {
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_LO)), _mm256_set1_ps(EXP_HI));
+  __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(LOG2E), _mm256_set1_ps(0.5f)));
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HI), x);
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LO), x);
+  __m256 y = _mm256_set1_ps(1.9875691500E-4f);
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507E-3f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073E-3f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894E-2f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459E-1f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201E-1f));
+  y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+  __m256i pow2 = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(y, _mm256_castsi256_ps(pow2));
+}
+
+/**
+ * exp_ps with a degree 3 minimax polynomial for exp(r), within a relative
+ * 7.5e-5 of it.
+ */
+inline __m256 fast_exp_ps(__m256 x) {
+  x = _mm256_max_ps(x, _mm256_set1_ps(EXP_LO));
+  __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(LOG2E), _mm256_set1_ps(0.5f)));
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HI), x);
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LO), x);
+  __m256 y = _mm256_set1_ps(0.16566832f);
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(0.50496326f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.00016419f));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(0.99992807f));
+  __m256i pow2 = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(y, _mm256_castsi256_ps(pow2));
+}
+
+/** Mask enabling the first n (< AVX2_WIDTH) lanes of a masked load/store. */
+inline __m256i tail_mask(int n) {
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+void add(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] + y[i];
+  }
+}
+
+void sub(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    _mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] - y[i];
+  }
+}
+
+void mul(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] * y[i];
+  }
+}
+
+void scale(const float *x, float scalar, float *out, int n) {
+  const __m256 s = _mm256_set1_ps(scalar);
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), s));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] * scalar;
+  }
+}
+
+void axpy(float a, const float *x, float *out, int n) {
+  const __m256 s = _mm256_set1_ps(a);
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    _mm256_storeu_ps(out + i, _mm256_fmadd_ps(_mm256_loadu_ps(x + i), s, _mm256_loadu_ps(out + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] += a * x[i];
+  }
+}
+
+float dot(const float *x, const float *y, int n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 2 * AVX2_WIDTH <= n; i += 2 * AVX2_WIDTH) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + AVX2_WIDTH), _mm256_loadu_ps(y + i + AVX2_WIDTH), acc1);
+  }
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+  }
+  if (i < n) {
+    const __m256i mask = tail_mask(n - i);
+    acc1 = _mm256_fmadd_ps(_mm256_maskload_ps(x + i, mask), _mm256_maskload_ps(y + i, mask), acc1);
+  }
+  return horizontal_sum(_mm256_add_ps(acc0, acc1));
+}
+
+// A block is one AVX2 vector.
+float block_dot(const float *values, const int *columns, int blocks, const float *x) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  int b = 0;
+  for (; b + 2 <= blocks; b += 2) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(values + b * SPARSE_BLOCK), _mm256_loadu_ps(x + columns[b]), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(values + (b + 1) * SPARSE_BLOCK),
+                           _mm256_loadu_ps(x + columns[b + 1]), acc1);
+  }
+  if (b < blocks) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(values + b * SPARSE_BLOCK), _mm256_loadu_ps(x + columns[b]), acc0);
+  }
+  return horizontal_sum(_mm256_add_ps(acc0, acc1));
+}
+
+float sum_squares(const float *x, int n) {
+  return dot(x, x, n);
+}
+
+void relu(const float *x, float *out, int n) {
+  const __m256 zero = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    _mm256_storeu_ps(out + i, _mm256_max_ps(_mm256_loadu_ps(x + i), zero));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] > 0.0f ? x[i] : 0.0f;
+  }
+}
+
+void maximum(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    _mm256_storeu_ps(out + i, _mm256_max_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] > y[i] ? x[i] : y[i];
+  }
+}
+
+float max(const float *x, int n) {
+  __m256 acc = _mm256_set1_ps(x[0]);
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    acc = _mm256_max_ps(acc, _mm256_loadu_ps(x + i));
+  }
+  __m128 m = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+  float result = _mm_cvtss_f32(_mm_max_ss(m, _mm_movehdup_ps(m)));
+  for (; i < n; ++i) {
+    result = x[i] > result ? x[i] : result;
+  }
+  return result;
+}
+
+void set_where_equal(const float *x, const float *y, float value, float *out, int n) {
+  const __m256 v = _mm256_set1_ps(value);
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    const __m256 equal = _mm256_cmp_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), _CMP_EQ_OQ);
+    _mm256_storeu_ps(out + i, _mm256_blendv_ps(_mm256_loadu_ps(out + i), v, equal));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] == y[i] ? value : out[i];
+  }
+}
+
+template <__m256 (*Exp)(__m256)>
+float exp_sum_with(const float *x, float shift, float *out, int n) {
+  const __m256 s = _mm256_set1_ps(shift);
+  __m256 sum = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    const __m256 e = Exp(_mm256_sub_ps(_mm256_loadu_ps(x + i), s));
+    _mm256_storeu_ps(out + i, e);
+    sum = _mm256_add_ps(sum, e);
+  }
+  if (i < n) {
+    const __m256i mask = tail_mask(n - i);
+    const __m256 e = _mm256_and_ps(Exp(_mm256_sub_ps(_mm256_maskload_ps(x + i, mask), s)),
+                                   _mm256_castsi256_ps(mask));
+    _mm256_maskstore_ps(out + i, mask, e);
+    sum = _mm256_add_ps(sum, e);
+  }
+  return horizontal_sum(sum);
+}
+
+float exp_sum(const float *x, float shift, float *out, int n) {
+  return exp_sum_with<exp_ps>(x, shift, out, n);
+}
+
+float fast_exp_sum(const float *x, float shift, float *out, int n) {
+  return exp_sum_with<fast_exp_ps>(x, shift, out, n);
+}
+
+void u8_to_float(const unsigned char *x, float scale, float *out, int n) {
+  const __m256 s = _mm256_set1_ps(scale);
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    const __m256i wide = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(x + i)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(wide), s));
+  }
+  for (; i < n; ++i) {
+    out[i] = static_cast<float>(x[i]) * scale;
+  }
+}
+
+/** pmaddubsw and pmaddwd over 32 bytes at a time, as in SimdSse.cpp. */
+int dot_u8s8(const unsigned char *x, const signed char *w, int n) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i));
+    const __m256i weights = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(w + i));
+    const __m256i products = _mm256_maddubs_epi16(bytes, weights);
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(products, ones));
+  }
+  __m128i sum4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum4 = _mm_add_epi32(sum4, _mm_shuffle_epi32(sum4, _MM_SHUFFLE(2, 3, 0, 1)));
+  int sum = _mm_cvtsi128_si32(sum4);
+  for (; i < n; ++i) {
+    sum += x[i] * w[i];
+  }
+  return sum;
+}
+
+/** F16C converts 8 FP16 values at once. */
+inline __m256 fp16_to_ps(__m128i h) {
+  return _mm256_cvtph_ps(h);
+}
+
+/** BF16 values are the top halves of floats. */
+inline __m256 bf16_to_ps(__m128i h) {
+  return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+}
+
+inline __m128i load_half(const uint16_t *x) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i *>(x));
+}
+
+/** The last n < AVX2_WIDTH values of x, zero padded. */
+inline __m128i load_half_tail(const uint16_t *x, int n) {
+  uint16_t rest[AVX2_WIDTH] = {};
+  for (int j = 0; j < n; ++j) {
+    rest[j] = x[j];
+  }
+  return load_half(rest);
+}
+
+template <__m256 (*convert)(__m128i)>
+void half_to_float(const uint16_t *x, float *out, int n) {
+  int i = 0;
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    _mm256_storeu_ps(out + i, convert(load_half(x + i)));
+  }
+  if (i < n) {
+    _mm256_maskstore_ps(out + i, tail_mask(n - i), convert(load_half_tail(x + i, n - i)));
+  }
+}
+
+template <__m256 (*convert)(__m128i)>
+float dot_half(const uint16_t *w, const float *x, int n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 2 * AVX2_WIDTH <= n; i += 2 * AVX2_WIDTH) {
+    acc0 = _mm256_fmadd_ps(convert(load_half(w + i)), _mm256_loadu_ps(x + i), acc0);
+    acc1 = _mm256_fmadd_ps(convert(load_half(w + i + AVX2_WIDTH)), _mm256_loadu_ps(x + i + AVX2_WIDTH), acc1);
+  }
+  for (; i + AVX2_WIDTH <= n; i += AVX2_WIDTH) {
+    acc0 = _mm256_fmadd_ps(convert(load_half(w + i)), _mm256_loadu_ps(x + i), acc0);
+  }
+  if (i < n) {
+    const __m256 tail = _mm256_maskload_ps(x + i, tail_mask(n - i));
+    acc1 = _mm256_fmadd_ps(convert(load_half_tail(w + i, n - i)), tail, acc1);
+  }
+  return horizontal_sum(_mm256_add_ps(acc0, acc1));
+}
+
+/**
+ * 6 X 16 tile held in twelve accumulators; each k step broadcasts six
+ * values of a against two vectors of b.
+ */
+void gemm_kernel(int kc, const float *a, const float *b, float *c, int ldc, bool accumulate) {
+  __m256 acc[AVX2_GEMM_MR][2];
+  for (int i = 0; i < AVX2_GEMM_MR; ++i) {
+    acc[i][0] = _mm256_setzero_ps();
+    acc[i][1] = _mm256_setzero_ps();
+  }
+  for (int p = 0; p < kc; ++p) {
+    const __m256 b0 = _mm256_loadu_ps(b);
+    const __m256 b1 = _mm256_loadu_ps(b + AVX2_WIDTH);
+    for (int i = 0; i < AVX2_GEMM_MR; ++i) {
+      const __m256 ai = _mm256_broadcast_ss(a + i);
+      acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+      acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+    }
+    a += AVX2_GEMM_MR;
+    b += AVX2_GEMM_NR;
+  }
+  for (int i = 0; i < AVX2_GEMM_MR; ++i) {
+    float *ci = c + i * ldc;
+    if (accumulate) {
+      acc[i][0] = _mm256_add_ps(acc[i][0], _mm256_loadu_ps(ci));
+      acc[i][1] = _mm256_add_ps(acc[i][1], _mm256_loadu_ps(ci + AVX2_WIDTH));
+    }
+    _mm256_storeu_ps(ci, acc[i][0]);
+    _mm256_storeu_ps(ci + AVX2_WIDTH, acc[i][1]);
+  }
+}
+
+/**
+ * An 8 X 8 block, transposed in registers: unpacks interleave row pairs,
+ * shuffles gather groups of four and lane permutes swap the 128-bit halves.
+ */
+inline void transpose_block(const float *in, int ld_in, float *out, int ld_out) {
+  __m256 r[AVX2_WIDTH], t[AVX2_WIDTH];
+  for (int i = 0; i < AVX2_WIDTH; ++i) {
+    r[i] = _mm256_loadu_ps(in + i * ld_in);
+  }
+  for (int i = 0; i < AVX2_WIDTH; i += 2) {
+    t[i] = _mm256_unpacklo_ps(r[i], r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_ps(r[i], r[i + 1]);
+  }
+  for (int i = 0; i < AVX2_WIDTH; i += 4) {
+    r[i] = _mm256_shuffle_ps(t[i], t[i + 2], 0x44);
+    r[i + 1] = _mm256_shuffle_ps(t[i], t[i + 2], 0xEE);
+    r[i + 2] = _mm256_shuffle_ps(t[i + 1], t[i + 3], 0x44);
+    r[i + 3] = _mm256_shuffle_ps(t[i + 1], t[i + 3], 0xEE);
+  }
+  for (int i = 0; i < 4; ++i) {
+    _mm256_storeu_ps(out + i * ld_out, _mm256_permute2f128_ps(r[i], r[i + 4], 0x20));
+    _mm256_storeu_ps(out + (i + 4) * ld_out, _mm256_permute2f128_ps(r[i], r[i + 4], 0x31));
+  }
+}
+
+void transpose(const float *in, int ld_in, float *out, int ld_out, int rows, int cols) {
+  const int fullRows = rows - rows % AVX2_WIDTH;
+  const int fullCols = cols - cols % AVX2_WIDTH;
+  for (int i = 0; i < fullRows; i += AVX2_WIDTH) {
+    for (int j = 0; j < fullCols; j += AVX2_WIDTH) {
+      transpose_block(in + i * ld_in + j, ld_in, out + j * ld_out + i, ld_out);
+    }
+  }
+  for (int i = 0; i < rows; ++i) {
+    for (int j = i < fullRows ? fullCols : 0; j < cols; ++j) {
+      out[j * ld_out + i] = in[i * ld_in + j];
+    }
+  }
+}
+
+}
+
+const simd::kernel_table &simd::avx2_kernels() {
+  static const kernel_table table = {AVX2, "avx2", add, sub, mul, scale, axpy, dot, block_dot, sum_squares,
+                                     relu, maximum, max, set_where_equal, exp_sum, fast_exp_sum, u8_to_float,
+                                     dot_u8s8, half_to_float<fp16_to_ps>, half_to_float<bf16_to_ps>,
+                                     dot_half<fp16_to_ps>, dot_half<bf16_to_ps>,
+                                     AVX2_GEMM_MR, AVX2_GEMM_NR, gemm_kernel, transpose};
+  return table;
+}
@@ -0,0 +1,398 @@
+#include "Simd.h"
+#include <immintrin.h>
+
+// Built with -mavx512f -mavx512bw and only reached after simd::kernels() has seen it
+// on the host. Keep library templates out of this file, see SimdAvx2.cpp.
+#define AVX512_WIDTH 16
+#define AVX512_GEMM_MR 6
+#define AVX512_GEMM_NR 32
+#define EXP_HI 88.3762626647949f
+#define EXP_LO -88.3762626647949f
+#define LOG2E 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+
+namespace {
+
+/** Same polynomial as the AVX2 exp_ps, with scalef applying 2^n. */
+inline __m512 exp_ps(__m512 x) {
+  x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_LO)), _mm512_set1_ps(EXP_HI));
+  __m512 n = _mm512_roundscale_ps(_mm512_fmadd_ps(x, _mm512_set1_ps(LOG2E), _mm512_set1_ps(0.5f)),
+                                  _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_HI), x);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_LO), x);
+  __m512 y = _mm512_set1_ps(1.9875691500E-4f);
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507E-3f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073E-3f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894E-2f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459E-1f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201E-1f));
+  y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+  return _mm512_scalef_ps(y, n);
+}
+
+/** Same polynomial as the AVX2 fast_exp_ps, with scalef applying 2^n. */
+inline __m512 fast_exp_ps(__m512 x) {
+  x = _mm512_max_ps(x, _mm512_set1_ps(EXP_LO));
+  __m512 n = _mm512_roundscale_ps(_mm512_fmadd_ps(x, _mm512_set1_ps(LOG2E), _mm512_set1_ps(0.5f)),
+                                  _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_HI), x);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_LO), x);
+  __m512 y = _mm512_set1_ps(0.16566832f);
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(0.50496326f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.00016419f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(0.99992807f));
+  return _mm512_scalef_ps(y, n);
+}
+
+/** Mask enabling the first n (< AVX512_WIDTH) lanes. */
+inline __mmask16 tail_mask(int n) {
+  return static_cast<__mmask16>((1u << n) - 1u);
+}
+
+void add(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    _mm512_mask_storeu_ps(out + i, m,
+                          _mm512_add_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+  }
+}
+
+void sub(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    _mm512_storeu_ps(out + i, _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    _mm512_mask_storeu_ps(out + i, m,
+                          _mm512_sub_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+  }
+}
+
+void mul(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    _mm512_mask_storeu_ps(out + i, m,
+                          _mm512_mul_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+  }
+}
+
+void scale(const float *x, float scalar, float *out, int n) {
+  const __m512 s = _mm512_set1_ps(scalar);
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), s));
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    _mm512_mask_storeu_ps(out + i, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, x + i), s));
+  }
+}
+
+void axpy(float a, const float *x, float *out, int n) {
+  const __m512 s = _mm512_set1_ps(a);
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    _mm512_storeu_ps(out + i, _mm512_fmadd_ps(_mm512_loadu_ps(x + i), s, _mm512_loadu_ps(out + i)));
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    const __m512 sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + i), s, _mm512_maskz_loadu_ps(m, out + i));
+    _mm512_mask_storeu_ps(out + i, m, sum);
+  }
+}
+
+float dot(const float *x, const float *y, int n) {
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 2 * AVX512_WIDTH <= n; i += 2 * AVX512_WIDTH) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + AVX512_WIDTH),
+                           _mm512_loadu_ps(y + i + AVX512_WIDTH), acc1);
+  }
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i), acc1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+// Two blocks fill a vector: their values are adjacent, their inputs are
+// joined from two halves.
+float block_dot(const float *values, const int *columns, int blocks, const float *x) {
+  __m512 acc = _mm512_setzero_ps();
+  int b = 0;
+  for (; b + 2 <= blocks; b += 2) {
+    const __m512d low = _mm512_castpd256_pd512(_mm256_castps_pd(_mm256_loadu_ps(x + columns[b])));
+    const __m256d high = _mm256_castps_pd(_mm256_loadu_ps(x + columns[b + 1]));
+    const __m512 xb = _mm512_castpd_ps(_mm512_insertf64x4(low, high, 1));
+    acc = _mm512_fmadd_ps(_mm512_loadu_ps(values + b * SPARSE_BLOCK), xb, acc);
+  }
+  if (b < blocks) {
+    const __mmask16 m = tail_mask(SPARSE_BLOCK);
+    acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, values + b * SPARSE_BLOCK),
+                          _mm512_maskz_loadu_ps(m, x + columns[b]), acc);
+  }
+  return _mm512_reduce_add_ps(acc);
+}
+
+float sum_squares(const float *x, int n) {
+  return dot(x, x, n);
+}
+
+void relu(const float *x, float *out, int n) {
+  const __m512 zero = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    _mm512_storeu_ps(out + i, _mm512_max_ps(_mm512_loadu_ps(x + i), zero));
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    _mm512_mask_storeu_ps(out + i, m, _mm512_max_ps(_mm512_maskz_loadu_ps(m, x + i), zero));
+  }
+}
+
+void maximum(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    _mm512_storeu_ps(out + i, _mm512_max_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    _mm512_mask_storeu_ps(out + i, m,
+                          _mm512_max_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+  }
+}
+
+float max(const float *x, int n) {
+  __m512 acc = _mm512_set1_ps(x[0]);
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    acc = _mm512_max_ps(acc, _mm512_loadu_ps(x + i));
+  }
+  if (i < n) {
+    acc = _mm512_max_ps(acc, _mm512_mask_loadu_ps(acc, tail_mask(n - i), x + i));
+  }
+  return _mm512_reduce_max_ps(acc);
+}
+
+void set_where_equal(const float *x, const float *y, float value, float *out, int n) {
+  const __m512 v = _mm512_set1_ps(value);
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    const __mmask16 equal = _mm512_cmp_ps_mask(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), _CMP_EQ_OQ);
+    _mm512_mask_storeu_ps(out + i, equal, v);
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    const __mmask16 equal = _mm512_mask_cmp_ps_mask(m, _mm512_maskz_loadu_ps(m, x + i),
+                                                    _mm512_maskz_loadu_ps(m, y + i), _CMP_EQ_OQ);
+    _mm512_mask_storeu_ps(out + i, equal, v);
+  }
+}
+
+template <__m512 (*Exp)(__m512)>
+float exp_sum_with(const float *x, float shift, float *out, int n) {
+  const __m512 s = _mm512_set1_ps(shift);
+  __m512 sum = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    const __m512 e = Exp(_mm512_sub_ps(_mm512_loadu_ps(x + i), s));
+    _mm512_storeu_ps(out + i, e);
+    sum = _mm512_add_ps(sum, e);
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    const __m512 e = _mm512_maskz_mov_ps(m, Exp(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, x + i), s)));
+    _mm512_mask_storeu_ps(out + i, m, e);
+    sum = _mm512_add_ps(sum, e);
+  }
+  return _mm512_reduce_add_ps(sum);
+}
+
+float exp_sum(const float *x, float shift, float *out, int n) {
+  return exp_sum_with<exp_ps>(x, shift, out, n);
+}
+
+float fast_exp_sum(const float *x, float shift, float *out, int n) {
+  return exp_sum_with<fast_exp_ps>(x, shift, out, n);
+}
+
+void u8_to_float(const unsigned char *x, float scale, float *out, int n) {
+  const __m512 s = _mm512_set1_ps(scale);
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    const __m512i wide = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i)));
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(wide), s));
+  }
+  for (; i < n; ++i) {
+    out[i] = static_cast<float>(x[i]) * scale;
+  }
+}
+
+/** pmaddubsw and pmaddwd over 64 bytes at a time, as in SimdSse.cpp. */
+int dot_u8s8(const unsigned char *x, const signed char *w, int n) {
+  const __m512i ones = _mm512_set1_epi16(1);
+  __m512i acc = _mm512_setzero_si512();
+  int i = 0;
+  for (; i + 64 <= n; i += 64) {
+    const __m512i products = _mm512_maddubs_epi16(_mm512_loadu_si512(x + i), _mm512_loadu_si512(w + i));
+    acc = _mm512_add_epi32(acc, _mm512_madd_epi16(products, ones));
+  }
+  if (i < n) {
+    const __mmask64 m = (1ULL << (n - i)) - 1ULL;
+    const __m512i products =
+        _mm512_maddubs_epi16(_mm512_maskz_loadu_epi8(m, x + i), _mm512_maskz_loadu_epi8(m, w + i));
+    acc = _mm512_add_epi32(acc, _mm512_madd_epi16(products, ones));
+  }
+  return _mm512_reduce_add_epi32(acc);
+}
+
+/** vcvtph2ps converts 16 FP16 values at once. */
+inline __m512 fp16_to_ps(__m256i h) {
+  return _mm512_cvtph_ps(h);
+}
+
+/** BF16 values are the top halves of floats. */
+inline __m512 bf16_to_ps(__m256i h) {
+  return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+}
+
+inline __m256i load_half(const uint16_t *x) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x));
+}
+
+inline __m256i load_half_tail(const uint16_t *x, __mmask16 m) {
+  return _mm512_castsi512_si256(_mm512_maskz_loadu_epi16(m, x));
+}
+
+template <__m512 (*convert)(__m256i)>
+void half_to_float(const uint16_t *x, float *out, int n) {
+  int i = 0;
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    _mm512_storeu_ps(out + i, convert(load_half(x + i)));
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    _mm512_mask_storeu_ps(out + i, m, convert(load_half_tail(x + i, m)));
+  }
+}
+
+template <__m512 (*convert)(__m256i)>
+float dot_half(const uint16_t *w, const float *x, int n) {
+  __m512 acc0 = _mm512_setzero_ps();
+  __m512 acc1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 2 * AVX512_WIDTH <= n; i += 2 * AVX512_WIDTH) {
+    acc0 = _mm512_fmadd_ps(convert(load_half(w + i)), _mm512_loadu_ps(x + i), acc0);
+    acc1 = _mm512_fmadd_ps(convert(load_half(w + i + AVX512_WIDTH)),
+                           _mm512_loadu_ps(x + i + AVX512_WIDTH), acc1);
+  }
+  for (; i + AVX512_WIDTH <= n; i += AVX512_WIDTH) {
+    acc0 = _mm512_fmadd_ps(convert(load_half(w + i)), _mm512_loadu_ps(x + i), acc0);
+  }
+  if (i < n) {
+    const __mmask16 m = tail_mask(n - i);
+    acc1 = _mm512_fmadd_ps(convert(load_half_tail(w + i, m)), _mm512_maskz_loadu_ps(m, x + i), acc1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+/** 6 X 32 tile in twelve accumulators, as in the AVX2 kernel. */
+void gemm_kernel(int kc, const float *a, const float *b, float *c, int ldc, bool accumulate) {
+  __m512 acc[AVX512_GEMM_MR][2];
+  for (int i = 0; i < AVX512_GEMM_MR; ++i) {
+    acc[i][0] = _mm512_setzero_ps();
+    acc[i][1] = _mm512_setzero_ps();
+  }
+  for (int p = 0; p < kc; ++p) {
+    const __m512 b0 = _mm512_loadu_ps(b);
+    const __m512 b1 = _mm512_loadu_ps(b + AVX512_WIDTH);
+    for (int i = 0; i < AVX512_GEMM_MR; ++i) {
+      const __m512 ai = _mm512_set1_ps(a[i]);
+      acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+      acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+    }
+    a += AVX512_GEMM_MR;
+    b += AVX512_GEMM_NR;
+  }
+  for (int i = 0; i < AVX512_GEMM_MR; ++i) {
+    float *ci = c + i * ldc;
+    if (accumulate) {
+      acc[i][0] = _mm512_add_ps(acc[i][0], _mm512_loadu_ps(ci));
+      acc[i][1] = _mm512_add_ps(acc[i][1], _mm512_loadu_ps(ci + AVX512_WIDTH));
+    }
+    _mm512_storeu_ps(ci, acc[i][0]);
+    _mm512_storeu_ps(ci + AVX512_WIDTH, acc[i][1]);
+  }
+}
+
+/**
+ * A 16 X 16 block, transposed in registers as in the AVX2 kernel, with two
+ * rounds of 128-bit lane shuffles in place of the single lane permute.
+ */
+inline void transpose_block(const float *in, int ld_in, float *out, int ld_out) {
+  __m512 r[AVX512_WIDTH], t[AVX512_WIDTH];
+  for (int i = 0; i < AVX512_WIDTH; ++i) {
+    r[i] = _mm512_loadu_ps(in + i * ld_in);
+  }
+  for (int i = 0; i < AVX512_WIDTH; i += 2) {
+    t[i] = _mm512_unpacklo_ps(r[i], r[i + 1]);
+    t[i + 1] = _mm512_unpackhi_ps(r[i], r[i + 1]);
+  }
+  for (int i = 0; i < AVX512_WIDTH; i += 4) {
+    r[i] = _mm512_shuffle_ps(t[i], t[i + 2], 0x44);
+    r[i + 1] = _mm512_shuffle_ps(t[i], t[i + 2], 0xEE);
+    r[i + 2] = _mm512_shuffle_ps(t[i + 1], t[i + 3], 0x44);
+    r[i + 3] = _mm512_shuffle_ps(t[i + 1], t[i + 3], 0xEE);
+  }
+  for (int i = 0; i < AVX512_WIDTH; i += 8) {
+    for (int k = 0; k < 4; ++k) {
+      t[i + k] = _mm512_shuffle_f32x4(r[i + k], r[i + k + 4], 0x88);
+      t[i + k + 4] = _mm512_shuffle_f32x4(r[i + k], r[i + k + 4], 0xDD);
+    }
+  }
+  for (int i = 0; i < 8; ++i) {
+    _mm512_storeu_ps(out + i * ld_out, _mm512_shuffle_f32x4(t[i], t[i + 8], 0x88));
+    _mm512_storeu_ps(out + (i + 8) * ld_out, _mm512_shuffle_f32x4(t[i], t[i + 8], 0xDD));
+  }
+}
+
+void transpose(const float *in, int ld_in, float *out, int ld_out, int rows, int cols) {
+  const int fullRows = rows - rows % AVX512_WIDTH;
+  const int fullCols = cols - cols % AVX512_WIDTH;
+  for (int i = 0; i < fullRows; i += AVX512_WIDTH) {
+    for (int j = 0; j < fullCols; j += AVX512_WIDTH) {
+      transpose_block(in + i * ld_in + j, ld_in, out + j * ld_out + i, ld_out);
+    }
+  }
+  for (int i = 0; i < rows; ++i) {
+    for (int j = i < fullRows ? fullCols : 0; j < cols; ++j) {
+      out[j * ld_out + i] = in[i * ld_in + j];
+    }
+  }
+}
+
+}
+
+const simd::kernel_table &simd::avx512_kernels() {
+  static const kernel_table table = {AVX512, "avx512", add, sub, mul, scale, axpy, dot, block_dot,
+                                     sum_squares, relu, maximum, max, set_where_equal, exp_sum, fast_exp_sum,
+                                     u8_to_float, dot_u8s8, half_to_float<fp16_to_ps>,
+                                     half_to_float<bf16_to_ps>, dot_half<fp16_to_ps>, dot_half<bf16_to_ps>,
+                                     AVX512_GEMM_MR, AVX512_GEMM_NR, gemm_kernel, transpose};
+  return table;
+}
@@ -0,0 +1,37 @@
+#include "Simd.h"
+#include <immintrin.h>
+
+// Built with -mavx512f -mavx512bw -mavx512vnni and only reached after
+// simd::kernels() has seen all three on the host. Keep library templates
+// out of this file, see SimdAvx2.cpp.
+
+namespace {
+
+/** vpdpbusd multiplies and accumulates 64 byte pairs straight into 32 bits. */
+int dot_u8s8(const unsigned char *x, const signed char *w, int n) {
+  __m512i acc = _mm512_setzero_si512();
+  int i = 0;
+  for (; i + 64 <= n; i += 64) {
+    acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(x + i), _mm512_loadu_si512(w + i));
+  }
+  if (i < n) {
+    const __mmask64 m = (1ULL << (n - i)) - 1ULL;
+    acc = _mm512_dpbusd_epi32(acc, _mm512_maskz_loadu_epi8(m, x + i), _mm512_maskz_loadu_epi8(m, w + i));
+  }
+  return _mm512_reduce_add_epi32(acc);
+}
+
+simd::kernel_table make_table() {
+  simd::kernel_table table = simd::avx512_kernels();
+  table.set = simd::AVX512_VNNI;
+  table.name = "avx512vnni";
+  table.dot_u8s8 = dot_u8s8;
+  return table;
+}
+
+}
+
+const simd::kernel_table &simd::avx512_vnni_kernels() {
+  static const kernel_table table = make_table();
+  return table;
+}
@@ -0,0 +1,222 @@
+#include "Simd.h"
+#include "HalfPrecision.h"
+#include <cmath>
+
+// Scalar reference kernels, used on hosts without any supported SIMD
+// extension. The loops are left simple for the compiler's autovectorizer.
+#define SCALAR_GEMM_MR 4
+#define SCALAR_GEMM_NR 8
+#define SCALAR_LANES 8
+#define EXP_LO -88.3762626647949f
+#define LOG2E 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+
+namespace {
+
+void add(const float *x, const float *y, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = x[i] + y[i];
+  }
+}
+
+void sub(const float *x, const float *y, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = x[i] - y[i];
+  }
+}
+
+void mul(const float *x, const float *y, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = x[i] * y[i];
+  }
+}
+
+void scale(const float *x, float scalar, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = x[i] * scalar;
+  }
+}
+
+void axpy(float a, const float *x, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] += a * x[i];
+  }
+}
+
+float dot(const float *x, const float *y, int n) {
+  float partial[SCALAR_LANES] = {};
+  int i = 0;
+  for (; i + SCALAR_LANES <= n; i += SCALAR_LANES) {
+    for (int l = 0; l < SCALAR_LANES; ++l) {
+      partial[l] += x[i + l] * y[i + l];
+    }
+  }
+  float sum = 0.0f;
+  for (int l = 0; l < SCALAR_LANES; ++l) {
+    sum += partial[l];
+  }
+  for (; i < n; ++i) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+float block_dot(const float *values, const int *columns, int blocks, const float *x) {
+  float partial[SPARSE_BLOCK] = {};
+  for (int b = 0; b < blocks; ++b) {
+    const float *v = values + b * SPARSE_BLOCK;
+    const float *xb = x + columns[b];
+    for (int l = 0; l < SPARSE_BLOCK; ++l) {
+      partial[l] += v[l] * xb[l];
+    }
+  }
+  float sum = 0.0f;
+  for (int l = 0; l < SPARSE_BLOCK; ++l) {
+    sum += partial[l];
+  }
+  return sum;
+}
+
+float sum_squares(const float *x, int n) {
+  return dot(x, x, n);
+}
+
+void relu(const float *x, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = x[i] > 0.0f ? x[i] : 0.0f;
+  }
+}
+
+void maximum(const float *x, const float *y, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = x[i] > y[i] ? x[i] : y[i];
+  }
+}
+
+float max(const float *x, int n) {
+  float result = x[0];
+  for (int i = 1; i < n; ++i) {
+    result = x[i] > result ? x[i] : result;
+  }
+  return result;
+}
+
+void set_where_equal(const float *x, const float *y, float value, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = x[i] == y[i] ? value : out[i];
+  }
+}
+
+float exp_sum(const float *x, float shift, float *out, int n) {
+  float sum = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    out[i] = std::exp(x[i] - shift);
+    sum += out[i];
+  }
+  return sum;
+}
+
+/**
+ * Splits x into k * ln2 + r and evaluates a degree 3 minimax polynomial
+ * for exp(r), within a relative 7.5e-5 of it, then scales by 2^k.
+ */
+inline float fast_exp(float x) {
+  x = x < EXP_LO ? EXP_LO : x;
+  const float k = std::floor(x * LOG2E + 0.5f);
+  const float r = x - k * LN2_HI - k * LN2_LO;
+  const float p = ((0.16566832f * r + 0.50496326f) * r + 1.00016419f) * r + 0.99992807f;
+  return std::ldexp(p, static_cast<int>(k));
+}
+
+float fast_exp_sum(const float *x, float shift, float *out, int n) {
+  float sum = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    out[i] = fast_exp(x[i] - shift);
+    sum += out[i];
+  }
+  return sum;
+}
+
+void u8_to_float(const unsigned char *x, float scale, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = static_cast<float>(x[i]) * scale;
+  }
+}
+
+int dot_u8s8(const unsigned char *x, const signed char *w, int n) {
+  int sum = 0;
+  for (int i = 0; i < n; ++i) {
+    sum += x[i] * w[i];
+  }
+  return sum;
+}
+
+void f16_to_float(const uint16_t *x, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = half::to_float(x[i], half::FP16);
+  }
+}
+
+void bf16_to_float(const uint16_t *x, float *out, int n) {
+  for (int i = 0; i < n; ++i) {
+    out[i] = half::to_float(x[i], half::BF16);
+  }
+}
+
+template <half::format F>
+float dot_half(const uint16_t *w, const float *x, int n) {
+  float partial[SCALAR_LANES] = {};
+  int i = 0;
+  for (; i + SCALAR_LANES <= n; i += SCALAR_LANES) {
+    for (int l = 0; l < SCALAR_LANES; ++l) {
+      partial[l] += half::to_float(w[i + l], F) * x[i + l];
+    }
+  }
+  float sum = 0.0f;
+  for (int l = 0; l < SCALAR_LANES; ++l) {
+    sum += partial[l];
+  }
+  for (; i < n; ++i) {
+    sum += half::to_float(w[i], F) * x[i];
+  }
+  return sum;
+}
+
+void gemm_kernel(int kc, const float *a, const float *b, float *c, int ldc, bool accumulate) {
+  float acc[SCALAR_GEMM_MR][SCALAR_GEMM_NR] = {};
+  for (int p = 0; p < kc; ++p) {
+    const float *bp = b + p * SCALAR_GEMM_NR;
+    for (int i = 0; i < SCALAR_GEMM_MR; ++i) {
+      const float ai = a[p * SCALAR_GEMM_MR + i];
+      for (int j = 0; j < SCALAR_GEMM_NR; ++j) {
+        acc[i][j] += ai * bp[j];
+      }
+    }
+  }
+  for (int i = 0; i < SCALAR_GEMM_MR; ++i) {
+    float *ci = c + i * ldc;
+    for (int j = 0; j < SCALAR_GEMM_NR; ++j) {
+      ci[j] = accumulate ? ci[j] + acc[i][j] : acc[i][j];
+    }
+  }
+}
+
+void transpose(const float *in, int ld_in, float *out, int ld_out, int rows, int cols) {
+  for (int i = 0; i < rows; ++i) {
+    for (int j = 0; j < cols; ++j) {
+      out[j * ld_out + i] = in[i * ld_in + j];
+    }
+  }
+}
+
+}
+
+const simd::kernel_table &simd::scalar_kernels() {
+  static const kernel_table table = {SCALAR, "scalar", add, sub, mul, scale, axpy, dot, block_dot,
+                                     sum_squares, relu, maximum, max, set_where_equal, exp_sum, fast_exp_sum,
+                                     u8_to_float, dot_u8s8, f16_to_float, bf16_to_float, dot_half<half::FP16>,
+                                     dot_half<half::BF16>,
+                                     SCALAR_GEMM_MR, SCALAR_GEMM_NR, gemm_kernel, transpose};
+  return table;
+}
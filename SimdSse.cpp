@@ -0,0 +1,391 @@
+#include "Simd.h"
+#include <immintrin.h>
+
+// Built with -msse4.1 and only reached after simd::kernels() has seen it
+// on the host. Keep library templates out of this file, see SimdAvx2.cpp.
+#define SSE_WIDTH 4
+#define SSE_GEMM_MR 4
+#define SSE_GEMM_NR 8
+#define EXP_HI 88.3762626647949f
+#define EXP_LO -88.3762626647949f
+#define LOG2E 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+// An FP16 exponent once shifted into a float's place, the float exponent
+// bias minus FP16's (127 - 15) in the exponent field, and 2^-14 as float
+// bits.
+#define FP16_EXPONENT_MASK 0x0f800000
+#define FP16_EXPONENT_REBIAS (112 << 23)
+#define FP16_MIN_NORMAL (113 << 23)
+
+namespace {
+
+inline float horizontal_sum(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_movehdup_ps(v));
+  return _mm_cvtss_f32(v);
+}
+
+inline __m128 madd(__m128 x, __m128 y, __m128 z) {
+  return _mm_add_ps(_mm_mul_ps(x, y), z);
+}
+
+/** Same polynomial as the AVX2 exp_ps, without fused multiply-adds. */
+inline __m128 exp_ps(__m128 x) {
+  x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(EXP_LO)), _mm_set1_ps(EXP_HI));
+  __m128 n = _mm_floor_ps(madd(x, _mm_set1_ps(LOG2E), _mm_set1_ps(0.5f)));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(LN2_HI)));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(LN2_LO)));
+  __m128 y = _mm_set1_ps(1.9875691500E-4f);
+  y = madd(y, x, _mm_set1_ps(1.3981999507E-3f));
+  y = madd(y, x, _mm_set1_ps(8.3334519073E-3f));
+  y = madd(y, x, _mm_set1_ps(4.1665795894E-2f));
+  y = madd(y, x, _mm_set1_ps(1.6666665459E-1f));
+  y = madd(y, x, _mm_set1_ps(5.0000001201E-1f));
+  y = madd(y, _mm_mul_ps(x, x), _mm_add_ps(x, _mm_set1_ps(1.0f)));
+  __m128i pow2 = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+  return _mm_mul_ps(y, _mm_castsi128_ps(pow2));
+}
+
+/** Same polynomial as the AVX2 fast_exp_ps, without fused multiply-adds. */
+inline __m128 fast_exp_ps(__m128 x) {
+  x = _mm_max_ps(x, _mm_set1_ps(EXP_LO));
+  __m128 n = _mm_floor_ps(madd(x, _mm_set1_ps(LOG2E), _mm_set1_ps(0.5f)));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(LN2_HI)));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(LN2_LO)));
+  __m128 y = _mm_set1_ps(0.16566832f);
+  y = madd(y, x, _mm_set1_ps(0.50496326f));
+  y = madd(y, x, _mm_set1_ps(1.00016419f));
+  y = madd(y, x, _mm_set1_ps(0.99992807f));
+  __m128i pow2 = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+  return _mm_mul_ps(y, _mm_castsi128_ps(pow2));
+}
+
+void add(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] + y[i];
+  }
+}
+
+void sub(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    _mm_storeu_ps(out + i, _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] - y[i];
+  }
+}
+
+void mul(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] * y[i];
+  }
+}
+
+void scale(const float *x, float scalar, float *out, int n) {
+  const __m128 s = _mm_set1_ps(scalar);
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(x + i), s));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] * scalar;
+  }
+}
+
+void axpy(float a, const float *x, float *out, int n) {
+  const __m128 s = _mm_set1_ps(a);
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    _mm_storeu_ps(out + i, madd(_mm_loadu_ps(x + i), s, _mm_loadu_ps(out + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] += a * x[i];
+  }
+}
+
+float dot(const float *x, const float *y, int n) {
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 2 * SSE_WIDTH <= n; i += 2 * SSE_WIDTH) {
+    acc0 = madd(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i), acc0);
+    acc1 = madd(_mm_loadu_ps(x + i + SSE_WIDTH), _mm_loadu_ps(y + i + SSE_WIDTH), acc1);
+  }
+  float sum = horizontal_sum(_mm_add_ps(acc0, acc1));
+  for (; i < n; ++i) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+float block_dot(const float *values, const int *columns, int blocks, const float *x) {
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  for (int b = 0; b < blocks; ++b) {
+    const float *v = values + b * SPARSE_BLOCK;
+    const float *xb = x + columns[b];
+    acc0 = madd(_mm_loadu_ps(v), _mm_loadu_ps(xb), acc0);
+    acc1 = madd(_mm_loadu_ps(v + SSE_WIDTH), _mm_loadu_ps(xb + SSE_WIDTH), acc1);
+  }
+  return horizontal_sum(_mm_add_ps(acc0, acc1));
+}
+
+float sum_squares(const float *x, int n) {
+  return dot(x, x, n);
+}
+
+void relu(const float *x, float *out, int n) {
+  const __m128 zero = _mm_setzero_ps();
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    _mm_storeu_ps(out + i, _mm_max_ps(_mm_loadu_ps(x + i), zero));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] > 0.0f ? x[i] : 0.0f;
+  }
+}
+
+void maximum(const float *x, const float *y, float *out, int n) {
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    _mm_storeu_ps(out + i, _mm_max_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] > y[i] ? x[i] : y[i];
+  }
+}
+
+float max(const float *x, int n) {
+  __m128 acc = _mm_set1_ps(x[0]);
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    acc = _mm_max_ps(acc, _mm_loadu_ps(x + i));
+  }
+  acc = _mm_max_ps(acc, _mm_movehl_ps(acc, acc));
+  float result = _mm_cvtss_f32(_mm_max_ss(acc, _mm_movehdup_ps(acc)));
+  for (; i < n; ++i) {
+    result = x[i] > result ? x[i] : result;
+  }
+  return result;
+}
+
+void set_where_equal(const float *x, const float *y, float value, float *out, int n) {
+  const __m128 v = _mm_set1_ps(value);
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    const __m128 equal = _mm_cmpeq_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+    _mm_storeu_ps(out + i, _mm_blendv_ps(_mm_loadu_ps(out + i), v, equal));
+  }
+  for (; i < n; ++i) {
+    out[i] = x[i] == y[i] ? value : out[i];
+  }
+}
+
+template <__m128 (*Exp)(__m128)>
+float exp_sum_with(const float *x, float shift, float *out, int n) {
+  const __m128 s = _mm_set1_ps(shift);
+  __m128 sum = _mm_setzero_ps();
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    const __m128 e = Exp(_mm_sub_ps(_mm_loadu_ps(x + i), s));
+    _mm_storeu_ps(out + i, e);
+    sum = _mm_add_ps(sum, e);
+  }
+  if (i < n) {
+    float tail[SSE_WIDTH] = {};
+    for (int l = 0; l < n - i; ++l) {
+      tail[l] = x[i + l];
+    }
+    _mm_storeu_ps(tail, Exp(_mm_sub_ps(_mm_loadu_ps(tail), s)));
+    for (int l = 0; l < n - i; ++l) {
+      out[i + l] = tail[l];
+      sum = _mm_add_ss(sum, _mm_set_ss(tail[l]));
+    }
+  }
+  return horizontal_sum(sum);
+}
+
+float exp_sum(const float *x, float shift, float *out, int n) {
+  return exp_sum_with<exp_ps>(x, shift, out, n);
+}
+
+float fast_exp_sum(const float *x, float shift, float *out, int n) {
+  return exp_sum_with<fast_exp_ps>(x, shift, out, n);
+}
+
+void u8_to_float(const unsigned char *x, float scale, float *out, int n) {
+  const __m128 s = _mm_set1_ps(scale);
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    const __m128i wide = _mm_cvtepu8_epi32(_mm_loadu_si32(x + i));
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(wide), s));
+  }
+  for (; i < n; ++i) {
+    out[i] = static_cast<float>(x[i]) * scale;
+  }
+}
+
+/**
+ * pmaddubsw multiplies 16 byte pairs into 8 pairwise sums, which pmaddwd
+ * with ones widens to 32 bits.
+ */
+int dot_u8s8(const unsigned char *x, const signed char *w, int n) {
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i products = _mm_maddubs_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i)),
+                                               _mm_loadu_si128(reinterpret_cast<const __m128i *>(w + i)));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(products, ones));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  int sum = _mm_cvtsi128_si32(acc);
+  for (; i < n; ++i) {
+    sum += x[i] * w[i];
+  }
+  return sum;
+}
+
+/**
+ * Converts 4 FP16 values, zero-extended to 32 bits, to floats. SSE has no
+ * F16C, so the exponent is rebiased with integer operations: infinities
+ * and NaNs are moved to the float's top exponent and subnormals are
+ * normalized by subtracting 2^-14 in float.
+ */
+inline __m128 fp16_to_ps(__m128i h) {
+  const __m128i exponent_mask = _mm_set1_epi32(FP16_EXPONENT_MASK);
+  const __m128i rebias = _mm_set1_epi32(FP16_EXPONENT_REBIAS);
+  const __m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+  __m128i bits = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7fff)), 13);
+  const __m128i exponent = _mm_and_si128(bits, exponent_mask);
+  bits = _mm_add_epi32(bits, rebias);
+  bits = _mm_add_epi32(bits, _mm_and_si128(_mm_cmpeq_epi32(exponent, exponent_mask), rebias));
+  const __m128 subnormal = _mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(1 << 23))),
+                                      _mm_castsi128_ps(_mm_set1_epi32(FP16_MIN_NORMAL)));
+  bits = _mm_blendv_epi8(bits, _mm_castps_si128(subnormal), _mm_cmpeq_epi32(exponent, _mm_setzero_si128()));
+  return _mm_castsi128_ps(_mm_or_si128(bits, sign));
+}
+
+/** BF16 values, zero-extended to 32 bits, are the top halves of floats. */
+inline __m128 bf16_to_ps(__m128i h) {
+  return _mm_castsi128_ps(_mm_slli_epi32(h, 16));
+}
+
+inline __m128i load_half(const uint16_t *x) {
+  return _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(x)));
+}
+
+template <__m128 (*convert)(__m128i)>
+void half_to_float(const uint16_t *x, float *out, int n) {
+  int i = 0;
+  for (; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+    _mm_storeu_ps(out + i, convert(load_half(x + i)));
+  }
+  if (i < n) {
+    uint16_t rest[SSE_WIDTH] = {};
+    float converted[SSE_WIDTH];
+    for (int j = 0; i + j < n; ++j) {
+      rest[j] = x[i + j];
+    }
+    _mm_storeu_ps(converted, convert(load_half(rest)));
+    for (int j = 0; i + j < n; ++j) {
+      out[i + j] = converted[j];
+    }
+  }
+}
+
+template <__m128 (*convert)(__m128i)>
+float dot_half(const uint16_t *w, const float *x, int n) {
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 2 * SSE_WIDTH <= n; i += 2 * SSE_WIDTH) {
+    acc0 = madd(convert(load_half(w + i)), _mm_loadu_ps(x + i), acc0);
+    acc1 = madd(convert(load_half(w + i + SSE_WIDTH)), _mm_loadu_ps(x + i + SSE_WIDTH), acc1);
+  }
+  float converted[2 * SSE_WIDTH];
+  half_to_float<convert>(w + i, converted, n - i);
+  float sum = horizontal_sum(_mm_add_ps(acc0, acc1));
+  for (int j = 0; i + j < n; ++j) {
+    sum += converted[j] * x[i + j];
+  }
+  return sum;
+}
+
+void gemm_kernel(int kc, const float *a, const float *b, float *c, int ldc, bool accumulate) {
+  __m128 acc[SSE_GEMM_MR][2];
+  for (int i = 0; i < SSE_GEMM_MR; ++i) {
+    acc[i][0] = _mm_setzero_ps();
+    acc[i][1] = _mm_setzero_ps();
+  }
+  for (int p = 0; p < kc; ++p) {
+    const __m128 b0 = _mm_loadu_ps(b);
+    const __m128 b1 = _mm_loadu_ps(b + SSE_WIDTH);
+    for (int i = 0; i < SSE_GEMM_MR; ++i) {
+      const __m128 ai = _mm_set1_ps(a[i]);
+      acc[i][0] = madd(ai, b0, acc[i][0]);
+      acc[i][1] = madd(ai, b1, acc[i][1]);
+    }
+    a += SSE_GEMM_MR;
+    b += SSE_GEMM_NR;
+  }
+  for (int i = 0; i < SSE_GEMM_MR; ++i) {
+    float *ci = c + i * ldc;
+    if (accumulate) {
+      acc[i][0] = _mm_add_ps(acc[i][0], _mm_loadu_ps(ci));
+      acc[i][1] = _mm_add_ps(acc[i][1], _mm_loadu_ps(ci + SSE_WIDTH));
+    }
+    _mm_storeu_ps(ci, acc[i][0]);
+    _mm_storeu_ps(ci + SSE_WIDTH, acc[i][1]);
+  }
+}
+
+/** A 4 X 4 block, transposed in registers. */
+inline void transpose_block(const float *in, int ld_in, float *out, int ld_out) {
+  __m128 r0 = _mm_loadu_ps(in);
+  __m128 r1 = _mm_loadu_ps(in + ld_in);
+  __m128 r2 = _mm_loadu_ps(in + 2 * ld_in);
+  __m128 r3 = _mm_loadu_ps(in + 3 * ld_in);
+  _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+  _mm_storeu_ps(out, r0);
+  _mm_storeu_ps(out + ld_out, r1);
+  _mm_storeu_ps(out + 2 * ld_out, r2);
+  _mm_storeu_ps(out + 3 * ld_out, r3);
+}
+
+void transpose(const float *in, int ld_in, float *out, int ld_out, int rows, int cols) {
+  const int fullRows = rows - rows % SSE_WIDTH;
+  const int fullCols = cols - cols % SSE_WIDTH;
+  for (int i = 0; i < fullRows; i += SSE_WIDTH) {
+    for (int j = 0; j < fullCols; j += SSE_WIDTH) {
+      transpose_block(in + i * ld_in + j, ld_in, out + j * ld_out + i, ld_out);
+    }
+  }
+  for (int i = 0; i < rows; ++i) {
+    for (int j = i < fullRows ? fullCols : 0; j < cols; ++j) {
+      out[j * ld_out + i] = in[i * ld_in + j];
+    }
+  }
+}
+
+}
+
+const simd::kernel_table &simd::sse_kernels() {
+  static const kernel_table table = {SSE, "sse", add, sub, mul, scale, axpy, dot, block_dot, sum_squares,
+                                     relu, maximum, max, set_where_equal, exp_sum, fast_exp_sum, u8_to_float,
+                                     dot_u8s8, half_to_float<fp16_to_ps>, half_to_float<bf16_to_ps>,
+                                     dot_half<fp16_to_ps>, dot_half<bf16_to_ps>,
+                                     SSE_GEMM_MR, SSE_GEMM_NR, gemm_kernel, transpose};
+  return table;
+}
@@ -0,0 +1,217 @@
+#include "Sparse.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+#define LENGTH_ERROR_MSG "Error: Invalid matrix size."
+#define INVALID_SPARSITY_MSG "Error: Sparsity must be between 0 and 1."
+#define SPARSE_CSR_LANES 4
+
+namespace {
+
+/**
+ * @return The first column of block b of a row of cols columns. Blocks
+ * cover consecutive SPARSE_BLOCK columns; when cols is not a multiple of
+ * SPARSE_BLOCK the last one starts early so it stays within the row, and
+ * only holds the columns the previous block does not.
+ */
+int block_start(int b, int cols) {
+  return std::min(b * SPARSE_BLOCK, cols - SPARSE_BLOCK);
+}
+
+int block_count(int cols) {
+  return (cols + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+}
+
+/**
+ * @return Whether every column of row in block b (see block_start) is
+ * zero.
+ */
+bool block_is_zero(const float *row, int b, int cols) {
+  const int end = std::min((b + 1) * SPARSE_BLOCK, cols);
+  return std::all_of(row + b * SPARSE_BLOCK, row + end, [](float value) { return value == 0.0f; });
+}
+
+}
+
+SparseMatrix::SparseMatrix() : _rows(0), _cols(0), _layout(CSR) {}
+
+SparseMatrix SparseMatrix::from_dense(const Matrix &m, layout chosen) {
+  SparseMatrix s;
+  s._rows = m.get_rows();
+  s._cols = m.get_cols();
+  s._layout = s._cols < SPARSE_BLOCK ? CSR : chosen;
+  s._row_starts.assign(1, 0);
+  for (int i = 0; i < s._rows; ++i) {
+    const float *row = m.row(i);
+    if (s._layout == CSR) {
+      for (int j = 0; j < s._cols; ++j) {
+        if (row[j] != 0.0f) {
+          s._columns.push_back(j);
+          s._values.push_back(row[j]);
+        }
+      }
+    } else {
+      for (int b = 0; b < block_count(s._cols); ++b) {
+        if (block_is_zero(row, b, s._cols)) {
+          continue;
+        }
+        const int start = block_start(b, s._cols);
+        s._columns.push_back(start);
+        for (int j = start; j < start + SPARSE_BLOCK; ++j) {
+          // Columns of the previous block stay zero in an early last one.
+          s._values.push_back(j >= b * SPARSE_BLOCK ? row[j] : 0.0f);
+        }
+      }
+    }
+    s._row_starts.push_back(static_cast<int>(s._columns.size()));
+  }
+  return s;
+}
+
+void SparseMatrix::prune(Matrix &m, float sparsity, bool blocks) {
+  if (!(sparsity >= 0.0f && sparsity <= 1.0f)) {
+    throw std::invalid_argument(INVALID_SPARSITY_MSG);
+  }
+  const int cols = m.get_cols();
+  const int row_blocks = blocks ? block_count(cols) : cols;
+  // A unit is an element or, with blocks, a block; units are numbered row
+  // by row.
+  const int units = m.get_rows() * row_blocks;
+  std::vector<float> magnitudes(units);
+  for (int u = 0; u < units; ++u) {
+    const float *row = m.row(u / row_blocks);
+    if (!blocks) {
+      magnitudes[u] = std::fabs(row[u % row_blocks]);
+      continue;
+    }
+    const int b = u % row_blocks;
+    const float *end = row + std::min((b + 1) * SPARSE_BLOCK, cols);
+    magnitudes[u] = std::accumulate(row + b * SPARSE_BLOCK, end, 0.0f,
+                                    [](float sum, float value) { return sum + std::fabs(value); });
+  }
+  const int pruned = static_cast<int>(sparsity * units);
+  std::vector<int> order(units);
+  std::iota(order.begin(), order.end(), 0);
+  std::nth_element(order.begin(), order.begin() + pruned, order.end(),
+                   [&magnitudes](int a, int b) { return magnitudes[a] < magnitudes[b]; });
+  for (int p = 0; p < pruned; ++p) {
+    float *row = m.row(order[p] / row_blocks);
+    const int unit = order[p] % row_blocks;
+    if (blocks) {
+      std::fill(row + unit * SPARSE_BLOCK, row + std::min((unit + 1) * SPARSE_BLOCK, cols), 0.0f);
+    } else {
+      row[unit] = 0.0f;
+    }
+  }
+}
+
+float SparseMatrix::density(const Matrix &m) {
+  const long size = static_cast<long>(m.get_rows()) * m.get_cols();
+  const long zeros = std::count(m.begin(), m.end(), 0.0f);
+  return static_cast<float>(size - zeros) / size;
+}
+
+float SparseMatrix::block_fill(const Matrix &m) {
+  long blocks = 0;
+  long nonzeros = 0;
+  for (int i = 0; i < m.get_rows(); ++i) {
+    const float *row = m.row(i);
+    for (int b = 0; b < block_count(m.get_cols()); ++b) {
+      blocks += !block_is_zero(row, b, m.get_cols());
+    }
+    nonzeros += m.get_cols() - std::count(row, row + m.get_cols(), 0.0f);
+  }
+  return blocks == 0 ? 0.0f : static_cast<float>(nonzeros) / (blocks * SPARSE_BLOCK);
+}
+
+SparseMatrix::layout SparseMatrix::choose_layout(const Matrix &m, bool &sparse) {
+  const layout chosen =
+      m.get_cols() >= SPARSE_BLOCK && block_fill(m) >= SPARSE_MIN_BLOCK_FILL ? BLOCKED : CSR;
+  sparse = density(m) <= (chosen == BLOCKED ? SPARSE_MAX_DENSITY : SPARSE_MAX_CSR_DENSITY);
+  return chosen;
+}
+
+void SparseMatrix::multiply(const Matrix &input, const float *bias, bool relu, Matrix &output) const {
+  if (input.get_rows() != _cols) {
+    throw std::length_error(LENGTH_ERROR_MSG);
+  }
+  const int batch = input.get_cols();
+  output.resize(_rows, batch);
+  const simd::kernel_table &kernels = simd::kernels();
+  if (batch == 1) {
+    multiply_vector(kernels, input.begin(), bias, relu, output.begin());
+    return;
+  }
+  for (int i = 0; i < _rows; ++i) {
+    float *out = output.row(i);
+    std::fill(out, out + batch, bias[i]);
+    for (int e = _row_starts[i]; e < _row_starts[i + 1]; ++e) {
+      if (_layout == CSR) {
+        kernels.axpy(_values[e], input.row(_columns[e]), out, batch);
+        continue;
+      }
+      const float *block = _values.data() + static_cast<size_t>(e) * SPARSE_BLOCK;
+      for (int t = 0; t < SPARSE_BLOCK; ++t) {
+        if (block[t] != 0.0f) {
+          kernels.axpy(block[t], input.row(_columns[e] + t), out, batch);
+        }
+      }
+    }
+    if (relu) {
+      kernels.relu(out, out, batch);
+    }
+  }
+}
+
+void SparseMatrix::multiply_vector(const simd::kernel_table &kernels, const float *x, const float *bias,
+                                   bool relu, float *out) const {
+  for (int i = 0; i < _rows; ++i) {
+    const int begin = _row_starts[i];
+    const int count = _row_starts[i + 1] - begin;
+    float sum = 0.0f;
+    if (_layout == BLOCKED) {
+      sum = kernels.block_dot(_values.data() + static_cast<size_t>(begin) * SPARSE_BLOCK,
+                              _columns.data() + begin, count, x);
+    } else {
+      // Independent partial sums keep the gathered products from waiting
+      // on one another.
+      float partial[SPARSE_CSR_LANES] = {};
+      int e = begin;
+      for (; e + SPARSE_CSR_LANES <= begin + count; e += SPARSE_CSR_LANES) {
+        for (int l = 0; l < SPARSE_CSR_LANES; ++l) {
+          partial[l] += _values[e + l] * x[_columns[e + l]];
+        }
+      }
+      for (; e < begin + count; ++e) {
+        sum += _values[e] * x[_columns[e]];
+      }
+      for (int l = 0; l < SPARSE_CSR_LANES; ++l) {
+        sum += partial[l];
+      }
+    }
+    const float value = sum + bias[i];
+    out[i] = relu && value < 0.0f ? 0.0f : value;
+  }
+}
+
+Matrix SparseMatrix::to_dense() const {
+  Matrix m(_rows, _cols);
+  for (int i = 0; i < _rows; ++i) {
+    float *row = m.row(i);
+    for (int e = _row_starts[i]; e < _row_starts[i + 1]; ++e) {
+      if (_layout == CSR) {
+        row[_columns[e]] = _values[e];
+        continue;
+      }
+      for (int t = 0; t < SPARSE_BLOCK; ++t) {
+        const float value = _values[static_cast<size_t>(e) * SPARSE_BLOCK + t];
+        if (value != 0.0f) {
+          row[_columns[e] + t] = value;
+        }
+      }
+    }
+  }
+  return m;
+}
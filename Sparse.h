@@ -0,0 +1,129 @@
+// Sparse.h
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "Matrix.h"
+#include "Simd.h"
+#include <vector>
+
+// Up to these fractions of non-zero weights a layer runs faster in the
+// blocked or the CSR layout than through the dense GEMM, even on a single
+// input, see SparseMatrix::choose_layout. CSR gathers each input element
+// on its own, so it needs far fewer of them.
+#define SPARSE_MAX_DENSITY 0.5f
+#define SPARSE_MAX_CSR_DENSITY 0.15f
+// The blocked layout pays off once its blocks are at least this full;
+// sparser rows are stored element by element.
+#define SPARSE_MIN_BLOCK_FILL 0.5f
+
+/**
+ * A matrix that stores only its non-zero elements, for the weights of
+ * pruned layers, in one of two layouts:
+ * CSR: each row's non-zero values with their column indices.
+ * BLOCKED: each row's non-zero blocks of SPARSE_BLOCK consecutive columns,
+ * with the column each block starts at. Blocks hold their zeros too, so a
+ * product with a single column multiplies whole blocks with SIMD loads
+ * (see simd::kernel_table::block_dot) instead of gathering elements.
+ * Products skip the missing elements, so their cost follows the non-zero
+ * elements rather than the shape.
+ */
+class SparseMatrix
+{
+ public:
+  /**
+   * @enum layout
+   * @brief How the non-zero elements are stored.
+   */
+  enum layout
+  {
+      CSR, BLOCKED
+  };
+
+  SparseMatrix ();
+
+  /**
+   * Stores the non-zero elements of m in the given layout. A matrix with
+   * fewer than SPARSE_BLOCK columns is always stored as CSR.
+   */
+  static SparseMatrix from_dense (const Matrix &m, layout chosen);
+
+  /**
+   * @return The fraction of m's elements that are not zero.
+   */
+  static float density (const Matrix &m);
+
+  /**
+   * @return The fraction of the elements of m's non-zero blocks (see
+   * BLOCKED) that are not zero.
+   */
+  static float block_fill (const Matrix &m);
+
+  /**
+   * Measures m and picks how to store it.
+   * @param sparse - Set to whether m is sparse enough for the chosen
+   * layout, at most SPARSE_MAX_DENSITY for BLOCKED or
+   * SPARSE_MAX_CSR_DENSITY for CSR, to be stored as a SparseMatrix at all.
+   * @return BLOCKED when m's blocks are at least SPARSE_MIN_BLOCK_FILL
+   * full, CSR otherwise.
+   */
+  static layout choose_layout (const Matrix &m, bool &sparse);
+
+  /**
+   * Magnitude pruning: zeroes the smallest elements of m until a
+   * sparsity fraction of them is zero, or, when blocks is set, the
+   * SPARSE_BLOCK wide blocks (see BLOCKED) of smallest absolute sum, which
+   * keeps the remaining blocks full.
+   * @throw std::invalid_argument unless 0 <= sparsity <= 1.
+   */
+  static void prune (Matrix &m, float sparsity, bool blocks);
+
+  int get_rows () const
+  { return _rows; }
+
+  int get_cols () const
+  { return _cols; }
+
+  layout get_layout () const
+  { return _layout; }
+
+  /**
+   * @return The stored values, zeros within blocks included.
+   */
+  int stored () const
+  { return static_cast<int>(_values.size ()); }
+
+  /**
+   * Computes output = this * input, adds bias[i] to row i and, if relu is
+   * set, replaces negative results with 0, like gemm::sgemm_bias. A single
+   * column is a sparse matrix-vector product; wider inputs add each
+   * stored weight times its input row to the output row (SpMM).
+   * @param input - get_cols () X n, n > 0.
+   * @param bias - get_rows () floats.
+   * @param output - Resized (see Matrix::resize) to get_rows () X n; must
+   * not be input.
+   */
+  void multiply (const Matrix &input, const float *bias, bool relu,
+                 Matrix &output) const;
+
+  /**
+   * @return The dense matrix this one stores.
+   */
+  Matrix to_dense () const;
+
+ private:
+  void multiply_vector (const simd::kernel_table &kernels, const float *x,
+                        const float *bias, bool relu, float *out) const;
+
+  int _rows;
+  int _cols;
+  layout _layout;
+  // Row i's entries (elements, or blocks) are _row_starts[i] up to
+  // _row_starts[i + 1].
+  std::vector<int> _row_starts;
+  // The column of each element, or the first column of each block.
+  std::vector<int> _columns;
+  // One value per element, or SPARSE_BLOCK per block.
+  std::vector<float> _values;
+};
+
+#endif //SPARSE_H
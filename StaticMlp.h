@@ -0,0 +1,213 @@
+// StaticMlp.h
+#ifndef STATICMLP_H
+#define STATICMLP_H
+
+#include "Matrix.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+#define STATIC_ALIGNMENT 64
+#define STATIC_SHAPE_ERROR_MSG "Error: Parameters do not match the static layer shape."
+
+/**
+ * A Rows X Cols matrix whose shape is part of its type, stored inline and
+ * aligned, with unchecked access. Meant for parameters and buffers whose
+ * sizes are known when compiling, such as the layers of MlpNetwork.
+ */
+template <int Rows, int Cols>
+class StaticMatrix
+{
+ public:
+  static constexpr int rows = Rows;
+  static constexpr int cols = Cols;
+  static constexpr int size = Rows * Cols;
+
+  float operator() (int row, int col) const
+  { return _data[row * Cols + col]; }
+
+  float &operator() (int row, int col)
+  { return _data[row * Cols + col]; }
+
+  const float *data () const
+  { return _data; }
+
+  float *data ()
+  { return _data; }
+
+ private:
+  alignas(STATIC_ALIGNMENT) float _data[Rows * Cols];
+};
+
+namespace static_activation
+{
+    /**
+     * relu for StaticDense, applied to N outputs in place.
+     */
+    struct relu
+    {
+        template <int N>
+        static void apply (float *values) {
+          for (int i = 0; i < N; ++i) {
+            values[i] = std::max(values[i], 0.0f);
+          }
+        }
+    };
+
+    /**
+     * softmax for StaticDense, applied to N outputs in place. The maximum
+     * is subtracted first so that large logits cannot overflow.
+     */
+    struct softmax
+    {
+        template <int N>
+        static void apply (float *values) {
+          const float max = *std::max_element(values, values + N);
+          float sum = 0.0f;
+          for (int i = 0; i < N; ++i) {
+            values[i] = std::exp(values[i] - max);
+            sum += values[i];
+          }
+          for (int i = 0; i < N; ++i) {
+            values[i] /= sum;
+          }
+        }
+    };
+}
+
+/**
+ * A dense layer with In inputs, Out outputs and activation Act, whose loops
+ * all have compile-time bounds. The weights are stored transposed, In X Out,
+ * so the product is In scaled additions of contiguous Out-long rows into
+ * the outputs: independent lanes the compiler can unroll and vectorize,
+ * unlike a dot product, whose reduction it may not reorder.
+ */
+template <int In, int Out, typename Act>
+class StaticDense
+{
+ public:
+  static constexpr int input_size = In;
+  static constexpr int output_size = Out;
+
+  /**
+   * Copies the parameters of a dynamic layer.
+   * @param weight - An Out X In matrix.
+   * @param bias - An Out X 1 matrix.
+   * @throw std::length_error if the shapes differ.
+   */
+  void load (const Matrix &weight, const Matrix &bias) {
+    if (weight.get_rows() != Out || weight.get_cols() != In
+        || bias.get_rows() != Out || bias.get_cols() != 1) {
+      throw std::length_error(STATIC_SHAPE_ERROR_MSG);
+    }
+    for (int i = 0; i < Out; ++i) {
+      for (int j = 0; j < In; ++j) {
+        _weight(j, i) = weight.begin()[i * In + j];
+      }
+      _bias(i, 0) = bias.begin()[i];
+    }
+  }
+
+  /**
+   * output = Act(weight * input + bias).
+   * @param input - In floats.
+   * @param output - Out floats, must not overlap input.
+   */
+  void forward (const float *input, float *output) const {
+    // A local accumulator cannot alias the weights, so the loop needs no
+    // runtime overlap checks.
+    alignas(STATIC_ALIGNMENT) float sums[Out];
+    std::copy(_bias.data(), _bias.data() + Out, sums);
+    for (int j = 0; j < In; ++j) {
+      const float x = input[j];
+      const float *row = _weight.data() + j * Out;
+      for (int i = 0; i < Out; ++i) {
+        sums[i] += row[i] * x;
+      }
+    }
+    Act::template apply<Out>(sums);
+    std::copy(sums, sums + Out, output);
+  }
+
+ private:
+  StaticMatrix<In, Out> _weight;
+  StaticMatrix<Out, 1> _bias;
+};
+
+/**
+ * A chain of StaticDense layers, each feeding the next. The intermediate
+ * outputs live in aligned buffers on the stack, so a forward pass touches
+ * no heap memory. Allocate it with new: it holds every parameter inline.
+ */
+template <typename... Layers>
+class StaticMlp;
+
+template <typename Last>
+class StaticMlp<Last>
+{
+ public:
+  static constexpr int input_size = Last::input_size;
+  static constexpr int output_size = Last::output_size;
+
+  /**
+   * Copies the parameters of dynamic layers, one weights and bias pair per
+   * layer, in order.
+   */
+  void load (const Matrix weights[], const Matrix biases[])
+  { _layer.load(weights[0], biases[0]); }
+
+  void forward (const float *input, float *output) const
+  { _layer.forward(input, output); }
+
+  // Plain new only guarantees alignof(std::max_align_t).
+  static void *operator new (size_t size) {
+    void *memory = nullptr;
+    if (posix_memalign(&memory, STATIC_ALIGNMENT, size) != 0) {
+      throw std::bad_alloc();
+    }
+    return memory;
+  }
+
+  static void operator delete (void *memory)
+  { free(memory); }
+
+ private:
+  Last _layer;
+};
+
+template <typename First, typename Second, typename... Rest>
+class StaticMlp<First, Second, Rest...>
+{
+  typedef StaticMlp<Second, Rest...> rest_type;
+  static_assert (First::output_size == Second::input_size,
+                 "Consecutive layers must have matching sizes");
+
+ public:
+  static constexpr int input_size = First::input_size;
+  static constexpr int output_size = rest_type::output_size;
+
+  void load (const Matrix weights[], const Matrix biases[]) {
+    _layer.load(weights[0], biases[0]);
+    _rest.load(weights + 1, biases + 1);
+  }
+
+  void forward (const float *input, float *output) const {
+    alignas(STATIC_ALIGNMENT) float hidden[First::output_size];
+    _layer.forward(input, hidden);
+    _rest.forward(hidden, output);
+  }
+
+  static void *operator new (size_t size)
+  { return rest_type::operator new(size); }
+
+  static void operator delete (void *memory)
+  { rest_type::operator delete(memory); }
+
+ private:
+  First _layer;
+  rest_type _rest;
+};
+
+#endif //STATICMLP_H
@@ -0,0 +1,130 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cstdlib>
+
+#define THREADS_ENV_VAR "MLP_THREADS"
+
+namespace {
+
+int default_thread_count() {
+  const char *value = std::getenv(THREADS_ENV_VAR);
+  if (value != nullptr && std::atoi(value) > 0) {
+    return std::atoi(value);
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+}
+
+ThreadPool::ThreadPool(int threads) : _queued(0), _pending(0), _next_queue(0), _stop(false) {
+  if (threads <= 0) {
+    threads = default_thread_count();
+  }
+  for (int i = 0; i < threads; ++i) {
+    _queues.emplace_back(new worker_queue);
+  }
+  for (int i = 0; i < threads; ++i) {
+    _threads.emplace_back(&ThreadPool::run, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this] { return _pending == 0; });
+    _stop = true;
+  }
+  _wake.notify_all();
+  for (std::thread &thread : _threads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::submit(task work) {
+  unsigned int queue;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_pending;
+    queue = _next_queue++ % _queues.size();
+  }
+  {
+    std::lock_guard<std::mutex> lock(_queues[queue]->mutex);
+    _queues[queue]->tasks.push_back(std::move(work));
+  }
+  {
+    // Publishing under _mutex keeps a worker from missing the wake-up
+    // between checking _queued and going to sleep.
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_queued;
+  }
+  _wake.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _idle.wait(lock, [this] { return _pending == 0; });
+  if (_error) {
+    std::exception_ptr error = _error;
+    _error = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void ThreadPool::parallel_for(int count, int grain, const std::function<void(int, int, int)> &body) {
+  grain = std::max(1, grain);
+  for (int begin = 0; begin < count; begin += grain) {
+    const int end = std::min(count, begin + grain);
+    submit([&body, begin, end](int worker) { body(worker, begin, end); });
+  }
+  wait();
+}
+
+bool ThreadPool::take(int worker, task &work) {
+  const int workers = static_cast<int>(_queues.size());
+  for (int i = 0; i < workers; ++i) {
+    const int victim = (worker + i) % workers;
+    worker_queue &queue = *_queues[victim];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      continue;
+    }
+    // Own work is taken newest first, stolen work oldest first.
+    if (victim == worker) {
+      work = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      work = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    --_queued;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::run(int worker) {
+  while (true) {
+    task work;
+    if (!take(worker, work)) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _wake.wait(lock, [this] { return _stop || _queued > 0; });
+      if (_stop && _queued == 0) {
+        return;
+      }
+      continue;
+    }
+    std::exception_ptr error;
+    try {
+      work(worker);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (error && !_error) {
+      _error = error;
+    }
+    if (--_pending == 0) {
+      _idle.notify_all();
+    }
+  }
+}
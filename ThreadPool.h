@@ -0,0 +1,84 @@
+// ThreadPool.h
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads with one task deque each. Workers take
+ * tasks from the back of their own deque and, once it is empty, steal from
+ * the front of the others', so uneven tasks still keep every core busy.
+ * Tasks receive the index of the worker running them, which lets each
+ * worker keep its own scratch buffers.
+ */
+class ThreadPool
+{
+ public:
+  typedef std::function<void (int worker)> task;
+
+  /**
+   * Starts the workers.
+   * @param threads - Amount of workers; 0 uses the MLP_THREADS environment
+   * variable if set, or else one per hardware thread.
+   */
+  explicit ThreadPool (int threads = 0);
+  ThreadPool (const ThreadPool &) = delete;
+  ThreadPool &operator= (const ThreadPool &) = delete;
+  /**
+   * Waits for the queued tasks and stops the workers.
+   */
+  ~ThreadPool ();
+
+  int size () const
+  { return static_cast<int>(_threads.size ()); }
+
+  /**
+   * Queues a task on the next worker's deque, round-robin.
+   */
+  void submit (task work);
+
+  /**
+   * Blocks until every submitted task has finished.
+   * @throw The first exception thrown by a task since the last wait.
+   */
+  void wait ();
+
+  /**
+   * Calls body(worker, begin, end) over consecutive ranges of at most grain
+   * indices covering [0, count), then waits for all of them.
+   */
+  void parallel_for (int count, int grain,
+                     const std::function<void (int worker, int begin,
+                                               int end)> &body);
+
+ private:
+  typedef struct worker_queue
+  {
+      std::mutex mutex;
+      std::deque<task> tasks;
+  } worker_queue;
+
+  void run (int worker);
+  bool take (int worker, task &work);
+
+  std::vector<std::unique_ptr<worker_queue>> _queues;
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _idle;
+  std::atomic<int> _queued;
+  int _pending;
+  unsigned int _next_queue;
+  bool _stop;
+  std::exception_ptr _error;
+};
+
+#endif //THREADPOOL_H
@@ -0,0 +1,268 @@
+#include "Trainer.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+#define INVALID_PARAMETERS_MSG "Error: Invalid training parameters."
+#define INVALID_LABELS_MSG "Error: Labels do not match the images."
+// Below this many images a shard costs more to schedule than to run.
+#define MIN_SHARD_SIZE 8
+#define LOSS_BATCH 256
+#define MIN_PROBABILITY 1e-30f
+
+namespace {
+
+/**
+ * Writes the columns of images selected by indices as the columns of out.
+ */
+void gather_columns(const Matrix &images, const int *indices, int count, Matrix &out) {
+  const int rows = images.get_rows();
+  const int cols = images.get_cols();
+  out.resize(rows, count);
+  for (int r = 0; r < rows; ++r) {
+    const float *row = images.begin() + r * cols;
+    float *dst = out.begin() + r * count;
+    for (int j = 0; j < count; ++j) {
+      dst[j] = row[indices[j]];
+    }
+  }
+}
+
+/**
+ * @return The summed cross-entropy of the probability columns against
+ * the labels selected by indices.
+ */
+float cross_entropy(const Matrix &probabilities, const std::vector<unsigned int> &labels,
+                    const int *indices) {
+  const int cols = probabilities.get_cols();
+  float loss = 0.0f;
+  for (int j = 0; j < cols; ++j) {
+    loss -= std::log(std::max(MIN_PROBABILITY, probabilities(labels[indices[j]], j)));
+  }
+  return loss;
+}
+
+/**
+ * @throw std::invalid_argument unless labels holds a digit for each column
+ * of images; the labels then index output rows without checks.
+ */
+void check_labels(const Matrix &images, const std::vector<unsigned int> &labels) {
+  auto invalid = [](unsigned int label) { return label >= OUTPUT_VECTOR_SIZE; };
+  if (static_cast<int>(labels.size()) != images.get_cols()
+      || std::any_of(labels.begin(), labels.end(), invalid)) {
+    throw std::invalid_argument(INVALID_LABELS_MSG);
+  }
+}
+
+/**
+ * @throw std::invalid_argument unless count is positive and each of the count
+ * indices selects a column of images whose label is a digit.
+ */
+void check_batch(const Matrix &images, const std::vector<unsigned int> &labels, const int *indices, int count) {
+  if (count <= 0) {
+    throw std::invalid_argument(INVALID_PARAMETERS_MSG);
+  }
+  const int cols = std::min(images.get_cols(), static_cast<int>(labels.size()));
+  for (int i = 0; i < count; ++i) {
+    if (indices[i] < 0 || indices[i] >= cols || labels[indices[i]] >= OUTPUT_VECTOR_SIZE) {
+      throw std::invalid_argument(INVALID_LABELS_MSG);
+    }
+  }
+}
+
+Matrix zeros_like(const Matrix &m) {
+  return Matrix(m.get_rows(), m.get_cols());
+}
+
+}
+
+Trainer::Trainer(const Matrix weights[], const Matrix biases[], const training_params &params, int threads)
+    : _params(params), _steps(0), _pool(threads) {
+  if (params.batch_size <= 0) {
+    throw std::invalid_argument(INVALID_PARAMETERS_MSG);
+  }
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    if (weights[i].get_rows() != weights_dims[i].rows || weights[i].get_cols() != weights_dims[i].cols
+        || biases[i].get_rows() != bias_dims[i].rows || biases[i].get_cols() != bias_dims[i].cols) {
+      throw std::invalid_argument(INVALID_PARAMETERS_MSG);
+    }
+    _weights[i] = weights[i];
+    _biases[i] = biases[i];
+    _weights[i].transpose_into(_transposed_weights[i]);
+    _weight_moments[i] = zeros_like(_weights[i]);
+    _bias_moments[i] = zeros_like(_biases[i]);
+    if (params.method == ADAM) {
+      _weight_second_moments[i] = zeros_like(_weights[i]);
+      _bias_second_moments[i] = zeros_like(_biases[i]);
+    }
+    _layers[i] = Dense(Matrix::view(_weights[i].begin(), _weights[i].get_rows(), _weights[i].get_cols()),
+                       Matrix::view(_biases[i].begin(), _biases[i].get_rows(), _biases[i].get_cols()),
+                       i == MLP_SIZE - 1 ? activation::softmax : activation::relu);
+  }
+  _shards.resize(_pool.size());
+}
+
+void Trainer::initialize(Matrix weights[], Matrix biases[], std::mt19937 &gen) {
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    std::normal_distribution<float> dist(0.0f, std::sqrt(2.0f / weights_dims[i].cols));
+    weights[i] = Matrix(weights_dims[i].rows, weights_dims[i].cols);
+    for (float &value : weights[i]) {
+      value = dist(gen);
+    }
+    biases[i] = Matrix(bias_dims[i].rows, bias_dims[i].cols);
+  }
+}
+
+void Trainer::run_shard(shard_state &shard, const Matrix &images, const std::vector<unsigned int> &labels,
+                        const int *indices, int count, int batch) const {
+  gather_columns(images, indices, count, shard.input);
+  const Matrix *input = &shard.input;
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    _layers[i].forward(*input, shard.outputs[i]);
+    input = &shard.outputs[i];
+  }
+  shard.loss = cross_entropy(shard.outputs[FINAL_LAYER_INDEX], labels, indices);
+
+  // Softmax with cross-entropy: the error of the logits is p - onehot,
+  // averaged over the whole minibatch.
+  Matrix &delta = shard.deltas[FINAL_LAYER_INDEX];
+  delta.resize(OUTPUT_VECTOR_SIZE, count);
+  const float scale = 1.0f / batch;
+  for (int r = 0; r < OUTPUT_VECTOR_SIZE; ++r) {
+    const float *output = shard.outputs[FINAL_LAYER_INDEX].row(r);
+    float *row = delta.row(r);
+    for (int j = 0; j < count; ++j) {
+      row[j] = output[j] * scale;
+    }
+  }
+  for (int j = 0; j < count; ++j) {
+    delta(labels[indices[j]], j) -= scale;
+  }
+
+  for (int i = FINAL_LAYER_INDEX; i >= 0; --i) {
+    const Matrix &layer_input = i == 0 ? shard.input : shard.outputs[i - 1];
+    layer_input.transpose_into(shard.transposed);
+    shard.deltas[i].multiply_into(shard.transposed, shard.weight_grads[i]);
+    Matrix &bias_grad = shard.bias_grads[i];
+    bias_grad.resize(shard.deltas[i].get_rows(), 1);
+    for (int r = 0; r < shard.deltas[i].get_rows(); ++r) {
+      const float *row = shard.deltas[i].begin() + r * count;
+      bias_grad[r] = std::accumulate(row, row + count, 0.0f);
+    }
+    if (i == 0) {
+      break;
+    }
+    // The previous layer is relu: its error passes where its output is
+    // positive.
+    _transposed_weights[i].multiply_into(shard.deltas[i], shard.deltas[i - 1]);
+    float *prev = shard.deltas[i - 1].begin();
+    const float *output = layer_input.begin();
+    const int size = layer_input.get_rows() * count;
+    for (int k = 0; k < size; ++k) {
+      if (output[k] <= 0.0f) {
+        prev[k] = 0.0f;
+      }
+    }
+  }
+}
+
+float Trainer::train_batch(const Matrix &images, const std::vector<unsigned int> &labels, const int *indices,
+                           int count) {
+  check_batch(images, labels, indices, count);
+  const int shards = std::max(1, std::min(_pool.size(), count / MIN_SHARD_SIZE));
+  const int grain = (count + shards - 1) / shards;
+  _pool.parallel_for(count, grain, [&](int, int begin, int end) {
+    run_shard(_shards[begin / grain], images, labels, indices + begin, end - begin, count);
+  });
+
+  const int used = (count + grain - 1) / grain;
+  shard_state &total = _shards[0];
+  for (int s = 1; s < used; ++s) {
+    total.loss += _shards[s].loss;
+    for (int i = 0; i < MLP_SIZE; ++i) {
+      total.weight_grads[i] += _shards[s].weight_grads[i];
+      total.bias_grads[i] += _shards[s].bias_grads[i];
+    }
+  }
+  step();
+  return total.loss / count;
+}
+
+void Trainer::step() {
+  ++_steps;
+  const shard_state &grads = _shards[0];
+  const float lr = _params.learning_rate;
+  // Adam's bias corrections for moments that start at zero.
+  const float correction1 = 1.0f - std::pow(_params.beta1, static_cast<float>(_steps));
+  const float correction2 = 1.0f - std::pow(_params.beta2, static_cast<float>(_steps));
+  auto update = [&](Matrix &param, const Matrix &grad, Matrix &moment, Matrix &second_moment) {
+    float *p = param.begin();
+    const float *g = grad.begin();
+    float *m = moment.begin();
+    const int size = param.get_rows() * param.get_cols();
+    if (_params.method == SGD_MOMENTUM) {
+      for (int k = 0; k < size; ++k) {
+        m[k] = _params.momentum * m[k] - lr * g[k];
+        p[k] += m[k];
+      }
+      return;
+    }
+    float *v = second_moment.begin();
+    for (int k = 0; k < size; ++k) {
+      m[k] = _params.beta1 * m[k] + (1.0f - _params.beta1) * g[k];
+      v[k] = _params.beta2 * v[k] + (1.0f - _params.beta2) * g[k] * g[k];
+      p[k] -= lr * (m[k] / correction1) / (std::sqrt(v[k] / correction2) + _params.epsilon);
+    }
+  };
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    update(_weights[i], grads.weight_grads[i], _weight_moments[i], _weight_second_moments[i]);
+    update(_biases[i], grads.bias_grads[i], _bias_moments[i], _bias_second_moments[i]);
+    _weights[i].transpose_into(_transposed_weights[i]);
+  }
+}
+
+float Trainer::train_epoch(const Matrix &images, const std::vector<unsigned int> &labels, std::mt19937 &gen) {
+  check_labels(images, labels);
+  const int count = images.get_cols();
+  std::vector<int> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), gen);
+  double loss = 0.0;
+  for (int begin = 0; begin < count; begin += _params.batch_size) {
+    const int size = std::min(_params.batch_size, count - begin);
+    loss += static_cast<double>(train_batch(images, labels, order.data() + begin, size)) * size;
+  }
+  return static_cast<float>(loss / count);
+}
+
+float Trainer::loss(const Matrix &images, const std::vector<unsigned int> &labels) const {
+  check_labels(images, labels);
+  const int count = images.get_cols();
+  std::vector<int> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::vector<double> losses(_pool.size(), 0.0);
+  std::vector<Matrix> inputs(_pool.size());
+  std::vector<mlp_workspace> workspaces(_pool.size());
+  for (mlp_workspace &workspace : workspaces) {
+    workspace.layer_outputs.resize(MLP_SIZE);
+  }
+  _pool.parallel_for(count, LOSS_BATCH, [&](int worker, int begin, int end) {
+    gather_columns(images, order.data() + begin, end - begin, inputs[worker]);
+    const Matrix *input = &inputs[worker];
+    for (int i = 0; i < MLP_SIZE; ++i) {
+      _layers[i].forward(*input, workspaces[worker].layer_outputs[i]);
+      input = &workspaces[worker].layer_outputs[i];
+    }
+    losses[worker] += cross_entropy(*input, labels, order.data() + begin);
+  });
+  return static_cast<float>(std::accumulate(losses.begin(), losses.end(), 0.0) / count);
+}
+
+MlpNetwork Trainer::network() const {
+  std::vector<Dense> layers;
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    layers.emplace_back(_weights[i], _biases[i], i == MLP_SIZE - 1 ? activation::softmax : activation::relu);
+  }
+  return MlpNetwork(layers);
+}
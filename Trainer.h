@@ -0,0 +1,158 @@
+// Trainer.h
+#ifndef TRAINER_H
+#define TRAINER_H
+
+#include "MlpNetwork.h"
+#include "ThreadPool.h"
+#include <random>
+#include <vector>
+
+/**
+ * @enum optimizer
+ * @brief The parameter update rule.
+ */
+enum optimizer
+{
+    SGD_MOMENTUM, ADAM
+};
+
+/**
+ * @struct training_params
+ * @brief Optimizer settings. momentum is used by SGD_MOMENTUM, beta1,
+ *        beta2 and epsilon by ADAM.
+ */
+typedef struct training_params
+{
+    optimizer method;
+    float learning_rate;
+    float momentum;
+    float beta1;
+    float beta2;
+    float epsilon;
+    int batch_size;
+} training_params;
+
+const training_params sgd_params = {SGD_MOMENTUM, 0.01f, 0.9f, 0.9f, 0.999f, 1e-8f, 64};
+const training_params adam_params = {ADAM, 0.001f, 0.9f, 0.9f, 0.999f, 1e-8f, 64};
+
+/**
+ * Trains the weights and biases of an MlpNetwork by minibatch gradient
+ * descent on the softmax cross-entropy loss. Each minibatch is split into
+ * shards that run on the workers of a ThreadPool: a shard's forward pass
+ * keeps every layer's output, and its backward pass computes the shard's
+ * gradients with the same GEMM kernel as inference. The shards' gradients
+ * are then summed and the optimizer updates the parameters.
+ */
+class Trainer
+{
+ public:
+  /**
+   * @param weights - MLP_SIZE weight matrices of the shapes in
+   * weights_dims, copied as the starting point.
+   * @param biases - MLP_SIZE biases of the shapes in bias_dims.
+   * @param threads - Amount of workers, see ThreadPool.
+   * @throw std::invalid_argument if a parameter has the wrong shape or
+   * params.batch_size is not positive.
+   */
+  Trainer (const Matrix weights[], const Matrix biases[],
+           const training_params &params, int threads = 0);
+  Trainer (const Trainer &) = delete;
+  Trainer &operator= (const Trainer &) = delete;
+
+  /**
+   * Fills weights with He-initialized random values, suited to relu
+   * layers, and biases with zeros, in the shapes of weights_dims and
+   * bias_dims.
+   */
+  static void initialize (Matrix weights[], Matrix biases[],
+                          std::mt19937 &gen);
+
+  /**
+   * Runs one optimizer step on the images selected by indices.
+   * @param images - Vectorized images as columns, see
+   * MlpNetwork::predict_batch.
+   * @param labels - The digit of each column of images.
+   * @param indices - count column indices into images.
+   * @return The mean loss of the selected images before the step.
+   * @throw std::invalid_argument if count is not positive, or an index does
+   * not select a column of images with a digit label.
+   */
+  float train_batch (const Matrix &images,
+                     const std::vector<unsigned int> &labels,
+                     const int *indices, int count);
+
+  /**
+   * Runs train_batch over every image once, in an order shuffled with gen,
+   * in minibatches of params.batch_size.
+   * @return The mean loss over the epoch.
+   * @throw std::invalid_argument if labels does not hold a digit for each
+   * column of images.
+   */
+  float train_epoch (const Matrix &images,
+                     const std::vector<unsigned int> &labels,
+                     std::mt19937 &gen);
+
+  /**
+   * @return The mean loss of the network on images, without training.
+   * @throw std::invalid_argument as train_epoch does.
+   */
+  float loss (const Matrix &images,
+              const std::vector<unsigned int> &labels) const;
+
+  /**
+   * @return The current MLP_SIZE weight matrices.
+   */
+  const Matrix *get_weights () const
+  { return _weights; }
+
+  /**
+   * @return The current MLP_SIZE biases.
+   */
+  const Matrix *get_biases () const
+  { return _biases; }
+
+  /**
+   * @return A network with a copy of the current parameters.
+   */
+  MlpNetwork network () const;
+
+ private:
+  /**
+   * @struct shard_state
+   * @brief One shard's inputs, cached layer outputs, error terms and
+   *        gradients, reused from batch to batch.
+   */
+  typedef struct shard_state
+  {
+      Matrix input;
+      Matrix outputs[MLP_SIZE];
+      Matrix deltas[MLP_SIZE];
+      Matrix transposed;
+      Matrix weight_grads[MLP_SIZE];
+      Matrix bias_grads[MLP_SIZE];
+      float loss;
+  } shard_state;
+
+  void run_shard (shard_state &shard, const Matrix &images,
+                  const std::vector<unsigned int> &labels,
+                  const int *indices, int count, int batch) const;
+  void step ();
+
+  training_params _params;
+  Matrix _weights[MLP_SIZE];
+  Matrix _biases[MLP_SIZE];
+  // Transposes of _weights, to propagate the error terms backwards.
+  Matrix _transposed_weights[MLP_SIZE];
+  // Optimizer state: velocities for SGD_MOMENTUM, first and second moment
+  // estimates for ADAM.
+  Matrix _weight_moments[MLP_SIZE];
+  Matrix _bias_moments[MLP_SIZE];
+  Matrix _weight_second_moments[MLP_SIZE];
+  Matrix _bias_second_moments[MLP_SIZE];
+  long _steps;
+  Dense _layers[MLP_SIZE];
+  mutable ThreadPool _pool;
+  std::vector<shard_state> _shards;
+};
+
+#endif //TRAINER_H
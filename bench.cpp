@@ -0,0 +1,536 @@
+#include "Matrix.h"
+#include "Activation.h"
+#include "Dataset.h"
+#include "Dense.h"
+#include "HalfPrecision.h"
+#include "Sparse.h"
+#include "MlpNetwork.h"
+#include "Simd.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#define USAGE_ERR "Usage: bench [seconds per benchmark]"
+#define DEFAULT_SECONDS 0.2
+#define MIN_SAMPLES 20
+#define MIN_SAMPLE_NS 10000
+#define MAX_BATCH 1024
+#define MATMUL_BATCH 64
+#define SEED 42
+#define TOP_K 3
+#define DATASET_PATH "./bench_dataset"
+#define SPARSITIES {0.5f, 0.7f, 0.9f}
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+/**
+ * @struct bench_result
+ * @brief One benchmark's latencies, per call of the measured operation.
+ *        items_per_call counts images for inference and is 0 otherwise;
+ *        flops_per_call is 0 where flops are not meaningful.
+ */
+typedef struct bench_result
+{
+    std::string name;
+    std::string shape;
+    long calls;
+    double p50_ns;
+    double p99_ns;
+    double items_per_call;
+    double flops_per_call;
+} bench_result;
+
+// Written by every benchmark so the measured work cannot be optimized away.
+volatile float sink;
+
+Matrix random_matrix(int rows, int cols, float scale, std::mt19937 &gen) {
+  std::uniform_real_distribution<float> dist(-scale, scale);
+  Matrix m(rows, cols);
+  for (float &value : m) {
+    value = dist(gen);
+  }
+  return m;
+}
+
+std::string shape_of(int rows, int cols) {
+  return std::to_string(rows) + "x" + std::to_string(cols);
+}
+
+/**
+ * Times op until seconds have passed and at least MIN_SAMPLES samples were
+ * taken. Each sample runs op enough times to last MIN_SAMPLE_NS, so fast
+ * operations are not dominated by the clock's resolution.
+ */
+template <typename Op>
+bench_result measure(const std::string &name, const std::string &shape, double seconds, Op op) {
+  op();
+  long reps = 1;
+  while (true) {
+    const bench_clock::time_point start = bench_clock::now();
+    for (long i = 0; i < reps; ++i) {
+      op();
+    }
+    if (bench_clock::now() - start >= std::chrono::nanoseconds(MIN_SAMPLE_NS)) {
+      break;
+    }
+    reps *= 2;
+  }
+
+  std::vector<double> samples;
+  const bench_clock::time_point end = bench_clock::now() + std::chrono::duration_cast<bench_clock::duration>(
+      std::chrono::duration<double>(seconds));
+  while (samples.size() < MIN_SAMPLES || bench_clock::now() < end) {
+    const bench_clock::time_point start = bench_clock::now();
+    for (long i = 0; i < reps; ++i) {
+      op();
+    }
+    const std::chrono::duration<double, std::nano> elapsed = bench_clock::now() - start;
+    samples.push_back(elapsed.count() / reps);
+  }
+  std::sort(samples.begin(), samples.end());
+  bench_result result = {};
+  result.name = name;
+  result.shape = shape;
+  result.calls = static_cast<long>(samples.size()) * reps;
+  result.p50_ns = samples[samples.size() / 2];
+  result.p99_ns = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+  return result;
+}
+
+void print_result(const bench_result &result, bool last) {
+  const double seconds = result.p50_ns * 1e-9;
+  std::cout << "    {\"name\": \"" << result.name << "\", \"shape\": \"" << result.shape << "\", \"calls\": "
+            << result.calls << ", \"p50_us\": " << result.p50_ns * 1e-3
+            << ", \"p99_us\": " << result.p99_ns * 1e-3;
+  if (result.items_per_call > 0) {
+    std::cout << ", \"images_per_sec\": " << result.items_per_call / seconds;
+  }
+  if (result.flops_per_call > 0) {
+    std::cout << ", \"gflops\": " << result.flops_per_call / seconds * 1e-9;
+  }
+  std::cout << "}" << (last ? "" : ",") << "\n";
+}
+
+/**
+ * Matrix::operator* for every layer's weights, against a single vectorized
+ * image and a batch of MATMUL_BATCH columns.
+ */
+void bench_matmul(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    const Matrix weights = random_matrix(weights_dims[i].rows, weights_dims[i].cols, 0.1f, gen);
+    for (int batch : {1, MATMUL_BATCH}) {
+      const Matrix input = random_matrix(weights_dims[i].cols, batch, 1.0f, gen);
+      bench_result result = measure("matmul", shape_of(weights_dims[i].rows, weights_dims[i].cols) + "*"
+                                    + shape_of(weights_dims[i].cols, batch), seconds, [&]() {
+        const Matrix product = weights * input;
+        sink = product[0];
+      });
+      result.flops_per_call = 2.0 * weights_dims[i].rows * weights_dims[i].cols * batch;
+      results.push_back(result);
+    }
+  }
+}
+
+/**
+ * A matrix product written as a plain i-k-j element loop over the second
+ * layer's weights and MATMUL_BATCH columns, reading the elements through
+ * the checked Matrix::at, through the unchecked operator () and through
+ * row pointers. The checked loop's branches keep its inner loop scalar.
+ */
+void bench_accessors(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  const int rows = weights_dims[1].rows;
+  const int depth = weights_dims[1].cols;
+  const Matrix weights = random_matrix(rows, depth, 0.1f, gen);
+  const Matrix input = random_matrix(depth, MATMUL_BATCH, 1.0f, gen);
+  Matrix product(rows, MATMUL_BATCH);
+  const std::string shape = shape_of(rows, depth) + "*" + shape_of(depth, MATMUL_BATCH);
+  const double flops = 2.0 * rows * depth * MATMUL_BATCH;
+  bench_result result = measure("matmul_loop_at", shape, seconds, [&]() {
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < MATMUL_BATCH; ++j) {
+        product.at(i, j) = 0.0f;
+      }
+      for (int k = 0; k < depth; ++k) {
+        for (int j = 0; j < MATMUL_BATCH; ++j) {
+          product.at(i, j) += weights.at(i, k) * input.at(k, j);
+        }
+      }
+    }
+    sink = product[0];
+  });
+  result.flops_per_call = flops;
+  results.push_back(result);
+  result = measure("matmul_loop_operator", shape, seconds, [&]() {
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < MATMUL_BATCH; ++j) {
+        product(i, j) = 0.0f;
+      }
+      for (int k = 0; k < depth; ++k) {
+        for (int j = 0; j < MATMUL_BATCH; ++j) {
+          product(i, j) += weights(i, k) * input(k, j);
+        }
+      }
+    }
+    sink = product[0];
+  });
+  result.flops_per_call = flops;
+  results.push_back(result);
+  result = measure("matmul_loop_row", shape, seconds, [&]() {
+    for (int i = 0; i < rows; ++i) {
+      float *out = product.row(i);
+      std::fill(out, out + MATMUL_BATCH, 0.0f);
+      for (int k = 0; k < depth; ++k) {
+        const float w = weights(i, k);
+        const float *in = input.row(k);
+        for (int j = 0; j < MATMUL_BATCH; ++j) {
+          out[j] += w * in[j];
+        }
+      }
+    }
+    sink = product[0];
+  });
+  result.flops_per_call = flops;
+  results.push_back(result);
+}
+
+/**
+ * The first layer with its weights pruned to each of SPARSITIES, for one
+ * image and MATMUL_BATCH images: through the dense GEMM, as CSR, and
+ * pruned by blocks as BLOCKED.
+ */
+void bench_sparse(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  const matrix_dims dims = weights_dims[0];
+  const Matrix bias = random_matrix(dims.rows, 1, 0.1f, gen);
+  for (float sparsity : SPARSITIES) {
+    Matrix pruned = random_matrix(dims.rows, dims.cols, 0.1f, gen);
+    Matrix blockPruned = pruned;
+    SparseMatrix::prune(pruned, sparsity, false);
+    SparseMatrix::prune(blockPruned, sparsity, true);
+    const Dense layers[] = {
+        Dense(pruned, bias, activation::relu),
+        Dense(SparseMatrix::from_dense(pruned, SparseMatrix::CSR), bias, activation::relu),
+        Dense(SparseMatrix::from_dense(blockPruned, SparseMatrix::BLOCKED), bias, activation::relu)};
+    const char *names[] = {"sparse_dense", "sparse_csr", "sparse_blocked"};
+    for (int batch : {1, MATMUL_BATCH}) {
+      const Matrix input = random_matrix(dims.cols, batch, 1.0f, gen);
+      Matrix output;
+      for (int l = 0; l < 3; ++l) {
+        const std::string shape = shape_of(dims.rows, dims.cols) + "*" + shape_of(dims.cols, batch) + "@"
+                                  + std::to_string(static_cast<int>(sparsity * 100)) + "%";
+        bench_result result = measure(names[l], shape, seconds, [&]() {
+          layers[l].forward(input, output);
+          sink = output[0];
+        });
+        result.flops_per_call = 2.0 * dims.rows * dims.cols * batch;
+        results.push_back(result);
+      }
+    }
+  }
+}
+
+/**
+ * The first layer with FP32, FP16 and BF16 weights, for one image and
+ * MATMUL_BATCH images.
+ */
+void bench_half(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  const matrix_dims dims = weights_dims[0];
+  const Matrix weights = random_matrix(dims.rows, dims.cols, 0.1f, gen);
+  const Matrix bias = random_matrix(dims.rows, 1, 0.1f, gen);
+  const Dense layers[] = {Dense(weights, bias, activation::relu),
+                          Dense(HalfMatrix::convert(weights, half::FP16), bias, activation::relu),
+                          Dense(HalfMatrix::convert(weights, half::BF16), bias, activation::relu)};
+  const char *names[] = {"half_fp32", "half_fp16", "half_bf16"};
+  for (int batch : {1, MATMUL_BATCH}) {
+    const Matrix input = random_matrix(dims.cols, batch, 1.0f, gen);
+    Matrix output;
+    for (int l = 0; l < 3; ++l) {
+      const std::string shape = shape_of(dims.rows, dims.cols) + "*" + shape_of(dims.cols, batch);
+      bench_result result = measure(names[l], shape, seconds, [&]() {
+        layers[l].forward(input, output);
+        sink = output[0];
+      });
+      result.flops_per_call = 2.0 * dims.rows * dims.cols * batch;
+      results.push_back(result);
+    }
+  }
+}
+
+/**
+ * Matrix::transpose of every layer's weights and of an image batch, in
+ * place, into a reused matrix, and by following cycles.
+ */
+void bench_transpose(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  std::vector<matrix_dims> shapes(weights_dims, weights_dims + MLP_SIZE);
+  shapes.push_back({img_dims.rows * img_dims.cols, MAX_BATCH});
+  shapes.push_back({weights_dims[0].rows, weights_dims[0].rows});
+  for (const matrix_dims &dims : shapes) {
+    Matrix weights = random_matrix(dims.rows, dims.cols, 0.1f, gen);
+    Matrix transposed;
+    const std::string shape = shape_of(dims.rows, dims.cols);
+    results.push_back(measure("transpose", shape, seconds, [&]() {
+      sink = weights.transpose()[1];
+    }));
+    results.push_back(measure("transpose_into", shape, seconds, [&]() {
+      weights.transpose_into(transposed);
+      sink = transposed[1];
+    }));
+    results.push_back(measure("transpose_in_place", shape, seconds, [&]() {
+      sink = weights.transpose_in_place()[1];
+    }));
+  }
+}
+
+/**
+ * The activations on the outputs of the first and last layers, for a
+ * single image and a full batch.
+ */
+void bench_activations(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  for (int batch : {1, MAX_BATCH}) {
+    const Matrix hidden = random_matrix(weights_dims[0].rows, batch, 10.0f, gen);
+    const Matrix logits = random_matrix(OUTPUT_VECTOR_SIZE, batch, 10.0f, gen);
+    Matrix output;
+    std::vector<unsigned int> labels(batch);
+    std::vector<float> probabilities(batch);
+    const activation::exp_mode mode = activation::get_exp_mode();
+    const std::string hiddenShape = shape_of(hidden.get_rows(), batch);
+    const std::string logitsShape = shape_of(logits.get_rows(), batch);
+    results.push_back(measure("relu", hiddenShape, seconds, [&]() {
+      sink = activation::relu(hidden)[0];
+    }));
+    results.push_back(measure("relu_in_place", hiddenShape, seconds, [&]() {
+      output = hidden;
+      activation::relu_in_place(output);
+      sink = output[0];
+    }));
+    results.push_back(measure("softmax_columns", logitsShape, seconds, [&]() {
+      sink = activation::softmax_columns(logits)[0];
+    }));
+    results.push_back(measure("softmax_columns_in_place", logitsShape, seconds, [&]() {
+      output = logits;
+      activation::softmax_columns_in_place(output);
+      sink = output[0];
+    }));
+    results.push_back(measure("softmax_columns_fast_exp", logitsShape, seconds, [&]() {
+      output = logits;
+      activation::set_exp_mode(activation::FAST_EXP);
+      activation::softmax_columns_in_place(output);
+      activation::set_exp_mode(mode);
+      sink = output[0];
+    }));
+    results.push_back(measure("softmax_columns_argmax", logitsShape, seconds, [&]() {
+      activation::softmax_columns_argmax(logits, labels.data(), probabilities.data());
+      sink = probabilities[0];
+    }));
+  }
+}
+
+/**
+ * Lazy expressions (see MatrixExpr.h) evaluated into a reused matrix: a
+ * compound elementwise expression over a batch of hidden outputs, run as
+ * one loop, and the first layer on one image plus its bias, run by the
+ * fused GEMM kernel.
+ */
+void bench_expressions(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  const Matrix hidden = random_matrix(weights_dims[0].rows, MAX_BATCH, 1.0f, gen);
+  const Matrix residual = random_matrix(weights_dims[0].rows, MAX_BATCH, 1.0f, gen);
+  Matrix output;
+  results.push_back(measure("expression_fused", shape_of(weights_dims[0].rows, MAX_BATCH), seconds, [&]() {
+    output = hidden + residual * 0.5f + hidden.dot(residual);
+    sink = output[0];
+  }));
+  const Matrix weights = random_matrix(weights_dims[0].rows, weights_dims[0].cols, 0.1f, gen);
+  const Matrix image = random_matrix(weights_dims[0].cols, 1, 1.0f, gen);
+  const Matrix bias = random_matrix(bias_dims[0].rows, bias_dims[0].cols, 0.1f, gen);
+  const std::string shape = shape_of(weights_dims[0].rows, weights_dims[0].cols);
+  bench_result result = measure("gemm_bias", shape, seconds, [&]() {
+    output = weights * image + bias;
+    sink = output[0];
+  });
+  result.flops_per_call = 2.0 * weights_dims[0].rows * weights_dims[0].cols;
+  results.push_back(result);
+}
+
+/**
+ * A layer written with value-returning operators, whose temporaries are
+ * allocated and freed on every call, with each MatrixAllocator. The arena
+ * is reset after every call, as a server would after every request.
+ */
+void bench_allocators(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  const Matrix weights = random_matrix(weights_dims[1].rows, weights_dims[1].cols, 0.1f, gen);
+  const Matrix input = random_matrix(weights_dims[1].cols, 1, 1.0f, gen);
+  const Matrix residual = random_matrix(weights_dims[1].rows, 1, 1.0f, gen);
+  const std::string shape = shape_of(weights_dims[1].rows, 1);
+  auto layer = [&]() {
+    sink = (activation::relu(weights * input) * 0.5f + residual).norm();
+  };
+  results.push_back(measure("temporaries_heap", shape, seconds, layer));
+  ArenaAllocator arena;
+  results.push_back(measure("temporaries_arena", shape, seconds, [&]() {
+    {
+      AllocatorScope scope(arena);
+      layer();
+    }
+    arena.reset();
+  }));
+  PoolAllocator pool;
+  results.push_back(measure("temporaries_pool", shape, seconds, [&]() {
+    AllocatorScope scope(pool);
+    layer();
+  }));
+}
+
+/**
+ * Dataset::read_batch of MAX_BATCH images from an IDX file, converting
+ * bytes to floats, and from a flat float file.
+ */
+void bench_dataset(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  const int imageSize = img_dims.rows * img_dims.cols;
+  const std::string shape = shape_of(imageSize, MAX_BATCH);
+  std::uniform_int_distribution<int> dist(0, 255);
+  std::vector<unsigned char> pixels(static_cast<size_t>(imageSize) * MAX_BATCH);
+  for (unsigned char &pixel : pixels) {
+    pixel = static_cast<unsigned char>(dist(gen));
+  }
+  const unsigned char header[] = {0, 0, 8, 3, 0, 0, MAX_BATCH >> 8, MAX_BATCH & 0xff,
+                                  0, 0, 0, static_cast<unsigned char>(img_dims.rows),
+                                  0, 0, 0, static_cast<unsigned char>(img_dims.cols)};
+  Matrix batch;
+  {
+    std::ofstream os(DATASET_PATH, std::ios::binary | std::ios::trunc);
+    os.write(reinterpret_cast<const char *>(header), sizeof(header));
+    os.write(reinterpret_cast<const char *>(pixels.data()), static_cast<std::streamsize>(pixels.size()));
+  }
+  {
+    const Dataset dataset(DATASET_PATH, imageSize);
+    bench_result result = measure("dataset_idx", shape, seconds, [&]() {
+      dataset.read_batch(0, MAX_BATCH, batch);
+      sink = batch[1];
+    });
+    result.items_per_call = MAX_BATCH;
+    results.push_back(result);
+  }
+  {
+    const Matrix images = random_matrix(MAX_BATCH, imageSize, 1.0f, gen);
+    std::ofstream os(DATASET_PATH, std::ios::binary | std::ios::trunc);
+    os.write(reinterpret_cast<const char *>(images.begin()),
+             static_cast<std::streamsize>(images.get_rows() * images.get_cols() * sizeof(float)));
+  }
+  {
+    const Dataset dataset(DATASET_PATH, imageSize);
+    bench_result result = measure("dataset_flat", shape, seconds, [&]() {
+      dataset.read_batch(0, MAX_BATCH, batch);
+      sink = batch[1];
+    });
+    result.items_per_call = MAX_BATCH;
+    results.push_back(result);
+  }
+  std::remove(DATASET_PATH);
+}
+
+/**
+ * Full inference with synthetic weights: MlpNetwork::operator() for one
+ * image, predict_batch for powers of two up to MAX_BATCH, the top-k and
+ * full probability outputs for one image and MAX_BATCH images, and the
+ * STATIC engine for one image and MATMUL_BATCH images.
+ */
+void bench_inference(double seconds, std::mt19937 &gen, std::vector<bench_result> &results) {
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  double flops = 0;
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    weights[i] = random_matrix(weights_dims[i].rows, weights_dims[i].cols, 0.1f, gen);
+    biases[i] = random_matrix(bias_dims[i].rows, bias_dims[i].cols, 0.1f, gen);
+    flops += 2.0 * weights_dims[i].rows * weights_dims[i].cols;
+  }
+  const MlpNetwork mlp(weights, biases);
+  const int imageSize = img_dims.rows * img_dims.cols;
+  mlp_workspace workspace;
+  MlpNetwork staticMlp(weights, biases);
+  staticMlp.set_engine(MlpNetwork::STATIC);
+  std::vector<digit> top(TOP_K * MAX_BATCH);
+  std::vector<float> probabilities(OUTPUT_VECTOR_SIZE * MAX_BATCH);
+  for (int batch = 1; batch <= MAX_BATCH; batch *= 2) {
+    const Matrix images = random_matrix(imageSize, batch, 1.0f, gen);
+    bench_result result;
+    if (batch == 1) {
+      result = measure("mlp", shape_of(imageSize, batch), seconds, [&]() {
+        sink = mlp(images, workspace).probability;
+      });
+    } else {
+      result = measure("mlp_predict_batch", shape_of(imageSize, batch), seconds, [&]() {
+        sink = mlp.predict_batch(images, workspace)[0].probability;
+      });
+    }
+    result.items_per_call = batch;
+    result.flops_per_call = flops * batch;
+    results.push_back(result);
+    if (batch == 1 || batch == MAX_BATCH) {
+      result = measure("mlp_top_k", shape_of(imageSize, batch), seconds, [&]() {
+        mlp.predict_top_k(images, TOP_K, top.data(), workspace);
+        sink = top[0].probability;
+      });
+      result.items_per_call = batch;
+      result.flops_per_call = flops * batch;
+      results.push_back(result);
+      result = measure("mlp_probabilities", shape_of(imageSize, batch), seconds, [&]() {
+        mlp.predict_probabilities(images, probabilities.data(), workspace);
+        sink = probabilities[0];
+      });
+      result.items_per_call = batch;
+      result.flops_per_call = flops * batch;
+      results.push_back(result);
+    }
+    // The compile-time specialized engine, one image at a time.
+    if (batch == 1 || batch == MATMUL_BATCH) {
+      result = measure("mlp_static", shape_of(imageSize, batch), seconds, [&]() {
+        sink = staticMlp.predict_batch(images, workspace)[0].probability;
+      });
+      result.items_per_call = batch;
+      result.flops_per_call = flops * batch;
+      results.push_back(result);
+    }
+  }
+}
+
+}
+
+/**
+ * Runs every benchmark and prints the results as JSON to stdout.
+ * @param argc count of args
+ * @param argv args values: optionally the seconds to spend on each benchmark
+ * @return program exit status code
+ */
+int main(int argc, char **argv) {
+  double seconds = DEFAULT_SECONDS;
+  if (argc > 2 || (argc == 2 && (seconds = std::atof(argv[1])) <= 0)) {
+    std::cerr << USAGE_ERR << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::mt19937 gen(SEED);
+  std::vector<bench_result> results;
+  bench_matmul(seconds, gen, results);
+  bench_accessors(seconds, gen, results);
+  bench_sparse(seconds, gen, results);
+  bench_half(seconds, gen, results);
+  bench_transpose(seconds, gen, results);
+  bench_activations(seconds, gen, results);
+  bench_expressions(seconds, gen, results);
+  bench_allocators(seconds, gen, results);
+  bench_dataset(seconds, gen, results);
+  bench_inference(seconds, gen, results);
+
+  std::cout << "{\n  \"simd\": \"" << simd::kernels().name << "\",\n  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    print_result(results[i], i + 1 == results.size());
+  }
+  std::cout << "  ]\n}" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+#include "Dataset.h"
+#include "InferenceServer.h"
+#include "MlpNetwork.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define USAGE_ERR "Usage: client <socket> <IDX or flat float images>" \
+                  " [connections] [requests per connection] [requests in flight per connection]"
+#define MIN_ARGS 3
+#define MAX_ARGS 6
+#define SOCKET_IDX 1
+#define IMAGES_IDX 2
+#define CONNECTIONS_IDX 3
+#define REQUESTS_IDX 4
+#define IN_FLIGHT_IDX 5
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_REQUESTS 1000
+#define DEFAULT_IN_FLIGHT 1
+// Requests cycle through at most this many images of the dataset, loaded
+// up front so that reading them is not measured.
+#define MAX_IMAGES 1024
+
+namespace {
+
+typedef std::chrono::steady_clock client_clock;
+
+/**
+ * Sends requests images over one connection, keeping in_flight of them
+ * sent ahead of their replies, and adds each request's time from sending
+ * to its reply to latencies_us.
+ */
+void run_connection(const std::string &path, const std::vector<float> &images, int image_count, long requests,
+                    int in_flight, std::vector<double> &latencies_us) {
+  const int image_size = static_cast<int>(images.size()) / image_count;
+  InferenceClient client(path);
+  std::vector<client_clock::time_point> sent(requests);
+  long next = 0;
+  for (long i = 0; i < requests; ++i) {
+    for (; next < requests && next < i + in_flight; ++next) {
+      sent[next] = client_clock::now();
+      client.send(images.data() + (next % image_count) * image_size, image_size);
+    }
+    client.receive();
+    latencies_us.push_back(std::chrono::duration<double, std::micro>(client_clock::now() - sent[i]).count());
+  }
+}
+
+}
+
+/**
+ * Load-tests a server started by the serve mode of Main: every connection
+ * sends its requests from its own thread and the client prints the
+ * requests per second and the p50 and p99 latency over all of them as
+ * JSON.
+ */
+int main(int argc, char **argv) {
+  const int connections = argc > CONNECTIONS_IDX ? std::atoi(argv[CONNECTIONS_IDX]) : DEFAULT_CONNECTIONS;
+  const long requests = argc > REQUESTS_IDX ? std::atol(argv[REQUESTS_IDX]) : DEFAULT_REQUESTS;
+  const int inFlight = argc > IN_FLIGHT_IDX ? std::atoi(argv[IN_FLIGHT_IDX]) : DEFAULT_IN_FLIGHT;
+  if (argc < MIN_ARGS || argc > MAX_ARGS || connections <= 0 || requests <= 0 || inFlight <= 0) {
+    std::cerr << USAGE_ERR << std::endl;
+    return EXIT_FAILURE;
+  }
+  try {
+    const Dataset dataset(argv[IMAGES_IDX], img_dims.rows * img_dims.cols);
+    const int imageCount = std::min(dataset.get_count(), MAX_IMAGES);
+    Matrix batch;
+    dataset.read_batch(0, imageCount, batch);
+    // Columns are images; requests need them one after the other.
+    batch.transpose();
+    const std::vector<float> images(batch.begin(), batch.end());
+
+    std::vector<std::vector<double>> latencies(connections);
+    std::vector<std::exception_ptr> errors(connections);
+    std::vector<std::thread> threads;
+    const client_clock::time_point start = client_clock::now();
+    for (int c = 0; c < connections; ++c) {
+      threads.emplace_back([&, c] {
+        try {
+          run_connection(argv[SOCKET_IDX], images, imageCount, requests, inFlight, latencies[c]);
+        } catch (...) {
+          errors[c] = std::current_exception();
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(client_clock::now() - start).count();
+    for (const std::exception_ptr &error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+
+    std::vector<double> all;
+    for (const std::vector<double> &part : latencies) {
+      all.insert(all.end(), part.begin(), part.end());
+    }
+    std::sort(all.begin(), all.end());
+    std::cout << "{\"connections\": " << connections << ", \"in_flight\": " << inFlight
+              << ", \"requests\": " << all.size() << ", \"seconds\": " << seconds
+              << ", \"qps\": " << all.size() / seconds << ", \"p50_us\": " << all[all.size() / 2]
+              << ", \"p99_us\": " << all[std::min(all.size() - 1, all.size() * 99 / 100)] << "}" << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
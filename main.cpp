@@ -2,9 +2,34 @@
 #include "Activation.h"
 #include "Dense.h"
 #include "MlpNetwork.h"
+#include "PackedModel.h"
+#include "ThreadPool.h"
+#include "RecordReader.h"
+#include "Trainer.h"
+#include "ModelDescriptor.h"
+#include "Dataset.h"
+#include "Evaluation.h"
+#include "Sparse.h"
+#include "Profiler.h"
+#include "InferenceServer.h"
+#include "Simd.h"
+#include <memory>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <csignal>
+#include <ctime>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #define QUIT "q"
 #define INSERT_IMAGE_PATH "Please insert image path:"
@@ -12,10 +37,102 @@
 #define ERROR_INVALID_INPUT "Error: Failed to retrieve input. Exiting.."
 #define ERROR_INVALID_IMG "Error: Invalid image path or size: "
 
-#define USAGE_ERR "Usage: mlp_network <weights> <biases>"
+#define ERROR_INVALID_DIR "Error: Cannot read directory: "
+#define ERROR_INVALID_MODEL "Error: Model input does not match the image size: "
+
+#define USAGE_ERR "Usage: mlp_network <weights> <biases>\n" \
+                  "       mlp_network <packed model or descriptor>\n" \
+                  "       mlp_network pack <packed model> <weights> <biases>\n" \
+                  "       mlp_network pack <packed model> <descriptor>\n" \
+                  "       mlp_network classify <packed model or descriptor> <image or directory>...\n" \
+                  "       mlp_network stream <packed model or descriptor> [binary] < images > predictions\n" \
+                  "       mlp_network dataset <packed model or descriptor> <IDX or flat float images>\n" \
+                  "       mlp_network serve <packed model or descriptor> <socket>" \
+                  " [max batch] [max wait us]\n" \
+                  "       mlp_network evaluate <packed model or descriptor> <images> <IDX labels>" \
+                  " [static] [int8|fp16|bf16] [fast-exp] [min accuracy]\n" \
+                  "       mlp_network quantize[-static] <packed model> <labels> <weights> <biases>\n" \
+                  "       mlp_network prune[-blocks] <packed model> <sparsity> <weights> <biases>\n" \
+                  "       mlp_network half <fp16|bf16> <packed model> <labels> <weights> <biases>\n" \
+                  "       mlp_network train <sgd|adam> <labels> <epochs> <weights> <biases>"
 #define ARGS_COUNT (1 + MLP_SIZE * 2)
+#define PACKED_ARGS_COUNT 2
+#define PACK_MODE "pack"
+#define PACK_ARGS_COUNT (ARGS_COUNT + 2)
+#define PACK_DESCRIPTOR_ARGS_COUNT 4
+#define PACK_DESCRIPTOR_IDX 3
+#define PACK_OUTPUT_IDX 2
+#define PACK_PARAMS_IDX 3
+#define CLASSIFY_MODE "classify"
+#define CLASSIFY_MIN_ARGS 4
+#define CLASSIFY_MODEL_IDX 2
+#define CLASSIFY_INPUTS_IDX 3
+#define CLASSIFY_BATCH 64
+#define STREAM_MODE "stream"
+#define STREAM_BINARY "binary"
+#define STREAM_MODEL_IDX 2
+#define STREAM_FORMAT_IDX 3
+#define STREAM_BATCH 64
+#define DATASET_MODE "dataset"
+#define DATASET_ARGS_COUNT 4
+#define DATASET_MODEL_IDX 2
+#define DATASET_PATH_IDX 3
+#define DATASET_BATCH 256
+#define SERVE_MODE "serve"
+#define SERVE_MIN_ARGS 4
+#define SERVE_MAX_ARGS 6
+#define SERVE_MODEL_IDX 2
+#define SERVE_SOCKET_IDX 3
+#define SERVE_BATCH_IDX 4
+#define SERVE_WAIT_IDX 5
+#define SERVE_REPORT_SECONDS 10
+#define EVALUATE_MODE "evaluate"
+#define EVALUATE_MIN_ARGS 5
+#define EVALUATE_MODEL_IDX 2
+#define EVALUATE_IMAGES_IDX 3
+#define EVALUATE_LABELS_IDX 4
+#define EVALUATE_OPTIONS_IDX 5
+#define EVALUATE_STATIC "static"
+#define EVALUATE_INT8 "int8"
+#define EVALUATE_FAST_EXP "fast-exp"
+#define FP16_OPTION "fp16"
+#define BF16_OPTION "bf16"
+#define ERROR_INVALID_OPTION "Error: Invalid evaluate option: "
+#define ERROR_BELOW_ACCURACY "Error: Accuracy is below the required "
+#define QUANTIZE_MODE "quantize"
+#define QUANTIZE_STATIC_MODE "quantize-static"
+#define QUANTIZE_ARGS_COUNT (ARGS_COUNT + 3)
+#define QUANTIZE_OUTPUT_IDX 2
+#define QUANTIZE_LABELS_IDX 3
+#define QUANTIZE_PARAMS_IDX 4
+#define CALIBRATION_SIZE 128
+#define PRUNE_MODE "prune"
+#define PRUNE_BLOCKS_MODE "prune-blocks"
+#define PRUNE_ARGS_COUNT (ARGS_COUNT + 3)
+#define PRUNE_OUTPUT_IDX 2
+#define PRUNE_SPARSITY_IDX 3
+#define PRUNE_PARAMS_IDX 4
+#define ERROR_INVALID_SPARSITY "Error: Invalid sparsity: "
+#define HALF_MODE "half"
+#define HALF_ARGS_COUNT (ARGS_COUNT + 4)
+#define HALF_FORMAT_IDX 2
+#define HALF_OUTPUT_IDX 3
+#define HALF_LABELS_IDX 4
+#define HALF_PARAMS_IDX 5
+#define ERROR_INVALID_FORMAT "Error: Invalid half precision format: "
+#define ERROR_INVALID_LABELS "Error: Invalid labels file: "
+#define TRAIN_MODE "train"
+#define TRAIN_SGD "sgd"
+#define TRAIN_ADAM "adam"
+#define TRAIN_ARGS_COUNT (ARGS_COUNT + 4)
+#define TRAIN_OPTIMIZER_IDX 2
+#define TRAIN_LABELS_IDX 3
+#define TRAIN_EPOCHS_IDX 4
+#define TRAIN_PARAMS_IDX 5
+#define TRAIN_SEED 1
+#define ERROR_INVALID_TRAINING "Error: Invalid optimizer or epochs: "
+#define ERROR_WRITE_PARAMETER "Error: Cannot write parameters file: "
 #define WEIGHTS_START_IDX 1
-#define BIAS_START_IDX (WEIGHTS_START_IDX + MLP_SIZE)
 
 /**
  * Prints program usage to stdout and checks the number of arguments.
@@ -56,21 +173,38 @@ bool readFileToMatrix(const std::string &filePath, Matrix &mat) {
   return is.good();
 }
 
+/**
+ * Writes a matrix to a binary file in the format readFileToMatrix reads.
+ * @param filePath - path of the binary file to write
+ * @param mat - matrix to write.
+ * @throw std::runtime_error if the file cannot be written
+ */
+void writeMatrixToFile(const std::string &filePath, const Matrix &mat) {
+  std::ofstream os(filePath, std::ios::out | std::ios::binary | std::ios::trunc);
+  os.write(reinterpret_cast<const char *>(mat.begin()),
+           static_cast<std::streamsize>(mat.get_rows() * mat.get_cols() * sizeof(float)));
+  if (!os.good()) {
+    throw std::runtime_error(ERROR_WRITE_PARAMETER + filePath);
+  }
+}
+
 /**
  * Loads MLP parameters from weights & biases paths into arrays.
  * Throws an exception upon failure.
- * @param paths array of program arguments, expected to be MLP parameters paths.
+ * @param argv program arguments.
+ * @param first index of the first weights path in argv: the paths of every
+ * layer's weights come first, then those of its biases.
  * @param weights array of matrices, weights[i] is the i-th layer weights matrix.
  * @param biases array of matrices, biases[i] is the i-th layer bias matrix (which is a vector).
  * @throw std::invalid_argument in case of problem with a certain argument
  */
-void loadParameters(char *paths[], Matrix weights[], Matrix biases[]) {
+void loadParameters(char *argv[], int first, Matrix weights[], Matrix biases[]) {
   for (int i = 0; i < MLP_SIZE; ++i) {
     weights[i] = Matrix(weights_dims[i].rows, weights_dims[i].cols);
     biases[i] = Matrix(bias_dims[i].rows, bias_dims[i].cols);
 
-    std::string weightsPath(paths[WEIGHTS_START_IDX + i]);
-    std::string biasPath(paths[BIAS_START_IDX + i]);
+    std::string weightsPath(argv[first + i]);
+    std::string biasPath(argv[first + MLP_SIZE + i]);
 
     if (!readFileToMatrix(weightsPath, weights[i]) || !readFileToMatrix(biasPath, biases[i])) {
       throw std::invalid_argument(ERROR_INVALID_PARAMETER + std::to_string(i + 1));
@@ -78,6 +212,31 @@ void loadParameters(char *paths[], Matrix weights[], Matrix biases[]) {
   }
 }
 
+/**
+ * Loads a network from a packed model or, for any other file, a model
+ * descriptor, and checks that it takes images.
+ * @param path the packed model or descriptor.
+ * @param packed receives the packed model, which must outlive the network.
+ * @throw std::invalid_argument if the model is invalid or does not take
+ * img_dims images; std::runtime_error if a packed model cannot be loaded
+ */
+MlpNetwork loadModel(const std::string &path, std::unique_ptr<PackedModel> &packed) {
+  std::vector<Dense> layers;
+  if (PackedModel::is_packed_model(path)) {
+    packed.reset(new PackedModel(path));
+    layers = packed->layers();
+  } else {
+    layers = ModelDescriptor::read(path).load();
+  }
+  MlpNetwork mlp(layers);
+  if (mlp.get_input_size() != img_dims.rows * img_dims.cols) {
+    throw std::invalid_argument(ERROR_INVALID_MODEL + path);
+  }
+  // Pruned weights run as sparse products when that is faster.
+  mlp.sparsify();
+  return mlp;
+}
+
 /**
  * Command line interface for the MLP network.
  * Loops on: {Retrieve user input, Feed input to MLP network, Print image & network prediction}
@@ -108,18 +267,605 @@ void mlpCli(MlpNetwork &mlp) {
 }
 
 /**
- * Program's main entry point.
+ * Expands classify arguments into image paths. Files are kept as given and
+ * directories are replaced by the regular files in them, in name order.
+ * @param args paths of images or directories.
+ * @param count number of paths in args.
+ * @throw std::invalid_argument if a directory cannot be read
+ */
+std::vector<std::string> listImages(char *args[], int count) {
+  std::vector<std::string> paths;
+  for (int i = 0; i < count; ++i) {
+    std::string path(args[i]);
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+      paths.push_back(path);
+      continue;
+    }
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+      throw std::invalid_argument(ERROR_INVALID_DIR + path);
+    }
+    std::vector<std::string> files;
+    for (dirent *entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+      std::string file = path + "/" + entry->d_name;
+      if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        files.push_back(file);
+      }
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    paths.insert(paths.end(), files.begin(), files.end());
+  }
+  return paths;
+}
+
+/**
+ * Lays out images stored back to back, one vectorized image after the
+ * other, as the columns of batch.
+ * @param records count images of img_dims.rows * img_dims.cols floats.
+ * @param count number of images.
+ * @param batch resized to (img_dims.rows * img_dims.cols) X count.
+ */
+void recordsToColumns(const float *records, int count, Matrix &batch) {
+  const int imageSize = img_dims.rows * img_dims.cols;
+  batch.resize(imageSize, count);
+  for (int r = 0; r < imageSize; ++r) {
+    for (int j = 0; j < count; ++j) {
+      batch[r * count + j] = records[j * imageSize + r];
+    }
+  }
+}
+
+/**
+ * Classifies images on every core and prints "<path> <digit> <probability>"
+ * for each, in input order. Workers take batches of CLASSIFY_BATCH images,
+ * each worker with its own buffers, and share the read-only network.
+ * @param mlp MlpNetwork to use for prediction.
+ * @param paths image paths.
+ * @return false if some image could not be read, true otherwise.
+ */
+bool classifyImages(const MlpNetwork &mlp, const std::vector<std::string> &paths) {
+  const int count = static_cast<int>(paths.size());
+  const int imageSize = img_dims.rows * img_dims.cols;
+  std::vector<digit> results(count);
+  std::vector<char> valid(count, 0);
+
+  ThreadPool pool;
+  std::vector<Matrix> images(pool.size(), Matrix(imageSize, 1));
+  std::vector<Matrix> staged(pool.size(), Matrix(CLASSIFY_BATCH, imageSize));
+  std::vector<Matrix> batches(pool.size(), Matrix(imageSize, CLASSIFY_BATCH));
+  std::vector<mlp_workspace> workspaces(pool.size());
+  pool.parallel_for(count, CLASSIFY_BATCH, [&](int worker, int begin, int end) {
+    Matrix &image = images[worker];
+    Matrix &batch = batches[worker];
+    // Valid images are staged one per row, then laid out as batch columns.
+    int indices[CLASSIFY_BATCH];
+    int batchSize = 0;
+    for (int i = begin; i < end; ++i) {
+      if (readFileToMatrix(paths[i], image)) {
+        valid[i] = 1;
+        std::copy(image.begin(), image.end(), staged[worker].begin() + batchSize * imageSize);
+        indices[batchSize++] = i;
+      }
+    }
+    if (batchSize == 0) {
+      return;
+    }
+    recordsToColumns(staged[worker].begin(), batchSize, batch);
+    std::vector<digit> digits = mlp.predict_batch(batch, workspaces[worker]);
+    for (int j = 0; j < batchSize; ++j) {
+      results[indices[j]] = digits[j];
+    }
+  });
+
+  bool allValid = true;
+  for (int i = 0; i < count; ++i) {
+    if (valid[i]) {
+      std::cout << paths[i] << " " << results[i].value << " " << results[i].probability << "\n";
+    } else {
+      std::cerr << ERROR_INVALID_IMG << paths[i] << std::endl;
+      allValid = false;
+    }
+  }
+  std::cout.flush();
+  return allValid;
+}
+
+/**
+ * @struct stream_result
+ * @brief A prediction as written by the binary stream format.
+ */
+typedef struct stream_result
+{
+    uint32_t value;
+    float probability;
+} stream_result;
+
+/**
+ * Classifies raw images streamed on stdin, each img_dims.rows *
+ * img_dims.cols native floats with no framing, and writes one prediction
+ * per image to stdout, in order: a "value,probability" line, or a
+ * stream_result record when binary is set. Images are read on a background
+ * thread while the previous batch is classified, and the output is flushed
+ * after every batch.
+ * @param mlp MlpNetwork to use for prediction.
+ * @param binary whether to write stream_result records instead of text.
+ * @throw std::runtime_error if stdin cannot be read or ends inside an image
+ */
+void streamImages(const MlpNetwork &mlp, bool binary) {
+  const int imageSize = img_dims.rows * img_dims.cols;
+  RecordReader reader(STDIN_FILENO, imageSize * sizeof(float), STREAM_BATCH);
+  Matrix batch(imageSize, STREAM_BATCH);
+  mlp_workspace workspace;
+  std::vector<stream_result> results(STREAM_BATCH);
+  int count;
+  for (const char *records = reader.next(count); count > 0; records = reader.next(count)) {
+    recordsToColumns(reinterpret_cast<const float *>(records), count, batch);
+    std::vector<digit> digits = mlp.predict_batch(batch, workspace);
+    if (binary) {
+      for (int j = 0; j < count; ++j) {
+        results[j] = {digits[j].value, digits[j].probability};
+      }
+      std::cout.write(reinterpret_cast<const char *>(results.data()), count * sizeof(stream_result));
+    } else {
+      for (const digit &d : digits) {
+        std::cout << d.value << "," << d.probability << "\n";
+      }
+    }
+    std::cout.flush();
+  }
+}
+
+/**
+ * Classifies every image of a dataset (see Dataset) on every core and
+ * prints "<index> <digit> <probability>" for each, in order. Workers read
+ * batches of DATASET_BATCH images straight from the mapped file into their
+ * own buffers and share the read-only network.
+ * @param mlp MlpNetwork to use for prediction.
+ * @param path the IDX or flat float dataset.
+ * @throw std::runtime_error if the dataset cannot be read
+ */
+void classifyDataset(const MlpNetwork &mlp, const std::string &path) {
+  const Dataset dataset(path, img_dims.rows * img_dims.cols);
+  const int count = dataset.get_count();
+  std::vector<digit> results(count);
+
+  ThreadPool pool;
+  std::vector<Matrix> batches(pool.size());
+  std::vector<mlp_workspace> workspaces(pool.size());
+  pool.parallel_for(count, DATASET_BATCH, [&](int worker, int begin, int end) {
+    dataset.read_batch(begin, end - begin, batches[worker]);
+    std::vector<digit> digits = mlp.predict_batch(batches[worker], workspaces[worker]);
+    std::copy(digits.begin(), digits.end(), results.begin() + begin);
+  });
+
+  for (int i = 0; i < count; ++i) {
+    std::cout << i << " " << results[i].value << " " << results[i].probability << "\n";
+  }
+  std::cout.flush();
+}
+
+/**
+ * Prints one line of server stats (see InferenceServer::take_stats).
+ */
+void printServerStats(const server_stats &stats) {
+  std::cout << "requests: " << stats.requests << " batches: " << stats.batches << " mean batch: "
+            << stats.mean_batch << " qps: " << stats.qps << " p50 us: " << stats.p50_us << " p99 us: "
+            << stats.p99_us << std::endl;
+}
+
+/**
+ * Serves a model on a Unix socket (see InferenceServer) until SIGINT or
+ * SIGTERM. Prints the stats of every SERVE_REPORT_SECONDS in which
+ * requests were answered, and of the last period when it stops.
+ * @throw std::invalid_argument if the model, socket path, max batch or
+ * max wait is invalid; std::runtime_error if the socket cannot be created
+ */
+void serveModel(char *argv[], int argc) {
+  server_options options = default_server_options;
+  if (argc > SERVE_BATCH_IDX) {
+    options.max_batch = std::atoi(argv[SERVE_BATCH_IDX]);
+  }
+  if (argc > SERVE_WAIT_IDX) {
+    options.max_wait_us = std::atol(argv[SERVE_WAIT_IDX]);
+  }
+  std::unique_ptr<PackedModel> model;
+  MlpNetwork mlp = loadModel(argv[SERVE_MODEL_IDX], model);
+  // Blocked before the server starts its threads, which inherit the mask,
+  // so that the signals only reach sigtimedwait below.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  InferenceServer server(mlp, argv[SERVE_SOCKET_IDX], options);
+  std::cout << "serving: " << argv[SERVE_SOCKET_IDX] << " max batch: " << options.max_batch
+            << " max wait us: " << options.max_wait_us << std::endl;
+  const timespec report = {SERVE_REPORT_SECONDS, 0};
+  while (sigtimedwait(&signals, nullptr, &report) < 0) {
+    const server_stats stats = server.take_stats();
+    if (stats.requests > 0) {
+      printServerStats(stats);
+    }
+  }
+  server.stop();
+  printServerStats(server.take_stats());
+}
+
+/**
+ * @return The name evaluate and the converters print for a weight format.
+ */
+const char *formatName(Dense::weight_format format) {
+  switch (format) {
+    case Dense::INT8:
+      return "int8";
+    case Dense::SPARSE:
+      return "sparse";
+    case Dense::FP16:
+      return "fp16";
+    case Dense::BF16:
+      return "bf16";
+    default:
+      return "float";
+  }
+}
+
+/**
+ * Evaluates a network on a dataset (see Dataset) labeled by an IDX label
+ * file on every core, and prints the configuration, the evaluation (see
+ * Evaluation) and the throughput. Options after the labels select the
+ * STATIC engine, INT8, FP16 or BF16 weights (see MlpNetwork::quantize and
+ * MlpNetwork::to_half) or FAST_EXP, and
+ * a number is the accuracy the network must reach, which makes the mode
+ * usable as a release gate.
+ * @param argv program arguments.
+ * @param argc count of program arguments.
+ * @return false if the accuracy is below the required one, true otherwise.
+ * @throw std::invalid_argument if an option is invalid; std::runtime_error
+ * if the images or labels cannot be read
+ */
+bool evaluateModel(char *argv[], int argc) {
+  std::unique_ptr<PackedModel> model;
+  MlpNetwork mlp = loadModel(argv[EVALUATE_MODEL_IDX], model);
+  float required = 0.0f;
+  for (int i = EVALUATE_OPTIONS_IDX; i < argc; ++i) {
+    const std::string option(argv[i]);
+    char *end;
+    if (option == EVALUATE_STATIC) {
+      mlp.set_engine(MlpNetwork::STATIC);
+    } else if (option == EVALUATE_INT8) {
+      mlp.quantize();
+    } else if (option == FP16_OPTION || option == BF16_OPTION) {
+      mlp.to_half(option == FP16_OPTION ? half::FP16 : half::BF16);
+    } else if (option == EVALUATE_FAST_EXP) {
+      activation::set_exp_mode(activation::FAST_EXP);
+    } else if ((required = std::strtof(argv[i], &end)), end == argv[i] || *end != '\0'
+               || required < 0.0f || required > 1.0f) {
+      throw std::invalid_argument(ERROR_INVALID_OPTION + option);
+    }
+  }
+  const Dataset images(argv[EVALUATE_IMAGES_IDX], img_dims.rows * img_dims.cols);
+  const std::vector<unsigned int> labels = Dataset::read_idx_labels(argv[EVALUATE_LABELS_IDX]);
+
+  ThreadPool pool;
+  const auto start = std::chrono::steady_clock::now();
+  const Evaluation evaluation = Evaluation::run(mlp, images, labels, pool);
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << "engine: " << (mlp.get_engine() == MlpNetwork::STATIC ? "static" : "dynamic") << "\n";
+  std::cout << "weights:";
+  for (const Dense &layer : mlp.get_layers()) {
+    const Dense::weight_format format = layer.get_format();
+    std::cout << " " << formatName(format);
+  }
+  std::cout << "\n";
+  std::cout << "exp: " << (activation::get_exp_mode() == activation::FAST_EXP ? "fast" : "precise") << "\n";
+  std::cout << "simd: " << simd::kernels().name << "\n";
+  std::cout << "threads: " << pool.size() << "\n";
+  std::cout << evaluation;
+  std::cout << "seconds: " << seconds << "\n";
+  std::cout << "images per second: " << evaluation.get_count() / seconds << std::endl;
+  if (evaluation.accuracy() < required) {
+    std::cerr << ERROR_BELOW_ACCURACY << required << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Reads a labeled set: one "<image path> <digit>" pair per line.
+ * @param path the labels file.
+ * @param images receives the images as columns.
+ * @param labels receives the digits, in column order.
+ * @throw std::invalid_argument if the file or one of its images is invalid
+ */
+void loadLabeledSet(const std::string &path, Matrix &images, std::vector<unsigned int> &labels) {
+  std::ifstream is(path);
+  if (!is.is_open()) {
+    throw std::invalid_argument(ERROR_INVALID_LABELS + path);
+  }
+  const int imageSize = img_dims.rows * img_dims.cols;
+  std::vector<std::string> paths;
+  std::string imgPath;
+  unsigned int label;
+  while (is >> imgPath >> label) {
+    if (label >= OUTPUT_VECTOR_SIZE) {
+      throw std::invalid_argument(ERROR_INVALID_LABELS + path);
+    }
+    paths.push_back(imgPath);
+    labels.push_back(label);
+  }
+  if (!is.eof() || paths.empty()) {
+    throw std::invalid_argument(ERROR_INVALID_LABELS + path);
+  }
+  const int count = static_cast<int>(paths.size());
+  Matrix image(imageSize, 1);
+  images.resize(imageSize, count);
+  for (int j = 0; j < count; ++j) {
+    if (!readFileToMatrix(paths[j], image)) {
+      throw std::invalid_argument(ERROR_INVALID_IMG + paths[j]);
+    }
+    for (int r = 0; r < imageSize; ++r) {
+      images[r * count + j] = image[r];
+    }
+  }
+}
+
+/**
+ * Prints the accuracy of a float network and of its converted copy on a
+ * labeled set, their delta, how often the two agree and the largest gap
+ * between their probabilities where they agree.
+ * @param images the labeled images as columns.
+ * @param labels their digits, in column order.
+ */
+void compareModels(const MlpNetwork &floatMlp, const MlpNetwork &converted, const Matrix &images,
+                   const std::vector<unsigned int> &labels) {
+  const std::string name = formatName(converted.get_layers().front().get_format());
+  std::vector<digit> floatDigits = floatMlp.predict_batch(images);
+  std::vector<digit> convertedDigits = converted.predict_batch(images);
+  int floatCorrect = 0;
+  int convertedCorrect = 0;
+  int agree = 0;
+  float probabilityDelta = 0.0f;
+  for (size_t i = 0; i < labels.size(); ++i) {
+    floatCorrect += floatDigits[i].value == labels[i];
+    convertedCorrect += convertedDigits[i].value == labels[i];
+    agree += floatDigits[i].value == convertedDigits[i].value;
+    if (floatDigits[i].value == convertedDigits[i].value) {
+      probabilityDelta = std::max(probabilityDelta,
+                                  std::fabs(floatDigits[i].probability - convertedDigits[i].probability));
+    }
+  }
+  const float count = static_cast<float>(labels.size());
+  std::cout << "images: " << labels.size() << std::endl;
+  std::cout << "float accuracy: " << floatCorrect / count << std::endl;
+  std::cout << name << " accuracy: " << convertedCorrect / count << std::endl;
+  std::cout << "accuracy delta: " << (convertedCorrect - floatCorrect) / count << std::endl;
+  std::cout << "agreement: " << agree / count << std::endl;
+  std::cout << "max probability delta: " << probabilityDelta << std::endl;
+}
+
+/**
+ * Converts float parameters to an INT8 packed model and prints the
+ * accuracy report of compareModels.
+ * @param argv program arguments.
+ * @param calibrate whether to fix each layer's input quantization from the
+ * first CALIBRATION_SIZE labeled images instead of computing it per image.
+ */
+void quantizeModel(char *argv[], bool calibrate) {
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  loadParameters(argv, QUANTIZE_PARAMS_IDX, weights, biases);
+  Matrix images;
+  std::vector<unsigned int> labels;
+  loadLabeledSet(argv[QUANTIZE_LABELS_IDX], images, labels);
+
+  MlpNetwork floatMlp(weights, biases);
+  MlpNetwork int8Mlp(weights, biases);
+  if (calibrate) {
+    const int size = std::min(CALIBRATION_SIZE, images.get_cols());
+    Matrix calibration(images.get_rows(), size);
+    for (int r = 0; r < images.get_rows(); ++r) {
+      std::copy(images.begin() + r * images.get_cols(), images.begin() + r * images.get_cols() + size,
+                calibration.begin() + r * size);
+    }
+    int8Mlp.quantize(&calibration);
+  } else {
+    int8Mlp.quantize();
+  }
+
+  compareModels(floatMlp, int8Mlp, images, labels);
+  PackedModel::write(argv[QUANTIZE_OUTPUT_IDX], int8Mlp.get_layers());
+}
+
+/**
+ * Converts float parameters to an FP16 or BF16 packed model, printing how
+ * far the weights moved and the accuracy report of quantizeModel.
+ * @param argv program arguments.
+ * @throw std::invalid_argument if the format is invalid
+ */
+void halfModel(char *argv[]) {
+  const std::string name(argv[HALF_FORMAT_IDX]);
+  if (name != FP16_OPTION && name != BF16_OPTION) {
+    throw std::invalid_argument(ERROR_INVALID_FORMAT + name);
+  }
+  const half::format format = name == FP16_OPTION ? half::FP16 : half::BF16;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  loadParameters(argv, HALF_PARAMS_IDX, weights, biases);
+  Matrix images;
+  std::vector<unsigned int> labels;
+  loadLabeledSet(argv[HALF_LABELS_IDX], images, labels);
+
+  MlpNetwork floatMlp(weights, biases);
+  MlpNetwork halfMlp(weights, biases);
+  halfMlp.to_half(format);
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    const Matrix rounded = halfMlp.get_layers()[i].get_half_weights().to_float();
+    float error = 0.0f;
+    for (int j = 0; j < weights[i].get_rows() * weights[i].get_cols(); ++j) {
+      error = std::max(error, std::fabs(rounded[j] - weights[i][j]));
+    }
+    std::cout << "layer " << i + 1 << " max weight error: " << error << std::endl;
+  }
+  compareModels(floatMlp, halfMlp, images, labels);
+  PackedModel::write(argv[HALF_OUTPUT_IDX], halfMlp.get_layers());
+}
+
+/**
+ * Prunes float parameters by magnitude (see SparseMatrix::prune) to the
+ * given sparsity, layer by layer, prints each layer's density and how it
+ * will run (see Dense::sparsify), and writes them as a packed model.
+ * @param argv program arguments.
+ * @param blocks whether to prune whole SPARSE_BLOCK wide blocks, which suits
+ * the BLOCKED layout, instead of single weights.
+ * @throw std::invalid_argument if the sparsity is invalid
+ */
+void pruneModel(char *argv[], bool blocks) {
+  char *end;
+  const float sparsity = std::strtof(argv[PRUNE_SPARSITY_IDX], &end);
+  if (end == argv[PRUNE_SPARSITY_IDX] || *end != '\0') {
+    throw std::invalid_argument(ERROR_INVALID_SPARSITY + std::string(argv[PRUNE_SPARSITY_IDX]));
+  }
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  loadParameters(argv, PRUNE_PARAMS_IDX, weights, biases);
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    SparseMatrix::prune(weights[i], sparsity, blocks);
+  }
+  MlpNetwork mlp(weights, biases);
+  mlp.sparsify();
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    const Dense &layer = mlp.get_layers()[i];
+    std::cout << "layer " << i + 1 << ": density " << SparseMatrix::density(weights[i]) << ", ";
+    if (layer.get_format() != Dense::SPARSE) {
+      std::cout << "dense" << std::endl;
+      continue;
+    }
+    const SparseMatrix &sparse = layer.get_sparse_weights();
+    std::cout << (sparse.get_layout() == SparseMatrix::BLOCKED ? "blocked" : "csr") << ", " << sparse.stored()
+              << " stored weights" << std::endl;
+  }
+  PackedModel::write(argv[PRUNE_OUTPUT_IDX], mlp.get_layers());
+}
+
+/**
+ * Trains a network from He-initialized weights on a labeled set, printing
+ * the loss and accuracy after each epoch, and writes the weights and
+ * biases to the usual parameter files.
+ * @param argv program arguments.
+ * @throw std::invalid_argument if the optimizer or epochs are invalid
+ */
+void trainModel(char *argv[]) {
+  const std::string method(argv[TRAIN_OPTIMIZER_IDX]);
+  const int epochs = std::atoi(argv[TRAIN_EPOCHS_IDX]);
+  if ((method != TRAIN_SGD && method != TRAIN_ADAM) || epochs <= 0) {
+    throw std::invalid_argument(ERROR_INVALID_TRAINING + method + " " + argv[TRAIN_EPOCHS_IDX]);
+  }
+  Matrix images;
+  std::vector<unsigned int> labels;
+  loadLabeledSet(argv[TRAIN_LABELS_IDX], images, labels);
+
+  std::mt19937 gen(TRAIN_SEED);
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  Trainer::initialize(weights, biases, gen);
+  Trainer trainer(weights, biases, method == TRAIN_SGD ? sgd_params : adam_params);
+  for (int epoch = 1; epoch <= epochs; ++epoch) {
+    const float loss = trainer.train_epoch(images, labels, gen);
+    std::vector<digit> digits = trainer.network().predict_batch(images);
+    int correct = 0;
+    for (size_t i = 0; i < labels.size(); ++i) {
+      correct += digits[i].value == labels[i];
+    }
+    std::cout << "epoch " << epoch << " loss: " << loss
+              << " accuracy: " << correct / static_cast<float>(labels.size()) << std::endl;
+  }
+
+  for (int i = 0; i < MLP_SIZE; ++i) {
+    writeMatrixToFile(argv[TRAIN_PARAMS_IDX + i], trainer.get_weights()[i]);
+    writeMatrixToFile(argv[TRAIN_PARAMS_IDX + MLP_SIZE + i], trainer.get_biases()[i]);
+  }
+}
+
+/**
+ * Runs the mode the arguments select.
  * @param argc count of args
  * @param argv args values
  * @return program exit status code
  */
-int main(int argc, char **argv) {
+int runMode(int argc, char **argv) {
   try {
+    if (argc == PACK_DESCRIPTOR_ARGS_COUNT && std::string(argv[1]) == PACK_MODE) {
+      PackedModel::write(argv[PACK_OUTPUT_IDX], ModelDescriptor::read(argv[PACK_DESCRIPTOR_IDX]).load());
+      return EXIT_SUCCESS;
+    }
+    if (argc == PACK_ARGS_COUNT && std::string(argv[1]) == PACK_MODE) {
+      Matrix weights[MLP_SIZE];
+      Matrix biases[MLP_SIZE];
+      loadParameters(argv, PACK_PARAMS_IDX, weights, biases);
+      PackedModel::write(argv[PACK_OUTPUT_IDX], weights, biases, MLP_SIZE);
+      return EXIT_SUCCESS;
+    }
+    if (argc == QUANTIZE_ARGS_COUNT
+        && (std::string(argv[1]) == QUANTIZE_MODE || std::string(argv[1]) == QUANTIZE_STATIC_MODE)) {
+      quantizeModel(argv, std::string(argv[1]) == QUANTIZE_STATIC_MODE);
+      return EXIT_SUCCESS;
+    }
+    if (argc == PRUNE_ARGS_COUNT
+        && (std::string(argv[1]) == PRUNE_MODE || std::string(argv[1]) == PRUNE_BLOCKS_MODE)) {
+      pruneModel(argv, std::string(argv[1]) == PRUNE_BLOCKS_MODE);
+      return EXIT_SUCCESS;
+    }
+    if (argc == HALF_ARGS_COUNT && std::string(argv[1]) == HALF_MODE) {
+      halfModel(argv);
+      return EXIT_SUCCESS;
+    }
+    if (argc == TRAIN_ARGS_COUNT && std::string(argv[1]) == TRAIN_MODE) {
+      trainModel(argv);
+      return EXIT_SUCCESS;
+    }
+    if (argc >= CLASSIFY_MIN_ARGS && std::string(argv[1]) == CLASSIFY_MODE) {
+      std::unique_ptr<PackedModel> model;
+      MlpNetwork mlp = loadModel(argv[CLASSIFY_MODEL_IDX], model);
+      std::vector<std::string> paths = listImages(argv + CLASSIFY_INPUTS_IDX, argc - CLASSIFY_INPUTS_IDX);
+      return classifyImages(mlp, paths) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    const bool streamFormatValid =
+        argc == STREAM_FORMAT_IDX
+        || (argc == STREAM_FORMAT_IDX + 1 && std::string(argv[STREAM_FORMAT_IDX]) == STREAM_BINARY);
+    if (streamFormatValid && std::string(argv[1]) == STREAM_MODE) {
+      std::unique_ptr<PackedModel> model;
+      MlpNetwork mlp = loadModel(argv[STREAM_MODEL_IDX], model);
+      streamImages(mlp, argc > STREAM_FORMAT_IDX);
+      return EXIT_SUCCESS;
+    }
+    if (argc == DATASET_ARGS_COUNT && std::string(argv[1]) == DATASET_MODE) {
+      std::unique_ptr<PackedModel> model;
+      MlpNetwork mlp = loadModel(argv[DATASET_MODEL_IDX], model);
+      classifyDataset(mlp, argv[DATASET_PATH_IDX]);
+      return EXIT_SUCCESS;
+    }
+    if (argc >= SERVE_MIN_ARGS && argc <= SERVE_MAX_ARGS && std::string(argv[1]) == SERVE_MODE) {
+      serveModel(argv, argc);
+      return EXIT_SUCCESS;
+    }
+    if (argc >= EVALUATE_MIN_ARGS && std::string(argv[1]) == EVALUATE_MODE) {
+      return evaluateModel(argv, argc) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc == PACKED_ARGS_COUNT) {
+      std::unique_ptr<PackedModel> model;
+      MlpNetwork mlp = loadModel(argv[1], model);
+      mlpCli(mlp);
+      return EXIT_SUCCESS;
+    }
     checkUsage(argc);
     Matrix weights[MLP_SIZE];
     Matrix biases[MLP_SIZE];
-    loadParameters(argv, weights, biases);
+    loadParameters(argv, WEIGHTS_START_IDX, weights, biases);
     MlpNetwork mlp(weights, biases);
+    mlp.sparsify();
     mlpCli(mlp);
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
@@ -128,3 +874,22 @@ int main(int argc, char **argv) {
 
   return EXIT_SUCCESS;
 }
+
+/**
+ * Program's main entry point. Runs the selected mode, then writes the
+ * layer profiles requested through MLP_PROFILE_JSON and MLP_PROFILE_TRACE
+ * (see profiling::write_requested).
+ * @param argc count of args
+ * @param argv args values
+ * @return program exit status code
+ */
+int main(int argc, char **argv) {
+  const int status = runMode(argc, argv);
+  try {
+    profiling::write_requested();
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return status;
+}
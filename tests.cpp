@@ -8,14 +8,41 @@
 #include <cmath>
 #include <random>
 #include <cassert>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
 
 // project headers
 #include "Matrix.h"
 #include "Dense.h"
 #include "MlpNetwork.h"
 #include "Activation.h"
+#include "Simd.h"
+#include "PackedModel.h"
+#include "ThreadPool.h"
+#include "RecordReader.h"
+#include "Trainer.h"
+#include "ModelDescriptor.h"
+#include "Dataset.h"
+#include "Evaluation.h"
+#include "Sparse.h"
+#include "HalfPrecision.h"
+#include "Profiler.h"
+#include "InferenceServer.h"
 #define REAL_BINARY_FILE_PATH "./images/im0"
 #define FAKE_BINARY_FILE_PATH "./fake_path"
+#define PACKED_MODEL_PATH "./test_model.pack"
+#define DATASET_PATH "./test_dataset"
+#define SERVER_SOCKET_PATH "./test_server.sock"
 
 
 // usage
@@ -42,6 +69,45 @@ using namespace activation;
 /*****************************************************************************/
 /*                             HELPER FUNCTIONS                              */
 /*****************************************************************************/
+// Counts every heap allocation made by the test binary, on any thread.
+// The replacements stay out of line: GCC otherwise inlines the deletes
+// into callers and warns that free releases what operator new returned.
+static std::atomic<long> allocation_count (0);
+
+__attribute__ ((noinline)) void *operator new (std::size_t size)
+{
+  allocation_count++;
+  void *p = std::malloc (size == 0 ? 1 : size);
+  if (p == nullptr)
+    throw std::bad_alloc ();
+  return p;
+}
+
+__attribute__ ((noinline)) void *operator new[] (std::size_t size)
+{
+  return operator new (size);
+}
+
+__attribute__ ((noinline)) void operator delete (void *p) noexcept
+{
+  std::free (p);
+}
+
+__attribute__ ((noinline)) void operator delete (void *p, std::size_t) noexcept
+{
+  std::free (p);
+}
+
+__attribute__ ((noinline)) void operator delete[] (void *p) noexcept
+{
+  std::free (p);
+}
+
+__attribute__ ((noinline)) void operator delete[] (void *p, std::size_t) noexcept
+{
+  std::free (p);
+}
+
 void is_same_size (Matrix &a, Matrix &b)
 {
   assert(a.get_rows () == b.get_rows () && a.get_cols () == b.get_cols ());
@@ -98,6 +164,150 @@ void test_constructor_matrix ()
   PASSED_TEST;
 }
 
+void test_constructor_move ()
+{
+  START_TEST;
+  Matrix m1 = generate_random_matrix (5, 4);
+  Matrix copy (m1);
+  const float *data = m1.begin ();
+  long before = allocation_count;
+  Matrix m2 (std::move (m1));
+  assert(allocation_count == before);
+  assert(m2.begin () == data);
+  cmp_matrices (m2, copy);
+
+  Matrix m3 = generate_random_matrix (2, 2);
+  before = allocation_count;
+  m3 = std::move (m2);
+  assert(allocation_count == before);
+  assert(m3.begin () == data);
+  cmp_matrices (m3, copy);
+
+  m2 = m3; // A moved-from matrix can be assigned to again
+  cmp_matrices (m2, copy);
+  PASSED_TEST;
+}
+
+void test_resize ()
+{
+  START_TEST;
+  Matrix m1 (10, 10);
+  const float *data = m1.begin ();
+  long before = allocation_count;
+  m1.resize (5, 20);
+  m1.resize (1, 3);
+  m1.resize (100, 1);
+  assert(allocation_count == before);
+  assert(m1.begin () == data);
+  assert(m1.get_rows () == 100 && m1.get_cols () == 1);
+  m1.resize (101, 1);
+  assert(m1.get_rows () == 101 && m1.get_cols () == 1);
+
+  Matrix m2 = generate_random_matrix (3, 3);
+  before = allocation_count;
+  m1 = m2; // Fits in the existing storage
+  assert(allocation_count == before);
+  cmp_matrices (m1, m2);
+
+  try
+  {
+    m1.resize (0, 3);
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {};
+  PASSED_TEST;
+}
+
+bool is_aligned (const Matrix &m)
+{
+  return reinterpret_cast<uintptr_t> (m.begin ()) % MATRIX_ALIGNMENT == 0;
+}
+
+// MatrixAllocator: the heap default, ArenaAllocator and PoolAllocator
+void test_matrix_allocators ()
+{
+  START_TEST;
+  MatrixAllocator &heap = MatrixAllocator::heap ();
+  assert(&MatrixAllocator::current () == &heap);
+  allocator_stats before = heap.stats ();
+  Matrix m1 (7, 3);
+  assert(is_aligned (m1));
+  assert(heap.stats ().allocations == before.allocations + 1);
+  assert(heap.stats ().bytes == before.bytes + 7 * 3 * (long) sizeof (float));
+
+  ArenaAllocator arena (1024);
+  Matrix kept;
+  {
+    AllocatorScope scope (arena);
+    assert(&MatrixAllocator::current () == &arena);
+    Matrix m2 = generate_random_matrix (16, 16);
+    Matrix m3 = m2 + m2;
+    assert(is_aligned (m2) && is_aligned (m3));
+    for (int i = 0; i < 16 * 16; i++)
+      assert(m3[i] == 2 * m2[i]);
+    {
+      // Nested scopes restore the previous allocator
+      AllocatorScope inner (heap);
+      kept = m1 * 2.0f;
+    }
+    assert(&MatrixAllocator::current () == &arena);
+    assert(arena.stats ().allocations == 2);
+    assert(arena.reserved () > 1024);
+  }
+  assert(&MatrixAllocator::current () == &heap);
+  const size_t reserved = arena.reserved ();
+  arena.reset ();
+  assert(arena.reserved () == reserved);
+  assert(kept.get_rows () == 7 && kept (6, 2) == 2 * m1 (6, 2));
+
+  // After a warm-up round, rounds of the same size do not touch the heap
+  long allocations = allocation_count;
+  Matrix image = generate_random_matrix (64, 1);
+  for (int round = 0; round < 3; round++)
+  {
+    {
+      AllocatorScope scope (arena);
+      Matrix sum = image + image;
+      Matrix scaled = sum * 0.5f;
+      Matrix copy = scaled;
+      copy.resize (64, 2);
+      cmp_matrices (scaled, image);
+    }
+    arena.reset ();
+    if (round == 0)
+      allocations = allocation_count;
+  }
+  assert(allocation_count == allocations);
+
+  // A released buffer goes back to its size class
+  PoolAllocator pool;
+  {
+    AllocatorScope scope (pool);
+    const float *data;
+    {
+      Matrix m4 (30, 10);
+      data = m4.begin ();
+      assert(is_aligned (m4));
+    }
+    assert(pool.cached () >= 30 * 10 * sizeof (float));
+    allocations = allocation_count;
+    Matrix m5 (20, 15);
+    assert(m5.begin () == data);
+    assert(allocation_count == allocations);
+    assert(m5 (19, 14) == 0);
+    assert(pool.cached () == 0);
+    // Moved storage still returns to the pool
+    kept = std::move (m5);
+  }
+  assert(pool.stats ().allocations == 2);
+  kept = Matrix (2, 2);
+  assert(pool.cached () > 0);
+  pool.trim ();
+  assert(pool.cached () == 0);
+  PASSED_TEST;
+}
+
 /*****************************************************************************/
 /*                             MATRIX METHODS                                */
 /*****************************************************************************/
@@ -148,6 +358,67 @@ void test_transpose ()
   PASSED_TEST;
 }
 
+// Matrix::transpose_into, Matrix::transpose_in_place and the transpose
+// kernel of every instruction set
+void test_transpose_variants ()
+{
+  START_TEST;
+  const int shapes[][2] = {{1, 7}, {7, 1}, {2, 3}, {5, 5}, {33, 33},
+                           {64, 64}, {70, 70}, {37, 45}, {128, 784},
+                           {784, 128}};
+  for (auto &shape : shapes)
+  {
+    Matrix m1 = generate_random_matrix (shape[0], shape[1]);
+    Matrix m2 (m1), m3 (m1), m4;
+    is_transposed (m1, m2.transpose ());
+    is_transposed (m1, m3.transpose_in_place ());
+    m1.transpose_into (m4);
+    is_transposed (m1, m4);
+
+    long before = allocation_count;
+    m1.transpose_into (m4);
+    if (shape[0] == shape[1])
+      m2.transpose ();
+    m3.transpose_in_place ();
+    assert(allocation_count == before || shape[0] != shape[1]);
+    cmp_matrices (m3, m1);
+    if (shape[0] == shape[1])
+      cmp_matrices (m2, m1);
+  }
+
+  // Views are not written by transpose
+  Matrix data = generate_random_matrix (6, 6);
+  Matrix copy (data);
+  Matrix view = Matrix::view (data.begin (), 6, 6);
+  view.transpose ();
+  assert(!view.is_view ());
+  cmp_matrices (data, copy);
+  is_transposed (data, view);
+
+  // Strided blocks, with edges narrower than any SIMD width
+  const simd::isa sets[] = {simd::SCALAR, simd::SSE, simd::AVX2,
+                            simd::AVX512};
+  Matrix in = generate_random_matrix (40, 50);
+  for (simd::isa set : sets)
+  {
+    const simd::kernel_table *k = simd::kernels_for (set);
+    if (k == nullptr)
+      continue;
+    for (int rows = 1; rows <= 35; rows += 17)
+      for (int cols = 1; cols <= 40; cols += 3)
+      {
+        Matrix out (60, 45);
+        k->transpose (in.begin () + 2 * 50 + 3, 50, out.begin () + 45 + 1,
+                      45, rows, cols);
+        for (int i = 0; i < rows; i++)
+          for (int j = 0; j < cols; j++)
+            assert(out (1 + j, 1 + i) == in (2 + i, 3 + j));
+        assert(out (0, 0) == 0 && out (1 + cols, 1) == 0);
+      }
+  }
+  PASSED_TEST;
+}
+
 void is_vectorized (Matrix &a, Matrix &b)
 {
   assert(b.get_cols () == 1 && b.get_rows () == a.get_rows () * a.get_cols ());
@@ -310,6 +581,53 @@ void test_matrix_mult_matrix_op ()
 
   PASSED_TEST;
 }
+Matrix naive_mult (Matrix &a, Matrix &b)
+{
+  Matrix ab (a.get_rows (), b.get_cols ());
+  for (int r = 0; r < a.get_rows (); r++)
+  {
+    for (int c = 0; c < b.get_cols (); c++)
+    {
+      double sum = 0;
+      for (int k = 0; k < a.get_cols (); k++)
+      {
+        sum += (double) a (r, k) * b (k, c);
+      }
+      ab (r, c) = (float) sum;
+    }
+  }
+  return ab;
+}
+
+void is_close_matrix_mult (int m, int k, int n)
+{
+  Matrix a = generate_random_matrix (m, k);
+  Matrix b = generate_random_matrix (k, n);
+  Matrix ab = a * b;
+  Matrix expected = naive_mult (a, b);
+  assert(ab.get_rows () == m && ab.get_cols () == n);
+  // Each entry sums k products of magnitude up to 100.
+  float tolerance = 1e-5f * 100.0f * (float) k;
+  for (int i = 0; i < m * n; i++)
+  {
+    assert(std::fabs (ab[i] - expected[i]) <= tolerance);
+  }
+}
+
+// Matrix Matrix::operator* (const Matrix &rhs) const, against a naive loop
+void test_matrix_mult_gemm ()
+{
+  START_TEST;
+  is_close_matrix_mult (1, 1, 1);
+  is_close_matrix_mult (7, 13, 5);
+  is_close_matrix_mult (128, 784, 1);
+  is_close_matrix_mult (128, 784, 37);
+  is_close_matrix_mult (10, 20, 64);
+  is_close_matrix_mult (300, 600, 50);
+  is_close_matrix_mult (33, 9, 2100);
+  PASSED_TEST;
+}
+
 // Matrix Matrix::operator* (const float rhs) const
 void test_matrix_mult_float_op ()
 {
@@ -390,10 +708,117 @@ void test_matrix_plus_assign_matrix_op ()
   PASSED_TEST;
 }
 
+// Lazy expressions (MatrixExpr.h): fused evaluation, aliasing, the fused
+// GEMM plus bias and the size checks
+void test_matrix_expressions ()
+{
+  START_TEST;
+  // Long enough for several evaluation blocks and a partial one
+  Matrix a = generate_random_matrix (37, 29);
+  Matrix b = generate_random_matrix (37, 29);
+  Matrix c = generate_random_matrix (37, 29);
+  long before = allocation_count;
+  Matrix r = a + b * 0.5f + 2.0f * a.dot (c) + (a + b).dot (b + c);
+  assert(allocation_count == before + 1);
+  for (int i = 0; i < 37 * 29; i++)
+    assert(std::fabs (r[i] - (a[i] + b[i] * 0.5f + 2.0f * a[i] * c[i]
+                              + (a[i] + b[i]) * (b[i] + c[i])))
+           <= 1e-4f * (1 + std::fabs (r[i])));
+
+  // Assigning reuses the storage, and may read the target
+  before = allocation_count;
+  r = a + b;
+  r = r * 3.0f + r.dot (a);
+  assert(allocation_count == before);
+  for (int i = 0; i < 37 * 29; i++)
+    assert(std::fabs (r[i] - ((a[i] + b[i]) * 3.0f + (a[i] + b[i]) * a[i]))
+           <= 1e-4f * (1 + std::fabs (r[i])));
+
+  // Elements and norms are read without evaluating the whole expression
+  assert((a + b)[5] == a[5] + b[5]);
+  assert((a * 2.0f) (3, 4) == a (3, 4) * 2.0f);
+  assert(CMP_FLOATS ((a + b).norm () / Matrix (a + b).norm (), 1.0f));
+  assert((a + b).at (36, 28) == a (36, 28) + b (36, 28));
+  try
+  {
+    (a + b).at (37, 0);
+    assert(false);
+  }
+  catch (std::out_of_range &e)
+  {}
+
+  // Products, with a bias fused into the GEMM kernel
+  Matrix w = generate_random_matrix (20, 29);
+  Matrix x = generate_random_matrix (29, 1);
+  Matrix bias = generate_random_matrix (20, 1);
+  Matrix wx (20, 1);
+  for (int i = 0; i < 20; i++)
+    for (int k = 0; k < 29; k++)
+      wx[i] += w (i, k) * x[k];
+  Matrix y = w * x + bias;
+  Matrix y2 = bias + w * x;
+  for (int i = 0; i < 20; i++)
+  {
+    assert(std::fabs (y[i] - (wx[i] + bias[i])) < 1e-3f);
+    assert(y2[i] == y[i]);
+    assert(std::fabs ((w * x)[i] - wx[i]) < 1e-3f);
+  }
+  bias = w * x + bias;
+  cmp_matrices (bias, y);
+  Matrix square = generate_random_matrix (29, 29);
+  Matrix expected = square * x;
+  x = square * x;
+  cmp_matrices (x, expected);
+
+  // A batch product plus a matrix of its size
+  Matrix batch = generate_random_matrix (29, 6);
+  Matrix addend = generate_random_matrix (20, 6);
+  Matrix product = w * batch;
+  Matrix sum = w * batch + addend;
+  for (int i = 0; i < 20 * 6; i++)
+    assert(sum[i] == product[i] + addend[i]);
+  addend = w * batch + addend;
+  cmp_matrices (addend, sum);
+
+  // Sizes are checked as the expression is built
+  Matrix other = generate_random_matrix (29, 37);
+  try
+  {
+    a + b * 2.0f + other;
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {}
+  try
+  {
+    a.dot (other);
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {}
+  try
+  {
+    w * a;
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {}
+  try
+  {
+    w * x + addend;
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {}
+  PASSED_TEST;
+}
+
 // float &Matrix::operator() (const int r, const int c)
 // float Matrix::operator() (const int r, const int c) const
 // float Matrix::operator[] (const int i) const
 // float &Matrix::operator[] (const int i)
+// float Matrix::at (const int r, const int c) const, and the other at,
+// data and row accessors
 void test_indexing_op ()
 {
   START_TEST;
@@ -401,6 +826,9 @@ void test_indexing_op ()
   // by value
   assert(m1 (3, 2) == m1[3 * m1.get_cols () + 2]);
   assert(m1[18] == m1 (1, 6));
+  assert(m1.at (1, 6) == m1 (1, 6) && m1.at (18) == m1[18]);
+  assert(m1.data () == m1.begin () && m1.row (4) == m1.begin () + 48);
+  assert(m1.row (4)[5] == m1 (4, 5));
   // by reference
   m1 (2, 3) = 1000.0;
   assert(m1[2 * m1.get_cols () + 3] == 1000.0);
@@ -408,19 +836,50 @@ void test_indexing_op ()
   assert(m1[34] == 1000);
   m1[34] += 1;
   assert(m1[34] == 1001);
+  m1.at (5, 7) = 7.0;
+  m1.at (35) += 1;
+  assert(m1 (5, 7) == 7.0 && m1 (2, 11) == m1.at (35));
+
+  // at checks its indices in every build; the operators only with
+  // MLP_CHECKED_ACCESS
+  try
+  {
+    m1.at (5000, 10);
+    assert(false);
+  }
+  catch (std::out_of_range &e)
+  {}
+
+  try
+  {
+    m1.at (5, -1);
+    assert(false);
+  }
+  catch (std::out_of_range &e)
+  {}
 
-  // exceptions
   try
   {
-    m1 (5000, 10);
+    m1.at (5000); // This should raise exception
     assert(false);
   }
   catch (std::out_of_range &e)
   {}
 
+  const Matrix &c1 = m1;
   try
   {
-    m1[5000]; // This should raise exception
+    c1.at (120);
+    assert(false);
+  }
+  catch (std::out_of_range &e)
+  {}
+
+  Matrix m2 = generate_random_matrix (12, 3);
+  assert(std::fabs ((m1 * m2).at (9, 2) - Matrix (m1 * m2) (9, 2)) <= 1e-4f);
+  try
+  {
+    (m1 * m2).at (10, 0);
     assert(false);
   }
   catch (std::out_of_range &e)
@@ -506,6 +965,317 @@ void test_softmax ()
   PASSED_TEST;
 }
 
+// The softmax functions subtract the maximum, their batch forms agree with
+// softmax on each sample, FAST_EXP stays within its bound and the argmax
+// fast path picks softmax_columns' winner and probability
+void test_softmax_stable ()
+{
+  START_TEST;
+  const activation::exp_mode mode = activation::get_exp_mode ();
+  activation::set_exp_mode (activation::PRECISE_EXP);
+  Matrix logits (10, 1);
+  double expected_sum = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    logits[i] = 1000.0f + i;
+    expected_sum += std::exp (i - 9.0);
+  }
+  Matrix p = activation::softmax (logits);
+  float sum = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    assert(std::isfinite (p[i]));
+    sum += p[i];
+  }
+  assert(CMP_FLOATS (sum, 1.0));
+  assert(std::fabs (p[9] - 1.0 / expected_sum) < 1e-6);
+
+  const int count = 37;
+  Matrix batch = generate_random_matrix (10, count) * 20.0f;
+  Matrix columns = activation::softmax_columns (batch);
+  Matrix transposed;
+  batch.transpose_into (transposed);
+  Matrix rows = activation::softmax_rows (transposed);
+  std::vector<unsigned int> labels (count);
+  std::vector<float> probabilities (count);
+  activation::softmax_columns_argmax (batch, labels.data (),
+                                      probabilities.data ());
+  for (int j = 0; j < count; j++)
+  {
+    Matrix column (10, 1);
+    for (int i = 0; i < 10; i++)
+      column[i] = batch (i, j);
+    Matrix single = activation::softmax (column);
+    unsigned int label = 0;
+    for (int i = 0; i < 10; i++)
+    {
+      assert(std::fabs (single[i] - columns (i, j)) <= 1e-6f);
+      assert(std::fabs (rows (j, i) - columns (i, j)) <= 1e-6f);
+      if (batch (i, j) > batch (label, j))
+        label = i;
+    }
+    assert(labels[j] == label);
+    assert(std::fabs (probabilities[j] - columns (label, j)) <= 1e-6f);
+  }
+
+  activation::set_exp_mode (activation::FAST_EXP);
+  Matrix fast = activation::softmax_columns (batch);
+  std::vector<unsigned int> fast_labels (count);
+  activation::softmax_columns_argmax (batch, fast_labels.data (),
+                                      probabilities.data ());
+  activation::set_exp_mode (mode);
+  for (int i = 0; i < 10 * count; i++)
+  {
+    assert(std::fabs (fast[i] - columns[i]) <= 2e-4f * columns[i] + 1e-30f);
+  }
+  for (int j = 0; j < count; j++)
+  {
+    assert(fast_labels[j] == labels[j]);
+    assert(std::fabs (probabilities[j] - columns (labels[j], j))
+           <= 2e-4f * columns (labels[j], j));
+  }
+  PASSED_TEST;
+}
+
+// Every SIMD kernel table the host can run, against the scalar one
+void test_simd_kernels ()
+{
+  START_TEST;
+  const simd::kernel_table &ref = simd::scalar_kernels ();
+  const simd::isa sets[] = {simd::SSE, simd::AVX2, simd::AVX512,
+                            simd::AVX512_VNNI};
+  std::mt19937 gen (7);
+  std::uniform_int_distribution<int> u8 (0, QUANT_ACTIVATION_MAX);
+  std::uniform_int_distribution<int> s8 (-QUANT_WEIGHT_MAX, QUANT_WEIGHT_MAX);
+  for (simd::isa set : sets)
+  {
+    const simd::kernel_table *k = simd::kernels_for (set);
+    if (k == nullptr)
+    {
+      continue;
+    }
+    for (int n = 1; n < 70; n++)
+    {
+      Matrix x = generate_random_matrix (1, n);
+      Matrix y = generate_random_matrix (1, n);
+      Matrix expected (1, n), actual (1, n);
+
+      ref.add (x.begin (), y.begin (), expected.begin (), n);
+      k->add (x.begin (), y.begin (), actual.begin (), n);
+      cmp_matrices (expected, actual);
+
+      ref.mul (x.begin (), y.begin (), expected.begin (), n);
+      k->mul (x.begin (), y.begin (), actual.begin (), n);
+      cmp_matrices (expected, actual);
+
+      ref.scale (x.begin (), 0.37f, expected.begin (), n);
+      k->scale (x.begin (), 0.37f, actual.begin (), n);
+      cmp_matrices (expected, actual);
+
+      expected = y;
+      actual = y;
+      ref.axpy (0.37f, x.begin (), expected.begin (), n);
+      k->axpy (0.37f, x.begin (), actual.begin (), n);
+      for (int i = 0; i < n; i++)
+      {
+        assert(std::fabs (expected[i] - actual[i]) <= 1e-6f);
+      }
+
+      ref.relu (x.begin (), expected.begin (), n);
+      k->relu (x.begin (), actual.begin (), n);
+      cmp_matrices (expected, actual);
+
+      assert(std::fabs (ref.dot (x.begin (), y.begin (), n)
+                        - k->dot (x.begin (), y.begin (), n)) < 1e-3f * n);
+      assert(std::fabs (ref.sum_squares (x.begin (), n)
+                        - k->sum_squares (x.begin (), n)) < 1e-3f * n);
+
+      ref.sub (x.begin (), y.begin (), expected.begin (), n);
+      k->sub (x.begin (), y.begin (), actual.begin (), n);
+      cmp_matrices (expected, actual);
+
+      ref.maximum (x.begin (), y.begin (), expected.begin (), n);
+      k->maximum (x.begin (), y.begin (), actual.begin (), n);
+      cmp_matrices (expected, actual);
+
+      const float max = ref.max (x.begin (), n);
+      assert(k->max (x.begin (), n) == max);
+
+      for (int i = 0; i < n; i += 3)
+        y[i] = x[i];
+      expected = x;
+      actual = x;
+      ref.set_where_equal (x.begin (), y.begin (), -1.0f, expected.begin (), n);
+      k->set_where_equal (x.begin (), y.begin (), -1.0f, actual.begin (), n);
+      cmp_matrices (expected, actual);
+
+      float ref_sum = ref.exp_sum (x.begin (), max, expected.begin (), n);
+      float sum = k->exp_sum (x.begin (), max, actual.begin (), n);
+      assert(std::fabs (ref_sum - sum) <= 1e-5f * ref_sum);
+      for (int i = 0; i < n; i++)
+      {
+        assert(std::fabs (expected[i] - actual[i]) <= 1e-6f * expected[i]);
+      }
+
+      sum = k->fast_exp_sum (x.begin (), max, actual.begin (), n);
+      assert(std::fabs (ref_sum - sum) <= 1e-4f * ref_sum);
+      for (int i = 0; i < n; i++)
+      {
+        assert(std::fabs (expected[i] - actual[i]) <= 1e-4f * expected[i]);
+      }
+    }
+    for (int n = 1; n < 300; n += 7)
+    {
+      std::vector<unsigned char> x (n);
+      std::vector<signed char> w (n);
+      for (int i = 0; i < n; i++)
+      {
+        x[i] = static_cast<unsigned char> (u8 (gen));
+        w[i] = static_cast<signed char> (s8 (gen));
+      }
+      assert(ref.dot_u8s8 (x.data (), w.data (), n)
+             == k->dot_u8s8 (x.data (), w.data (), n));
+
+      std::vector<float> expected (n), actual (n);
+      ref.u8_to_float (x.data (), 1.0f / 255.0f, expected.data (), n);
+      k->u8_to_float (x.data (), 1.0f / 255.0f, actual.data (), n);
+      assert(expected == actual);
+    }
+    // Subnormals and infinities go through the same conversions
+    const uint16_t specials[] = {0x0001, 0x03ff, 0x8200, 0x0400, 0x7bff,
+                                 0x7c00, 0xfc00, 0x8000};
+    for (int n = 1; n < 70; n += 3)
+    {
+      std::vector<uint16_t> fp16 (n), bf16 (n);
+      Matrix x = generate_random_matrix (1, n);
+      for (int i = 0; i < n; i++)
+      {
+        fp16[i] = half::from_float (x[i] * 4.0f, half::FP16);
+        bf16[i] = half::from_float (x[i] * 4.0f, half::BF16);
+      }
+      std::vector<float> expected (n), actual (n);
+      ref.f16_to_float (fp16.data (), expected.data (), n);
+      k->f16_to_float (fp16.data (), actual.data (), n);
+      assert(expected == actual);
+      ref.bf16_to_float (bf16.data (), expected.data (), n);
+      k->bf16_to_float (bf16.data (), actual.data (), n);
+      assert(expected == actual);
+      assert(std::fabs (ref.dot_f16 (fp16.data (), x.begin (), n)
+                        - k->dot_f16 (fp16.data (), x.begin (), n))
+             < 1e-3f * n);
+      assert(std::fabs (ref.dot_bf16 (bf16.data (), x.begin (), n)
+                        - k->dot_bf16 (bf16.data (), x.begin (), n))
+             < 1e-3f * n);
+
+      for (int i = 0; i < n; i++)
+        fp16[i] = specials[i % 8];
+      ref.f16_to_float (fp16.data (), expected.data (), n);
+      k->f16_to_float (fp16.data (), actual.data (), n);
+      assert(expected == actual);
+    }
+    // Blocks start at any column, overlapping one another
+    Matrix row = generate_random_matrix (1, 64);
+    for (int blocks = 0; blocks < 12; blocks++)
+    {
+      Matrix values = generate_random_matrix (1, blocks * SPARSE_BLOCK + 1);
+      std::vector<int> columns (blocks);
+      for (int &column : columns)
+        column = static_cast<int> (gen () % (64 - SPARSE_BLOCK + 1));
+      assert(std::fabs (ref.block_dot (values.begin (), columns.data (),
+                                       blocks, row.begin ())
+                        - k->block_dot (values.begin (), columns.data (),
+                                        blocks, row.begin ()))
+             < 1e-3f * (blocks + 1));
+    }
+  }
+  PASSED_TEST;
+}
+
+/*****************************************************************************/
+/*                                DENSE TESTS                                */
+/*****************************************************************************/
+
+Matrix identity_activation (const Matrix &input)
+{
+  return input;
+}
+
+void is_close_matrix (const Matrix &a, const Matrix &b, float tolerance)
+{
+  assert(a.get_rows () == b.get_rows () && a.get_cols () == b.get_cols ());
+  for (int i = 0; i < a.get_rows () * a.get_cols (); i++)
+    assert(std::fabs (a[i] - b[i]) <= tolerance);
+}
+
+// Dense::forward fuses the bias and relu into the product
+void test_dense_fused ()
+{
+  START_TEST;
+  Matrix weights = generate_random_matrix (20, 300) * 0.01f;
+  Matrix bias = generate_random_matrix (20, 1);
+  const int batch_sizes[] = {1, 7, 40};
+  for (int count : batch_sizes)
+  {
+    Matrix input = generate_random_matrix (300, count);
+    Matrix logits = naive_mult (weights, input);
+    for (int r = 0; r < logits.get_rows (); r++)
+      for (int c = 0; c < logits.get_cols (); c++)
+        logits (r, c) += bias[r];
+
+    is_close_matrix (Dense (weights, bias, relu) (input), relu (logits), 1e-3f);
+    is_close_matrix (Dense (weights, bias, identity_activation) (input),
+                     logits, 1e-3f);
+    is_close_matrix (Dense (weights, bias, softmax) (input),
+                     softmax_columns (logits), 1e-5f);
+  }
+
+  try
+  {
+    Dense (weights, bias, relu) (Matrix (299, 1));
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {};
+  PASSED_TEST;
+}
+
+// INT8 layers stay close to their FP32 originals
+void test_dense_int8 ()
+{
+  START_TEST;
+  Matrix weights = generate_random_matrix (20, 300) * 0.01f;
+  Matrix bias = generate_random_matrix (20, 1);
+  QuantizedMatrix quantized = QuantizedMatrix::quantize (weights);
+  // Weights lie in [-0.1, 0.1], so every row scale is at most
+  // 0.1 / QUANT_WEIGHT_MAX and values round to within half of it
+  is_close_matrix (quantized.dequantize (), weights,
+                   0.5f * 0.1f / QUANT_WEIGHT_MAX + 1e-6f);
+
+  Dense fp32 (weights, bias, identity_activation);
+  Dense dynamic = fp32;
+  dynamic.quantize ();
+  assert(dynamic.get_format () == Dense::INT8);
+  assert(dynamic.get_input_size () == 300 && dynamic.get_output_size () == 20);
+  const int batch_sizes[] = {1, 7, 40};
+  for (int count : batch_sizes)
+  {
+    Matrix input = generate_random_matrix (300, count);
+    is_close_matrix (dynamic (input), fp32 (input), 0.3f);
+  }
+
+  // Calibrated parameters for non-negative inputs, with fused relu
+  Matrix pixels = generate_random_matrix (300, 5);
+  for (float &v : pixels)
+    v = std::fabs (v);
+  float max = *std::max_element (pixels.begin (), pixels.end ());
+  Dense relu_fp32 (weights, bias, relu);
+  Dense calibrated = relu_fp32;
+  calibrated.quantize (quantization::params_for_range (0.0f, max));
+  assert(calibrated.get_input_params ().zero_point == 0);
+  is_close_matrix (calibrated (pixels), relu_fp32 (pixels), 0.3f);
+  PASSED_TEST;
+}
+
 /*****************************************************************************/
 /*                              MLPNETWORK TESTS                             */
 /*****************************************************************************/
@@ -516,6 +1286,1381 @@ void test_mlp ()
   PASSED_TEST;
 }
 
+/**
+ * Fills weights and biases with small random parameters of the network's
+ * layer shapes, small enough to keep the softmax inputs moderate.
+ */
+void generate_random_parameters (Matrix weights[], Matrix biases[])
+{
+  for (int i = 0; i < MLP_SIZE; i++)
+  {
+    weights[i] = generate_random_matrix (weights_dims[i].rows,
+                                         weights_dims[i].cols) * 0.01f;
+    biases[i] = generate_random_matrix (bias_dims[i].rows,
+                                        bias_dims[i].cols) * 0.01f;
+  }
+}
+
+Matrix generate_random_images (int count)
+{
+  Matrix images = generate_random_matrix (img_dims.rows * img_dims.cols,
+                                          count);
+  for (int i = 0; i < images.get_rows () * images.get_cols (); i++)
+    images[i] = std::fabs (images[i]) / 10;
+  return images;
+}
+
+Matrix image_column (const Matrix &images, int j)
+{
+  Matrix image (images.get_rows (), 1);
+  for (int i = 0; i < images.get_rows (); i++)
+    image[i] = images (i, j);
+  return image;
+}
+
+// A forward pass after warm-up must not touch the heap
+void test_mlp_forward_no_allocations ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  MlpNetwork mlp (weights, biases);
+  mlp_workspace workspace;
+
+  Matrix image = generate_random_images (1);
+  digit expected = mlp (image, workspace);
+  long before = allocation_count;
+  digit output = mlp (image, workspace);
+  assert(allocation_count == before);
+  assert(output.value == expected.value);
+
+  Matrix images = generate_random_images (64);
+  mlp.forward (images, workspace);
+  before = allocation_count;
+  mlp.forward (images, workspace);
+  assert(allocation_count == before);
+  PASSED_TEST;
+}
+
+// std::vector<digit> MlpNetwork::predict_batch (const Matrix &images) const
+void test_mlp_predict_batch ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  MlpNetwork mlp (weights, biases);
+  mlp_workspace workspace;
+
+  const int batch_sizes[] = {1, 2, 37};
+  for (int count : batch_sizes)
+  {
+    Matrix images = generate_random_images (count);
+    std::vector<digit> digits = mlp.predict_batch (images);
+    assert((int) digits.size () == count);
+    // The argmax fast path gives the normalized winner's probability
+    const Matrix &output = mlp.forward (images, workspace);
+    for (int j = 0; j < count; j++)
+    {
+      digit expected = mlp (image_column (images, j));
+      assert(digits[j].value == expected.value);
+      assert(CMP_FLOATS (digits[j].probability, expected.probability));
+      assert(std::fabs (digits[j].probability
+                        - output (digits[j].value, j)) <= 1e-6f);
+    }
+  }
+
+  // The overloads without a workspace may run concurrently
+  const Matrix shared_images = generate_random_images (16);
+  const std::vector<digit> expected = mlp.predict_batch (shared_images);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back ([&] {
+      for (int r = 0; r < 50; r++)
+      {
+        std::vector<digit> digits = mlp.predict_batch (shared_images);
+        for (int j = 0; j < 16; j++)
+          assert(digits[j].value == expected[j].value
+                 && digits[j].probability == expected[j].probability);
+      }
+    });
+  for (std::thread &thread : threads)
+    thread.join ();
+
+  try
+  {
+    mlp.predict_batch (Matrix (100, 3));
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {};
+  try
+  {
+    mlp (generate_random_images (2));
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {};
+  PASSED_TEST;
+}
+
+// MlpNetwork::predict_top_k and predict_probabilities, from one pass
+void test_mlp_top_k ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  MlpNetwork mlp (weights, biases);
+  mlp_workspace workspace;
+  const int k = 3;
+
+  const int batch_sizes[] = {1, 37};
+  for (int count : batch_sizes)
+  {
+    Matrix images = generate_random_images (count);
+    std::vector<digit> top (count * k);
+    std::vector<float> probabilities (count * OUTPUT_VECTOR_SIZE);
+    mlp.predict_top_k (images, k, top.data (), workspace);
+    mlp.predict_probabilities (images, probabilities.data (), workspace);
+    std::vector<digit> digits = mlp.predict_batch (images, workspace);
+    const Matrix &output = mlp.forward (images, workspace);
+
+    long before = allocation_count;
+    mlp.predict_top_k (images, k, top.data (), workspace);
+    mlp.predict_probabilities (images, probabilities.data (), workspace);
+    assert(allocation_count == before);
+
+    for (int j = 0; j < count; j++)
+    {
+      const float *p = probabilities.data () + j * OUTPUT_VECTOR_SIZE;
+      float sum = 0;
+      for (int i = 0; i < OUTPUT_VECTOR_SIZE; i++)
+      {
+        assert(p[i] == output (i, j));
+        sum += p[i];
+      }
+      assert(CMP_FLOATS (sum, 1.0));
+
+      const digit *best = top.data () + j * k;
+      assert(best[0].value == digits[j].value);
+      for (int i = 0; i < k; i++)
+      {
+        assert(best[i].probability == p[best[i].value]);
+        if (i > 0)
+          assert(best[i].probability <= best[i - 1].probability);
+      }
+      // Every digit left out is no more probable than the last kept
+      for (int i = 0; i < OUTPUT_VECTOR_SIZE; i++)
+      {
+        bool kept = false;
+        for (int t = 0; t < k; t++)
+          kept = kept || best[t].value == (unsigned int) i;
+        assert(kept || p[i] <= best[k - 1].probability);
+      }
+    }
+  }
+
+  // k may cover every digit, but not more
+  Matrix image = generate_random_images (1);
+  std::vector<digit> all (OUTPUT_VECTOR_SIZE);
+  mlp.predict_top_k (image, OUTPUT_VECTOR_SIZE, all.data ());
+  const int invalid[] = {0, OUTPUT_VECTOR_SIZE + 1};
+  for (int bad : invalid)
+  {
+    try
+    {
+      mlp.predict_top_k (image, bad, all.data ());
+      assert(false);
+    }
+    catch (std::invalid_argument &e)
+    {}
+  }
+  PASSED_TEST;
+}
+
+// PackedModel::write and the mapped PackedModel views
+void test_packed_model ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  PackedModel::write (PACKED_MODEL_PATH, weights, biases, MLP_SIZE);
+  {
+    PackedModel model (PACKED_MODEL_PATH);
+    assert(model.layer_count () == MLP_SIZE);
+    for (int i = 0; i < MLP_SIZE; i++)
+    {
+      const Dense &layer = model.layers ()[i];
+      assert(layer.get_format () == Dense::FP32);
+      assert(layer.get_weights ().is_view () && layer.get_bias ().is_view ());
+      assert(reinterpret_cast<uintptr_t> (layer.get_weights ().begin ()) % 64
+             == 0);
+      cmp_matrices (layer.get_weights (), weights[i]);
+      cmp_matrices (layer.get_bias (), biases[i]);
+      assert(layer.get_activation () == (i == MLP_SIZE - 1
+                                         ? activation::softmax
+                                         : activation::relu));
+    }
+
+    // Layers copied from the model keep sharing the mapped data
+    long before = allocation_count;
+    Dense layer = model.layers ()[0];
+    assert(allocation_count == before);
+    assert(layer.get_weights ().begin ()
+           == model.layers ()[0].get_weights ().begin ());
+
+    // Copies of a view own their elements
+    const Matrix &mapped_bias = model.layers ()[0].get_bias ();
+    Matrix owned (mapped_bias);
+    assert(!owned.is_view () && owned.begin () != mapped_bias.begin ());
+    owned = model.layers ()[1].get_bias ();
+    assert(!owned.is_view ());
+    cmp_matrices (owned, biases[1]);
+
+    // Matrices copied out of a layer are writable, read-only mapping or not
+    Matrix w = model.layers ()[0].get_weights ();
+    assert(!w.is_view ());
+    w += w;
+    cmp_matrices (model.layers ()[0].get_weights (), weights[0]);
+
+    MlpNetwork mapped (model.layers ());
+    MlpNetwork loaded (weights, biases);
+    Matrix images = generate_random_images (5);
+    std::vector<digit> expected = loaded.predict_batch (images);
+    std::vector<digit> actual = mapped.predict_batch (images);
+    for (int j = 0; j < 5; j++)
+      assert(expected[j].value == actual[j].value);
+  }
+
+  // A file whose size disagrees with its header is rejected
+  {
+    std::ofstream os (PACKED_MODEL_PATH, std::ios::binary | std::ios::app);
+    os << "x";
+  }
+  try
+  {
+    PackedModel model (PACKED_MODEL_PATH);
+    assert(false);
+  }
+  catch (std::runtime_error &e)
+  {}
+  try
+  {
+    PackedModel model (FAKE_BINARY_FILE_PATH);
+    assert(false);
+  }
+  catch (std::runtime_error &e)
+  {}
+  std::remove (PACKED_MODEL_PATH);
+  PASSED_TEST;
+}
+
+// The compile-time specialized engine agrees with the Dense layers
+void test_mlp_static_engine ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  MlpNetwork dynamic (weights, biases);
+  MlpNetwork fixed (weights, biases);
+  fixed.set_engine (MlpNetwork::STATIC);
+  assert(fixed.get_engine () == MlpNetwork::STATIC);
+  Matrix images = generate_random_images (9);
+  mlp_workspace dynamic_ws, fixed_ws;
+  is_close_matrix (fixed.forward (images, fixed_ws),
+                   dynamic.forward (images, dynamic_ws), 1e-5f);
+  Matrix image = image_column (images, 4);
+  digit expected = dynamic (image);
+  long before = allocation_count;
+  digit actual = fixed (image, fixed_ws);
+  assert(allocation_count == before);
+  assert(expected.value == actual.value);
+  assert(std::fabs (expected.probability - actual.probability) < 1e-5f);
+
+  // Copies share the engine
+  MlpNetwork copy = fixed;
+  assert(copy.get_engine () == MlpNetwork::STATIC);
+  fixed.set_engine (MlpNetwork::DYNAMIC);
+  assert(fixed.get_engine () == MlpNetwork::DYNAMIC);
+
+  // Quantized layers only run on the dynamic engine
+  fixed.quantize ();
+  try
+  {
+    fixed.set_engine (MlpNetwork::STATIC);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+  PASSED_TEST;
+}
+
+// Quantized networks survive a packed model round trip and mostly agree
+// with the float network
+void test_mlp_quantize ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  MlpNetwork fp32 (weights, biases);
+  Matrix images = generate_random_images (50);
+  std::vector<digit> expected = fp32.predict_batch (images);
+
+  MlpNetwork dynamic (weights, biases);
+  dynamic.quantize ();
+  MlpNetwork calibrated (weights, biases);
+  calibrated.quantize (&images);
+  for (const MlpNetwork *mlp : {&dynamic, &calibrated})
+  {
+    std::vector<digit> actual = mlp->predict_batch (images);
+    int agree = 0;
+    for (int j = 0; j < 50; j++)
+    {
+      agree += expected[j].value == actual[j].value;
+      assert(std::fabs (expected[j].probability - actual[j].probability)
+             < 0.05f);
+    }
+    assert(agree >= 45);
+  }
+
+  PackedModel::write (PACKED_MODEL_PATH, calibrated.get_layers ());
+  {
+    PackedModel model (PACKED_MODEL_PATH);
+    std::vector<Dense> originals = calibrated.get_layers ();
+    for (int i = 0; i < MLP_SIZE; i++)
+    {
+      const Dense &layer = model.layers ()[i];
+      const Dense &original = originals[i];
+      assert(layer.get_format () == Dense::INT8);
+      assert(reinterpret_cast<uintptr_t> (
+                 layer.get_quantized_weights ().row (0)) % 64 == 0);
+      cmp_matrices (layer.get_quantized_weights ().dequantize (),
+                    original.get_quantized_weights ().dequantize ());
+      assert(layer.get_input_params ().scale
+             == original.get_input_params ().scale);
+      assert(layer.get_input_params ().zero_point
+             == original.get_input_params ().zero_point);
+    }
+    MlpNetwork mapped (model.layers ());
+    std::vector<digit> loaded = calibrated.predict_batch (images);
+    std::vector<digit> actual = mapped.predict_batch (images);
+    for (int j = 0; j < 50; j++)
+      assert(loaded[j].value == actual[j].value);
+  }
+  std::remove (PACKED_MODEL_PATH);
+
+  PASSED_TEST;
+}
+
+/**
+ * Builds layers of the given sizes, sizes[i] inputs to sizes[i + 1]
+ * outputs, with the given activations.
+ */
+std::vector<Dense> generate_random_layers (const std::vector<int> &sizes,
+                                           const std::vector<activation_func>
+                                           &activations)
+{
+  std::vector<Dense> layers;
+  for (size_t i = 0; i + 1 < sizes.size (); i++)
+    layers.emplace_back (
+        generate_random_matrix (sizes[i + 1], sizes[i]) * 0.05f,
+        generate_random_matrix (sizes[i + 1], 1) * 0.05f, activations[i]);
+  return layers;
+}
+
+// Sparse layers compute the same products as dense ones
+void test_sparse ()
+{
+  START_TEST;
+  const SparseMatrix::layout layouts[] = {SparseMatrix::CSR,
+                                          SparseMatrix::BLOCKED};
+  // 20 columns end with a block that starts early, 5 fit no block at all
+  const int widths[] = {20, 5, 300};
+  for (int cols : widths)
+  {
+    Matrix weights = generate_random_matrix (30, cols);
+    SparseMatrix::prune (weights, 0.8f, false);
+    assert(std::count (weights.begin (), weights.end (), 0.0f)
+           == static_cast<long> (0.8f * 30 * cols));
+    Matrix bias = generate_random_matrix (30, 1);
+    for (SparseMatrix::layout chosen : layouts)
+    {
+      SparseMatrix sparse = SparseMatrix::from_dense (weights, chosen);
+      assert(sparse.get_layout () == (cols < SPARSE_BLOCK
+                                      ? SparseMatrix::CSR : chosen));
+      cmp_matrices (sparse.to_dense (), weights);
+      const int batch_sizes[] = {1, 37};
+      for (int count : batch_sizes)
+      {
+        Matrix input = generate_random_matrix (cols, count);
+        Matrix logits = naive_mult (weights, input);
+        for (int r = 0; r < logits.get_rows (); r++)
+          for (int c = 0; c < logits.get_cols (); c++)
+            logits (r, c) += bias[r];
+        Matrix output;
+        sparse.multiply (input, bias.begin (), false, output);
+        is_close_matrix (output, logits, 1e-3f);
+        sparse.multiply (input, bias.begin (), true, output);
+        is_close_matrix (output, relu (logits), 1e-3f);
+      }
+    }
+  }
+
+  // Block pruning removes whole blocks, which the blocked layout suits
+  Matrix weights = generate_random_matrix (40, 300);
+  SparseMatrix::prune (weights, 0.75f, true);
+  assert(SparseMatrix::block_fill (weights) == 1.0f);
+  bool sparse;
+  assert(SparseMatrix::choose_layout (weights, sparse)
+         == SparseMatrix::BLOCKED && sparse);
+  assert(SparseMatrix::from_dense (weights, SparseMatrix::BLOCKED).stored ()
+         == static_cast<int> (SparseMatrix::density (weights) * 40 * 300
+                              + 0.5f));
+  // Scattered zeros leave the blocks mostly empty
+  Matrix scattered = generate_random_matrix (40, 300);
+  SparseMatrix::prune (scattered, 0.95f, false);
+  assert(SparseMatrix::choose_layout (scattered, sparse)
+         == SparseMatrix::CSR && sparse);
+  Matrix dense = generate_random_matrix (40, 300);
+  SparseMatrix::choose_layout (dense, sparse);
+  assert(!sparse);
+  try
+  {
+    SparseMatrix::prune (dense, 1.5f, false);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+
+  Matrix bias = generate_random_matrix (40, 1);
+  Dense layer (weights, bias, relu);
+  assert(layer.sparsify () && layer.get_format () == Dense::SPARSE);
+  assert(layer.get_input_size () == 300 && layer.get_output_size () == 40);
+  Matrix input = generate_random_matrix (300, 7);
+  is_close_matrix (layer (input), Dense (weights, bias, relu) (input), 1e-3f);
+  Dense kept (dense, bias, relu);
+  assert(!kept.sparsify () && kept.get_format () == Dense::FP32);
+
+  // A pruned network predicts as before once sparse, and is written dense
+  Matrix mlp_weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (mlp_weights, biases);
+  for (int i = 0; i < MLP_SIZE; i++)
+    SparseMatrix::prune (mlp_weights[i], 0.9f, i % 2 == 0);
+  MlpNetwork expected (mlp_weights, biases);
+  MlpNetwork pruned (mlp_weights, biases);
+  assert(pruned.sparsify () == MLP_SIZE);
+  assert(pruned.get_engine () == MlpNetwork::DYNAMIC);
+  Matrix images = generate_random_images (9);
+  std::vector<digit> before = expected.predict_batch (images);
+  std::vector<digit> after = pruned.predict_batch (images);
+  for (int j = 0; j < 9; j++)
+    assert(before[j].value == after[j].value);
+
+  // The static engine runs sparse layers dense and leaves them sparse
+  pruned.set_engine (MlpNetwork::STATIC);
+  assert(pruned.get_layers ()[0].get_format () == Dense::SPARSE);
+  mlp_workspace expected_ws, pruned_ws;
+  is_close_matrix (pruned.forward (images, pruned_ws),
+                   expected.forward (images, expected_ws), 1e-5f);
+  pruned.set_engine (MlpNetwork::DYNAMIC);
+  PackedModel::write (PACKED_MODEL_PATH, pruned.get_layers ());
+  {
+    PackedModel model (PACKED_MODEL_PATH);
+    for (int i = 0; i < MLP_SIZE; i++)
+    {
+      assert(model.layers ()[i].get_format () == Dense::FP32);
+      cmp_matrices (model.layers ()[i].get_weights (), mlp_weights[i]);
+    }
+  }
+  std::remove (PACKED_MODEL_PATH);
+  PASSED_TEST;
+}
+
+// 16-bit floats round to nearest even and convert back exactly
+void test_half_precision ()
+{
+  START_TEST;
+  assert(half::from_float (1.0f, half::FP16) == 0x3c00);
+  assert(half::from_float (-2.0f, half::FP16) == 0xc000);
+  assert(half::from_float (65504.0f, half::FP16) == 0x7bff);
+  assert(half::from_float (65519.0f, half::FP16) == 0x7bff);
+  assert(half::from_float (65520.0f, half::FP16) == 0x7c00);
+  assert(half::from_float (-1e10f, half::FP16) == 0xfc00);
+  assert(half::from_float (std::ldexp (1.0f, -14), half::FP16) == 0x0400);
+  assert(half::from_float (std::ldexp (1.0f, -24), half::FP16) == 0x0001);
+  // Ties go to the even neighbour
+  assert(half::from_float (std::ldexp (1.0f, -25), half::FP16) == 0x0000);
+  assert(half::from_float (std::ldexp (3.0f, -25), half::FP16) == 0x0002);
+  assert(half::from_float (1.0f + std::ldexp (1.0f, -11), half::FP16)
+         == 0x3c00);
+  assert(half::from_float (1.0f + std::ldexp (3.0f, -11), half::FP16)
+         == 0x3c02);
+  assert(half::from_float (1.0f, half::BF16) == 0x3f80);
+  assert(half::from_float (1.0f + std::ldexp (1.0f, -8), half::BF16)
+         == 0x3f80);
+  assert(half::from_float (1.0f + std::ldexp (3.0f, -8), half::BF16)
+         == 0x3f82);
+  assert(std::isnan (half::to_float (half::from_float (NAN, half::FP16),
+                                     half::FP16)));
+  assert(std::isnan (half::to_float (half::from_float (NAN, half::BF16),
+                                     half::BF16)));
+  // Every value but NaN survives a round trip
+  for (uint32_t value = 0; value <= 0xffff; value++)
+  {
+    const uint16_t h = static_cast<uint16_t> (value);
+    const half::format formats[] = {half::FP16, half::BF16};
+    for (half::format f : formats)
+    {
+      const float converted = half::to_float (h, f);
+      if (!std::isnan (converted))
+        assert(half::from_float (converted, f) == h);
+    }
+  }
+
+  // Weights in [-0.1, 0.1] lose at most half a step of their exponent
+  Matrix weights = generate_random_matrix (20, 300) * 0.01f;
+  Matrix bias = generate_random_matrix (20, 1);
+  is_close_matrix (HalfMatrix::convert (weights, half::FP16).to_float (),
+                   weights, 0.1f * std::ldexp (1.0f, -11));
+  is_close_matrix (HalfMatrix::convert (weights, half::BF16).to_float (),
+                   weights, 0.1f * std::ldexp (1.0f, -8));
+
+  Dense fp32 (weights, bias, relu);
+  Dense fp16 = fp32;
+  fp16.to_half (half::FP16);
+  Dense bf16 (HalfMatrix::convert (weights, half::BF16), bias, relu);
+  assert(fp16.get_format () == Dense::FP16);
+  assert(bf16.get_format () == Dense::BF16);
+  assert(fp16.get_input_size () == 300 && fp16.get_output_size () == 20);
+  const int batch_sizes[] = {1, 7, 40};
+  for (int count : batch_sizes)
+  {
+    Matrix input = generate_random_matrix (300, count);
+    is_close_matrix (fp16 (input), fp32 (input), 1e-2f);
+    is_close_matrix (bf16 (input), fp32 (input), 1e-1f);
+    // The same as a float layer with the rounded weights
+    is_close_matrix (fp16 (input),
+                     Dense (fp16.get_half_weights ().to_float (), bias,
+                            relu) (input), 1e-3f);
+  }
+  try
+  {
+    fp16 (Matrix (299, 1));
+    assert(false);
+  }
+  catch (std::length_error &e)
+  {}
+  // Other conversions start from the rounded weights
+  Dense int8 = fp16;
+  int8.quantize ();
+  assert(int8.get_format () == Dense::INT8);
+  int8.to_half (half::BF16);
+  assert(int8.get_format () == Dense::INT8);
+
+  // Networks predict as before and keep their format in packed models
+  Matrix mlp_weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (mlp_weights, biases);
+  MlpNetwork expected (mlp_weights, biases);
+  MlpNetwork converted (mlp_weights, biases);
+  converted.set_engine (MlpNetwork::STATIC);
+  converted.to_half (half::FP16);
+  assert(converted.get_engine () == MlpNetwork::DYNAMIC);
+  Matrix images = generate_random_images (9);
+  std::vector<digit> before = expected.predict_batch (images);
+  std::vector<digit> after = converted.predict_batch (images);
+  for (int j = 0; j < 9; j++)
+  {
+    assert(before[j].value == after[j].value);
+    assert(std::fabs (before[j].probability - after[j].probability) < 1e-2f);
+  }
+  PackedModel::write (PACKED_MODEL_PATH, converted.get_layers ());
+  {
+    PackedModel model (PACKED_MODEL_PATH);
+    for (int i = 0; i < MLP_SIZE; i++)
+    {
+      const Dense &layer = model.layers ()[i];
+      assert(layer.get_format () == Dense::FP16);
+      cmp_matrices (layer.get_half_weights ().to_float (),
+                    converted.get_layers ()[i].get_half_weights ()
+                        .to_float ());
+    }
+    std::vector<digit> mapped = MlpNetwork (model.layers ())
+        .predict_batch (images);
+    for (int j = 0; j < 9; j++)
+      assert(mapped[j].value == after[j].value
+             && mapped[j].probability == after[j].probability);
+  }
+  std::remove (PACKED_MODEL_PATH);
+  PASSED_TEST;
+}
+
+void test_profiler ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  MlpNetwork mlp (weights, biases);
+  profiling::reset ();
+  mlp.predict_batch (generate_random_images (5));
+  mlp.predict_batch (generate_random_images (3));
+  std::vector<profiling::layer_profile> layers = profiling::layers ();
+  std::vector<profiling::layer_event> events = profiling::events ();
+  std::ostringstream json;
+  std::ostringstream trace;
+  profiling::write_json (json);
+  profiling::write_chrome_trace (trace);
+  if (!PROFILE_ENABLED)
+  {
+    // Disabled builds record nothing but still write valid documents
+    assert(layers.empty () && events.empty ());
+    assert(json.str ().find ("\"enabled\": false") != std::string::npos);
+    assert(trace.str ().find ("\"traceEvents\"") != std::string::npos);
+    PASSED_TEST;
+    return;
+  }
+
+  assert(layers.size () == MLP_SIZE);
+  assert(events.size () == 2 * MLP_SIZE);
+  for (int i = 0; i < MLP_SIZE; i++)
+  {
+    const Dense &layer = mlp.get_layers ()[i];
+    const profiling::layer_profile &p = layers[i];
+    assert(p.format == Dense::FP32);
+    assert(p.runs == 2 && p.samples == 8);
+    assert(p.seconds > 0.0 && p.min_seconds <= p.max_seconds);
+    assert(p.flops == 2.0 * layer.get_input_size ()
+                      * layer.get_output_size () * 8);
+    assert(p.bytes >= 4.0 * layer.get_input_size ()
+                      * layer.get_output_size ());
+    long counted = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++)
+      counted += p.histogram[b];
+    assert(counted == 2);
+    if (layer.get_activation () == activation::relu)
+    {
+      assert(p.relu_outputs == layer.get_output_size () * 8L);
+      assert(p.relu_zeros >= 0 && p.relu_zeros <= p.relu_outputs);
+    }
+  }
+  for (size_t j = 1; j < events.size (); j++)
+    assert(events[j - 1].start_ns <= events[j].start_ns);
+  assert(events[0].start_ns >= 0 && events[0].layer == 0
+         && events[0].batch == 5);
+  assert(json.str ().find ("\"p99_us\"") != std::string::npos);
+  assert(json.str ().find ("\"relu_zero_fraction\"") != std::string::npos);
+  assert(trace.str ().find ("\"name\": \"layer 1\"") != std::string::npos);
+
+  profiling::reset ();
+  assert(profiling::layers ().empty () && profiling::events ().empty ());
+  PASSED_TEST;
+}
+
+// Requests from many connections are batched and answered in order
+void test_inference_server ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  MlpNetwork mlp (weights, biases);
+  const int count = 24;
+  const int clients = 3;
+  Matrix images = generate_random_images (count);
+  std::vector<digit> expected = mlp.predict_batch (images);
+  std::vector<Matrix> columns;
+  for (int j = 0; j < count; j++)
+    columns.push_back (image_column (images, j));
+  const int size = images.get_rows ();
+
+  const server_options options = {8, 2000, 2};
+  {
+    InferenceServer server (mlp, SERVER_SOCKET_PATH, options);
+    try
+    {
+      InferenceServer second (mlp, SERVER_SOCKET_PATH, options);
+      assert(false);
+    }
+    catch (std::runtime_error &e)
+    {}
+    // Every client sends all its requests before reading any reply
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; c++)
+      threads.emplace_back ([&] {
+        InferenceClient client (SERVER_SOCKET_PATH);
+        for (int j = 0; j < count; j++)
+          client.send (columns[j].begin (), size);
+        for (int j = 0; j < count; j++)
+        {
+          inference_result result = client.receive ();
+          assert(result.value == expected[j].value);
+          assert(CMP_FLOATS (result.probability, expected[j].probability));
+        }
+      });
+    for (std::thread &thread : threads)
+      thread.join ();
+    InferenceClient single (SERVER_SOCKET_PATH);
+    assert(single.classify (columns[5].begin (), size).value
+           == expected[5].value);
+
+    server_stats stats = server.take_stats ();
+    const long requests = clients * count + 1;
+    assert(stats.requests == requests);
+    assert(stats.batches >= (requests + options.max_batch - 1)
+                            / options.max_batch);
+    assert(stats.batches <= requests);
+    assert(stats.qps > 0 && stats.p50_us > 0);
+    assert(stats.p50_us <= stats.p99_us);
+    assert(server.take_stats ().requests == 0);
+
+    // A client that sends without ever reading its replies is held back
+    // by its socket, and holds up neither other clients nor stop
+    std::atomic<long> stalled_sent (0);
+    std::thread stalled ([&] {
+      InferenceClient client (SERVER_SOCKET_PATH);
+      try
+      {
+        for (;; stalled_sent++)
+          client.send (columns[0].begin (), size);
+      }
+      catch (std::runtime_error &e)
+      {}
+    });
+    // Waits past the cap first: on a busy host the server may go longer
+    // than one check without reading
+    for (long seen = -1;
+         stalled_sent <= SERVER_MAX_IN_FLIGHT || seen != stalled_sent;)
+    {
+      seen = stalled_sent;
+      std::this_thread::sleep_for (std::chrono::milliseconds (100));
+    }
+    assert(stalled_sent > SERVER_MAX_IN_FLIGHT);
+    assert(single.classify (columns[7].begin (), size).value
+           == expected[7].value);
+
+    server.stop ();
+    stalled.join ();
+    try
+    {
+      InferenceClient late (SERVER_SOCKET_PATH);
+      assert(false);
+    }
+    catch (std::runtime_error &e)
+    {}
+  }
+  assert(access (SERVER_SOCKET_PATH, F_OK) != 0);
+  try
+  {
+    InferenceServer invalid (mlp, SERVER_SOCKET_PATH, {0, 1000, 1});
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+  PASSED_TEST;
+}
+
+// Networks of any depth and width, with any activation per layer
+void test_mlp_any_depth ()
+{
+  START_TEST;
+  const std::vector<int> sizes = {30, 50, 40, 40, 25, 17, 7};
+  const std::vector<activation_func> activations = {
+      activation::relu, activation::identity, activation::relu,
+      activation::identity, activation::relu, activation::softmax};
+  MlpNetwork mlp (generate_random_layers (sizes, activations));
+  assert(mlp.layer_count () == 6);
+  assert(mlp.get_input_size () == 30 && mlp.get_output_size () == 7);
+
+  // Compare with the layers applied one by one
+  Matrix images = generate_random_matrix (30, 5);
+  Matrix expected = images;
+  for (const Dense &layer : mlp.get_layers ())
+    expected = layer (expected);
+  mlp_workspace workspace;
+  const Matrix &output = mlp.forward (images, workspace);
+  assert(output.get_rows () == 7 && output.get_cols () == 5);
+  for (int i = 0; i < 7 * 5; i++)
+    assert(std::fabs (output[i] - expected[i]) < 1e-5f);
+  std::vector<digit> digits = mlp.predict_batch (images);
+  for (int j = 0; j < 5; j++)
+    assert(digits[j].value < 7);
+
+  long before = allocation_count;
+  mlp.forward (images, workspace);
+  assert(allocation_count == before);
+
+  // Identity layers survive a packed model round trip
+  PackedModel::write (PACKED_MODEL_PATH, mlp.get_layers ());
+  {
+    PackedModel model (PACKED_MODEL_PATH);
+    assert(model.layer_count () == 6);
+    for (int i = 0; i < 6; i++)
+      assert(model.layers ()[i].get_activation () == activations[i]);
+    MlpNetwork mapped (model.layers ());
+    mlp_workspace mapped_workspace;
+    const Matrix &actual = mapped.forward (images, mapped_workspace);
+    for (int i = 0; i < 7 * 5; i++)
+      assert(actual[i] == output[i]);
+  }
+  std::remove (PACKED_MODEL_PATH);
+
+  // The default topology only fits the static engine
+  try
+  {
+    mlp.set_engine (MlpNetwork::STATIC);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+
+  // Layers must fit together
+  std::vector<Dense> mismatched = generate_random_layers ({30, 50},
+                                                        {activation::relu});
+  mismatched.push_back (mlp.get_layers ().back ());
+  try
+  {
+    MlpNetwork network (mismatched);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+  try
+  {
+    MlpNetwork network ((std::vector<Dense> ()));
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+  PASSED_TEST;
+}
+
+void write_raw_matrix (const string &path, const Matrix &m)
+{
+  std::ofstream os (path, std::ios::binary);
+  os.write (reinterpret_cast<const char *> (m.begin ()),
+            sizeof (float) * m.get_rows () * m.get_cols ());
+}
+
+void write_text_file (const string &path, const string &text)
+{
+  std::ofstream os (path);
+  os << text;
+}
+
+// ModelDescriptor::read and ModelDescriptor::load
+void test_model_descriptor ()
+{
+  START_TEST;
+  assert(activation::from_name ("relu") == activation::relu);
+  assert(activation::from_name ("identity") == activation::identity);
+  assert(activation::from_name ("tanh") == nullptr);
+  assert(string (activation::name_of (activation::softmax)) == "softmax");
+
+  Matrix w0 = generate_random_matrix (12, 8), b0 = generate_random_matrix (12, 1);
+  Matrix w1 = generate_random_matrix (3, 12), b1 = generate_random_matrix (3, 1);
+  write_raw_matrix ("./test_w0", w0);
+  write_raw_matrix ("./test_b0", b0);
+  write_raw_matrix ("./test_w1", w1);
+  write_raw_matrix ("./test_b1", b1);
+  write_text_file ("./test_model.desc",
+                   "# rows cols activation weights bias\n"
+                   "12 8 identity test_w0 test_b0\n"
+                   "\n"
+                   "3 12 softmax ./test_w1 test_b1\n");
+  ModelDescriptor descriptor = ModelDescriptor::read ("./test_model.desc");
+  assert(descriptor.layers ().size () == 2);
+  assert(descriptor.layers ()[0].activation == activation::identity);
+  assert(descriptor.layers ()[1].weights_path == "././test_w1");
+  std::vector<Dense> layers = descriptor.load ();
+  cmp_matrices (layers[0].get_weights (), w0);
+  cmp_matrices (layers[1].get_bias (), b1);
+  MlpNetwork mlp (layers);
+  assert(mlp.get_input_size () == 8 && mlp.get_output_size () == 3);
+
+  const char *invalid[] = {
+      "",
+      "12 8 identity test_w0\n",
+      "12 8 tanh test_w0 test_b0\n",
+      "12 8 relu test_w0 test_b0 extra\n",
+      "-12 8 relu test_w0 test_b0\n",
+      "12 8 relu test_w0 test_b0\n3 11 softmax test_w1 test_b1\n",
+  };
+  for (const char *text : invalid)
+  {
+    write_text_file ("./test_model.desc", text);
+    try
+    {
+      ModelDescriptor::read ("./test_model.desc");
+      assert(false);
+    }
+    catch (std::invalid_argument &e)
+    {}
+  }
+
+  // The parameter files must exist and hold rows X cols floats
+  write_text_file ("./test_model.desc", "12 8 relu test_w1 test_b0\n");
+  try
+  {
+    ModelDescriptor::read ("./test_model.desc").load ();
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+  try
+  {
+    ModelDescriptor::read (FAKE_BINARY_FILE_PATH);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+  for (const char *path : {"./test_w0", "./test_b0", "./test_w1",
+                           "./test_b1", "./test_model.desc"})
+    std::remove (path);
+  PASSED_TEST;
+}
+
+/*****************************************************************************/
+/*                             THREAD POOL TESTS                             */
+/*****************************************************************************/
+
+void test_thread_pool ()
+{
+  START_TEST;
+  ThreadPool pool (4);
+  assert(pool.size () == 4);
+  const int count = 1000;
+  std::vector<std::atomic<int>> hits (count);
+  std::atomic<int> bad_worker (0);
+  pool.parallel_for (count, 7, [&] (int worker, int begin, int end)
+  {
+    if (worker < 0 || worker >= pool.size ())
+      bad_worker++;
+    for (int i = begin; i < end; i++)
+      hits[i]++;
+  });
+  assert(bad_worker == 0);
+  for (int i = 0; i < count; i++)
+    assert(hits[i] == 1);
+
+  try
+  {
+    pool.parallel_for (10, 1, [] (int, int begin, int)
+    {
+      if (begin == 5)
+        throw std::runtime_error ("task failed");
+    });
+    assert(false);
+  }
+  catch (std::runtime_error &e)
+  {}
+
+  // The pool keeps working after a failed task
+  std::atomic<int> total (0);
+  pool.parallel_for (100, 10, [&] (int, int begin, int end)
+  { total += end - begin; });
+  assert(total == 100);
+  PASSED_TEST;
+}
+
+/*****************************************************************************/
+/*                            RECORD READER TESTS                            */
+/*****************************************************************************/
+
+// Records come back in order, in batches of at most max_records, and a
+// truncated record is an error
+void test_record_reader ()
+{
+  START_TEST;
+  const int record_floats = 3;
+  int fds[2];
+  assert(pipe (fds) == 0);
+  std::vector<float> written (11 * record_floats);
+  for (size_t i = 0; i < written.size (); i++)
+    written[i] = static_cast<float> (i);
+  assert(write (fds[1], written.data (), written.size () * sizeof (float))
+         == static_cast<ssize_t> (written.size () * sizeof (float)));
+  // Half of a 12th record
+  assert(write (fds[1], written.data (), sizeof (float)) == sizeof (float));
+  close (fds[1]);
+  {
+    RecordReader reader (fds[0], record_floats * sizeof (float), 4);
+    std::vector<float> read;
+    int count;
+    try
+    {
+      for (const char *records = reader.next (count); count > 0;
+           records = reader.next (count))
+      {
+        assert(count <= 4);
+        const float *values = reinterpret_cast<const float *> (records);
+        read.insert (read.end (), values, values + count * record_floats);
+      }
+      assert(false);
+    }
+    catch (std::runtime_error &e)
+    {}
+    // Every whole record before the truncated one was delivered
+    assert(read.size () == written.size ());
+    for (size_t i = 0; i < read.size (); i++)
+      assert(read[i] == written[i]);
+  }
+  close (fds[0]);
+
+  assert(pipe (fds) == 0);
+  assert(write (fds[1], written.data (), written.size () * sizeof (float))
+         == static_cast<ssize_t> (written.size () * sizeof (float)));
+  close (fds[1]);
+  {
+    RecordReader reader (fds[0], record_floats * sizeof (float), 4);
+    int total = 0;
+    int count;
+    for (reader.next (count); count > 0; reader.next (count))
+      total += count;
+    assert(total == 11);
+    reader.next (count);
+    assert(count == 0);
+  }
+  close (fds[0]);
+  PASSED_TEST;
+}
+
+void write_big_endian (std::ofstream &os, uint32_t value)
+{
+  const char bytes[] = {static_cast<char> (value >> 24),
+                        static_cast<char> (value >> 16),
+                        static_cast<char> (value >> 8),
+                        static_cast<char> (value)};
+  os.write (bytes, sizeof (bytes));
+}
+
+// Dataset reads IDX and flat float files into batch columns
+void test_dataset ()
+{
+  START_TEST;
+  const int rows = 5, cols = 7, size = rows * cols, count = 37;
+  std::vector<unsigned char> pixels (count * size);
+  for (size_t i = 0; i < pixels.size (); i++)
+    pixels[i] = static_cast<unsigned char> (i * 31);
+  {
+    std::ofstream os (DATASET_PATH, std::ios::binary);
+    write_big_endian (os, 0x00000803);
+    write_big_endian (os, count);
+    write_big_endian (os, rows);
+    write_big_endian (os, cols);
+    os.write (reinterpret_cast<const char *> (pixels.data ()), pixels.size ());
+  }
+  Matrix batch;
+  {
+    Dataset dataset (DATASET_PATH, size);
+    assert(dataset.get_format () == Dataset::IDX);
+    assert(dataset.get_count () == count);
+    const int ranges[][2] = {{0, 1}, {36, 1}, {0, count}, {3, 33}};
+    for (auto &range : ranges)
+    {
+      dataset.read_batch (range[0], range[1], batch);
+      assert(batch.get_rows () == size && batch.get_cols () == range[1]);
+      for (int j = 0; j < range[1]; j++)
+        for (int p = 0; p < size; p++)
+          assert(batch (p, j)
+                 == pixels[(range[0] + j) * size + p] * (1.0f / 255.0f));
+    }
+    const int bad_ranges[][2] = {{-1, 1}, {0, 0}, {36, 2}, {count, 1}};
+    for (auto &range : bad_ranges)
+    {
+      try
+      {
+        dataset.read_batch (range[0], range[1], batch);
+        assert(false);
+      }
+      catch (std::out_of_range &e)
+      {}
+    }
+  }
+
+  // The same images as floats, with no header
+  Matrix images = generate_random_matrix (count, size);
+  write_raw_matrix (DATASET_PATH, images);
+  {
+    Dataset dataset (DATASET_PATH, size);
+    assert(dataset.get_format () == Dataset::FLAT);
+    assert(dataset.get_count () == count);
+    dataset.read_batch (2, 35, batch);
+    for (int j = 0; j < 35; j++)
+      for (int p = 0; p < size; p++)
+        assert(batch (p, j) == images (2 + j, p));
+  }
+
+  // Not a whole amount of images
+  write_text_file (DATASET_PATH, "abc");
+  try
+  {
+    Dataset dataset (DATASET_PATH, size);
+    assert(false);
+  }
+  catch (std::runtime_error &e)
+  {}
+
+  {
+    std::ofstream os (DATASET_PATH, std::ios::binary);
+    write_big_endian (os, 0x00000801);
+    write_big_endian (os, 3);
+    os.write ("\x07\x00\x09", 3);
+  }
+  assert(Dataset::read_idx_labels (DATASET_PATH)
+         == std::vector<unsigned int> ({7, 0, 9}));
+  // A label short
+  {
+    std::ofstream os (DATASET_PATH, std::ios::binary);
+    write_big_endian (os, 0x00000801);
+    write_big_endian (os, 4);
+    os.write ("\x07\x00\x09", 3);
+  }
+  try
+  {
+    Dataset::read_idx_labels (DATASET_PATH);
+    assert(false);
+  }
+  catch (std::runtime_error &e)
+  {}
+  std::remove (DATASET_PATH);
+  PASSED_TEST;
+}
+
+// Evaluation counts accuracy, confusion and calibration, and Evaluation::run
+// agrees with predict_batch
+void test_evaluation ()
+{
+  START_TEST;
+  const digit predictions[] = {{1, 0.95f}, {2, 0.35f}, {0, 1.0f}, {1, 0.31f}};
+  const unsigned int labels[] = {1, 1, 0, 2};
+  Evaluation evaluation (3);
+  evaluation.add (predictions, labels, 2);
+  Evaluation rest (3);
+  rest.add (predictions + 2, labels + 2, 2);
+  evaluation.merge (rest);
+  assert(evaluation.get_count () == 4 && evaluation.get_correct () == 2);
+  assert(CMP_FLOATS (evaluation.accuracy (), 0.5f));
+  assert(CMP_FLOATS (evaluation.mean_probability (), 2.61f / 4));
+  assert(evaluation.confusion (1, 1) == 1 && evaluation.confusion (1, 2) == 1
+         && evaluation.confusion (0, 0) == 1
+         && evaluation.confusion (2, 1) == 1
+         && evaluation.confusion (2, 2) == 0);
+  // 0.35 and 0.31 share a bin and are both wrong; 0.95 and 1 share the last
+  const calibration_bin &low = evaluation.get_bin (3);
+  assert(low.count == 2 && low.correct == 0);
+  const calibration_bin &high = evaluation.get_bin (CALIBRATION_BINS - 1);
+  assert(high.count == 2 && high.correct == 2);
+  assert(CMP_FLOATS (evaluation.calibration_error (),
+                     (0.66f + (2.0f - 1.95f)) / 4));
+  const unsigned int bad_label = 3;
+  try
+  {
+    evaluation.add (predictions, &bad_label, 1);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  generate_random_parameters (weights, biases);
+  MlpNetwork mlp (weights, biases);
+  const int count = 300;
+  const Matrix images = generate_random_images (count);
+  Matrix records;
+  images.transpose_into (records);
+  write_raw_matrix (DATASET_PATH, records);
+  const std::vector<digit> digits = mlp.predict_batch (images);
+  std::vector<unsigned int> truth (count);
+  for (int j = 0; j < count; j++)
+    truth[j] = j % 3 == 0 ? (digits[j].value + 1) % OUTPUT_VECTOR_SIZE
+                          : digits[j].value;
+  {
+    const Dataset dataset (DATASET_PATH, images.get_rows ());
+    ThreadPool pool (3);
+    const Evaluation result = Evaluation::run (mlp, dataset, truth, pool);
+    assert(result.get_count () == count);
+    assert(result.get_correct () == count - count / 3);
+    for (int j = 0; j < count; j++)
+      assert(result.confusion (truth[j], digits[j].value) > 0);
+    truth.pop_back ();
+    try
+    {
+      Evaluation::run (mlp, dataset, truth, pool);
+      assert(false);
+    }
+    catch (std::invalid_argument &e)
+    {}
+  }
+  std::remove (DATASET_PATH);
+  PASSED_TEST;
+}
+
+/*****************************************************************************/
+/*                               TRAINER TESTS                               */
+/*****************************************************************************/
+
+// One plain SGD step with a learning rate of 1 subtracts the gradient, which
+// must match finite differences of the loss
+void test_trainer_gradients ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  std::mt19937 gen (3);
+  Trainer::initialize (weights, biases, gen);
+  // Random images sometimes put a relu input within eps of its kink,
+  // where the finite differences below are meaningless. These seeded
+  // ones keep every checked difference clear of the kinks.
+  std::mt19937 pixels (2);
+  std::uniform_real_distribution<float> pixel (0.0f, 1.0f);
+  Matrix images (img_dims.rows * img_dims.cols, 16);
+  for (float &value : images)
+    value = pixel (pixels);
+  std::vector<unsigned int> labels (16);
+  std::vector<int> indices (16);
+  for (int j = 0; j < 16; j++)
+  {
+    labels[j] = j % OUTPUT_VECTOR_SIZE;
+    indices[j] = j;
+  }
+  training_params params = sgd_params;
+  params.learning_rate = 1.0f;
+  params.momentum = 0.0f;
+  Trainer trainer (weights, biases, params, 2);
+  float loss = trainer.train_batch (images, labels, indices.data (), 16);
+  assert(std::fabs (loss - Trainer (weights, biases, params, 1).loss (
+      images, labels)) < 1e-4f);
+
+  const float eps = 1e-2f;
+  for (int layer = 0; layer < MLP_SIZE; layer++)
+  {
+    for (int k = 0; k < 3; k++)
+    {
+      const int index = (k * 7919) % (weights_dims[layer].rows
+                                       * weights_dims[layer].cols);
+      const float grad = weights[layer][index]
+                         - trainer.get_weights ()[layer][index];
+      Matrix perturbed[MLP_SIZE];
+      for (int i = 0; i < MLP_SIZE; i++)
+        perturbed[i] = weights[i] * 1.0f;
+      perturbed[layer][index] += eps;
+      float up = Trainer (perturbed, biases, params, 1).loss (images, labels);
+      perturbed[layer][index] -= 2 * eps;
+      float down = Trainer (perturbed, biases, params, 1).loss (images,
+                                                                labels);
+      assert(std::fabs ((up - down) / (2 * eps) - grad)
+             <= 0.02f * std::fabs (grad) + 1e-4f);
+    }
+    const float bias_grad = biases[layer][0]
+                            - trainer.get_biases ()[layer][0];
+    Matrix perturbed[MLP_SIZE];
+    for (int i = 0; i < MLP_SIZE; i++)
+      perturbed[i] = biases[i] * 1.0f;
+    perturbed[layer][0] += eps;
+    float up = Trainer (weights, perturbed, params, 1).loss (images, labels);
+    perturbed[layer][0] -= 2 * eps;
+    float down = Trainer (weights, perturbed, params, 1).loss (images, labels);
+    assert(std::fabs ((up - down) / (2 * eps) - bias_grad)
+           <= 0.02f * std::fabs (bias_grad) + 1e-4f);
+  }
+  PASSED_TEST;
+}
+
+void test_trainer_rejects_bad_batches ()
+{
+  START_TEST;
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  std::mt19937 gen (3);
+  Trainer::initialize (weights, biases, gen);
+  Matrix images (img_dims.rows * img_dims.cols, 4);
+  std::vector<unsigned int> labels = {1, 2, OUTPUT_VECTOR_SIZE, 3};
+  Trainer trainer (weights, biases, sgd_params, 2);
+  const int good[] = {0, 1, 3};
+  try
+  {
+    trainer.train_batch (images, labels, good, 0);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {};
+  const int bad[] = {0, 2};
+  try
+  {
+    trainer.train_batch (images, labels, bad, 2);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {};
+  const int out_of_range[] = {0, 4};
+  try
+  {
+    trainer.train_batch (images, labels, out_of_range, 2);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {};
+  trainer.train_batch (images, labels, good, 3);
+  PASSED_TEST;
+}
+
+// Both optimizers learn a separable problem: each digit lights up its own
+// band of pixels
+void test_trainer_learns ()
+{
+  START_TEST;
+  const int count = 200;
+  const int band = img_dims.rows * img_dims.cols / OUTPUT_VECTOR_SIZE;
+  Matrix images = generate_random_images (count);
+  std::vector<unsigned int> labels (count);
+  for (int j = 0; j < count; j++)
+  {
+    labels[j] = j % OUTPUT_VECTOR_SIZE;
+    for (int r = 0; r < band; r++)
+      images (labels[j] * band + r, j) += 1.0f;
+  }
+  for (const training_params &params : {sgd_params, adam_params})
+  {
+    Matrix weights[MLP_SIZE];
+    Matrix biases[MLP_SIZE];
+    std::mt19937 gen (5);
+    Trainer::initialize (weights, biases, gen);
+    Trainer trainer (weights, biases, params);
+    float before = trainer.loss (images, labels);
+    for (int epoch = 0; epoch < 10; epoch++)
+      trainer.train_epoch (images, labels, gen);
+    assert(trainer.loss (images, labels) < before / 4);
+    std::vector<digit> digits = trainer.network ().predict_batch (images);
+    int correct = 0;
+    for (int j = 0; j < count; j++)
+      correct += digits[j].value == labels[j];
+    assert(correct >= count * 9 / 10);
+  }
+
+  // Labels index the output rows unchecked, so they are validated first
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  std::mt19937 gen (5);
+  Trainer::initialize (weights, biases, gen);
+  Trainer trainer (weights, biases, sgd_params);
+  labels[3] = OUTPUT_VECTOR_SIZE;
+  try
+  {
+    trainer.train_epoch (images, labels, gen);
+    assert(false);
+  }
+  catch (std::invalid_argument &e)
+  {}
+  PASSED_TEST;
+}
 
 /*****************************************************************************/
 /*                                  MAIN                                     */
@@ -526,20 +2671,49 @@ int main ()
       test_constructor_default,
       test_constructor_rows_cols,
       test_constructor_matrix,
+      test_constructor_move,
+      test_resize,
+      test_matrix_allocators,
       test_transpose,
+      test_transpose_variants,
       test_vectorize,
       //test_dot,
       test_norm,
       test_matrix_plus_matrix_op,
       test_matrix_mult_matrix_op,
+      test_matrix_mult_gemm,
       test_matrix_mult_float_op,
       test_float_mult_matrix_op,
       test_matrix_assign_matrix_op,
       test_matrix_plus_assign_matrix_op,
+      test_matrix_expressions,
       test_indexing_op,
       test_stream_input_matrix_op,
       test_relu,
       test_softmax,
+      test_softmax_stable,
+      test_simd_kernels,
+      test_dense_fused,
+      test_mlp_predict_batch,
+      test_mlp_top_k,
+      test_mlp_forward_no_allocations,
+      test_packed_model,
+      test_dense_int8,
+      test_mlp_static_engine,
+      test_mlp_quantize,
+      test_sparse,
+      test_half_precision,
+      test_profiler,
+      test_inference_server,
+      test_mlp_any_depth,
+      test_model_descriptor,
+      test_thread_pool,
+      test_record_reader,
+      test_dataset,
+      test_evaluation,
+      test_trainer_gradients,
+      test_trainer_rejects_bad_batches,
+      test_trainer_learns,
 
   };
   cout << "RUNNING TESTS" << endl;